@@ -0,0 +1,38 @@
+#ifndef _ATLAS_IMAGE_GENERATOR_
+#define _ATLAS_IMAGE_GENERATOR_
+
+#include "VirtualImageGenerator.h"
+#include "ViewAtlas.h"
+
+/**
+ *  Serves the precomputed view of an atlas file (see build_atlas) nearest
+ *  to the requested pose instead of rendering, together with the view's
+ *  features and their 3D points.  Nothing is rendered or extracted at run
+ *  time, which suits fixed objects whose relevant viewpoints are known.
+ */
+class AtlasImageGenerator : public VirtualImageGenerator
+{
+public:
+  // rot_weight converts the rotation angle (rad) between poses into map
+  // units when looking for the nearest view
+  AtlasImageGenerator(const std::string& filename, float rot_weight = 1.0);
+
+  bool IsOpen() const;
+  virtual cv::Mat GenerateVirtualImage(const Eigen::Matrix4f& pose, cv::Mat& depth, cv::Mat& mask);
+  virtual Eigen::Matrix3f GetK();
+
+  // Like GenerateVirtualImage, pose is set to the pose of the returned view
+  cv::Mat GenerateNearestView(Eigen::Matrix4f& pose, cv::Mat& depth, cv::Mat& mask);
+
+  // Features of image (a view returned by this generator) if they were
+  // stored with desc_type.  points are in the model frame.
+  bool GetFeatures(const cv::Mat& image, const std::string& desc_type, std::vector<cv::KeyPoint>& keypoints,
+    cv::Mat& descriptors, std::vector<cv::Point3f>& points);
+
+private:
+  ViewAtlas atlas;
+  float rot_weight;
+  int last_view;
+  uchar* last_image;
+};
+#endif
@@ -0,0 +1,132 @@
+#ifndef _BOUNDED_QUEUE_H_
+#define _BOUNDED_QUEUE_H_
+
+#include <deque>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+/**
+ *  Fixed capacity FIFO used to hand work between pipeline stages.  Producers
+ *  can either block until there is room or evict the oldest entry, so a slow
+ *  consumer never makes latency grow without bound.  Closing the queue wakes
+ *  up every waiting thread so workers can shut down.
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+  BoundedQueue(unsigned int capacity = 1) :
+    capacity(capacity > 0 ? capacity : 1),
+    closed(false),
+    num_dropped(0)
+  {
+  }
+
+  // Blocks until there is room.  Returns false if the queue has been closed.
+  bool Push(const T& item)
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    while(!closed && items.size() >= capacity)
+    {
+      not_full.wait(lock);
+    }
+    if(closed)
+      return false;
+    items.push_back(item);
+    not_empty.notify_one();
+    return true;
+  }
+
+  // Never blocks.  If the queue is full the oldest entry is discarded.  Returns
+  // false if an entry had to be dropped (or the queue is closed).
+  bool PushDropOldest(const T& item)
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    if(closed)
+      return false;
+    bool dropped = false;
+    while(items.size() >= capacity)
+    {
+      items.pop_front();
+      num_dropped++;
+      dropped = true;
+    }
+    items.push_back(item);
+    not_empty.notify_one();
+    return !dropped;
+  }
+
+  // Blocks until an entry is available.  Returns false once the queue is closed
+  // and drained.
+  bool Pop(T& item)
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    while(!closed && items.empty())
+    {
+      not_empty.wait(lock);
+    }
+    if(items.empty())
+      return false;
+    item = items.front();
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  bool TryPop(T& item)
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    if(items.empty())
+      return false;
+    item = items.front();
+    items.pop_front();
+    not_full.notify_one();
+    return true;
+  }
+
+  void SetCapacity(unsigned int new_capacity)
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    capacity = new_capacity > 0 ? new_capacity : 1;
+    not_full.notify_all();
+  }
+
+  void Close()
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    closed = true;
+    not_empty.notify_all();
+    not_full.notify_all();
+  }
+
+  void Clear()
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    items.clear();
+    not_full.notify_all();
+  }
+
+  unsigned int Size()
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    return items.size();
+  }
+
+  unsigned long NumDropped()
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    return num_dropped;
+  }
+
+private:
+  std::deque<T> items;
+  unsigned int capacity;
+  bool closed;
+  unsigned long num_dropped;
+
+  boost::mutex mutex;
+  boost::condition_variable not_empty;
+  boost::condition_variable not_full;
+};
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef _CHUNKED_POINT_CLOUD_H_
+#define _CHUNKED_POINT_CLOUD_H_
+
+#include <vector>
+#include <Eigen/Core>
+#include <Eigen/Dense>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include "SplatRenderer.h"
+
+/**
+ *  Points of one voxel block of the map, with the bounds used for culling.
+ *  The normal cone holds every point normal within cone_angle of cone_axis,
+ *  cone_angle is pi if the normals say nothing (missing or spread out).
+ *
+ *  levels[0] holds the points as loaded, every further level averages the
+ *  points of the previous one over voxels twice the size.  spacing[i] is
+ *  the (estimated) distance between neighbouring points of levels[i].
+ */
+struct PointChunk
+{
+  std::vector<PointBlock> levels;
+  std::vector<float> spacing;
+  Eigen::Vector3f min;
+  Eigen::Vector3f max;
+  Eigen::Vector3f cone_axis;
+  float cone_angle;
+};
+
+// A chunk that passed culling, with the smallest depth of its box in the camera
+struct VisibleChunk
+{
+  const PointChunk* chunk;
+  float near_depth;
+};
+
+/**
+ *  Map point cloud split into cubic voxel blocks, so a render only touches
+ *  the blocks that can be seen: blocks outside the camera frustum, or whose
+ *  points all face away from the camera, are skipped as a whole.
+ */
+class ChunkedPointCloud
+{
+public:
+  // chunk_size is the edge length of a block in map units.  With build_lod
+  // every block gets a level of detail pyramid.
+  ChunkedPointCloud(const pcl::PointCloud<pcl::PointXYZRGBNormal>& pc, float chunk_size,
+    bool build_lod = true);
+  ~ChunkedPointCloud();
+
+  // Blocks that may be visible from pose (camera pose in the map frame) in
+  // a rows x cols image with intrinsics K.  The test is conservative.
+  void GetVisibleChunks(const Eigen::Matrix4f& pose, const Eigen::Matrix3f& K, int rows, int cols,
+    bool backface_culling, std::vector<VisibleChunk>& visible) const;
+
+  // Coarsest level of chunk whose points are at most max_pixel_spacing pixels
+  // apart when seen at near_depth with focal length focal
+  static const PointBlock& SelectLevel(const PointChunk& chunk, float near_depth, float focal,
+    float max_pixel_spacing);
+
+  size_t NumChunks() const;
+  size_t NumPoints() const;
+
+private:
+  bool InFrustum(const PointChunk& chunk, const Eigen::Matrix4f& pose_inv, float xmin, float xmax,
+    float ymin, float ymax, float& near_depth) const;
+  void BuildLevels(PointChunk& chunk);
+  bool FacesAway(const PointChunk& chunk, const Eigen::Vector3f& camera) const;
+
+  std::vector<PointChunk*> chunks;
+  size_t num_points;
+};
+
+#endif
@@ -4,33 +4,26 @@
 #include "MonocularLocalizer.h"
 #include "KeyframeMatch.h"
 #include "KeyframeContainer.h"
+#include "KeyframeRetriever.h"
+
+#include <boost/shared_ptr.hpp>
 
 class DepthFeatureMatchLocalizer : public MonocularLocalizer
 {
-  struct KeyframePositionSorter
-  {
-    Eigen::Matrix4f currentPose;
-    KeyframePositionSorter(Eigen::Matrix4f pose): currentPose(pose) {};
-    
-    bool operator()(KeyframeContainer* kfc1, KeyframeContainer* kfc2)
-    {
-      return (kfc1->GetTf().block<3,1>(0,3)-currentPose.block<3,1>(0,3)).norm() < (kfc2->GetTf().block<3,1>(0,3)-currentPose.block<3,1>(0,3)).norm();
-    }
-  };
-
 public:
 
   DepthFeatureMatchLocalizer(const std::vector<KeyframeContainer*>& train,
     std::string desc_type = "surf", bool show_matches = false, int min_inliers = 10, 
-    double max_reproj_error = 3, double ratio_test_thresh = 0.8);
+    double max_reproj_error = 3, double ratio_test_thresh = 0.8, std::string index_filename = "",
+    std::string vocabulary_filename = "", int shortlist_size = 20,
+    boost::shared_ptr<WorkerPool> shared_workers = boost::shared_ptr<WorkerPool>());
   virtual bool localize(const cv::Mat& img, const cv::Mat& K, Eigen::Matrix4f* pose,
     Eigen::Matrix4f* pose_guess = NULL);
 
 private:
 
-  std::vector< KeyframeMatch > FindImageMatches(KeyframeContainer* img, int k, Eigen::Matrix4f* pose_guess = NULL, unsigned int search_bound = 0);
-
   std::vector<KeyframeContainer*> keyframes; 
+  boost::shared_ptr<KeyframeRetriever> retriever;
   int min_inliers;
   double max_reproj_error;
   double ratio_test_thresh;
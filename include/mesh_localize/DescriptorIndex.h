@@ -0,0 +1,70 @@
+#ifndef _DESCRIPTOR_INDEX_H_
+#define _DESCRIPTOR_INDEX_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <opencv2/core/core.hpp>
+#include <opencv2/flann/flann.hpp>
+
+#include "KeyframeContainer.h"
+
+// Layout of the file next to the saved FLANN index: the header, then the
+// number of descriptors of every keyframe
+struct DescriptorIndexHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t num_keyframes;
+  uint32_t num_descriptors;
+  int32_t desc_mat_type;
+  int32_t desc_cols;
+};
+
+/**
+ *  One approximate nearest neighbour index over the descriptors of all
+ *  keyframes of an image database (randomized kd-trees for float
+ *  descriptors, LSH for binary ones), with the keyframe every descriptor
+ *  belongs to.  A query image is searched against the whole database at
+ *  once instead of keyframe by keyframe, to rank the keyframes worth
+ *  matching.  It only votes: the matches themselves come from matching the
+ *  best ranked keyframes on their own.
+ *
+ *  Keyframes are identified by their position in the vector the index was
+ *  built from.
+ */
+class DescriptorIndex
+{
+public:
+  DescriptorIndex();
+  ~DescriptorIndex();
+
+  bool Build(const std::vector<KeyframeContainer*>& keyframes);
+  // Saves to filename and the FLANN index to filename.flann
+  bool Save(const std::string& filename) const;
+  // Loads an index saved for the descriptors of the same keyframes, fails
+  // if the keyframes' descriptors don't fit it
+  bool Load(const std::string& filename, const std::vector<KeyframeContainer*>& keyframes);
+
+  size_t NumKeyframes() const;
+
+  // Number of query features that match each keyframe: among the nearest
+  // neighbours of a feature over all keyframes, the nearest in a keyframe
+  // passes the ratio test against the second nearest in that same keyframe.
+  // A feature votes for every keyframe it matches, so keyframes that see
+  // the same part of the object all get its vote.
+  void Vote(const cv::Mat& query, double ratio, std::vector<int>& votes) const;
+
+private:
+  bool Gather(const std::vector<KeyframeContainer*>& keyframes);
+
+  // descriptors of all keyframes, one after the other
+  cv::Mat descriptors;
+  // keyframe of every descriptor and first descriptor of every keyframe
+  std::vector<int> keyframe_ids;
+  std::vector<int> keyframe_start;
+  cv::flann::Index* index;
+  bool binary;
+};
+
+#endif
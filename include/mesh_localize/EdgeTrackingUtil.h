@@ -11,6 +11,7 @@
 #include <Eigen/Dense>
 #include <Eigen/Core>
 #include "TooN/se3.h"       // for special Euclidean group
+#include "PointUndistorter.h"
 
 class EdgeTrackingUtil
 {
@@ -29,19 +30,34 @@ public:
     CvPoint2D32f edge_pt2;      // corresponding edge coordinate
     int edge_mem;               // Edge membership (0, 1, 2, ... until # of edges -1)
   };
+  // Edge search settings of one tracker
+  struct EdgeParams
+  {
+    EdgeParams();
+
+    bool show_debug;
+    bool autotune_canny;
+    double canny_high_thresh;
+    double canny_low_thresh;
+    double canny_sigma;
+    double dmax;
+    // If set, the query image is distorted and edge searches are done in it
+    const PointUndistorter* undistorter;
+  };
   static void getEstimatedPosePnP(Eigen::Matrix4f& pose_cur, const Eigen::Matrix4f& pose_pre,
     const std::vector<SamplePoint>& vSamplePt, const cv::Mat& intrinsics);
-  static void getEstimatedPoseIRLS(Eigen::Matrix4f& pose_cur, const Eigen::Matrix4f& pose_pre, const std::vector<SamplePoint>& vSamplePt, const Eigen::Matrix3f& intrinsics);
+  static void getEstimatedPoseIRLS(Eigen::Matrix4f& pose_cur, const Eigen::Matrix4f& pose_pre, const std::vector<SamplePoint>& vSamplePt, const Eigen::Matrix3f& intrinsics,
+    const EdgeParams& params);
   static TooN::Vector<6> calcJacobian(const CvPoint3D32f& pts3, const CvPoint2D32f& pts2, 
     const CvPoint2D32f& ptsnv, double ptsd, const TooN::SE3<double> &E, 
     const Eigen::Matrix3f& intrinsics);
   static std::vector<SamplePoint> getEdgeMatches(const cv::Mat& vimg, const cv::Mat& kf, 
     const Eigen::Matrix3f vimgK, const Eigen::Matrix3f K, const cv::Mat& vdepth, 
-    const cv::Mat& kf_mask, const Eigen::Matrix4f& vimgTf);
+    const cv::Mat& kf_mask, const Eigen::Matrix4f& vimgTf, const EdgeParams& params);
   static std::vector<SamplePoint> getEdgeMatches(const std::vector<cv::Point>& vimg_edge_pts, 
     const std::vector<double>& vimg_edge_dirs, const cv::Mat& kf_detected_edges, 
     const cv::Mat& kf_edge_dir, const Eigen::Matrix3f vimgK, const Eigen::Matrix3f K, 
-    const cv::Mat& vdepth, const Eigen::Matrix4f& vimgTf);
+    const cv::Mat& vdepth, const Eigen::Matrix4f& vimgTf, const EdgeParams& params);
   static std::vector<EdgeTrackingUtil::SamplePoint> getWindowedEdgeMatches(
     const cv::Mat& vimg,
     const std::vector<cv::Point>& vimg_edge_pts, const std::vector<double>& vimg_edge_dirs, 
@@ -64,12 +80,6 @@ public:
   static bool withinOri(float o1, float o2, float oth);
   static double getMedian(const cv::Mat& im, int start_bin=0);
 
-  static bool show_debug;
-  static bool autotune_canny;
-  static double canny_high_thresh;
-  static double canny_low_thresh;
-  static double canny_sigma;
-  static double dmax;
 };
 
 #endif
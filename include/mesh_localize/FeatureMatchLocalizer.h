@@ -4,30 +4,24 @@
 #include "MonocularLocalizer.h"
 #include "KeyframeMatch.h"
 #include "KeyframeContainer.h"
+#include "KeyframeRetriever.h"
+
+#include <boost/shared_ptr.hpp>
 
 class FeatureMatchLocalizer : public MonocularLocalizer
 {
-  struct KeyframePositionSorter
-  {
-    Eigen::Matrix4f currentPose;
-    KeyframePositionSorter(Eigen::Matrix4f pose): currentPose(pose) {};
-    
-    bool operator()(KeyframeContainer* kfc1, KeyframeContainer* kfc2)
-    {
-      return (kfc1->GetTf().block<3,1>(0,3)-currentPose.block<3,1>(0,3)).norm() < (kfc2->GetTf().block<3,1>(0,3)-currentPose.block<3,1>(0,3)).norm();
-    }
-  };
-
 public:
 
-  FeatureMatchLocalizer(const std::vector<CameraContainer*>& train, std::string descriptor_type, bool show_matches = false, bool load_descriptors = false, std::string descriptor_filename = "");
+  FeatureMatchLocalizer(const std::vector<CameraContainer*>& train, std::string descriptor_type, bool show_matches = false, bool load_descriptors = false, std::string descriptor_filename = "", std::string index_filename = "",
+    std::string vocabulary_filename = "", int shortlist_size = 20,
+    boost::shared_ptr<WorkerPool> shared_workers = boost::shared_ptr<WorkerPool>());
   virtual bool localize(const cv::Mat& img, const cv::Mat& K, Eigen::Matrix4f* pose, Eigen::Matrix4f* pose_guess = NULL);
 private:
-  std::vector< KeyframeMatch > FindImageMatches(KeyframeContainer* img, int k, Eigen::Matrix4f* pose_guess = NULL, unsigned int search_bound = 0);
   bool WriteDescriptorsToFile(std::string filename);
 
 
   std::vector<KeyframeContainer*> keyframes; 
+  boost::shared_ptr<KeyframeRetriever> retriever;
   std::string desc_type;
   bool show_matches;
 };
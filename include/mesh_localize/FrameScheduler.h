@@ -0,0 +1,58 @@
+#ifndef _FRAME_SCHEDULER_H_
+#define _FRAME_SCHEDULER_H_
+
+#include <map>
+#include <string>
+
+/**
+ *  Keeps per-frame latency within a budget.  The cost of every processing
+ *  path (a localizer state run at some level of degradation) is tracked with
+ *  a moving average of measured run times, and each frame is given the most
+ *  complete level that is expected to finish before its deadline.  Frames
+ *  that would miss the deadline even at the cheapest level are dropped.
+ *
+ *  Levels that get skipped slowly forget their cost so they are tried again
+ *  once the scene gets easier.
+ */
+class FrameScheduler
+{
+public:
+  enum Level
+  {
+    FULL = 0,
+    REDUCED = 1,
+    DROP = -1
+  };
+
+  // budget in seconds, 0 disables scheduling
+  FrameScheduler(double budget = 0);
+
+  void SetBudget(double budget);
+  bool IsEnabled() const;
+
+  // Picks the level for a frame that has already waited age seconds.
+  // num_levels is the number of levels the path supports.  Frames of paths
+  // that are not droppable only get dropped once they are already late.
+  Level Schedule(const std::string& path, double age, int num_levels, bool droppable);
+  void Report(const std::string& path, Level level, double seconds);
+
+  // Whether a frame of path is expected to fit in the budget at the given level
+  bool Fits(const std::string& path, Level level, double age = 0) const;
+  unsigned long NumDropped() const;
+
+private:
+  struct Estimate
+  {
+    Estimate() : cost(0), samples(0) {}
+    double cost;
+    unsigned long samples;
+  };
+
+  static std::string Key(const std::string& path, Level level);
+
+  double budget;
+  std::map<std::string, Estimate> estimates;
+  unsigned long num_dropped;
+};
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef _GAZEBO_RENDER_SERVICE_H_
+#define _GAZEBO_RENDER_SERVICE_H_
+
+#include <vector>
+#include <ros/ros.h>
+#include <sensor_msgs/Image.h>
+#include <rosgraph_msgs/Clock.h>
+
+#include "RenderService.h"
+
+/**
+ *  Renders with a camera in Gazebo.  For each request the camera link is
+ *  moved with SetLinkState, and the response is the first image/depth pair
+ *  whose stamp is newer than the simulation time (from /clock) after the
+ *  move, so it was rendered at the requested pose.  The image is shared with
+ *  its message and the depth map is parsed from its message in one pass.
+ */
+class GazeboRenderService : public RenderService
+{
+public:
+  // Subscribes to virtual_image/virtual_depth/virtual_caminfo on nh.  No
+  // response is given to a request that isn't rendered within timeout seconds.
+  GazeboRenderService(ros::NodeHandle nh, double timeout = 1.0);
+  ~GazeboRenderService();
+
+  // Blocks until the virtual camera's calibration arrives
+  bool WaitForCameraInfo();
+  virtual void Stop();
+  virtual Eigen::Matrix3f GetK();
+
+protected:
+  virtual bool Render(const Eigen::Matrix4f& pose, RenderResponse& response);
+
+private:
+  void HandleImage(const sensor_msgs::ImageConstPtr& msg);
+  void HandleDepth(const sensor_msgs::ImageConstPtr& msg);
+  void HandleClock(const rosgraph_msgs::ClockConstPtr& msg);
+  bool MoveCamera(const Eigen::Matrix4f& pose);
+  bool ParseDepth(const sensor_msgs::Image& msg, cv::Mat& depth, cv::Mat& mask);
+  cv::Mat AcquireBuffer(std::vector<cv::Mat>& pool, int rows, int cols, int type);
+
+  ros::NodeHandle nh;
+  ros::ServiceClient link_state_client;
+  ros::Subscriber image_sub;
+  ros::Subscriber depth_sub;
+  ros::Subscriber clock_sub;
+  double timeout;
+  Eigen::Matrix3f K;
+
+  // Latest messages from the callback thread
+  boost::mutex msg_mutex;
+  boost::condition_variable msg_cond;
+  sensor_msgs::ImageConstPtr latest_image;
+  sensor_msgs::ImageConstPtr latest_depth;
+  ros::Time sim_time;
+  unsigned long num_clock_msgs;
+  bool stopping;
+
+  // Parsed depth/mask buffers, reused once the caller has let go of them
+  static const unsigned int BUFFER_POOL_SIZE = 3;
+  std::vector<cv::Mat> depth_pool;
+  std::vector<cv::Mat> mask_pool;
+
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef _GUIDED_MATCHER_H_
+#define _GUIDED_MATCHER_H_
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+
+/**
+ *  Matches features whose image position is predicted (e.g. projected from
+ *  a pose guess) against the features of an image, each only against the
+ *  image features within a radius of its prediction.  The image features
+ *  are bucketed into a grid of square cells, so a prediction only visits the
+ *  cells its search circle touches and matching is roughly linear in the
+ *  number of features.  Binary descriptors are compared by Hamming distance,
+ *  others by L2 distance.
+ */
+class GuidedMatcher
+{
+public:
+  // cell_size is best about the typical search radius
+  GuidedMatcher(const std::vector<cv::KeyPoint>& keypoints, const cv::Mat& descriptors, float cell_size);
+
+  // For every prediction its two nearest image features by descriptor
+  // distance within radii[i] (radius for all if radii is empty), ordered like
+  // the result of knnMatch with k = 2: queryIdx is the image feature and
+  // trainIdx the prediction, so a ratio test applies as usual.  The second
+  // match has infinite distance if only one image feature is in range,
+  // predictions with none in range get no matches.
+  void Match(const std::vector<cv::Point2f>& predicted, const cv::Mat& descriptors, float radius,
+    const std::vector<float>& radii, std::vector< std::vector<cv::DMatch> >& matches) const;
+
+private:
+  float Distance(int feature, const cv::Mat& descriptors, int row) const;
+
+  std::vector<cv::Point2f> points;
+  cv::Mat descriptors;
+  bool binary;
+  float cell_size;
+  float x0, y0;
+  int grid_cols, grid_rows;
+  // features of cell c are cell_features[cell_start[c]] to cell_features[cell_start[c+1]-1]
+  std::vector<int> cell_start;
+  std::vector<int> cell_features;
+};
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef _HAMMING_MATCHER_H_
+#define _HAMMING_MATCHER_H_
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+
+#include "WorkerPool.h"
+
+/**
+ *  Brute force matching of binary descriptors (e.g. ORB) by Hamming
+ *  distance with the ratio test applied while matching.  Every query row is
+ *  compared against all train rows keeping only its best two distances, so
+ *  no per query match lists are built.  32 byte rows (ORB) take an AVX2 or
+ *  NEON popcount kernel when the compiler targets one, other widths go
+ *  through cv::normHamming.  The query rows are split over the workers.
+ *
+ *  Not thread safe, Match is called from one thread at a time.
+ */
+class HammingMatcher
+{
+public:
+  // Matches on workers, which may be shared with other components, or on a
+  // pool of all cores if none is given
+  HammingMatcher(boost::shared_ptr<WorkerPool> shared_workers = boost::shared_ptr<WorkerPool>());
+
+  // For every query row the nearest train row, kept if its distance is below
+  // ratio times the distance of the second nearest (always with a single
+  // train row).  matches are ordered by queryIdx.
+  void Match(const cv::Mat& query, const cv::Mat& train, float ratio, std::vector<cv::DMatch>& matches);
+
+private:
+  void MatchRows(const cv::Mat& query, const cv::Mat& train, int begin, int end, float ratio,
+    std::vector<cv::DMatch>* matches) const;
+
+  boost::shared_ptr<WorkerPool> workers;
+  // matches of each task, concatenated once all are done
+  std::vector< std::vector<cv::DMatch> > task_matches;
+};
+
+#endif
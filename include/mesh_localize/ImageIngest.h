@@ -0,0 +1,67 @@
+#ifndef _IMAGE_INGEST_H_
+#define _IMAGE_INGEST_H_
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+/**
+ *  Turns incoming camera images into the grayscale, scaled and undistorted
+ *  frames used for tracking.  Color conversion, scaling and undistortion are
+ *  done in one pass over the camera's buffer (e.g. wrapping a message, see
+ *  RosImageUtil) using fixed-point remap tables with the image scale folded
+ *  in.  Output frames come from a small pool of buffers that are reused once
+ *  the downstream stages let go of them.
+ */
+class ImageIngest
+{
+public:
+  // 8 bit layouts of the camera buffer
+  enum PixelFormat
+  {
+    MONO8,
+    BGR8,
+    RGB8,
+    BGRA8,
+    RGBA8,
+    BAYER_RGGB8,
+    BAYER_BGGR8,
+    BAYER_GBRG8,
+    BAYER_GRBG8
+  };
+
+  ImageIngest(unsigned int pool_size = 4);
+
+  // K and distcoeff describe the full resolution camera image
+  void Configure(const cv::Mat& K, const cv::Mat& distcoeff, double scale, bool undistort);
+  // src is 8 bit mono, BGR or BGRA (OpenCV channel order)
+  bool Process(const cv::Mat& src, cv::Mat& dst);
+  // src has 1, 3 or 4 channels as format says
+  bool Process(const cv::Mat& src, PixelFormat format, cv::Mat& dst);
+
+private:
+  void BuildMaps(int width, int height);
+  cv::Mat AcquireBuffer();
+  void Prepare(int width, int height, cv::Mat& dst);
+  void ProcessGray(const cv::Mat& src, cv::Mat& dst);
+  void ProcessColor(const cv::Mat& src, cv::Mat& dst, bool rgb);
+  template <int CN, int RI, int BI>
+  void RemapToGray(const cv::Mat& src, cv::Mat& dst);
+
+  cv::Mat K;
+  cv::Mat distcoeff;
+  double scale;
+  bool undistort;
+  bool identity;
+
+  int src_width;
+  int src_height;
+  cv::Size dst_size;
+  cv::Mat map_xy;
+  cv::Mat map_a;
+
+  unsigned int pool_size;
+  std::vector<cv::Mat> pool;
+  cv::Mat convert_buffer;
+};
+
+#endif
@@ -3,6 +3,7 @@
 
 #include <opencv2/opencv.hpp>
 #include <Eigen/Dense>
+#include "PointUndistorter.h"
 
 class KLTTracker 
 {
@@ -11,10 +12,11 @@ public:
   KLTTracker();
   void init(const cv::Mat& inputFrame, const cv::Mat& depth, const Eigen::Matrix3f& inputK, 
     const Eigen::Matrix3f& depthK, const Eigen::Matrix4f& inputTf, const cv::Mat& mask);
-  virtual bool processFrame(const cv::Mat& inputFrame, cv::Mat& outputFrame, 
-    std::vector<cv::Point2f>& pts2d, std::vector<cv::Point3f>& pts3d, std::vector<int>& ptIDs);
+  virtual bool processFrame(const cv::Mat& inputFrame, std::vector<cv::Point2f>& pts2d, std::vector<cv::Point3f>& pts3d, std::vector<int>& ptIDs);
   std::vector<unsigned char> filterMatchesEpipolarContraint(const std::vector<cv::Point2f>& pts1, 
     const std::vector<cv::Point2f>& pts2);
+  // Points are tracked in the raw images and undistorted before being returned
+  void setUndistorter(const PointUndistorter* undistorter);
 
 private:
   int m_maxNumberOfPoints;
@@ -37,5 +39,6 @@ private:
   std::vector<float> m_error;
 
   cv::Ptr<cv::FeatureDetector> m_fastDetector;
+  const PointUndistorter* m_undistorter;
 };
 #endif
@@ -2,6 +2,7 @@
 #define _KEYFRAMECONTAINER_H_
 
 #include "CameraContainer.h"
+#include "PointUndistorter.h"
 
 #include <stdio.h>
 #include <iostream>
@@ -37,12 +38,19 @@ public:
 #ifdef MESH_LOCALIZER_ENABLE_GPU
   gpu::GpuMat GetGPUDescriptors();
 #endif
-  std::vector<KeyPoint> GetKeypoints();
+  const std::vector<KeyPoint>& GetKeypoints();
   Eigen::Matrix4f GetTf();
   Eigen::Matrix3f GetK();
 
   void ExtractFeatures();
+  // Uses features extracted elsewhere (e.g. shared with other trackers) instead
+  void SetFeatures(const std::vector<KeyPoint>& new_keypoints, const Mat& new_descriptors);
   void SetMask(Mat new_mask);
+  void SetUndistorter(const PointUndistorter* new_undistorter);
+  // Set if the image is distorted and only its features get undistorted
+  const PointUndistorter* GetUndistorter();
+  // Feature budget for ORB extraction
+  void SetMaxFeatures(int new_max_features);
 private:
 
   void ExtractFeatures(std::string desc_type);
@@ -56,6 +64,8 @@ private:
   Mat depth; //May not be used
   Mat mask;
   string desc_type;
+  const PointUndistorter* undistorter;
+  int max_features;
 
   bool delete_cc;
   bool has_depth;
@@ -0,0 +1,92 @@
+#ifndef _KEYFRAME_RETRIEVER_H_
+#define _KEYFRAME_RETRIEVER_H_
+
+#include <string>
+#include <vector>
+#include <Eigen/Dense>
+
+#include "KeyframeMatch.h"
+#include "KeyframeContainer.h"
+#include "DescriptorIndex.h"
+#include "VocabularyTree.h"
+#include "WorkerPool.h"
+
+/**
+ *  Finds the keyframes of an image database that best match a query image,
+ *  for the feature matching initializations.  The keyframes near a pose
+ *  guess are ranked either by vocabulary tree score or by the votes of one
+ *  descriptor index over all keyframes, and the best ranked are then
+ *  matched feature by feature with the ratio test, keyframes in parallel on
+ *  the workers.
+ *
+ *  Keyframe ids are positions in the keyframe vector, which is not owned.
+ */
+class KeyframeRetriever
+{
+  // Orders keyframe ids by the distance of the keyframes to a pose
+  struct KeyframePositionSorter
+  {
+    Eigen::Matrix4f currentPose;
+    const std::vector<KeyframeContainer*>& keyframes;
+    KeyframePositionSorter(Eigen::Matrix4f pose, const std::vector<KeyframeContainer*>& keyframes):
+      currentPose(pose), keyframes(keyframes) {};
+
+    bool operator()(int kf1, int kf2)
+    {
+      return (keyframes[kf1]->GetTf().block<3,1>(0,3)-currentPose.block<3,1>(0,3)).norm() < (keyframes[kf2]->GetTf().block<3,1>(0,3)-currentPose.block<3,1>(0,3)).norm();
+    }
+  };
+
+  // Orders keyframe ids by their number of good matches, most first
+  struct KeyframeMatchSorter
+  {
+    const std::vector< std::vector<DMatch> >& matches;
+    KeyframeMatchSorter(const std::vector< std::vector<DMatch> >& matches): matches(matches) {};
+
+    bool operator()(int kf1, int kf2)
+    {
+      return matches[kf1].size() > matches[kf2].size();
+    }
+  };
+
+  // Orders keyframe ids by their score, best first
+  struct KeyframeScoreSorter
+  {
+    const std::vector<float>& scores;
+    KeyframeScoreSorter(const std::vector<float>& scores): scores(scores) {};
+
+    bool operator()(int kf1, int kf2)
+    {
+      return scores[kf1] > scores[kf2];
+    }
+  };
+
+public:
+  // Uses the vocabulary if it loads and fits the keyframes' descriptors,
+  // otherwise the index, loaded from index_filename or built (and saved
+  // there)
+  KeyframeRetriever(const std::vector<KeyframeContainer*>& keyframes, std::string index_filename = "",
+    std::string vocabulary_filename = "", int shortlist_size = 20,
+    boost::shared_ptr<WorkerPool> shared_workers = boost::shared_ptr<WorkerPool>());
+
+  // The k keyframes with the most matches passing the ratio test, most
+  // first.  With a pose guess only its search_bound nearest keyframes.
+  std::vector< KeyframeMatch > FindImageMatches(KeyframeContainer* img, int k, double ratio,
+    Eigen::Matrix4f* pose_guess = NULL, unsigned int search_bound = 0);
+
+private:
+  void MatchKeyframe(KeyframeContainer* img, int kf, double ratio, std::vector<DMatch>& good, std::vector<DMatch>& all);
+  bool InitVocabulary(const std::string& vocabulary_filename);
+
+  std::vector<KeyframeContainer*> keyframes;
+  // all keyframe descriptors, votes for the keyframes to match
+  DescriptorIndex index;
+  // with a vocabulary, shortlists keyframes to match instead of the index
+  VocabularyTree vocabulary;
+  BowDatabase bow;
+  bool use_vocabulary;
+  int shortlist_size;
+  boost::shared_ptr<WorkerPool> workers;
+};
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef _LANDMARK_DATABASE_H_
+#define _LANDMARK_DATABASE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <opencv2/core/core.hpp>
+#include <Eigen/Core>
+#include <Eigen/Dense>
+#include <Eigen/StdVector>
+
+// On disk layout: the header, the landmark records, then the descriptors of
+// all landmarks as one row per landmark
+struct LandmarkFileHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t num_landmarks;
+  int32_t desc_mat_type;
+  int32_t desc_cols;
+  char desc_type[16];
+};
+
+struct LandmarkRecord
+{
+  // model frame point
+  float point[3];
+  // the landmark was seen from directions within acos(cos_view_angle) of
+  // view_axis (pointing from the landmark to the camera), at camera
+  // distances from min_distance to max_distance
+  float view_axis[3];
+  float cos_view_angle;
+  float min_distance;
+  float max_distance;
+  uint32_t num_observations;
+};
+
+/**
+ *  Merges the features of many views of the model into landmarks.  A
+ *  feature is added to a landmark whose point is within merge_radius and
+ *  whose descriptor is within max_desc_dist of the feature, otherwise it
+ *  starts a new landmark.  A landmark's descriptor is the medoid of its
+ *  features' descriptors, its point their mean.
+ */
+class LandmarkDatabaseBuilder
+{
+public:
+  LandmarkDatabaseBuilder(float merge_radius, double max_desc_dist);
+
+  // pose is the camera pose of the view, points the model frame points of
+  // the features
+  bool Add(const Eigen::Matrix4f& pose, const cv::Mat& descriptors, const std::vector<cv::Point3f>& points);
+
+  // Writes the landmarks seen in at least min_observations views.  The view
+  // cones are widened by view_margin radians and the distance ranges by the
+  // factor distance_margin, since the views only sample the poses a
+  // landmark is seen from.
+  bool Write(const std::string& filename, const std::string& desc_type, unsigned int min_observations,
+    float view_margin, float distance_margin, size_t* num_written = NULL);
+
+  size_t NumLandmarks() const;
+
+private:
+  struct Track
+  {
+    Eigen::Vector3f point_sum;
+    // observations by row of all_descriptors, with the camera they were seen from
+    std::vector<int> rows;
+    std::vector<Eigen::Vector3f, Eigen::aligned_allocator<Eigen::Vector3f> > cameras;
+    int representative;
+  };
+
+  uint64_t VoxelKey(const Eigen::Vector3f& p, int dx, int dy, int dz) const;
+  double Distance(int row_a, int row_b) const;
+  int MedoidRow(const Track& track) const;
+
+  float merge_radius;
+  double max_desc_dist;
+  int norm_type;
+  cv::Mat all_descriptors;
+  std::vector<Track> tracks;
+  // landmarks by the voxel (of merge_radius) of their first point
+  std::map<uint64_t, std::vector<int> > grid;
+};
+
+/**
+ *  3D landmarks of the model with their descriptors, for PNP without
+ *  rendering.  SelectVisible picks the landmarks that project into the
+ *  image from a pose within their recorded viewing directions and
+ *  distances, which also keeps out most landmarks the model hides.
+ */
+class LandmarkDatabase
+{
+public:
+  LandmarkDatabase();
+
+  bool Load(const std::string& filename);
+
+  size_t NumLandmarks() const;
+  const std::string& GetDescriptorType() const;
+  const cv::Mat& GetDescriptors() const;
+  cv::Point3f GetPoint(int landmark) const;
+
+  // Landmarks visible from pose (camera pose in the model frame) in a rows
+  // x cols image with intrinsics K, and their projections into it
+  void SelectVisible(const Eigen::Matrix4f& pose, const Eigen::Matrix3f& K, int rows, int cols,
+    std::vector<int>& landmarks, std::vector<cv::Point2f>& projections) const;
+
+private:
+  // structure of arrays so selection streams through contiguous floats
+  std::vector<float> x, y, z;
+  std::vector<float> ax, ay, az;
+  std::vector<float> cos_view_angle;
+  std::vector<float> min_distance;
+  std::vector<float> max_distance;
+  cv::Mat descriptors;
+  std::string desc_type;
+};
+
+#endif
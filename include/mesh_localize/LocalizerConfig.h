@@ -0,0 +1,152 @@
+#ifndef _LOCALIZER_CONFIG_H_
+#define _LOCALIZER_CONFIG_H_
+
+#include <string>
+
+/**
+ *  All tunable parameters of the localizer with their defaults.  Parameters
+ *  can be read from any source that provides a reader functor through Visit,
+ *  e.g. the ROS parameter server or a YAML/XML file (Load).
+ */
+struct LocalizerConfig
+{
+  LocalizerConfig();
+
+  // Reads the config from an OpenCV FileStorage (YAML or XML) file.  Keys
+  // match the ROS parameter names, missing keys keep their current value.
+  bool Load(const std::string& filename);
+
+  // Calls reader(name, value) for every parameter.  The reader should only
+  // overwrite value if the parameter is set in its source.
+  template <typename Reader>
+  void Visit(Reader& reader)
+  {
+    reader("point_cloud_filename", pc_filename);
+    reader("mesh_filename", mesh_filename);
+    reader("photoscan_filename", photoscan_filename);
+    reader("load_descriptors", load_descriptors);
+    reader("descriptor_filename", descriptor_filename);
+    reader("descriptor_index_filename", descriptor_index_filename);
+    reader("vocabulary_filename", vocabulary_filename);
+    reader("vocabulary_shortlist", vocabulary_shortlist);
+    reader("show_pnp_matches", show_pnp_matches);
+    reader("show_debug", show_debug);
+    reader("show_global_matches", show_global_matches);
+    reader("ogre_data_dir", ogre_data_dir);
+    reader("ogre_cfg_dir", ogre_cfg_dir);
+    reader("ogre_model", ogre_model);
+    reader("virtual_image_source", virtual_image_source);
+    reader("pnp_descriptor_type", pnp_descriptor_type);
+    reader("img_match_descriptor_type", img_match_descriptor_type);
+    reader("global_localization_alg", global_localization_alg);
+    reader("image_scale", image_scale);
+    reader("min_pnp_inliers", min_pnp_inliers);
+    reader("max_pnp_reproj_error", max_pnp_reproj_error);
+    reader("ratio_test_thresh", ratio_test_thresh);
+    reader("canny_sigma", canny_sigma);
+    reader("canny_high_thresh", canny_high_thresh);
+    reader("canny_low_thresh", canny_low_thresh);
+    reader("edge_tracking_dmax", edge_tracking_dmax);
+    reader("autotune_canny", autotune_canny);
+    reader("tracking_mode", tracking_mode);
+    reader("edge_tracking_iterations", edge_tracking_iterations);
+    reader("pnp_match_radius", pnp_match_radius);
+    reader("motion_model", motion_model);
+    reader("do_undistort", do_undistort);
+    reader("undistort_mode", undistort_mode);
+    reader("pixel_noise", pixel_noise);
+    reader("virtual_fx", virtual_fx);
+    reader("virtual_fy", virtual_fy);
+    reader("use_depth_shader", use_depth_shader);
+    reader("pipeline_queue_size", pipeline_queue_size);
+    reader("enable_profiling", enable_profiling);
+    reader("profile_trace_file", profile_trace_file);
+    reader("diagnostics_period", diagnostics_period);
+    reader("speculative_render", speculative_render);
+    reader("speculative_trans_tol", speculative_trans_tol);
+    reader("speculative_rot_tol", speculative_rot_tol);
+    reader("frame_budget", frame_budget);
+    reader("orb_features", orb_features);
+    reader("degraded_orb_features", degraded_orb_features);
+    reader("tracking_threads", tracking_threads);
+    reader("worker_threads", worker_threads);
+    reader("pc_chunk_size", pc_chunk_size);
+    reader("pc_backface_culling", pc_backface_culling);
+    reader("pc_lod_pixel_spacing", pc_lod_pixel_spacing);
+    reader("mesh_backface_culling", mesh_backface_culling);
+    reader("render_cache_size", render_cache_size);
+    reader("render_cache_trans_tol", render_cache_trans_tol);
+    reader("render_cache_rot_tol", render_cache_rot_tol);
+    reader("render_cache_warp_trans_tol", render_cache_warp_trans_tol);
+    reader("render_cache_warp_rot_tol", render_cache_warp_rot_tol);
+    reader("atlas_filename", atlas_filename);
+    reader("atlas_rot_weight", atlas_rot_weight);
+    reader("render_crop_margin", render_crop_margin);
+    reader("landmark_filename", landmark_filename);
+  }
+
+  std::string pc_filename;
+  std::string mesh_filename;
+  std::string photoscan_filename;
+  bool load_descriptors;
+  std::string descriptor_filename;
+  std::string descriptor_index_filename;
+  std::string vocabulary_filename;
+  int vocabulary_shortlist;
+  bool show_pnp_matches;
+  bool show_debug;
+  bool show_global_matches;
+  std::string ogre_data_dir;
+  std::string ogre_cfg_dir;
+  std::string ogre_model;
+  std::string virtual_image_source;
+  std::string pnp_descriptor_type;
+  std::string img_match_descriptor_type;
+  std::string global_localization_alg;
+  double image_scale;
+  int min_pnp_inliers;
+  double max_pnp_reproj_error;
+  double ratio_test_thresh;
+  double canny_sigma;
+  double canny_high_thresh;
+  double canny_low_thresh;
+  double edge_tracking_dmax;
+  bool autotune_canny;
+  std::string tracking_mode;
+  int edge_tracking_iterations;
+  double pnp_match_radius;
+  std::string motion_model;
+  bool do_undistort;
+  std::string undistort_mode;
+  double pixel_noise;
+  double virtual_fx;
+  double virtual_fy;
+  bool use_depth_shader;
+  int pipeline_queue_size;
+  bool enable_profiling;
+  std::string profile_trace_file;
+  double diagnostics_period;
+  bool speculative_render;
+  double speculative_trans_tol;
+  double speculative_rot_tol;
+  double frame_budget;
+  int orb_features;
+  int degraded_orb_features;
+  int tracking_threads;
+  int worker_threads;
+  double pc_chunk_size;
+  bool pc_backface_culling;
+  double pc_lod_pixel_spacing;
+  bool mesh_backface_culling;
+  int render_cache_size;
+  double render_cache_trans_tol;
+  double render_cache_rot_tol;
+  double render_cache_warp_trans_tol;
+  double render_cache_warp_rot_tol;
+  std::string atlas_filename;
+  double atlas_rot_weight;
+  int render_crop_margin;
+  std::string landmark_filename;
+};
+
+#endif
@@ -0,0 +1,231 @@
+#ifndef _LOCALIZER_PIPELINE_H_
+#define _LOCALIZER_PIPELINE_H_
+
+#include <vector>
+#include <string>
+#include <Eigen/Dense>
+#include <opencv2/core/core.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include "MonocularLocalizer.h"
+#include "VirtualImageGenerator.h"
+#include "KeyframeContainer.h"
+#include "MapFeatures.h"
+#include "KLTTracker.h"
+#include "LocalizerConfig.h"
+#include "FrameScheduler.h"
+#include "WorkerPool.h"
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+class RenderStage;
+class RenderService;
+class RenderCache;
+class AtlasImageGenerator;
+class LandmarkDatabase;
+class ImageIngest;
+class QueryFeatureCache;
+class HammingMatcher;
+
+/**
+ *  Outcome of running one frame through the localizer.
+ */
+struct PoseResult
+{
+  PoseResult();
+
+  bool localized;
+  // Skipped because it could not be processed within frame_budget
+  bool dropped;
+  // Camera pose in the model frame, valid if localized
+  Eigen::Matrix4f pose;
+  double stamp;
+  // State the frame was processed in
+  const char* state;
+
+  // Only set by the PNP state: the tracked frame and the virtual depth map it
+  // was matched against (see LocalizerPipeline::TransformDepthFrame)
+  cv::Mat image;
+  cv::Mat virtual_depth;
+  Eigen::Matrix4f virtual_pose;
+  Eigen::Matrix3f virtual_K;
+
+  // Only set by the KLT states: the tracked points (undistorted, in the
+  // preprocessed frame) and their track ids, for debug overlays
+  std::vector<cv::Point2f> tracked_points;
+  std::vector<int> tracked_ids;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+/**
+ *  The localization state machine without any ROS plumbing.  Frames are
+ *  passed in by the caller together with their stamp and the pose is
+ *  returned directly, so the localizer can be embedded in another process or
+ *  driven by offline tools.  MeshLocalizer wraps it as a ROS node.
+ *
+ *  Not thread safe: frames must be processed from one thread at a time.
+ */
+class LocalizerPipeline
+{
+public:
+  enum State
+  {
+    INIT,
+    INIT_PNP,
+    LOCAL_INIT,
+    PNP,
+    EDGES,
+    KLT_INIT,
+    KLT
+  };
+
+  // camK and camD describe the full resolution camera images.  A render
+  // service (not owned) renders the virtual views instead of
+  // virtual_image_source, it is required when that is "gazebo".  Rendering
+  // and matching run on shared_workers, e.g. one pool for all pipelines of a
+  // process, or on a pool of config.worker_threads if none are given.
+  LocalizerPipeline(const LocalizerConfig& config, const cv::Mat& camK, const cv::Mat& camD,
+    int width, int height, RenderService* render_service = NULL,
+    boost::shared_ptr<WorkerPool> shared_workers = boost::shared_ptr<WorkerPool>());
+  ~LocalizerPipeline();
+
+  // False if the image database or the virtual image generator could not be loaded
+  bool IsInitialized() const;
+
+  // Converts a raw 8 bit mono/BGR/BGRA image and runs it through the state machine
+  PoseResult ProcessFrame(const cv::Mat& image, double stamp);
+  // Runs a frame that was already converted by Preprocess, or by an
+  // ImageIngest set up with ConfigureIngest (e.g. on another thread).  age is
+  // the time in seconds since the frame arrived, it counts against frame_budget.
+  PoseResult ProcessPreprocessedFrame(const cv::Mat& frame, double stamp, double age = 0);
+  bool Preprocess(const cv::Mat& image, cv::Mat& frame);
+  void ConfigureIngest(ImageIngest& ingest) const;
+
+  // Features of the frames passed to ProcessPreprocessedFrame are taken from
+  // cache when it holds the same frame, e.g. when several objects are tracked
+  // in one camera stream.  NULL (default) extracts them per pipeline.
+  void SetQueryFeatures(QueryFeatureCache* cache);
+
+  // Fully undistorts a preprocessed frame (a copy if frames are already undistorted)
+  void UndistortFrame(const cv::Mat& frame, cv::Mat& dst) const;
+
+  State GetState() const;
+  const char* GetStateName() const;
+  static const char* StateName(State state);
+  const LocalizerConfig& GetConfig() const;
+  // Intrinsics of the preprocessed (scaled) frames
+  const Eigen::Matrix3f& GetK() const;
+
+  // Creates the generator for config.virtual_image_source, rendering rows x
+  // cols images with intrinsics K (Ogre uses its own) on workers, all cores
+  // if none are given.  NULL on failure.
+  static VirtualImageGenerator* CreateVirtualImageGenerator(const LocalizerConfig& config,
+    const Eigen::Matrix3f& K, int rows, int cols,
+    boost::shared_ptr<WorkerPool> workers = boost::shared_ptr<WorkerPool>());
+
+  // Reprojects depth map d1 seen from tf1 into a camera at tf2
+  static void TransformDepthFrame(const cv::Mat& d1, const Eigen::Matrix4f& tf1, const Eigen::Matrix3f K1,
+    cv::Mat& d2, const Eigen::Matrix4f& tf2, const Eigen::Matrix3f& K2, const cv::Size& d2_size);
+
+private:
+  bool Init();
+  void InitCamera(const cv::Mat& camK, const cv::Mat& camD, int width, int height);
+  bool InitRenderStage();
+  Eigen::Matrix4f FindImageTfPnp(KeyframeContainer* kcv, const MapFeatures& mf);
+  bool FindImageTfVirtualPnp(KeyframeContainer* kcv, Eigen::Matrix4f vimgTf, Eigen::Matrix4f& out, std::string vdesc_type, bool mask_kf, Eigen::Matrix<float, 6, 6>& cov);
+  bool FindImageTfVirtualEdges(KeyframeContainer* kcv, Eigen::Matrix4f vimgTf, Eigen::Matrix4f& out, bool mask_kf);
+  std::vector<pcl::PointXYZ> GetPointCloudFromFrames(KeyframeContainer*, KeyframeContainer*);
+  std::vector<int> FindPlaneInPointCloud(const std::vector<pcl::PointXYZ>& pts);
+  bool GetVirtualImage(Eigen::Matrix4f& pose, cv::Mat& vimg, cv::Mat& depth, cv::Mat& mask,
+    Eigen::Matrix3f& vimgK, bool predicted = false);
+
+  void UpdateMotionModel(const Eigen::Matrix4f& olfTf, const Eigen::Matrix4f& newTf,
+    const Eigen::Matrix<float, 6, 6>& cov, double dt);
+  Eigen::Matrix4f ApplyMotionModel(double dt);
+  void ResetMotionModel();
+  void PredictionRadii(const std::vector<cv::Point3f>& pts3d, const Eigen::Matrix4f& pose,
+    std::vector<float>& radii);
+
+  void RunStateMachine(double dt);
+  int NumLevels(State state) const;
+  int OrbFeatures() const;
+  void SetPose(const Eigen::Matrix4f& tf);
+  bool WithinSpeculativeTolerance(const Eigen::Matrix4f& a, const Eigen::Matrix4f& b) const;
+
+  std::vector<cv::Point3d> PCLToPoint3d(const std::vector<pcl::PointXYZ>& cpvec);
+  void ReprojectMask(cv::Mat& dst, const cv::Mat& src, const Eigen::Matrix3f& dstK,
+    const Eigen::Matrix3f& srcK, bool median_blur = true);
+
+  State localize_state;
+  LocalizerConfig config;
+  bool initialized;
+
+  // Result of the frame currently being processed
+  PoseResult result;
+  cv::Mat current_image;
+
+  cv::Mat virtual_depth;
+  Eigen::Matrix4f virtual_depth_tf;
+  Eigen::Matrix3f virtual_depth_K;
+  Eigen::Matrix4f currentPose;
+  int numPnpRetrys;
+  int numLocalizeRetrys;
+  double pnpReprojError;
+
+  MonocularLocalizer* localization_init;
+  RenderStage* render_stage;
+  RenderCache* render_cache;
+  AtlasImageGenerator* atlas;
+  // Replaces the virtual image in PNP when its descriptors are the ones asked for
+  LandmarkDatabase* landmarks;
+  RenderService* render_service;
+  // Render requested at the last pose update, 0 if none
+  unsigned long pending_render;
+  Eigen::Matrix4f pending_render_pose;
+  // Covariance of the last PNP pose in pixel units, widens the guided
+  // matching radius of the next frame
+  Eigen::Matrix<float, 6, 6> pnp_cov;
+  bool pnp_cov_valid;
+  // Keeps the memory of the last render service image alive
+  boost::shared_ptr<const void> render_owner;
+  PointUndistorter* point_undistorter;
+  ImageIngest* image_ingest;
+  QueryFeatureCache* query_features;
+  // Rendering and matching threads, possibly shared with other pipelines
+  boost::shared_ptr<WorkerPool> workers;
+  // ORB matching with the ratio test in PNP
+  HammingMatcher* hamming_matcher;
+
+  MapFeatures map_features;
+
+  Eigen::Matrix4f camera_velocity;
+  double last_stamp;
+  double frame_interval;
+
+  Eigen::Matrix3f K;
+  Eigen::Matrix3f K_scaled;
+  Eigen::Matrix3f map_K;
+  Eigen::VectorXf distcoeff;
+  Eigen::VectorXf map_distcoeff;
+  cv::Mat Kcv;
+  cv::Mat Kcv_undistort;
+  cv::Mat map_Kcv;
+  cv::Mat distcoeffcv;
+  cv::Mat map_distcoeffcv;
+  int camera_height;
+  int camera_width;
+
+  KLTTracker klt_tracker;
+  cv::Mat klt_init_img;
+
+  // Picks how much work each frame gets when frame_budget is set
+  FrameScheduler scheduler;
+  FrameScheduler::Level level;
+
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+#endif
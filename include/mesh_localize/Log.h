@@ -0,0 +1,42 @@
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <string>
+#include <boost/function.hpp>
+
+/**
+ *  Logging of the localization library.  Messages are printed to stderr
+ *  unless a handler is set, e.g. by MeshLocalizer to forward them to
+ *  rosconsole, so the pipeline can be embedded without ROS.  Messages below
+ *  the log level are dropped before they are formatted.
+ */
+class Log
+{
+public:
+  enum Level
+  {
+    LEVEL_DEBUG,
+    LEVEL_INFO,
+    LEVEL_WARN,
+    LEVEL_ERROR
+  };
+
+  typedef boost::function<void (Level, const std::string&)> Handler;
+
+  // An empty handler prints to stderr again
+  static void SetHandler(Handler handler);
+  // Default LEVEL_INFO
+  static void SetLevel(Level level);
+  static bool Enabled(Level level);
+  static void Write(Level level, const char* format, ...)
+    __attribute__((format(printf, 2, 3)));
+};
+
+#define ML_LOG(level, ...) \
+  do { if(Log::Enabled(level)) Log::Write(level, __VA_ARGS__); } while(0)
+#define ML_DEBUG(...) ML_LOG(Log::LEVEL_DEBUG, __VA_ARGS__)
+#define ML_INFO(...) ML_LOG(Log::LEVEL_INFO, __VA_ARGS__)
+#define ML_WARN(...) ML_LOG(Log::LEVEL_WARN, __VA_ARGS__)
+#define ML_ERROR(...) ML_LOG(Log::LEVEL_ERROR, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef _MESH_IMAGE_GENERATOR_
+#define _MESH_IMAGE_GENERATOR_
+
+#include "VirtualImageGenerator.h"
+#include "MeshRasterizer.h"
+#include <pcl/PolygonMesh.h>
+
+/**
+ *  Renders virtual images of a triangle mesh (STL, OBJ, PLY, ...) on the
+ *  CPU, so mesh based tracking runs without a GL context or a simulator.
+ *  Meshes with vertex colors are drawn in their grey levels, others are
+ *  shaded with a light at the camera.
+ */
+class MeshImageGenerator : public VirtualImageGenerator
+{
+public:
+  // The mesh is copied, polygons with more than three vertices are split
+  // into triangle fans.  Renders on shared_workers, or on all cores if none
+  // are given.
+  MeshImageGenerator(const pcl::PolygonMesh& mesh, const Eigen::Matrix3f& K, int rows, int cols,
+    boost::shared_ptr<WorkerPool> shared_workers = boost::shared_ptr<WorkerPool>(), bool backface_culling = false);
+  ~MeshImageGenerator();
+  virtual cv::Mat GenerateVirtualImage(const Eigen::Matrix4f& pose, cv::Mat& depth, cv::Mat& mask);
+  virtual Eigen::Matrix3f GetK();
+  // Only rasterizes the projected bounding box of the mesh
+  virtual cv::Mat GenerateCroppedVirtualImage(const Eigen::Matrix4f& pose, int margin, cv::Mat& depth,
+    cv::Mat& mask, cv::Rect& roi);
+  // The poses are split between lanes with a rasterizer each, which render
+  // their poses in parallel on the same workers
+  virtual void GenerateVirtualImages(const PoseList& poses, std::vector<cv::Mat>& images,
+    std::vector<cv::Mat>& depths, std::vector<cv::Mat>& masks, int outputs = RENDER_ALL);
+
+private:
+  void SetupLanes(unsigned int num_lanes);
+  void RenderLane(unsigned int lane, const PoseList& poses, std::vector<cv::Mat>& images,
+    std::vector<cv::Mat>& depths, std::vector<cv::Mat>& masks, int outputs);
+
+  TriangleMesh triangles;
+  boost::shared_ptr<WorkerPool> workers;
+  MeshRasterizer rasterizer;
+  // Batch renders, one rasterizer per lane
+  std::vector<MeshRasterizer*> lanes;
+  bool backface_culling;
+  Eigen::Matrix3f K;
+  int rows;
+  int cols;
+  Eigen::Vector3f min_pt;
+  Eigen::Vector3f max_pt;
+
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+#endif
@@ -2,38 +2,85 @@
 #define _MAPLOCALIZER_H_
 
 #include <vector>
+#include <atomic>
 #include <ros/ros.h>
 #include <Eigen/Dense>
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
 #include "tf/transform_broadcaster.h"
 #include "sensor_msgs/Image.h"
 #include "sensor_msgs/CameraInfo.h"
 
-#include "MonocularLocalizer.h"
-#include "VirtualImageGenerator.h"
-#include "KeyframeContainer.h"
-#include "KeyframeMatch.h"
-#include "MapFeatures.h"
-#include "EdgeTrackingUtil.h"
-//#include "IMUMotionModel.h"
-#include "KLTTracker.h"
+#include "LocalizerPipeline.h"
+#include "GazeboRenderService.h"
+#include "BoundedQueue.h"
+#include "ImageIngest.h"
+#include "LocalizerConfig.h"
+#include "QueryFeatureCache.h"
+#include "WorkerPool.h"
 
 #include "pcl_ros/point_cloud.h"
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
-#include <pcl/PolygonMesh.h>
+
+/**
+ *  ROS node around LocalizerPipeline.  Images are converted on an ingest
+ *  worker, run through the pipeline on a tracking worker and the resulting
+ *  poses/depth are sent out by a publish worker.  When Gazebo renders the
+ *  virtual views the pipeline requests them from a GazeboRenderService.
+ *
+ *  Several objects can be tracked in the same camera stream (the "objects"
+ *  parameter).  Every object has its own pipeline, but the frames are
+ *  converted once and the objects' trackers run side by side on a worker
+ *  pool, sharing the feature extraction of each frame.
+ */
 class MeshLocalizer
 {
+  // Image as received, with the (Profiler::Now) time it arrived
+  struct RawImage
+  {
+    sensor_msgs::ImageConstPtr msg;
+    int64_t arrival;
+  };
 
-  enum LocalizeState
+  // Preprocessed camera frame handed from the ingest stage to the tracking stage
+  struct Frame
+  {
+    Mat image;
+    ros::Time stamp;
+    int64_t arrival;
+  };
+
+  // One tracked object with its own pipeline and output topics
+  struct ObjectTracker
+  {
+    ObjectTracker() : pipeline(NULL) {}
+
+    std::string name;
+    LocalizerConfig config;
+    LocalizerPipeline* pipeline;
+    // tf child frame of the object pose
+    std::string frame_id;
+
+    ros::Publisher estimated_pose_pub;
+    ros::Publisher image_pub;
+    ros::Publisher image_cam_info_pub;
+    ros::Publisher depth_pub;
+    ros::Publisher debug_image_pub;
+  };
+
+  // Pipeline result to publish, stamped with the exact stamp of the image
+  struct PublishJob
   {
-    INIT,
-    INIT_PNP,
-    LOCAL_INIT,
-    PNP,
-    EDGES,
-    KLT_INIT,
-    KLT
-  } localize_state;
+    PoseResult result;
+    ros::Time stamp;
+    // index into trackers
+    unsigned int object;
+    // The tracked frame, only kept while the debug image has subscribers
+    Mat frame;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
 
 public:
 
@@ -41,139 +88,69 @@ public:
   ~MeshLocalizer();
 
 private:
-  Eigen::Matrix4f FindImageTfPnp(KeyframeContainer* kcv, const MapFeatures& mf);
-  bool FindImageTfVirtualPnp(KeyframeContainer* kcv, Eigen::Matrix4f vimgTf, Eigen::Matrix4f& out, std::string vdesc_type, bool mask_kf, Eigen::Matrix<float, 6, 6>& cov);
-  bool FindImageTfVirtualEdges(KeyframeContainer* kcv, Eigen::Matrix4f vimgTf, Eigen::Matrix4f& out, bool mask_kf);
-  std::vector<pcl::PointXYZ> GetPointCloudFromFrames(KeyframeContainer*, KeyframeContainer*);
-  std::vector<int> FindPlaneInPointCloud(const std::vector<pcl::PointXYZ>& pts);
-  Mat GetVirtualImageFromTopic(Mat& depths, Mat& mask);
-  Mat GenerateVirtualImage(Eigen::Matrix4f tf, Eigen::Matrix3f K, int height, int width, pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr cloud, Mat& depth, Mat& mask);
-
-  void UpdateMotionModel(const Eigen::Matrix4f& olfTf, const Eigen::Matrix4f& newTf, 
-    const Eigen::Matrix<float, 6, 6>& cov, double dt);
-  Eigen::Matrix4f ApplyMotionModel(double dt);
-  void ResetMotionModel();
-
-  void PublishDepthMat(const Mat& depth, ros::Time stamp);
-  void PublishPose(Eigen::Matrix4f tf);
+  bool CreateTrackers(const std::vector<std::string>& names, const Mat& camK, const Mat& camD,
+    int width, int height);
+  void PublishDepthMat(const ObjectTracker& tracker, const Mat& depth, ros::Time stamp);
+  void PublishPose(const ObjectTracker& tracker, Eigen::Matrix4f tf, ros::Time stamp);
   void PublishMap();
   void PublishPointCloud(const std::vector<pcl::PointXYZ>&);
   void PublishPointCloud(pcl::PointCloud<pcl::PointXYZ>::Ptr pc);
   void PlotTf(Eigen::Matrix4f tf, std::string name);
 
-  void spin(const ros::TimerEvent& e);
+  void IngestLoop();
+  void TrackLoop();
+  void TrackObject(const Frame& frame, double age, PublishJob* job);
+  void PublishLoop();
+  void VizLoop();
+  void PublishMapTimer(const ros::TimerEvent& e);
+  void PublishDiagnostics(const ros::TimerEvent& e);
+  bool PreprocessImage(const RawImage& raw, Frame& frame);
   void HandleImage(const sensor_msgs::ImageConstPtr& msg);
-  void HandleVirtualImage(const sensor_msgs::ImageConstPtr& msg);
-  void HandleVirtualDepth(const sensor_msgs::ImageConstPtr& msg);
-  void UpdateVirtualSensorState(Eigen::Matrix4f tf);
-
-  std::vector<Point3d> PCLToPoint3d(const std::vector<pcl::PointXYZ>& cpvec);
-  void PublishProcessedImageAndDepth(const cv::Mat& image, const cv::Mat& depth, ros::Time stamp);
-  void ReprojectMask(cv::Mat& dst, const cv::Mat& src, const Eigen::Matrix3f& dstK, 
-    const Eigen::Matrix3f& srcK, bool median_blur = true);
-  void TransformDepthFrame(const Mat& d1, const Eigen::Matrix4f& tf1, const Eigen::Matrix3f K1, 
-    Mat& d2, const Eigen::Matrix4f& tf2, const Eigen::Matrix3f& K2);
-  void CreateTfViz(Mat& src, Mat& dst, const Eigen::Matrix4f& tf,
-    const Eigen::Matrix3f& K);
-
-  std::vector<CameraContainer*> cameras;
-  
-  ros::Time img_time_stamp;
-  Mat current_image;
-  Mat current_virtual_image;
-  sensor_msgs::ImageConstPtr current_virtual_depth_msg;
-
-  Mat virtual_depth;
-  std::vector<Eigen::Vector3f> positionList;
-  Eigen::Matrix4f currentPose;
-  bool get_frame;
-  bool get_virtual_image;
-  bool get_virtual_depth;
-  int numPnpRetrys;
-  int numLocalizeRetrys;
-  double pnpReprojError;
-  double pixel_noise;
-  double virtual_fx;
-  double virtual_fy;
-
-  MonocularLocalizer* localization_init;
-  VirtualImageGenerator* vig;
-
-  ros::Time spin_time;
-
-  MapFeatures map_features;
-
-  std::string ogre_data_dir;
-  std::string ogre_cfg_dir;
-  std::string ogre_model;
-  std::string pc_filename;
-  std::string mesh_filename;
-  std::string photoscan_filename;
-  std::string virtual_image_source;
-  std::string pnp_descriptor_type;
-  std::string img_match_descriptor_type;
-  bool show_pnp_matches;
-  bool show_global_matches;
-  bool show_debug;
-  std::string tracking_mode;
-  std::string global_localization_alg;
-  double image_scale;
-  double canny_high_thresh;
-  double canny_low_thresh;
-  double canny_sigma;
-  bool autotune_canny;
-  double edge_tracking_dmax;
-  int edge_tracking_iterations;
-  double pnp_match_radius;
-  int min_pnp_inliers;
-  double max_pnp_reproj_error;
-  double ratio_test_thresh;
-  std::string motion_model;
-  bool do_undistort;
-  bool use_depth_shader;
+  void PublishProcessedImageAndDepth(const ObjectTracker& tracker, const cv::Mat& image,
+    const cv::Mat& depth, ros::Time stamp);
+
+  // Node level parameters, the defaults of every object
+  LocalizerConfig config;
+  std::vector<ObjectTracker*> trackers;
+
+  // Renders the virtual views when virtual_image_source is "gazebo"
+  GazeboRenderService* gazebo;
 
   ros::NodeHandle nh;
   ros::NodeHandle nh_private;
 
-  ros::ServiceClient gazebo_client;
-  ros::Publisher  estimated_pose_pub;
   ros::Publisher  map_marker_pub;
   ros::Publisher  pointcloud_pub;
-  ros::Publisher  image_pub;
-  ros::Publisher  image_cam_info_pub;
-  ros::Publisher  depth_pub;
-  tf::TransformBroadcaster br;
+  ros::Publisher  diagnostics_pub;
+  boost::shared_ptr<tf::TransformBroadcaster> br;
 
   ros::Subscriber image_sub;
-  ros::Subscriber virtual_image_sub;
-  ros::Subscriber virtual_depth_sub;
-
-  ros::Timer timer;
-
-  Eigen::Matrix4f camera_velocity;
-  ros::Time last_spin_time;
-
-  Eigen::Matrix3f K;
-  Eigen::Matrix3f K_scaled;
-  Eigen::Matrix3f map_K;
-  Eigen::Matrix3f virtual_K;
-  Eigen::VectorXf distcoeff;
-  Eigen::VectorXf map_distcoeff;
-  Mat Kcv;
-  Mat Kcv_undistort;
-  Mat map_Kcv;
-  Mat virtual_Kcv;
-  Mat distcoeffcv;
-  Mat map_distcoeffcv;
-  int virtual_height;
-  int virtual_width;
-  bool init_undistort;
-  Mat undistort_map1, undistort_map2;
-
-  //IMUMotionModel * imu_mm;
-
-  KLTTracker klt_tracker;
-  Mat klt_init_img;
+
+  ros::Timer map_timer;
+  ros::Timer diagnostics_timer;
+
+  // Pipeline stages.  Raw images are preprocessed by the ingest worker, the
+  // tracking worker runs the localization state machine (rendering is done on
+  // the render stage's own thread) and results are sent out by the publish worker.
+  // Debug overlays are drawn by the visualization worker, which only gets
+  // frames while someone subscribes to them.
+  BoundedQueue<RawImage> image_queue;
+  ImageIngest image_ingest;
+  BoundedQueue<Frame> frame_queue;
+  BoundedQueue< boost::shared_ptr<PublishJob> > publish_queue;
+  BoundedQueue< boost::shared_ptr<PublishJob> > viz_queue;
+  boost::thread ingest_thread;
+  boost::thread track_thread;
+  boost::thread publish_thread;
+  boost::thread viz_thread;
+  // Runs the objects' trackers on each frame, with the features they share
+  WorkerPool* workers;
+  // Rendering and matching of all objects' pipelines
+  boost::shared_ptr<WorkerPool> compute_workers;
+  QueryFeatureCache query_features;
+  bool running;
+  // Frames the pipeline skipped to stay within frame_budget
+  std::atomic<unsigned long> num_deadline_drops;
 };
 
 #endif
@@ -0,0 +1,102 @@
+#ifndef _MESH_RASTERIZER_H_
+#define _MESH_RASTERIZER_H_
+
+#include <vector>
+#include <stdint.h>
+#include <opencv2/core/core.hpp>
+#include <Eigen/Core>
+#include <Eigen/Dense>
+
+#include "WorkerPool.h"
+#include "RenderOutputs.h"
+
+/**
+ *  Indexed triangle mesh, vertices stored as a structure of arrays.
+ *  intensity is per vertex, with shade set the rasterizer ignores it and
+ *  shades every face by its angle to the view ray instead.
+ */
+struct TriangleMesh
+{
+  TriangleMesh();
+  void AddVertex(float px, float py, float pz, uchar value);
+  void AddTriangle(uint32_t a, uint32_t b, uint32_t c);
+  size_t NumVertices() const;
+  size_t NumTriangles() const;
+
+  std::vector<float> x, y, z;
+  std::vector<uchar> intensity;
+  std::vector<uint32_t> indices;
+  bool shade;
+};
+
+/**
+ *  Renders a triangle mesh into an intensity/depth image on the CPU.
+ *  Vertices are transformed and triangles set up (near plane clipped,
+ *  culled, turned into edge functions) in parallel, and binned into screen
+ *  tiles.  Each tile is then rasterized by one worker over its own part of
+ *  the z-buffer, so no locking is needed; the inner loop over a span of
+ *  pixels is branch free so the compiler vectorizes it.
+ *
+ *  Not thread safe, Render is called from one thread at a time.
+ */
+class MeshRasterizer
+{
+public:
+  // Rasterizes on workers, which may be shared with other components, or on
+  // a pool of all cores if none is given
+  MeshRasterizer(const Eigen::Matrix3f& K, int rows, int cols,
+    boost::shared_ptr<WorkerPool> shared_workers = boost::shared_ptr<WorkerPool>());
+
+  // Skips triangles wound clockwise as seen from the camera
+  void SetBackfaceCulling(bool enable);
+  // Intrinsics and size of the following renders, e.g. to render a crop
+  void SetCamera(const Eigen::Matrix3f& K, int rows, int cols);
+
+  // pose is the camera pose in the frame of the mesh.  Depth is the camera
+  // z, pixels no triangle covers get depth -1 and mask 0.  outputs are the
+  // RenderOutputs wanted, the others are released.  Without the image
+  // intensity isn't interpolated.
+  void Render(const Eigen::Matrix4f& pose, const TriangleMesh& mesh, cv::Mat& img, cv::Mat& depth,
+    cv::Mat& mask, int outputs = RENDER_ALL);
+
+private:
+  // Edge functions and attribute planes of a triangle in screen space
+  struct ScreenTriangle
+  {
+    float edge[3][3];
+    // 1/z and intensity/z as a + b*x + c*y
+    float inv_z[3];
+    float value_z[3];
+    int xmin, xmax, ymin, ymax;
+  };
+
+  void Transform(size_t begin, size_t end);
+  void Setup(unsigned int task, size_t begin, size_t end);
+  void AddTriangle(unsigned int task, const Eigen::Vector3f* p, const float* value);
+  void Rasterize(int tile, cv::Mat* img, cv::Mat* depth, cv::Mat* mask);
+
+  Eigen::Matrix3f K;
+  int rows;
+  int cols;
+  int tiles_x;
+  int tiles_y;
+  boost::shared_ptr<WorkerPool> workers;
+  bool backface_culling;
+
+  // State of the current render
+  Eigen::Matrix4f pose_inv;
+  const TriangleMesh* mesh;
+  // vertices in the camera frame
+  std::vector<float> cam_x, cam_y, cam_z;
+  // set up triangles and their tile bins, one list per setup task
+  std::vector< std::vector<ScreenTriangle> > triangles;
+  std::vector< std::vector< std::vector<uint32_t> > > bins;
+  // 1/z and intensity/z of the nearest triangle so far
+  std::vector<float> zbuffer;
+  std::vector<float> vbuffer;
+
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+#endif
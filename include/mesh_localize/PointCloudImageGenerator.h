@@ -2,7 +2,8 @@
 #define _POINTCLOUD_IMAGE_GENERATOR_
 
 #include "VirtualImageGenerator.h"
-#include "pcl_ros/point_cloud.h"
+#include "SplatRenderer.h"
+#include "ChunkedPointCloud.h"
 #include <pcl/point_cloud.h>
 #include <pcl/point_types.h>
 #include <pcl/PolygonMesh.h>
@@ -10,15 +11,46 @@
 class PointCloudImageGenerator : public VirtualImageGenerator
 {
 public:
-  PointCloudImageGenerator(pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr pc, const Eigen::Matrix3f& K, int rows, int cols);
+  // The cloud is copied into chunk_size voxel blocks, pc isn't kept.
+  // Renders on shared_workers, or on all cores if none are given.  lod_pixel_spacing > 0 renders
+  // each block at the coarsest level of detail whose points are at most that
+  // many pixels apart, 0 always renders all points.
+  PointCloudImageGenerator(pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr pc, const Eigen::Matrix3f& K, int rows, int cols,
+    boost::shared_ptr<WorkerPool> shared_workers = boost::shared_ptr<WorkerPool>(), float chunk_size = 1.0,
+    bool backface_culling = true, float lod_pixel_spacing = 1.0);
+  ~PointCloudImageGenerator();
   virtual cv::Mat GenerateVirtualImage(const Eigen::Matrix4f& pose, cv::Mat& depth, cv::Mat& mask);  
   virtual Eigen::Matrix3f GetK();
-  
+  // Only splats into the projected bounding box of the cloud
+  virtual cv::Mat GenerateCroppedVirtualImage(const Eigen::Matrix4f& pose, int margin, cv::Mat& depth,
+    cv::Mat& mask, cv::Rect& roi);
+  // The poses are split between lanes with a renderer each, which render
+  // their poses in parallel on the same workers
+  virtual void GenerateVirtualImages(const PoseList& poses, std::vector<cv::Mat>& images,
+    std::vector<cv::Mat>& depths, std::vector<cv::Mat>& masks, int outputs = RENDER_ALL);
+
 
 private:
-  pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr map_cloud;
+  cv::Mat Render(SplatRenderer& renderer, const Eigen::Matrix4f& pose, const Eigen::Matrix3f& K, int rows,
+    int cols, cv::Mat& depth, cv::Mat& mask, int outputs = RENDER_ALL);
+  void SetupLanes(unsigned int num_lanes);
+  void RenderLane(unsigned int lane, const PoseList& poses, std::vector<cv::Mat>& images,
+    std::vector<cv::Mat>& depths, std::vector<cv::Mat>& masks, int outputs);
+
+  ChunkedPointCloud map_chunks;
+  boost::shared_ptr<WorkerPool> workers;
+  SplatRenderer renderer;
+  // Batch renders, one renderer per lane
+  std::vector<SplatRenderer*> lanes;
   Eigen::Matrix3f K;
   int rows;
   int cols;
+  bool backface_culling;
+  float lod_pixel_spacing;
+  Eigen::Vector3f min_pt;
+  Eigen::Vector3f max_pt;
+
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 #endif
@@ -0,0 +1,49 @@
+#ifndef _POINT_UNDISTORTER_H_
+#define _POINT_UNDISTORTER_H_
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+
+/**
+ *  Undistorts individual image points instead of whole frames.  A coarse
+ *  lookup table of undistorted coordinates is built once over the distorted
+ *  image and points are bilinearly interpolated from it, so the cost per frame
+ *  is proportional to the number of tracked points.  Whole frames can still
+ *  be undistorted on demand (global localization, published images).
+ */
+class PointUndistorter
+{
+public:
+  PointUndistorter(const cv::Mat& K, const cv::Mat& distcoeff, const cv::Size& size,
+    int lut_step = 4);
+
+  cv::Point2f Undistort(const cv::Point2f& pt) const;
+  void Undistort(std::vector<cv::Point2f>& pts) const;
+  void Undistort(std::vector<cv::KeyPoint>& kps) const;
+
+  // Maps an undistorted point back into the distorted image
+  cv::Point2f Distort(const cv::Point2f& pt) const;
+
+  void UndistortImage(const cv::Mat& src, cv::Mat& dst) const;
+  // Warps an image in undistorted coordinates (e.g. a mask reprojected with
+  // K) onto the distorted image
+  void DistortImage(const cv::Mat& src, cv::Mat& dst, int interpolation = cv::INTER_LINEAR) const;
+
+private:
+  cv::Point2f UndistortExact(const cv::Point2f& pt) const;
+
+  cv::Mat K;
+  cv::Mat distcoeff;
+  cv::Size size;
+  int lut_step;
+  cv::Mat lut;
+  cv::Mat map1;
+  cv::Mat map2;
+  cv::Mat distort_map1;
+  cv::Mat distort_map2;
+  double fx, fy, cx, cy;
+  double k1, k2, p1, p2, k3;
+};
+
+#endif
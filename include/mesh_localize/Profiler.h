@@ -0,0 +1,122 @@
+#ifndef _PROFILER_H_
+#define _PROFILER_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+/**
+ *  Low overhead latency instrumentation for the localization pipeline.
+ *  ScopedTimer records (stage, start, end) events with a nanosecond clock into
+ *  a per-thread buffer.  Buffers are merged into per-stage log-scale
+ *  histograms when they fill up or when statistics are requested, and the
+ *  most recent events are kept for export in the Chrome trace format
+ *  (load the file in chrome://tracing).
+ */
+class Profiler
+{
+public:
+  struct StageStats
+  {
+    std::string name;
+    unsigned long count;
+    double mean_ms;
+    double p50_ms;
+    double p95_ms;
+    double p99_ms;
+    double max_ms;
+  };
+
+  static Profiler& Instance();
+  static int64_t Now();
+
+  void Record(const char* stage, int64_t start_ns, int64_t end_ns);
+  void CountFrame(const char* state);
+
+  void GetStageStats(std::vector<StageStats>& stats);
+  void GetFrameCounts(std::map<std::string, unsigned long>& counts);
+  bool WriteChromeTrace(const std::string& filename);
+  void Reset();
+
+  void SetEnabled(bool enabled);
+  bool IsEnabled() const;
+  void SetTraceCapacity(unsigned int capacity);
+
+private:
+  struct Event
+  {
+    const char* stage;
+    int64_t start;
+    int64_t end;
+    int tid;
+  };
+
+  struct ThreadBuffer
+  {
+    boost::mutex mutex;
+    std::vector<Event> events;
+    int tid;
+  };
+
+  // Log-linear buckets, 8 per power of two (~12% resolution)
+  class Histogram
+  {
+  public:
+    Histogram();
+    void Add(uint64_t value);
+    double Percentile(double p) const;
+
+    unsigned long count;
+    double sum;
+    uint64_t max;
+  private:
+    static int Bucket(uint64_t value);
+    static uint64_t BucketStart(int bucket);
+    std::vector<unsigned long> buckets;
+  };
+
+  Profiler();
+  ThreadBuffer* GetThreadBuffer();
+  void Merge(const std::vector<Event>& events);
+  void FlushAll();
+
+  static thread_local ThreadBuffer* thread_buffer;
+  bool enabled;
+
+  boost::mutex buffers_mutex;
+  std::vector< boost::shared_ptr<ThreadBuffer> > buffers;
+
+  boost::mutex stats_mutex;
+  std::map<std::string, Histogram> histograms;
+  std::map<std::string, unsigned long> frame_counts;
+  std::vector<Event> trace;
+  unsigned int trace_capacity;
+  unsigned int trace_next;
+};
+
+/**
+ *  Times the enclosing scope (or until Stop is called) as one stage event.
+ */
+class ScopedTimer
+{
+public:
+  ScopedTimer(const char* stage);
+  ~ScopedTimer();
+
+  // Ends the measurement early, returns the elapsed time in seconds
+  double Stop();
+
+private:
+  const char* stage;
+  int64_t start;
+  bool stopped;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(stage) ScopedTimer PROFILE_CONCAT(scoped_timer_, __LINE__)(stage)
+
+#endif
@@ -0,0 +1,56 @@
+#ifndef _QUERY_FEATURE_CACHE_H_
+#define _QUERY_FEATURE_CACHE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include "PointUndistorter.h"
+
+/**
+ *  Features of the current camera frame, shared by several trackers working
+ *  on the same frame.  Each descriptor type is extracted once over the whole
+ *  frame by the first tracker that asks for it, and every tracker gets the
+ *  subset that falls inside its own (reprojected model) mask.  The feature
+ *  budget of an extraction is the requested budget times the number of
+ *  trackers sharing the frame.  Safe to use from several threads.
+ */
+class QueryFeatureCache
+{
+public:
+  QueryFeatureCache();
+
+  // Starts a new frame, dropping the features of the previous one
+  void Reset(const cv::Mat& image, unsigned int num_trackers);
+
+  // False if desc_type can't be shared (GPU descriptors)
+  static bool CanShare(const std::string& desc_type);
+
+  // Features of image inside mask.  False if image is not the shared frame or
+  // desc_type can't be shared, the caller then extracts its own.  Keypoints
+  // are tested against mask at their detected location and are then
+  // undistorted if an undistorter is given.
+  bool Get(const cv::Mat& image, const std::string& desc_type, int max_features, const cv::Mat& mask,
+    const PointUndistorter* undistorter, std::vector<cv::KeyPoint>& keypoints, cv::Mat& descriptors);
+
+private:
+  struct Entry
+  {
+    Entry() : extracted(false) {}
+    boost::mutex mutex;
+    bool extracted;
+    std::vector<cv::KeyPoint> keypoints;
+    cv::Mat descriptors;
+  };
+
+  boost::mutex mutex;
+  cv::Mat image;
+  unsigned int num_trackers;
+  std::map<std::string, boost::shared_ptr<Entry> > entries;
+};
+
+#endif
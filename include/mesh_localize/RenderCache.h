@@ -0,0 +1,100 @@
+#ifndef _RENDER_CACHE_H_
+#define _RENDER_CACHE_H_
+
+#include <map>
+#include <string>
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+#include <Eigen/Core>
+#include <Eigen/Dense>
+
+/**
+ *  Recent virtual renders keyed on their pose, quantized to cells of
+ *  trans_tol x rot_tol.  A request whose pose falls into the cell of a cached
+ *  render gets that render back.  Otherwise the nearest render within the
+ *  warp tolerance is forward warped to the requested pose using its depth,
+ *  and only if there is none the caller renders.  Features extracted from a
+ *  cached render are kept with it, so a hit also skips the extraction.
+ *
+ *  Every render is kept with its own camera matrix, so cropped renders can
+ *  be cached; a warp stays in the crop of the render it comes from.
+ *  Warped images are never cached themselves, so errors don't accumulate.
+ *  Not thread safe.
+ */
+class RenderCache
+{
+public:
+  enum Result
+  {
+    MISS,
+    HIT,
+    WARPED
+  };
+
+  RenderCache(unsigned int capacity, double trans_tol, double rot_tol, double warp_trans_tol,
+    double warp_rot_tol);
+  ~RenderCache();
+
+  // On a HIT pose is set to the pose the returned render was made at, a
+  // warped image is at the requested pose.  K is set to the camera matrix of
+  // the returned image.  The returned images must not be modified.
+  Result Lookup(Eigen::Matrix4f& pose, cv::Mat& image, cv::Mat& depth, cv::Mat& mask, Eigen::Matrix3f& K);
+  // Adds a render made with camera matrix K, replacing the one in the same
+  // cell and evicting the least recently used if the cache is full
+  void Insert(const Eigen::Matrix4f& pose, const cv::Mat& image, const cv::Mat& depth, const cv::Mat& mask,
+    const Eigen::Matrix3f& K);
+
+  // Features of a cached render, found by its image data, under key (the
+  // descriptor type and budget).  False if image isn't cached or the
+  // features under key haven't been set.
+  bool GetFeatures(const cv::Mat& image, const std::string& key, std::vector<cv::KeyPoint>& keypoints,
+    cv::Mat& descriptors);
+  void SetFeatures(const cv::Mat& image, const std::string& key, const std::vector<cv::KeyPoint>& keypoints,
+    const cv::Mat& descriptors);
+
+private:
+  struct Features
+  {
+    std::vector<cv::KeyPoint> keypoints;
+    cv::Mat descriptors;
+  };
+
+  struct Entry
+  {
+    Eigen::Matrix4f pose;
+    Eigen::Matrix3f K;
+    cv::Mat image;
+    cv::Mat depth;
+    cv::Mat mask;
+    std::map<std::string, Features> features;
+    unsigned long last_used;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  // Translation and rotation vector in units of the tolerances
+  typedef std::vector<int> PoseKey;
+  typedef std::map<PoseKey, Entry*> EntryMap;
+
+  PoseKey Quantize(const Eigen::Matrix4f& pose) const;
+  Entry* FindEntry(const cv::Mat& image);
+  void Warp(const Entry& entry, const Eigen::Matrix4f& pose, cv::Mat& image, cv::Mat& depth, cv::Mat& mask);
+
+  unsigned int capacity;
+  double trans_tol;
+  double rot_tol;
+  double warp_trans_tol;
+  double warp_rot_tol;
+
+  EntryMap entries;
+  unsigned long clock;
+  unsigned long num_hits;
+  unsigned long num_warps;
+  unsigned long num_misses;
+
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+#endif
@@ -0,0 +1,14 @@
+#ifndef _RENDER_OUTPUTS_H_
+#define _RENDER_OUTPUTS_H_
+
+// Outputs of a virtual render, or'd together to ask for only some of them.
+// Outputs that aren't asked for are left empty and cost nothing to produce.
+enum RenderOutputs
+{
+  RENDER_IMAGE = 1,
+  RENDER_DEPTH = 2,
+  RENDER_MASK = 4,
+  RENDER_ALL = RENDER_IMAGE | RENDER_DEPTH | RENDER_MASK
+};
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef _RENDER_SERVICE_H_
+#define _RENDER_SERVICE_H_
+
+#include <map>
+#include <deque>
+#include <opencv2/core/core.hpp>
+#include <Eigen/Core>
+#include <Eigen/Dense>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "VirtualImageGenerator.h"
+
+/**
+ *  Answer to one render request: the views rendered at exactly pose.
+ */
+struct RenderResponse
+{
+  RenderResponse();
+
+  unsigned long seq;
+  Eigen::Matrix4f pose;
+  cv::Mat image;
+  cv::Mat depth;
+  cv::Mat mask;
+  // Keeps memory the Mats point into but don't own (e.g. a message) alive
+  boost::shared_ptr<const void> owner;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+/**
+ *  Request/response interface to a renderer living outside of the pipeline,
+ *  e.g. a simulator.  Every request gets a sequence id and is answered with
+ *  the views rendered at its pose, so a view can never be paired with the
+ *  wrong pose.  Requests are rendered in order on the service's worker
+ *  thread and several may be outstanding, the caller only blocks in Wait.
+ *
+ *  Implementations provide Render, which runs on the worker.
+ */
+class RenderService
+{
+public:
+  RenderService();
+  virtual ~RenderService();
+
+  // Starts the worker, false if Setup failed
+  bool Start();
+  // Fails the outstanding requests and wakes every waiter
+  virtual void Stop();
+
+  // Queues a render at pose and returns its sequence id
+  unsigned long Request(const Eigen::Matrix4f& pose);
+  // Blocks until seq is rendered.  False if it failed, was cancelled or the
+  // service stopped.  A response can only be taken once.
+  bool Wait(unsigned long seq, RenderResponse& response);
+  // Drops a request that is no longer needed, or its response
+  void Cancel(unsigned long seq);
+  virtual Eigen::Matrix3f GetK() = 0;
+
+protected:
+  // Run on the worker before the first request (e.g. to create a GL context)
+  virtual bool Setup() { return true; }
+  virtual void Teardown() {}
+  virtual bool Render(const Eigen::Matrix4f& pose, RenderResponse& response) = 0;
+
+private:
+  struct PendingRender
+  {
+    unsigned long seq;
+    Eigen::Matrix4f pose;
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  typedef std::map<unsigned long, RenderResponse, std::less<unsigned long>,
+    Eigen::aligned_allocator<std::pair<const unsigned long, RenderResponse> > > ResponseMap;
+
+  void Run();
+
+  boost::thread worker;
+  boost::mutex mutex;
+  boost::condition_variable cond;
+  bool running;
+  bool ready;
+  bool setup_ok;
+  unsigned long next_seq;
+  // seq being rendered, 0 if none
+  unsigned long current_seq;
+  bool current_cancelled;
+  std::deque<PendingRender, Eigen::aligned_allocator<PendingRender> > requests;
+  ResponseMap responses;
+};
+
+/**
+ *  Local stand-in for an external renderer that answers requests with a
+ *  VirtualImageGenerator, e.g. to run the render service code path without
+ *  a simulator.  The generator is created on the worker thread.
+ */
+class GeneratorRenderService : public RenderService
+{
+public:
+  typedef boost::function<VirtualImageGenerator* ()> GeneratorFactory;
+
+  GeneratorRenderService(GeneratorFactory factory);
+  ~GeneratorRenderService();
+
+  virtual Eigen::Matrix3f GetK();
+
+protected:
+  virtual bool Setup();
+  virtual void Teardown();
+  virtual bool Render(const Eigen::Matrix4f& pose, RenderResponse& response);
+
+private:
+  GeneratorFactory factory;
+  VirtualImageGenerator* generator;
+  Eigen::Matrix3f K;
+
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+#endif
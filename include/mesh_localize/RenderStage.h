@@ -0,0 +1,110 @@
+#ifndef _RENDER_STAGE_H_
+#define _RENDER_STAGE_H_
+
+#include <opencv2/core/core.hpp>
+#include <Eigen/Core>
+#include <Eigen/Dense>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+
+#include "VirtualImageGenerator.h"
+#include "BoundedQueue.h"
+
+/**
+ *  A single virtual render request.  The requesting thread waits on it while
+ *  the render stage worker fills in the image, depth, mask and the camera
+ *  matrix of the image (which differs from the generator's for a crop).
+ *  A job cancelled before the worker gets to it finishes with empty images.
+ */
+class RenderJob
+{
+public:
+  RenderJob(const Eigen::Matrix4f& pose, int crop_margin = -1);
+
+  void Finish(const cv::Mat& image, const cv::Mat& depth, const cv::Mat& mask, const Eigen::Matrix3f& K);
+  void Wait();
+  bool IsDone();
+  void Cancel();
+  bool IsCancelled();
+
+  Eigen::Matrix4f pose;
+  // Renders around the model only, with this margin, if >= 0
+  int crop_margin;
+  cv::Mat image;
+  cv::Mat depth;
+  cv::Mat mask;
+  Eigen::Matrix3f K;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+private:
+  bool done;
+  bool cancelled;
+  boost::mutex mutex;
+  boost::condition_variable cond;
+};
+
+/**
+ *  Pipeline stage that owns the VirtualImageGenerator and services render
+ *  requests on its own thread.  The generator is created by the worker itself
+ *  since OGRE's GL context is bound to the thread that creates it.
+ *
+ *  A render for a predicted pose can be started ahead of time with Prefetch.
+ *  The next RenderPredicted call reuses it if the requested pose is within
+ *  the speculative tolerance, otherwise the pose is rendered again.  A
+ *  prediction that is not used is cancelled, so a render still waiting in
+ *  the queue doesn't delay the one that replaces it.
+ *
+ *  With a crop margin set only the region around the projected model is
+ *  rendered, and renders come with the camera matrix of that crop.
+ */
+class RenderStage
+{
+public:
+  typedef boost::function<VirtualImageGenerator* ()> GeneratorFactory;
+
+  RenderStage(GeneratorFactory factory, unsigned int queue_size = 2);
+  ~RenderStage();
+
+  // Starts the worker and blocks until the generator has been created
+  bool Start();
+  void Stop();
+
+  boost::shared_ptr<RenderJob> Submit(const Eigen::Matrix4f& pose);
+  // image_K is set to the camera matrix of the returned image
+  cv::Mat Render(const Eigen::Matrix4f& pose, cv::Mat& depth, cv::Mat& mask, Eigen::Matrix3f& image_K);
+  // Camera matrix of full (uncropped) views
+  Eigen::Matrix3f GetK();
+
+  // margin < 0 renders full views
+  void SetCropMargin(int margin);
+
+  void SetSpeculativeTolerance(double trans_tol, double rot_tol);
+  void Prefetch(const Eigen::Matrix4f& pose);
+  // pose is set to the pose the returned image was actually rendered at
+  cv::Mat RenderPredicted(Eigen::Matrix4f& pose, cv::Mat& depth, cv::Mat& mask, Eigen::Matrix3f& image_K);
+
+private:
+  void Run();
+  bool WithinTolerance(const Eigen::Matrix4f& a, const Eigen::Matrix4f& b);
+
+  GeneratorFactory factory;
+  VirtualImageGenerator* generator;
+  Eigen::Matrix3f K;
+
+  BoundedQueue< boost::shared_ptr<RenderJob> > jobs;
+  boost::thread worker;
+  boost::mutex ready_mutex;
+  boost::condition_variable ready_cond;
+  bool ready;
+
+  boost::shared_ptr<RenderJob> prefetch_job;
+  boost::mutex prefetch_mutex;
+  double trans_tol;
+  double rot_tol;
+  unsigned long num_prefetch_hits;
+  unsigned long num_prefetch_misses;
+  int crop_margin;
+};
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef _ROS_IMAGE_UTIL_H_
+#define _ROS_IMAGE_UTIL_H_
+
+#include <opencv2/core/core.hpp>
+#include "sensor_msgs/Image.h"
+
+#include "ImageIngest.h"
+
+/**
+ *  Feeds ROS image messages to the ROS-free ImageIngest.  Common encodings
+ *  are read straight from the message buffer, others are converted by
+ *  cv_bridge first.
+ */
+class RosImageUtil
+{
+public:
+  static bool Ingest(ImageIngest& ingest, const sensor_msgs::ImageConstPtr& msg, cv::Mat& dst);
+};
+
+#endif
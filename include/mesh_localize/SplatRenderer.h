@@ -0,0 +1,83 @@
+#ifndef _SPLAT_RENDERER_H_
+#define _SPLAT_RENDERER_H_
+
+#include <vector>
+#include <atomic>
+#include <stdint.h>
+#include <opencv2/core/core.hpp>
+#include <Eigen/Core>
+#include <Eigen/Dense>
+
+#include "WorkerPool.h"
+#include "RenderOutputs.h"
+
+/**
+ *  Points stored as a structure of arrays, so projection streams through
+ *  contiguous floats.
+ */
+struct PointBlock
+{
+  void Reserve(size_t n);
+  void Push(float px, float py, float pz, float pnx, float pny, float pnz, uchar value);
+  size_t Size() const;
+
+  std::vector<float> x, y, z;
+  std::vector<float> nx, ny, nz;
+  std::vector<uchar> intensity;
+};
+
+/**
+ *  Renders point blocks into an intensity/depth image by z-buffered
+ *  splatting.  Points are projected in fixed-size batches (laid out so the
+ *  compiler vectorizes them) and written into a z-buffer of packed
+ *  depth/point index words with an atomic min, so any number of workers can
+ *  splat at once.  Intensity and mask are resolved from the winning point
+ *  indices in a final pass over the image.
+ *
+ *  Not thread safe, Render is called from one thread at a time.
+ */
+class SplatRenderer
+{
+public:
+  // Renders on workers, which may be shared with other components, or on
+  // a pool of all cores if none is given
+  SplatRenderer(const Eigen::Matrix3f& K, int rows, int cols,
+    boost::shared_ptr<WorkerPool> shared_workers = boost::shared_ptr<WorkerPool>());
+  ~SplatRenderer();
+
+  // Skips points whose normal faces away from the camera, points with a
+  // zero normal are always drawn
+  void SetBackfaceCulling(bool enable);
+  // Intrinsics and size of the following renders, e.g. to render a crop
+  void SetCamera(const Eigen::Matrix3f& K, int rows, int cols);
+
+  // pose is the camera pose in the frame of the points.  Pixels no point
+  // projects to get depth -1 and mask 0.  outputs are the RenderOutputs
+  // wanted, the others are released.
+  void Render(const Eigen::Matrix4f& pose, const std::vector<const PointBlock*>& blocks,
+    cv::Mat& img, cv::Mat& depth, cv::Mat& mask, int outputs = RENDER_ALL);
+
+private:
+  void Splat(const PointBlock* block, size_t begin, size_t end, uint32_t base);
+  void Resolve(int row_begin, int row_end, cv::Mat* img, cv::Mat* depth, cv::Mat* mask);
+
+  Eigen::Matrix3f K;
+  int rows;
+  int cols;
+  boost::shared_ptr<WorkerPool> workers;
+
+  // Projection of the current render, K*[R|t] of the inverse pose
+  Eigen::Matrix<float, 3, 4> P;
+  Eigen::Vector3f camera;
+  bool backface_culling;
+  std::vector<const PointBlock*> blocks;
+  // index of each block's first point in the packed point indices
+  std::vector<uint32_t> block_base;
+  std::atomic<uint64_t>* zbuffer;
+  size_t zbuffer_size;
+
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+#endif
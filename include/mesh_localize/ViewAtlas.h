@@ -0,0 +1,137 @@
+#ifndef _VIEW_ATLAS_H_
+#define _VIEW_ATLAS_H_
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <stdint.h>
+#include <opencv2/core/core.hpp>
+#include <opencv2/features2d/features2d.hpp>
+#include <Eigen/Core>
+#include <Eigen/Dense>
+
+/**
+ *  One precomputed view of the model: the render, its features and the
+ *  model frame 3D point of every feature.
+ */
+struct AtlasView
+{
+  Eigen::Matrix4f pose;
+  cv::Mat image;
+  cv::Mat depth;
+  cv::Mat mask;
+  std::vector<cv::KeyPoint> keypoints;
+  cv::Mat descriptors;
+  std::vector<cv::Point3f> points;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+// On disk layout: the header, then every view's image, depth, mask,
+// keypoints and descriptors (each section 16 byte aligned), then the view
+// table at table_offset
+struct AtlasFileHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t num_views;
+  int32_t rows;
+  int32_t cols;
+  int32_t image_type;
+  int32_t desc_mat_type;
+  int32_t desc_cols;
+  float K[9];
+  char desc_type[16];
+  uint64_t table_offset;
+};
+
+struct AtlasViewRecord
+{
+  float pose[16];
+  uint64_t image_offset;
+  uint64_t depth_offset;
+  uint64_t mask_offset;
+  uint64_t keypoints_offset;
+  uint64_t descriptors_offset;
+  uint32_t num_features;
+  uint32_t reserved;
+};
+
+struct AtlasKeypoint
+{
+  float x, y, size, angle, response;
+  int32_t octave;
+  // model frame point the keypoint back projects to
+  float px, py, pz;
+};
+
+/**
+ *  Writes views one at a time into an atlas file, so an atlas never has to
+ *  fit in memory while it is built.  All views share the image size and type
+ *  of the first one and the descriptor layout of the first one with features.
+ */
+class ViewAtlasWriter
+{
+public:
+  ViewAtlasWriter();
+  ~ViewAtlasWriter();
+
+  bool Open(const std::string& filename, const Eigen::Matrix3f& K, const std::string& desc_type);
+  bool Add(const AtlasView& view);
+  // Writes the view table, the atlas is unusable if this isn't called
+  bool Close();
+
+private:
+  bool WriteAligned(const void* data, size_t size, uint64_t& offset);
+
+  FILE* file;
+  Eigen::Matrix3f K;
+  std::string desc_type;
+  std::vector<AtlasViewRecord> records;
+  int rows;
+  int cols;
+  int image_type;
+  int desc_mat_type;
+  int desc_cols;
+
+public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+/**
+ *  Read side of an atlas file.  The file is memory mapped and views are
+ *  returned as cv::Mat headers pointing into the mapping, so serving a view
+ *  copies nothing and only the pages of views that are used are read.  The
+ *  mapping is private, writing into a returned image doesn't change the file.
+ */
+class ViewAtlas
+{
+public:
+  ViewAtlas();
+  ~ViewAtlas();
+
+  bool Open(const std::string& filename);
+  bool IsOpen() const;
+
+  size_t NumViews() const;
+  Eigen::Matrix3f GetK() const;
+  const std::string& GetDescriptorType() const;
+
+  // View nearest to pose, by camera distance plus rot_weight times the
+  // rotation angle between the poses.  -1 if the atlas is empty.
+  int FindNearest(const Eigen::Matrix4f& pose, float rot_weight) const;
+  Eigen::Matrix4f GetPose(int view) const;
+  void GetImages(int view, cv::Mat& image, cv::Mat& depth, cv::Mat& mask) const;
+  void GetFeatures(int view, std::vector<cv::KeyPoint>& keypoints, cv::Mat& descriptors,
+    std::vector<cv::Point3f>& points) const;
+
+private:
+  const AtlasViewRecord* GetRecord(int view) const;
+
+  uchar* data;
+  size_t size;
+  const AtlasFileHeader* header;
+  std::string desc_type;
+};
+
+#endif
@@ -1,14 +1,44 @@
 #ifndef _VIRTUAL_IMAGE_GENERATOR_
 #define _VIRTUAL_IMAGE_GENERATOR_
 
+#include <vector>
 #include <opencv2/core/core.hpp>
 #include <Eigen/Core>
 #include <Eigen/Dense>
+#include <Eigen/StdVector>
+
+#include "RenderOutputs.h"
 
 class VirtualImageGenerator
 {
 public:
-  virtual cv::Mat GenerateVirtualImage(const Eigen::Matrix4f& pose, cv::Mat& depth, cv::Mat& mask) = 0;  
+  typedef std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f> > PoseList;
+
+  virtual ~VirtualImageGenerator() {}
+  virtual cv::Mat GenerateVirtualImage(const Eigen::Matrix4f& pose, cv::Mat& depth, cv::Mat& mask) = 0;
   virtual Eigen::Matrix3f GetK() = 0;
+
+  // Renders only the part of the view around the model, margin pixels
+  // beyond its projected bounding box.  roi is set to the rendered part in
+  // pixels of the full view, the camera matrix of the crop is GetK() with
+  // the principal point moved by -roi.tl().  The default renders the whole
+  // view and crops it to the mask.
+  virtual cv::Mat GenerateCroppedVirtualImage(const Eigen::Matrix4f& pose, int margin, cv::Mat& depth,
+    cv::Mat& mask, cv::Rect& roi);
+
+  // Renders a full view for each pose, e.g. to score pose hypotheses.
+  // outputs are the RenderOutputs wanted, the others are left empty.  The
+  // default renders the poses one after the other.
+  virtual void GenerateVirtualImages(const PoseList& poses, std::vector<cv::Mat>& images,
+    std::vector<cv::Mat>& depths, std::vector<cv::Mat>& masks, int outputs = RENDER_ALL);
+
+  static Eigen::Matrix3f CropK(const Eigen::Matrix3f& K, const cv::Rect& roi);
+
+protected:
+  // Bounding rectangle of the projected corners of the box min_pt-max_pt,
+  // grown by margin and clipped to the view.  The whole view if the box
+  // reaches behind the camera.
+  static cv::Rect ProjectBounds(const Eigen::Vector3f& min_pt, const Eigen::Vector3f& max_pt,
+    const Eigen::Matrix4f& pose, const Eigen::Matrix3f& K, int rows, int cols, int margin);
 };
 #endif
@@ -0,0 +1,24 @@
+#ifndef _VIZ_UTIL_H_
+#define _VIZ_UTIL_H_
+
+#include <opencv2/core/core.hpp>
+#include <Eigen/Core>
+#include <Eigen/Dense>
+#include <vector>
+
+/**
+ *  Debug overlays of the tracking output.  These are only drawn off the
+ *  tracking thread (see MeshLocalizer's visualization worker), the tracker
+ *  itself never touches a display.
+ */
+class VizUtil
+{
+public:
+  // Draws the object axes at tf (object pose in the camera frame) onto a color copy of src
+  static void DrawPose(const cv::Mat& src, cv::Mat& dst, const Eigen::Matrix4f& tf,
+    const Eigen::Matrix3f& K);
+  // Draws tracked points with their ids onto a color image
+  static void DrawTracks(cv::Mat& dst, const std::vector<cv::Point2f>& pts, 
+    const std::vector<int>& ids);
+};
+#endif
@@ -0,0 +1,110 @@
+#ifndef _VOCABULARY_TREE_H_
+#define _VOCABULARY_TREE_H_
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <opencv2/core/core.hpp>
+
+// On disk layout: the header, the node records, then the cluster centre of
+// every node as one row per node (the root's is unused)
+struct VocabularyFileHeader
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t branching;
+  uint32_t depth;
+  uint32_t num_nodes;
+  uint32_t num_words;
+  int32_t desc_mat_type;
+  int32_t desc_cols;
+};
+
+struct VocabularyNode
+{
+  // children are nodes first_child to first_child+num_children-1, leaves
+  // have none and are word number word
+  int32_t first_child;
+  int32_t num_children;
+  int32_t word;
+};
+
+/**
+ *  Hierarchical k-means vocabulary of descriptors.  Every level splits the
+ *  descriptors of a node into up to branching clusters, down to depth
+ *  levels, and the leaves are the visual words.  Float descriptors are
+ *  clustered by k-means (L2), binary ones by k-majority (Hamming), so a
+ *  descriptor is quantized with branching*depth distance computations.
+ */
+class VocabularyTree
+{
+public:
+  VocabularyTree();
+
+  // Nodes with fewer than branching descriptors become leaves early
+  bool Train(const cv::Mat& descriptors, int branching, int depth);
+  bool Save(const std::string& filename) const;
+  bool Load(const std::string& filename);
+
+  size_t NumWords() const;
+  // Type and columns of the descriptors the vocabulary is for
+  int DescriptorType() const;
+  int DescriptorCols() const;
+
+  int Quantize(const cv::Mat& descriptors, int row) const;
+
+private:
+  void Split(const cv::Mat& descriptors, const std::vector<int>& rows, int node, int level);
+  void Cluster(const cv::Mat& descriptors, const std::vector<int>& rows, int k, cv::Mat& centers,
+    std::vector<int>& labels) const;
+  float Distance(const cv::Mat& descriptors, int row, int node) const;
+
+  int branching;
+  int depth;
+  std::vector<VocabularyNode> nodes;
+  cv::Mat centers;
+  int num_words;
+};
+
+/**
+ *  TF-IDF weighted bag of words of every image of a database with an
+ *  inverted file per word.  Scoring a query only visits the images that
+ *  share a word with it.  Images are identified by the order they were
+ *  added in.
+ */
+class BowDatabase
+{
+public:
+  // vocabulary has to outlive the database
+  BowDatabase(const VocabularyTree* vocabulary);
+
+  void Add(const cv::Mat& descriptors);
+  // Computes the word weights, call once all images are added
+  void Finish();
+
+  size_t NumImages() const;
+
+  // Similarity of the query to every image, from 0 (no words in common) to
+  // 1 (same normalized histograms), as the intersection of the L1
+  // normalized TF-IDF histograms
+  void Score(const cv::Mat& descriptors, std::vector<float>& scores) const;
+
+private:
+  struct Posting
+  {
+    int image;
+    float weight;
+  };
+
+  // word counts of descriptors, sorted by word
+  void Histogram(const cv::Mat& descriptors, std::vector< std::pair<int, float> >& histogram) const;
+  void Normalize(std::vector< std::pair<int, float> >& histogram) const;
+
+  const VocabularyTree* vocabulary;
+  // raw word counts of every image until Finish
+  std::vector< std::vector< std::pair<int, float> > > histograms;
+  std::vector<float> idf;
+  std::vector< std::vector<Posting> > inverted;
+};
+
+#endif
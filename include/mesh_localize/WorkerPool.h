@@ -0,0 +1,52 @@
+#ifndef _WORKER_POOL_H_
+#define _WORKER_POOL_H_
+
+#include <deque>
+#include <vector>
+#include <boost/function.hpp>
+#include <boost/thread.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/make_shared.hpp>
+
+/**
+ *  Fixed set of worker threads that run batches of independent tasks, e.g.
+ *  one tracker per object on the same camera frame, or the tiles of a
+ *  render.  One pool can be shared by several components and threads, so
+ *  the machine's cores aren't oversubscribed by a pool per component.
+ *  RunAll may be called from several threads at once and from inside a
+ *  task: the caller runs its own batch's tasks while it waits, so nested
+ *  batches can't deadlock on busy workers.
+ */
+class WorkerPool
+{
+public:
+  // With num_threads <= 1 tasks run on the calling thread
+  WorkerPool(unsigned int num_threads = 0);
+  ~WorkerPool();
+
+  unsigned int NumThreads() const;
+
+  // Runs all tasks and returns once every one of them has finished
+  void RunAll(const std::vector< boost::function<void()> >& tasks);
+
+private:
+  struct Task
+  {
+    boost::function<void()> run;
+    // tasks of the batch that are not finished yet
+    unsigned int* pending;
+  };
+
+  void WorkerLoop();
+  void Finish(const Task& task);
+
+  boost::mutex mutex;
+  boost::condition_variable work_cond;
+  boost::condition_variable done_cond;
+  std::deque<Task> tasks;
+  unsigned int num_threads;
+  bool running;
+  std::vector<boost::thread*> threads;
+};
+
+#endif
@@ -0,0 +1,56 @@
+#include "mesh_localize/AtlasImageGenerator.h"
+
+#include "mesh_localize/Log.h"
+
+using namespace cv;
+
+AtlasImageGenerator::AtlasImageGenerator(const std::string& filename, float rot_weight) :
+  rot_weight(rot_weight),
+  last_view(-1),
+  last_image(NULL)
+{
+  if(atlas.Open(filename))
+  {
+    ML_INFO("Loaded atlas %s with %lu %s views", filename.c_str(), atlas.NumViews(),
+      atlas.GetDescriptorType().c_str());
+  }
+}
+
+bool AtlasImageGenerator::IsOpen() const
+{
+  return atlas.IsOpen() && atlas.NumViews() > 0;
+}
+
+Eigen::Matrix3f AtlasImageGenerator::GetK()
+{
+  return atlas.GetK();
+}
+
+Mat AtlasImageGenerator::GenerateVirtualImage(const Eigen::Matrix4f& pose, Mat& depth, Mat& mask)
+{
+  Eigen::Matrix4f view_pose = pose;
+  return GenerateNearestView(view_pose, depth, mask);
+}
+
+Mat AtlasImageGenerator::GenerateNearestView(Eigen::Matrix4f& pose, Mat& depth, Mat& mask)
+{
+  int view = atlas.FindNearest(pose, rot_weight);
+  if(view < 0)
+    return Mat();
+
+  Mat image;
+  atlas.GetImages(view, image, depth, mask);
+  pose = atlas.GetPose(view);
+  last_view = view;
+  last_image = image.data;
+  return image;
+}
+
+bool AtlasImageGenerator::GetFeatures(const Mat& image, const std::string& desc_type, std::vector<KeyPoint>& keypoints,
+  Mat& descriptors, std::vector<Point3f>& points)
+{
+  if(last_view < 0 || image.data != last_image || desc_type != atlas.GetDescriptorType())
+    return false;
+  atlas.GetFeatures(last_view, keypoints, descriptors, points);
+  return true;
+}
@@ -0,0 +1,260 @@
+#include "mesh_localize/ChunkedPointCloud.h"
+
+#include <cmath>
+#include <map>
+#include <limits>
+#include <algorithm>
+#include <stdint.h>
+
+// Normals shorter than this count as missing
+static const float MIN_NORMAL_NORM = 1e-3;
+// Pyramids stop once a level has this few points
+static const size_t MIN_LEVEL_POINTS = 8;
+static const int MAX_LEVELS = 10;
+
+// Packs integer block coordinates into one map key, 21 bits per axis
+static uint64_t ChunkKey(int x, int y, int z)
+{
+  const int offset = 1 << 20;
+  return ((uint64_t)((x + offset) & 0x1fffff) << 42) |
+         ((uint64_t)((y + offset) & 0x1fffff) << 21) |
+          (uint64_t)((z + offset) & 0x1fffff);
+}
+
+ChunkedPointCloud::ChunkedPointCloud(const pcl::PointCloud<pcl::PointXYZRGBNormal>& pc, float chunk_size,
+  bool build_lod) :
+  num_points(0)
+{
+  std::map<uint64_t, PointChunk*> blocks;
+  for(unsigned int j = 0; j < pc.points.size(); j++)
+  {
+    const pcl::PointXYZRGBNormal& pt = pc.points[j];
+    if(!std::isfinite(pt.x) || !std::isfinite(pt.y) || !std::isfinite(pt.z))
+      continue;
+
+    uint64_t key = ChunkKey(std::floor(pt.x/chunk_size), std::floor(pt.y/chunk_size),
+      std::floor(pt.z/chunk_size));
+    PointChunk*& chunk = blocks[key];
+    if(!chunk)
+    {
+      chunk = new PointChunk;
+      chunk->levels.resize(1);
+      chunk->min = Eigen::Vector3f(pt.x, pt.y, pt.z);
+      chunk->max = chunk->min;
+      chunk->cone_axis = Eigen::Vector3f::Zero();
+      chunks.push_back(chunk);
+    }
+
+    // Missing normals are stored as zero, which the renderer never culls
+    Eigen::Vector3f normal(pt.normal_x, pt.normal_y, pt.normal_z);
+    if(!std::isfinite(normal.sum()))
+      normal.setZero();
+
+    Eigen::Vector3f p(pt.x, pt.y, pt.z);
+    chunk->min = chunk->min.cwiseMin(p);
+    chunk->max = chunk->max.cwiseMax(p);
+    chunk->cone_axis += normal.norm() > MIN_NORMAL_NORM ? normal.normalized() : Eigen::Vector3f::Zero();
+    chunk->levels[0].Push(pt.x, pt.y, pt.z, normal(0), normal(1), normal(2),
+      (*reinterpret_cast<const int*>(&pt.rgb) & 0x0000ff));
+    num_points++;
+  }
+
+  for(unsigned int i = 0; i < chunks.size(); i++)
+  {
+    PointChunk* chunk = chunks[i];
+    // points of a surface patch of about the block's extent squared
+    float extent = std::max(1e-6f, (chunk->max - chunk->min).maxCoeff());
+    chunk->spacing.push_back(extent/std::sqrt((float)chunk->levels[0].Size()));
+    if(build_lod)
+      BuildLevels(*chunk);
+
+    // Widen the normal cone until it holds every normal of the block
+    chunk->cone_angle = M_PI;
+    if(chunk->cone_axis.norm() < MIN_NORMAL_NORM)
+      continue;
+    chunk->cone_axis.normalize();
+
+    float min_cos = 1;
+    const PointBlock& pts = chunk->levels[0];
+    for(size_t j = 0; j < pts.Size(); j++)
+    {
+      Eigen::Vector3f normal(pts.nx[j], pts.ny[j], pts.nz[j]);
+      float norm = normal.norm();
+      if(norm < MIN_NORMAL_NORM)
+      {
+        min_cos = -1;
+        break;
+      }
+      min_cos = std::min(min_cos, chunk->cone_axis.dot(normal)/norm);
+    }
+    chunk->cone_angle = std::acos(std::max(-1.0f, std::min(1.0f, min_cos)));
+  }
+}
+
+void ChunkedPointCloud::BuildLevels(PointChunk& chunk)
+{
+  // Accumulated point of a voxel of the next level
+  struct Voxel
+  {
+    Voxel() : x(0), y(0), z(0), normal(Eigen::Vector3f::Zero()), intensity(0), weight(0), 
+      missing_normal(false) {}
+    double x, y, z;
+    Eigen::Vector3f normal;
+    double intensity;
+    float weight;
+    bool missing_normal;
+  };
+
+  // number of loaded points each point of the current level stands for
+  std::vector<float> weights(chunk.levels[0].Size(), 1);
+  for(int level = 1; level < MAX_LEVELS; level++)
+  {
+    const PointBlock& src = chunk.levels[level-1];
+    if(src.Size() <= MIN_LEVEL_POINTS)
+      break;
+
+    float voxel_size = chunk.spacing[level-1]*2;
+    std::map<uint64_t, Voxel> voxels;
+    for(size_t j = 0; j < src.Size(); j++)
+    {
+      Voxel& v = voxels[ChunkKey(std::floor((src.x[j] - chunk.min(0))/voxel_size),
+        std::floor((src.y[j] - chunk.min(1))/voxel_size), std::floor((src.z[j] - chunk.min(2))/voxel_size))];
+      float w = weights[j];
+      v.x += w*src.x[j];
+      v.y += w*src.y[j];
+      v.z += w*src.z[j];
+      v.intensity += w*src.intensity[j];
+      v.weight += w;
+      Eigen::Vector3f normal(src.nx[j], src.ny[j], src.nz[j]);
+      if(normal.norm() < MIN_NORMAL_NORM)
+        v.missing_normal = true;
+      v.normal += w*normal;
+    }
+    // stop when points are already sparser than the voxels
+    if(voxels.size() == src.Size())
+      break;
+
+    PointBlock dst;
+    dst.Reserve(voxels.size());
+    std::vector<float> dst_weights;
+    dst_weights.reserve(voxels.size());
+    for(std::map<uint64_t, Voxel>::const_iterator it = voxels.begin(); it != voxels.end(); it++)
+    {
+      const Voxel& v = it->second;
+      // averaged normals that cancel out say nothing about the facing
+      Eigen::Vector3f normal = Eigen::Vector3f::Zero();
+      if(!v.missing_normal && v.normal.norm() > MIN_NORMAL_NORM)
+        normal = v.normal.normalized();
+      dst.Push(v.x/v.weight, v.y/v.weight, v.z/v.weight, normal(0), normal(1), normal(2),
+        (uchar)(v.intensity/v.weight + 0.5));
+      dst_weights.push_back(v.weight);
+    }
+    chunk.levels.push_back(dst);
+    chunk.spacing.push_back(voxel_size);
+    weights.swap(dst_weights);
+  }
+}
+
+const PointBlock& ChunkedPointCloud::SelectLevel(const PointChunk& chunk, float near_depth, float focal,
+  float max_pixel_spacing)
+{
+  if(near_depth <= 0)
+    return chunk.levels[0];
+  int level = 0;
+  while(level + 1 < (int)chunk.levels.size() && 
+    focal*chunk.spacing[level+1]/near_depth <= max_pixel_spacing)
+  {
+    level++;
+  }
+  return chunk.levels[level];
+}
+
+ChunkedPointCloud::~ChunkedPointCloud()
+{
+  for(unsigned int i = 0; i < chunks.size(); i++)
+  {
+    delete chunks[i];
+  }
+}
+
+size_t ChunkedPointCloud::NumChunks() const
+{
+  return chunks.size();
+}
+
+size_t ChunkedPointCloud::NumPoints() const
+{
+  return num_points;
+}
+
+void ChunkedPointCloud::GetVisibleChunks(const Eigen::Matrix4f& pose, const Eigen::Matrix3f& K,
+  int rows, int cols, bool backface_culling, std::vector<VisibleChunk>& visible) const
+{
+  // Frustum side planes as bounds on x/z and y/z in the camera frame
+  float xmin = -K(0,2)/K(0,0);
+  float xmax = (cols - K(0,2))/K(0,0);
+  float ymin = -K(1,2)/K(1,1);
+  float ymax = (rows - K(1,2))/K(1,1);
+  Eigen::Matrix4f pose_inv = pose.inverse();
+  Eigen::Vector3f camera = pose.block<3,1>(0,3);
+
+  visible.clear();
+  for(unsigned int i = 0; i < chunks.size(); i++)
+  {
+    VisibleChunk v;
+    v.chunk = chunks[i];
+    if(!InFrustum(*chunks[i], pose_inv, xmin, xmax, ymin, ymax, v.near_depth))
+      continue;
+    if(backface_culling && FacesAway(*chunks[i], camera))
+      continue;
+    visible.push_back(v);
+  }
+}
+
+bool ChunkedPointCloud::InFrustum(const PointChunk& chunk, const Eigen::Matrix4f& pose_inv,
+  float xmin, float xmax, float ymin, float ymax, float& near_depth) const
+{
+  // A block is outside if all its corners are behind the same plane
+  int outside[5] = {0, 0, 0, 0, 0};
+  near_depth = std::numeric_limits<float>::max();
+  for(int c = 0; c < 8; c++)
+  {
+    Eigen::Vector4f corner((c & 1) ? chunk.max(0) : chunk.min(0),
+                           (c & 2) ? chunk.max(1) : chunk.min(1),
+                           (c & 4) ? chunk.max(2) : chunk.min(2), 1);
+    Eigen::Vector4f p = pose_inv*corner;
+    // depth is linear, so the box's nearest depth is at a corner
+    near_depth = std::min(near_depth, p(2));
+    outside[0] += p(2) <= 0;
+    outside[1] += p(0) < xmin*p(2);
+    outside[2] += p(0) > xmax*p(2);
+    outside[3] += p(1) < ymin*p(2);
+    outside[4] += p(1) > ymax*p(2);
+  }
+  for(int i = 0; i < 5; i++)
+  {
+    if(outside[i] == 8)
+      return false;
+  }
+  return true;
+}
+
+bool ChunkedPointCloud::FacesAway(const PointChunk& chunk, const Eigen::Vector3f& camera) const
+{
+  if(chunk.cone_angle >= M_PI/2)
+    return false;
+
+  // Every point of the bounding sphere is seen within asin(r/d) of the
+  // direction to its center, and every normal is within cone_angle of the
+  // axis.  If both together stay under 90 deg no point faces the camera.
+  Eigen::Vector3f center = 0.5*(chunk.min + chunk.max);
+  float radius = 0.5*(chunk.max - chunk.min).norm();
+  Eigen::Vector3f view = center - camera;
+  float dist = view.norm();
+  if(dist <= radius)
+    return false;
+  float spread = chunk.cone_angle + std::asin(radius/dist);
+  if(spread >= M_PI/2)
+    return false;
+  return chunk.cone_axis.dot(view) > dist*std::sin(spread);
+}
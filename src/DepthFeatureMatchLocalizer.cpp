@@ -10,11 +10,15 @@ using namespace std;
 
 DepthFeatureMatchLocalizer::DepthFeatureMatchLocalizer(const std::vector<KeyframeContainer*>& train,
   std::string desc_type, bool show_matches, int min_inliers, double max_reproj_error,
-  double ratio_test_thresh)
-  : keyframes(train), desc_type(desc_type), show_matches(show_matches), min_inliers(min_inliers),
+  double ratio_test_thresh, std::string index_filename, std::string vocabulary_filename, int shortlist_size,
+  boost::shared_ptr<WorkerPool> shared_workers)
+  : keyframes(train), retriever(new KeyframeRetriever(train, index_filename, vocabulary_filename, shortlist_size,
+      shared_workers)),
+    desc_type(desc_type), show_matches(show_matches), min_inliers(min_inliers),
     max_reproj_error(max_reproj_error), ratio_test_thresh(ratio_test_thresh)
 {
-  namedWindow( "Match", WINDOW_NORMAL );
+  if(show_matches)
+    namedWindow( "Match", WINDOW_NORMAL );
 }
 
 bool DepthFeatureMatchLocalizer::localize(const Mat& img, const Mat& Kcv, Eigen::Matrix4f* pose, Eigen::Matrix4f* pose_guess)
@@ -24,11 +28,11 @@ bool DepthFeatureMatchLocalizer::localize(const Mat& img, const Mat& Kcv, Eigen:
 
   if(pose_guess)
   { 
-    matches = FindImageMatches(kf, 10, pose_guess, keyframes.size()/4);  
+    matches = retriever->FindImageMatches(kf, 10, ratio_test_thresh, pose_guess, keyframes.size()/4);  
   }
   else
   {
-    matches = FindImageMatches(kf, 10);  
+    matches = retriever->FindImageMatches(kf, 10, ratio_test_thresh);  
   }
 
   // Find most geometrically consistent match
@@ -120,74 +124,3 @@ bool DepthFeatureMatchLocalizer::localize(const Mat& img, const Mat& Kcv, Eigen:
     return false;
   }
 }
-
-std::vector< KeyframeMatch > DepthFeatureMatchLocalizer::FindImageMatches(KeyframeContainer* img, int k, Eigen::Matrix4f* pose_guess, unsigned int search_bound)
-{
-  const double numMatchThresh = 0;//0.16;
-  const double matchRatio = ratio_test_thresh;;
-  std::vector< KeyframeMatch > kfMatches;
-
-  if(pose_guess)
-  {
-    if(search_bound >= keyframes.size())
-    {
-      search_bound = keyframes.size();
-    }
-    else 
-    {
-      KeyframePositionSorter kps(*pose_guess);
-      std::sort(keyframes.begin(), keyframes.end(), kps);
-    }
-  }
-  else
-  {
-    search_bound = keyframes.size();
-  }
-
-  // Find potential frame matches
-  #pragma omp parallel for
-  for(unsigned int i = 0; i < search_bound; i++)
-  {
-    //std::cout << i/double(keyframes.size()) << std::endl;
-
-    FlannBasedMatcher matcher;
-    std::vector < std::vector< DMatch > > matches;
-    if(keyframes[i]->GetDescriptors().rows == 0 || keyframes[i]->GetDescriptors().cols == 0)
-      continue;
-    matcher.knnMatch( img->GetDescriptors(), keyframes[i]->GetDescriptors(), matches, 2 );
-
-    std::vector< DMatch > goodMatches;
-    std::vector< DMatch > allMatches;
-    std::vector<Point2f> matchPts1;
-    std::vector<Point2f> matchPts2;
-    std::vector<KeyPoint> matchKps1;
-    std::vector<KeyPoint> matchKps2;
-    
-    // Use ratio test to find good keypoint matches
-    for(unsigned int j = 0; j < matches.size(); j++)
-    {
-      allMatches.push_back(matches[j][0]);
-      if(matches[j][0].distance < matchRatio*matches[j][1].distance)
-      {
-        goodMatches.push_back(matches[j][0]);
-        matchPts1.push_back(img->GetKeypoints()[matches[j][0].queryIdx].pt);
-        matchPts2.push_back(keyframes[i]->GetKeypoints()[matches[j][0].trainIdx].pt);
-        matchKps1.push_back(img->GetKeypoints()[matches[j][0].queryIdx]);
-        matchKps2.push_back(keyframes[i]->GetKeypoints()[matches[j][0].trainIdx]);
-      }
-    }
-    if(goodMatches.size() >= numMatchThresh*matches.size())
-    {
-      //std:: cout << "Found Match!" << std::endl;
-      #pragma omp critical
-      {
-        kfMatches.push_back(KeyframeMatch(keyframes[i], goodMatches, allMatches, matchPts1, matchPts2, matchKps1, matchKps2));
-      }
-    }
-  }
-
-  k = (kfMatches.size() < k) ? kfMatches.size() : k;
-  std::sort(kfMatches.begin(), kfMatches.end());
-
-  return std::vector< KeyframeMatch > (kfMatches.begin(), kfMatches.begin()+k);
-}
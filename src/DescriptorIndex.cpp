@@ -0,0 +1,227 @@
+#include "mesh_localize/DescriptorIndex.h"
+#include "mesh_localize/Log.h"
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+using namespace cv;
+
+static const char DESCRIPTOR_INDEX_MAGIC[8] = {'M', 'L', 'D', 'I', 'N', 'D', 'X', '\0'};
+static const uint32_t DESCRIPTOR_INDEX_VERSION = 1;
+// Leaves the kd-trees visit per query, as FlannBasedMatcher does by default
+static const int SEARCH_CHECKS = 32;
+// Neighbours searched per query feature, enough to usually find the two
+// nearest of several keyframes
+static const int VOTE_NEIGHBOURS = 8;
+
+DescriptorIndex::DescriptorIndex() :
+  index(NULL),
+  binary(false)
+{
+}
+
+DescriptorIndex::~DescriptorIndex()
+{
+  delete index;
+}
+
+bool DescriptorIndex::Gather(const std::vector<KeyframeContainer*>& keyframes)
+{
+  int total = 0, cols = 0, type = -1;
+  for(unsigned int i = 0; i < keyframes.size(); i++)
+  {
+    Mat desc = keyframes[i]->GetDescriptors();
+    if(desc.rows == 0 || desc.cols == 0)
+      continue;
+    if(type >= 0 && (desc.type() != type || desc.cols != cols))
+    {
+      ML_ERROR("DescriptorIndex: keyframe %u has descriptors of a different type", i);
+      return false;
+    }
+    type = desc.type();
+    cols = desc.cols;
+    total += desc.rows;
+  }
+
+  keyframe_ids.resize(total);
+  keyframe_start.resize(keyframes.size());
+  if(total > 0)
+    descriptors.create(total, cols, type);
+  else
+    descriptors.release();
+  int row = 0;
+  for(unsigned int i = 0; i < keyframes.size(); i++)
+  {
+    keyframe_start[i] = row;
+    Mat desc = keyframes[i]->GetDescriptors();
+    if(desc.rows == 0 || desc.cols == 0)
+      continue;
+    desc.copyTo(descriptors.rowRange(row, row + desc.rows));
+    std::fill(keyframe_ids.begin() + row, keyframe_ids.begin() + row + desc.rows, i);
+    row += desc.rows;
+  }
+  binary = type == CV_8U;
+  return true;
+}
+
+bool DescriptorIndex::Build(const std::vector<KeyframeContainer*>& keyframes)
+{
+  delete index;
+  index = NULL;
+  if(!Gather(keyframes))
+    return false;
+  // the ratio test needs two neighbours
+  if(descriptors.rows < 2)
+    return true;
+
+  if(binary)
+    index = new flann::Index(descriptors, flann::LshIndexParams(12, 20, 2), cvflann::FLANN_DIST_HAMMING);
+  else
+    index = new flann::Index(descriptors, flann::KDTreeIndexParams(4));
+  return true;
+}
+
+bool DescriptorIndex::Save(const std::string& filename) const
+{
+  DescriptorIndexHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, DESCRIPTOR_INDEX_MAGIC, sizeof(header.magic));
+  header.version = DESCRIPTOR_INDEX_VERSION;
+  header.num_keyframes = keyframe_start.size();
+  header.num_descriptors = descriptors.rows;
+  header.desc_mat_type = descriptors.type();
+  header.desc_cols = descriptors.cols;
+  std::vector<uint32_t> counts(keyframe_start.size());
+  for(unsigned int i = 0; i < counts.size(); i++)
+  {
+    int end = i + 1 < keyframe_start.size() ? keyframe_start[i + 1] : descriptors.rows;
+    counts[i] = end - keyframe_start[i];
+  }
+
+  FILE* file = fopen(filename.c_str(), "wb");
+  if(!file)
+  {
+    ML_ERROR("DescriptorIndex: could not open %s", filename.c_str());
+    return false;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+    (counts.empty() || fwrite(&counts[0], sizeof(uint32_t), counts.size(), file) == counts.size());
+  ok = fclose(file) == 0 && ok;
+  if(ok && index)
+    index->save(filename + ".flann");
+  if(!ok)
+    ML_ERROR("DescriptorIndex: write failed");
+  return ok;
+}
+
+bool DescriptorIndex::Load(const std::string& filename, const std::vector<KeyframeContainer*>& keyframes)
+{
+  delete index;
+  index = NULL;
+
+  FILE* file = fopen(filename.c_str(), "rb");
+  if(!file)
+    return false;
+  DescriptorIndexHeader header;
+  std::vector<uint32_t> counts;
+  bool ok = fread(&header, sizeof(header), 1, file) == 1 &&
+    memcmp(header.magic, DESCRIPTOR_INDEX_MAGIC, sizeof(DESCRIPTOR_INDEX_MAGIC)) == 0 &&
+    header.version == DESCRIPTOR_INDEX_VERSION && header.num_keyframes == keyframes.size();
+  if(ok)
+  {
+    counts.resize(header.num_keyframes);
+    ok = counts.empty() || fread(&counts[0], sizeof(uint32_t), counts.size(), file) == counts.size();
+  }
+  fclose(file);
+  for(unsigned int i = 0; ok && i < counts.size(); i++)
+  {
+    ok = counts[i] == (uint32_t)keyframes[i]->GetDescriptors().rows;
+  }
+  if(!ok)
+  {
+    ML_WARN("DescriptorIndex: %s does not index these keyframes", filename.c_str());
+    return false;
+  }
+
+  if(!Gather(keyframes) || (uint32_t)descriptors.rows != header.num_descriptors)
+    return false;
+  if(descriptors.rows < 2)
+    return true;
+  if(descriptors.type() != header.desc_mat_type || descriptors.cols != header.desc_cols)
+  {
+    ML_WARN("DescriptorIndex: %s indexes other descriptors", filename.c_str());
+    return false;
+  }
+  index = new flann::Index;
+  if(!index->load(descriptors, filename + ".flann"))
+  {
+    ML_WARN("DescriptorIndex: could not load %s.flann", filename.c_str());
+    delete index;
+    index = NULL;
+    return false;
+  }
+  return true;
+}
+
+size_t DescriptorIndex::NumKeyframes() const
+{
+  return keyframe_start.size();
+}
+
+void DescriptorIndex::Vote(const Mat& query, double ratio, std::vector<int>& votes) const
+{
+  votes.assign(keyframe_start.size(), 0);
+  if(!index || query.rows == 0 || query.type() != descriptors.type() || query.cols != descriptors.cols)
+    return;
+
+  int knn = std::min(VOTE_NEIGHBOURS, descriptors.rows);
+  Mat indices, dists;
+  index->knnSearch(query, indices, dists, knn, flann::SearchParams(SEARCH_CHECKS));
+  Mat distsf;
+  dists.convertTo(distsf, CV_32F);
+  // kd-tree distances are squared
+  float ratio_test = binary ? ratio : ratio*ratio;
+  // keyframes among the neighbours of a feature, with the distances of
+  // their nearest and second nearest (-1 if not among them)
+  std::vector<int> kfs;
+  std::vector<float> first, second;
+  for(int i = 0; i < query.rows; i++)
+  {
+    kfs.clear();
+    first.clear();
+    second.clear();
+    int found = 0;
+    float farthest = 0;
+    for(int n = 0; n < knn; n++)
+    {
+      int nn = indices.at<int>(i, n);
+      // LSH may not find all neighbours
+      if(nn < 0 || nn >= descriptors.rows)
+        continue;
+      float dist = distsf.at<float>(i, n);
+      int kf = keyframe_ids[nn];
+      int pos = std::find(kfs.begin(), kfs.end(), kf) - kfs.begin();
+      if(pos == kfs.size())
+      {
+        kfs.push_back(kf);
+        first.push_back(dist);
+        second.push_back(-1);
+      }
+      else if(second[pos] < 0)
+      {
+        second[pos] = dist;
+      }
+      farthest = std::max(farthest, dist);
+      found++;
+    }
+    for(unsigned int j = 0; j < kfs.size(); j++)
+    {
+      // The second nearest in a keyframe that shows up only once is no
+      // nearer than the farthest neighbour, if there are farther ones
+      float dist2 = second[j] >= 0 ? second[j] : (found == knn && knn < descriptors.rows ? farthest : -1);
+      if(dist2 >= 0 && first[j] < ratio_test*dist2)
+        votes[kfs[j]]++;
+    }
+  }
+}
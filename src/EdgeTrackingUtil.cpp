@@ -1,5 +1,6 @@
 #include "mesh_localize/EdgeTrackingUtil.h"
 #include "mesh_localize/PnPUtil.h"
+#include "mesh_localize/Profiler.h"
 #include "TooN/TooN.h"
 #include "TooN/SVD.h"       // for SVD
 #include "TooN/so3.h"       // for special orthogonal group
@@ -13,12 +14,16 @@
 using namespace TooN;
 using namespace cv;
   
-bool EdgeTrackingUtil::show_debug = false;
-bool EdgeTrackingUtil::autotune_canny = true;
-double EdgeTrackingUtil::canny_high_thresh = 180;
-double EdgeTrackingUtil::canny_low_thresh = 60;
-double EdgeTrackingUtil::dmax = 15;
-double EdgeTrackingUtil::canny_sigma = .33;
+EdgeTrackingUtil::EdgeParams::EdgeParams() :
+  show_debug(false),
+  autotune_canny(true),
+  canny_high_thresh(180),
+  canny_low_thresh(60),
+  canny_sigma(.33),
+  dmax(15),
+  undistorter(NULL)
+{
+}
 
 bool EdgeTrackingUtil::withinOri(float o1, float o2, float oth)
 {
@@ -346,7 +351,7 @@ std::vector<EdgeTrackingUtil::SamplePoint> EdgeTrackingUtil::getWindowedEdgeMatc
 std::vector<EdgeTrackingUtil::SamplePoint> EdgeTrackingUtil::getEdgeMatches(
   const std::vector<Point>& vimg_edge_pts, const std::vector<double>& vimg_edge_dirs, 
   const Mat& kf_detected_edges, const Mat& kf_edge_dir, const Eigen::Matrix3f vimgK, 
-  const Eigen::Matrix3f K, const Mat& vdepth, const Eigen::Matrix4f& vimgTf)
+  const Eigen::Matrix3f K, const Mat& vdepth, const Eigen::Matrix4f& vimgTf, const EdgeParams& params)
 {
   Eigen::Matrix3f vimgK_inv = vimgK.inverse();
 
@@ -363,10 +368,14 @@ std::vector<EdgeTrackingUtil::SamplePoint> EdgeTrackingUtil::getEdgeMatches(
     // camera intrinsics may not match virtual intrinsics, so we reproject the virtual point to 
     // the real camera frame
     Eigen::Vector3f p_kf = K*vimgK_inv*Eigen::Vector3f(pt.x,pt.y,1); 
-    for(int d = 0; d < dmax; d++)
+    // search for the edge where the point lands in the (possibly distorted) query image
+    Point2f p_search(p_kf(0), p_kf(1));
+    if(params.undistorter)
+      p_search = params.undistorter->Distort(p_search);
+    for(int d = 0; d < params.dmax; d++)
     {
-      int x_idx = p_kf(0) + d*cos(edge_dir);
-      int y_idx = p_kf(1) + d*sin(edge_dir);
+      int x_idx = p_search.x + d*cos(edge_dir);
+      int y_idx = p_search.y + d*sin(edge_dir);
       if(x_idx < 0 || x_idx >= kf_detected_edges.cols || y_idx < 0 || y_idx >= kf_detected_edges.rows)
         continue;
       
@@ -375,9 +384,12 @@ std::vector<EdgeTrackingUtil::SamplePoint> EdgeTrackingUtil::getEdgeMatches(
         // Found correspondence
         // Store vimg and KF 2D correspondences
         EdgeTrackingUtil::SamplePoint sp; 
+        Point2f edge_pt(x_idx, y_idx);
+        if(params.undistorter)
+          edge_pt = params.undistorter->Undistort(edge_pt);
         sp.coord2 = cvPoint2D32f(p_kf(0), p_kf(1)); 
-        sp.edge_pt2 = cvPoint2D32f(x_idx, y_idx); 
-        sp.dist = sqrt(pow(p_kf(0) - x_idx,2)+pow(p_kf(1) - y_idx,2));
+        sp.edge_pt2 = cvPoint2D32f(edge_pt.x, edge_pt.y); 
+        sp.dist = sqrt(pow(p_kf(0) - edge_pt.x,2)+pow(p_kf(1) - edge_pt.y,2));
         sp.dx = cos(edge_dir);
         sp.dy = sin(edge_dir);
         sp.nuv = cvPoint2D32f(cos(edge_dir), sin(edge_dir));
@@ -392,8 +404,8 @@ std::vector<EdgeTrackingUtil::SamplePoint> EdgeTrackingUtil::getEdgeMatches(
         break;
       }
       //check other direction
-      x_idx = p_kf(0) - d*cos(edge_dir);
-      y_idx = p_kf(1) - d*sin(edge_dir);
+      x_idx = p_search.x - d*cos(edge_dir);
+      y_idx = p_search.y - d*sin(edge_dir);
       if(x_idx < 0 || x_idx >= kf_detected_edges.cols || y_idx < 0 || y_idx >= kf_detected_edges.rows)
         continue;
       if(kf_detected_edges.at<uchar>(y_idx, x_idx) == 255 && withinOri(edge_dir*180./M_PI, kf_edge_dir.at<float>(y_idx, x_idx)*180./M_PI, 20))
@@ -401,9 +413,12 @@ std::vector<EdgeTrackingUtil::SamplePoint> EdgeTrackingUtil::getEdgeMatches(
         // Found correspondence
         // Store vimg and KF 2D correspondences
         EdgeTrackingUtil::SamplePoint sp; 
+        Point2f edge_pt(x_idx, y_idx);
+        if(params.undistorter)
+          edge_pt = params.undistorter->Undistort(edge_pt);
         sp.coord2 = cvPoint2D32f(p_kf(0), p_kf(1)); 
-        sp.edge_pt2 = cvPoint2D32f(x_idx, y_idx); 
-        sp.dist = sqrt(pow(p_kf(0) - x_idx,2)+pow(p_kf(1) - y_idx,2));
+        sp.edge_pt2 = cvPoint2D32f(edge_pt.x, edge_pt.y); 
+        sp.dist = sqrt(pow(p_kf(0) - edge_pt.x,2)+pow(p_kf(1) - edge_pt.y,2));
         sp.dx = -cos(edge_dir);
         sp.dy = -sin(edge_dir);
         sp.nuv = cvPoint2D32f(-cos(edge_dir), -sin(edge_dir));
@@ -427,44 +442,37 @@ std::vector<EdgeTrackingUtil::SamplePoint> EdgeTrackingUtil::getEdgeMatches(
 
 std::vector<EdgeTrackingUtil::SamplePoint> EdgeTrackingUtil::getEdgeMatches(const Mat& vimg, 
   const Mat& kf, const Eigen::Matrix3f vimgK, const Eigen::Matrix3f K, const Mat& vdepth, 
-  const Mat& kf_mask, const Eigen::Matrix4f& vimgTf)
+  const Mat& kf_mask, const Eigen::Matrix4f& vimgTf, const EdgeParams& params)
 {
-  std::clock_t start;
   // Get edges from vimg and kf using canny
   Mat kf_detected_edges, vimg_detected_edges;
 
-  start = std::clock();
+  ScopedTimer canny_timer("canny");
   double canny_low_thresh1, canny_low_thresh2, canny_high_thresh1, canny_high_thresh2;
-  if(autotune_canny)
+  if(params.autotune_canny)
   {
     double med1 = getMedian(kf,1);
     double med2 = getMedian(vimg, 1); // 1 ignores black background
-    canny_low_thresh1 = (1-canny_sigma)*med1;
-    canny_low_thresh2 = (1-canny_sigma)*med2;
-    canny_high_thresh1 = (1+canny_sigma)*med1;
-    canny_high_thresh2 = (1+canny_sigma)*med2;
+    canny_low_thresh1 = (1-params.canny_sigma)*med1;
+    canny_low_thresh2 = (1-params.canny_sigma)*med2;
+    canny_high_thresh1 = (1+params.canny_sigma)*med1;
+    canny_high_thresh2 = (1+params.canny_sigma)*med2;
   }
   else
   {
-    canny_low_thresh1 = canny_low_thresh;
-    canny_low_thresh2 = canny_low_thresh;
-    canny_high_thresh1 = canny_high_thresh;
-    canny_high_thresh2 = canny_high_thresh;
+    canny_low_thresh1 = params.canny_low_thresh;
+    canny_low_thresh2 = params.canny_low_thresh;
+    canny_high_thresh1 = params.canny_high_thresh;
+    canny_high_thresh2 = params.canny_high_thresh;
   }
-  std::cout << "Canny thresh time: " << (std::clock() - start) / (double)(CLOCKS_PER_SEC) << std::endl;
 
   // do both cannys at once since it's slow
-  start = std::clock();
   boost::thread canny_thread = boost::thread(Canny, boost::ref(kf), boost::ref(kf_detected_edges), 
     canny_low_thresh1, 
     canny_high_thresh1, 3, false);
     
   Canny(vimg, vimg_detected_edges, canny_low_thresh2, canny_high_thresh2, 3);
-  std::cout << "Canny 2 time: " << (std::clock() - start) / (double)(CLOCKS_PER_SEC) << std::endl;
-
-  start = std::clock();
   canny_thread.join();
-  std::cout << "Canny 1 time: " << (std::clock() - start) / (double)(CLOCKS_PER_SEC) << std::endl;
 
   //start = std::clock();
   //vector<Vec4i> vimg_detected_lines;
@@ -485,25 +493,24 @@ std::vector<EdgeTrackingUtil::SamplePoint> EdgeTrackingUtil::getEdgeMatches(cons
     if(kf_mask.at<uchar>(kf_edge_pts_mat.at<Point>(i).y, kf_edge_pts_mat.at<Point>(i).x) > 0)
       kf_edge_pts[i] = kf_edge_pts_mat.at<Point>(i);
   } 
-  std::cout << "Canny time: " << (std::clock() - start) / (double)(CLOCKS_PER_SEC) << std::endl;
+  canny_timer.Stop();
 
   //Get all edge points in vimg and gradients
-  start = std::clock();
+  ScopedTimer grad_timer("edge_gradient");
   Mat kf_edge_dir;
   std::vector<double> vimg_edge_dirs = calcImageGradientDirection(vimg, vimg_edge_pts);
-  start = std::clock();
   calcImageGradientDirection(kf_edge_dir, kf, kf_edge_pts);
   //std::vector<double> kf_edge_dirs = calcImageGradientDirection(kf, kf_edge_pts);
-  std::cout << "Edge grad time: " << (std::clock() - start) / (double)(CLOCKS_PER_SEC) << std::endl;
+  grad_timer.Stop();
 
-  start = std::clock();
+  ScopedTimer match_timer("edge_match");
   std::vector<SamplePoint> sps = getEdgeMatches(vimg_edge_pts, vimg_edge_dirs, kf_detected_edges, 
-                                   kf_edge_dir, vimgK, K, vdepth, vimgTf);
+                                   kf_edge_dir, vimgK, K, vdepth, vimgTf, params);
   //std::vector<SamplePoint> sps = getWindowedEdgeMatches(vimg, vimg_edge_pts, vimg_edge_dirs, 
   //                                 kf,  kf_detected_edges, 
   //                                 kf_edge_dir, vimgK, K, vdepth, vimgTf);
-  std::cout << "Edge match time: " << (std::clock() - start) / (double)(CLOCKS_PER_SEC) << std::endl;
-  if(show_debug)
+  match_timer.Stop();
+  if(params.show_debug)
   {
     Mat edge_dir_im;
     drawGradientLines(edge_dir_im, vimg_detected_edges, vimg_edge_pts, vimg_edge_dirs); 
@@ -534,7 +541,8 @@ std::vector<EdgeTrackingUtil::SamplePoint> EdgeTrackingUtil::getEdgeMatches(cons
   return sps;
 }  
 
-void EdgeTrackingUtil::getEstimatedPoseIRLS(Eigen::Matrix4f& pose_cur, const Eigen::Matrix4f& pose_pre, const std::vector<SamplePoint>& vSamplePt, const Eigen::Matrix3f& intrinsics)
+void EdgeTrackingUtil::getEstimatedPoseIRLS(Eigen::Matrix4f& pose_cur, const Eigen::Matrix4f& pose_pre, const std::vector<SamplePoint>& vSamplePt, const Eigen::Matrix3f& intrinsics,
+  const EdgeParams& params)
 {
   double alpha_ = 32.;
   // use a numerical non-linear optimization (weighted least square) to find pose (P)
@@ -555,7 +563,7 @@ void EdgeTrackingUtil::getEstimatedPoseIRLS(Eigen::Matrix4f& pose_cur, const Eig
   //wls.add_prior(1e1);
   for(int i=0; i<int(vSamplePt.size()); i++)
   {
-    if(vSamplePt[i].dist < dmax)
+    if(vSamplePt[i].dist < params.dmax)
     {
       // INVERSE 1/(alpha_ + dist)
       wls.add_mJ(
@@ -4,7 +4,8 @@
 
 using namespace cv;
 
-FeatureMatchLocalizer::FeatureMatchLocalizer(const std::vector<CameraContainer*>& train, std::string descriptor_type, bool show_matches,  bool load_descriptors, std::string desc_filename)
+FeatureMatchLocalizer::FeatureMatchLocalizer(const std::vector<CameraContainer*>& train, std::string descriptor_type, bool show_matches,  bool load_descriptors, std::string desc_filename, std::string index_filename,
+  std::string vocabulary_filename, int shortlist_size, boost::shared_ptr<WorkerPool> shared_workers)
   : desc_type(descriptor_type), show_matches(show_matches)
 {
   std::ifstream desc_file;
@@ -64,6 +65,8 @@ FeatureMatchLocalizer::FeatureMatchLocalizer(const std::vector<CameraContainer*>
   {
     WriteDescriptorsToFile(desc_filename);
   }
+
+  retriever.reset(new KeyframeRetriever(keyframes, index_filename, vocabulary_filename, shortlist_size, shared_workers));
 }
 
 bool FeatureMatchLocalizer::WriteDescriptorsToFile(std::string filename)
@@ -105,16 +108,19 @@ bool FeatureMatchLocalizer::WriteDescriptorsToFile(std::string filename)
 
 bool FeatureMatchLocalizer::localize(const Mat& img, const Mat& K, Eigen::Matrix4f* pose, Eigen::Matrix4f* pose_guess)
 {
+  const double matchRatio = 0.7;
+  if(!retriever)
+    return false;
   KeyframeContainer* kf = new KeyframeContainer(img, desc_type);
   std::vector< KeyframeMatch > matches;
 
   if(pose_guess)
   { 
-    matches = FindImageMatches(kf, 5, pose_guess, keyframes.size()/4);  
+    matches = retriever->FindImageMatches(kf, 5, matchRatio, pose_guess, keyframes.size()/4);  
   }
   else
   {
-    matches = FindImageMatches(kf, 5);  
+    matches = retriever->FindImageMatches(kf, 5, matchRatio);  
   }
 
   if(show_matches)
@@ -138,72 +144,3 @@ bool FeatureMatchLocalizer::localize(const Mat& img, const Mat& K, Eigen::Matrix
     return false;
   }
 }
-
-std::vector< KeyframeMatch > FeatureMatchLocalizer::FindImageMatches(KeyframeContainer* img, int k, Eigen::Matrix4f* pose_guess, unsigned int search_bound)
-{
-  const double numMatchThresh = 0;//0.16;
-  const double matchRatio = 0.7;
-  std::vector< KeyframeMatch > kfMatches;
-
-  if(pose_guess)
-  {
-    if(search_bound >= keyframes.size())
-    {
-      search_bound = keyframes.size();
-    }
-    else 
-    {
-      KeyframePositionSorter kps(*pose_guess);
-      std::sort(keyframes.begin(), keyframes.end(), kps);
-    }
-  }
-  else
-  {
-    search_bound = keyframes.size();
-  }
-
-  // Find potential frame matches
-  #pragma omp parallel for
-  for(unsigned int i = 0; i < search_bound; i++)
-  {
-    //std::cout << i/double(keyframes.size()) << std::endl;
-
-    FlannBasedMatcher matcher;
-    std::vector < std::vector< DMatch > > matches;
-    matcher.knnMatch( img->GetDescriptors(), keyframes[i]->GetDescriptors(), matches, 2 );
-
-    std::vector< DMatch > goodMatches;
-    std::vector< DMatch > allMatches;
-    std::vector<Point2f> matchPts1;
-    std::vector<Point2f> matchPts2;
-    std::vector<KeyPoint> matchKps1;
-    std::vector<KeyPoint> matchKps2;
-    
-    // Use ratio test to find good keypoint matches
-    for(unsigned int j = 0; j < matches.size(); j++)
-    {
-      allMatches.push_back(matches[j][0]);
-      if(matches[j][0].distance < matchRatio*matches[j][1].distance)
-      {
-        goodMatches.push_back(matches[j][0]);
-        matchPts1.push_back(img->GetKeypoints()[matches[j][0].queryIdx].pt);
-        matchPts2.push_back(keyframes[i]->GetKeypoints()[matches[j][0].trainIdx].pt);
-        matchKps1.push_back(img->GetKeypoints()[matches[j][0].queryIdx]);
-        matchKps2.push_back(keyframes[i]->GetKeypoints()[matches[j][0].trainIdx]);
-      }
-    }
-    if(goodMatches.size() >= numMatchThresh*matches.size())
-    {
-      //std:: cout << "Found Match!" << std::endl;
-      #pragma omp critical
-      {
-        kfMatches.push_back(KeyframeMatch(keyframes[i], goodMatches, allMatches, matchPts1, matchPts2, matchKps1, matchKps2));
-      }
-    }
-  }
-
-  k = (kfMatches.size() < k) ? kfMatches.size() : k;
-  std::sort(kfMatches.begin(), kfMatches.end());
-
-  return std::vector< KeyframeMatch > (kfMatches.begin(), kfMatches.begin()+k);
-}
@@ -0,0 +1,83 @@
+#include "mesh_localize/FrameScheduler.h"
+
+#include <sstream>
+
+// Weight of a new sample in the cost average
+static const double COST_ALPHA = 0.2;
+// Cost estimates of skipped levels decay by this factor per frame
+static const double SKIP_DECAY = 0.95;
+
+FrameScheduler::FrameScheduler(double budget) :
+  budget(budget),
+  num_dropped(0)
+{
+}
+
+void FrameScheduler::SetBudget(double budget)
+{
+  this->budget = budget;
+}
+
+bool FrameScheduler::IsEnabled() const
+{
+  return budget > 0;
+}
+
+std::string FrameScheduler::Key(const std::string& path, Level level)
+{
+  std::stringstream ss;
+  ss << path << "/" << (int)level;
+  return ss.str();
+}
+
+bool FrameScheduler::Fits(const std::string& path, Level level, double age) const
+{
+  if(!IsEnabled())
+    return true;
+  std::map<std::string, Estimate>::const_iterator it = estimates.find(Key(path, level));
+  // unmeasured paths are assumed to fit so they get measured
+  if(it == estimates.end() || it->second.samples == 0)
+    return age < budget;
+  return age + it->second.cost <= budget;
+}
+
+FrameScheduler::Level FrameScheduler::Schedule(const std::string& path, double age, int num_levels,
+  bool droppable)
+{
+  if(!IsEnabled())
+    return FULL;
+
+  // The deadline has already passed, running the frame would only delay the next one
+  if(age >= budget)
+  {
+    num_dropped++;
+    return DROP;
+  }
+
+  for(int i = 0; i < num_levels; i++)
+  {
+    Level level = (Level)i;
+    if(Fits(path, level, age))
+      return level;
+    estimates[Key(path, level)].cost *= SKIP_DECAY;
+  }
+
+  if(!droppable)
+    return (Level)(num_levels-1);
+  num_dropped++;
+  return DROP;
+}
+
+void FrameScheduler::Report(const std::string& path, Level level, double seconds)
+{
+  if(level == DROP)
+    return;
+  Estimate& e = estimates[Key(path, level)];
+  e.cost = e.samples == 0 ? seconds : (1-COST_ALPHA)*e.cost + COST_ALPHA*seconds;
+  e.samples++;
+}
+
+unsigned long FrameScheduler::NumDropped() const
+{
+  return num_dropped;
+}
@@ -0,0 +1,245 @@
+#include "mesh_localize/GazeboRenderService.h"
+#include "mesh_localize/Profiler.h"
+
+#include <Eigen/Geometry>
+#include <cv_bridge/cv_bridge.h>
+#include <sensor_msgs/CameraInfo.h>
+#include <sensor_msgs/image_encodings.h>
+
+#include "gazebo_msgs/LinkState.h"
+#include "gazebo_msgs/SetLinkState.h"
+
+using namespace cv;
+
+GazeboRenderService::GazeboRenderService(ros::NodeHandle nh, double timeout) :
+  nh(nh),
+  timeout(timeout),
+  num_clock_msgs(0),
+  stopping(false)
+{
+  K = Eigen::Matrix3f::Identity();
+  link_state_client = nh.serviceClient<gazebo_msgs::SetLinkState>("/gazebo/set_link_state");
+  image_sub = nh.subscribe<sensor_msgs::Image>("virtual_image", 1, &GazeboRenderService::HandleImage, this,
+    ros::TransportHints().tcpNoDelay());
+  depth_sub = nh.subscribe<sensor_msgs::Image>("virtual_depth", 1, &GazeboRenderService::HandleDepth, this,
+    ros::TransportHints().tcpNoDelay());
+  clock_sub = nh.subscribe<rosgraph_msgs::Clock>("/clock", 1, &GazeboRenderService::HandleClock, this,
+    ros::TransportHints().tcpNoDelay());
+}
+
+GazeboRenderService::~GazeboRenderService()
+{
+  Stop();
+}
+
+bool GazeboRenderService::WaitForCameraInfo()
+{
+  ROS_INFO("Waiting for virtual camera calibration info...");
+  sensor_msgs::CameraInfoConstPtr msg = ros::topic::waitForMessage<sensor_msgs::CameraInfo>("virtual_caminfo", nh);
+  if(!msg)
+    return false;
+  K << msg->K[0], msg->K[1], msg->K[2],
+       msg->K[3], msg->K[4], msg->K[5],
+       msg->K[6], msg->K[7], msg->K[8];
+  ROS_INFO("Virtual calibration info received");
+  return true;
+}
+
+void GazeboRenderService::Stop()
+{
+  {
+    boost::mutex::scoped_lock lock(msg_mutex);
+    stopping = true;
+    msg_cond.notify_all();
+  }
+  RenderService::Stop();
+}
+
+Eigen::Matrix3f GazeboRenderService::GetK()
+{
+  return K;
+}
+
+void GazeboRenderService::HandleImage(const sensor_msgs::ImageConstPtr& msg)
+{
+  boost::mutex::scoped_lock lock(msg_mutex);
+  latest_image = msg;
+  msg_cond.notify_all();
+}
+
+void GazeboRenderService::HandleDepth(const sensor_msgs::ImageConstPtr& msg)
+{
+  boost::mutex::scoped_lock lock(msg_mutex);
+  latest_depth = msg;
+  msg_cond.notify_all();
+}
+
+void GazeboRenderService::HandleClock(const rosgraph_msgs::ClockConstPtr& msg)
+{
+  boost::mutex::scoped_lock lock(msg_mutex);
+  sim_time = msg->clock;
+  num_clock_msgs++;
+  msg_cond.notify_all();
+}
+
+bool GazeboRenderService::Render(const Eigen::Matrix4f& pose, RenderResponse& response)
+{
+  unsigned long clock_before;
+  {
+    boost::mutex::scoped_lock lock(msg_mutex);
+    clock_before = num_clock_msgs;
+  }
+  if(!MoveCamera(pose))
+    return false;
+
+  sensor_msgs::ImageConstPtr image_msg, depth_msg;
+  {
+    ScopedTimer timer("gazebo_wait_render");
+    boost::mutex::scoped_lock lock(msg_mutex);
+    boost::system_time deadline = boost::get_system_time() + boost::posix_time::microseconds(timeout*1e6);
+    // The second clock tick after the move (the first may have been in
+    // flight) is later than the move, anything stamped after it was
+    // rendered at the new pose
+    while(!stopping && num_clock_msgs < clock_before + 2)
+    {
+      if(!msg_cond.timed_wait(lock, deadline))
+        break;
+    }
+    ros::Time moved_at = sim_time;
+    while(!stopping && num_clock_msgs >= clock_before + 2)
+    {
+      if(latest_image && latest_depth && latest_image->header.stamp > moved_at &&
+        latest_image->header.stamp == latest_depth->header.stamp)
+      {
+        image_msg = latest_image;
+        depth_msg = latest_depth;
+        break;
+      }
+      if(!msg_cond.timed_wait(lock, deadline))
+        break;
+    }
+  }
+  if(!image_msg)
+  {
+    if(!stopping)
+      ROS_ERROR("GazeboRenderService: no view rendered within %.2fs of the camera move", timeout);
+    return false;
+  }
+
+  if(!ParseDepth(*depth_msg, response.depth, response.mask))
+    return false;
+  // shared with the message, which the response keeps alive
+  response.image = cv_bridge::toCvShare(image_msg)->image;
+  response.owner = image_msg;
+  response.pose = pose;
+  return true;
+}
+
+bool GazeboRenderService::MoveCamera(const Eigen::Matrix4f& tf)
+{
+  gazebo_msgs::SetLinkState vimg_state_srv;
+  gazebo_msgs::LinkState vimg_state_msg;
+  vimg_state_msg.link_name = "kinect::link";
+
+  vimg_state_msg.pose.position.x = tf(0,3);
+  vimg_state_msg.pose.position.y = tf(1,3);
+  vimg_state_msg.pose.position.z = tf(2,3);
+
+  Eigen::Matrix3f rot = tf.block<3,3>(0,0)*Eigen::AngleAxisf(-M_PI/2, Eigen::Vector3f::UnitY())*Eigen::AngleAxisf(M_PI/2, Eigen::Vector3f::UnitX());
+  Eigen::Quaternionf q(rot);
+  q.normalize();
+  vimg_state_msg.pose.orientation.x = q.x();
+  vimg_state_msg.pose.orientation.y = q.y();
+  vimg_state_msg.pose.orientation.z = q.z();
+  vimg_state_msg.pose.orientation.w = q.w();
+
+  vimg_state_msg.twist.linear.x = 0;
+  vimg_state_msg.twist.linear.y = 0;
+  vimg_state_msg.twist.linear.z = 0;
+  vimg_state_msg.twist.angular.x = 0;
+  vimg_state_msg.twist.angular.y = 0;
+  vimg_state_msg.twist.angular.z = 0;
+
+  vimg_state_srv.request.link_state = vimg_state_msg;
+
+  ScopedTimer timer("gazebo_set_link_state");
+  if(!link_state_client.call(vimg_state_srv))
+  {
+    ROS_ERROR("Failed to contact gazebo set_link_state service");
+    return false;
+  }
+  return true;
+}
+
+// Invalid (NaN) pixels become 0 depth outside the mask, in one branch free
+// pass the compiler can vectorize, for a range of rows
+class ParseDepthBody : public ParallelLoopBody
+{
+public:
+  ParseDepthBody(const Mat& raw, Mat& depth, Mat& mask) : raw(raw), depth(depth), mask(mask)
+  {
+  }
+
+  virtual void operator()(const Range& rows) const
+  {
+    for(int i = rows.start; i < rows.end; i++)
+    {
+      const float* src = raw.ptr<float>(i);
+      float* dst = depth.ptr<float>(i);
+      uchar* m = mask.ptr<uchar>(i);
+      for(int j = 0; j < raw.cols; j++)
+      {
+        float d = src[j];
+        bool valid = d == d;
+        dst[j] = valid ? d : 0;
+        m[j] = valid ? 255 : 0;
+      }
+    }
+  }
+
+private:
+  const Mat& raw;
+  Mat& depth;
+  Mat& mask;
+};
+
+bool GazeboRenderService::ParseDepth(const sensor_msgs::Image& msg, Mat& depth, Mat& mask)
+{
+  if(msg.encoding != sensor_msgs::image_encodings::TYPE_32FC1 || msg.step % sizeof(float) != 0 ||
+    msg.is_bigendian != (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__))
+  {
+    ROS_ERROR("Virtual depth must be native endian %s, got %s", sensor_msgs::image_encodings::TYPE_32FC1.c_str(),
+      msg.encoding.c_str());
+    return false;
+  }
+
+  ScopedTimer parse_timer("parse_virtual_depth");
+  // view over the message buffer, no copy
+  const Mat raw(msg.height, msg.width, CV_32F, const_cast<uchar*>(&msg.data[0]), msg.step);
+  depth = AcquireBuffer(depth_pool, raw.rows, raw.cols, CV_32F);
+  mask = AcquireBuffer(mask_pool, raw.rows, raw.cols, CV_8U);
+
+  // rows on OpenCV's threads
+  parallel_for_(Range(0, raw.rows), ParseDepthBody(raw, depth, mask));
+  return true;
+}
+
+Mat GazeboRenderService::AcquireBuffer(std::vector<Mat>& pool, int rows, int cols, int type)
+{
+  for(unsigned int i = 0; i < pool.size(); i++)
+  {
+    // If the pool holds the only reference the caller is done with it
+    if(pool[i].refcount && *pool[i].refcount == 1)
+    {
+      pool[i].create(rows, cols, type);
+      return pool[i];
+    }
+  }
+
+  Mat buffer(rows, cols, type);
+  if(pool.size() < BUFFER_POOL_SIZE)
+  {
+    pool.push_back(buffer);
+  }
+  return buffer;
+}
@@ -0,0 +1,124 @@
+#include "mesh_localize/GuidedMatcher.h"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+using namespace cv;
+
+GuidedMatcher::GuidedMatcher(const std::vector<KeyPoint>& keypoints, const Mat& descriptors, float cell_size) :
+  descriptors(descriptors),
+  binary(descriptors.depth() == CV_8U),
+  cell_size(std::max(1.0f, cell_size)),
+  x0(0),
+  y0(0),
+  grid_cols(0),
+  grid_rows(0)
+{
+  points.resize(keypoints.size());
+  float x1 = 0, y1 = 0;
+  for(unsigned int i = 0; i < keypoints.size(); i++)
+  {
+    points[i] = keypoints[i].pt;
+    if(i == 0 || points[i].x < x0)
+      x0 = points[i].x;
+    if(i == 0 || points[i].y < y0)
+      y0 = points[i].y;
+    x1 = std::max(x1, points[i].x);
+    y1 = std::max(y1, points[i].y);
+  }
+  if(points.empty())
+    return;
+  grid_cols = (x1 - x0)/this->cell_size + 1;
+  grid_rows = (y1 - y0)/this->cell_size + 1;
+
+  // counting sort of the features by cell
+  std::vector<int> cell(points.size());
+  cell_start.assign(grid_cols*grid_rows + 1, 0);
+  for(unsigned int i = 0; i < points.size(); i++)
+  {
+    int cx = (points[i].x - x0)/this->cell_size;
+    int cy = (points[i].y - y0)/this->cell_size;
+    cell[i] = cy*grid_cols + cx;
+    cell_start[cell[i] + 1]++;
+  }
+  for(unsigned int c = 0; c + 1 < cell_start.size(); c++)
+  {
+    cell_start[c + 1] += cell_start[c];
+  }
+  std::vector<int> fill(cell_start.begin(), cell_start.end() - 1);
+  cell_features.resize(points.size());
+  for(unsigned int i = 0; i < points.size(); i++)
+  {
+    cell_features[fill[cell[i]]++] = i;
+  }
+}
+
+float GuidedMatcher::Distance(int feature, const Mat& other, int row) const
+{
+  if(binary)
+    return normHamming(descriptors.ptr<uchar>(feature), other.ptr<uchar>(row), descriptors.cols);
+  return std::sqrt(normL2Sqr_(descriptors.ptr<float>(feature), other.ptr<float>(row), descriptors.cols));
+}
+
+void GuidedMatcher::Match(const std::vector<Point2f>& predicted, const Mat& other, float radius,
+  const std::vector<float>& radii, std::vector< std::vector<DMatch> >& matches) const
+{
+  matches.clear();
+  if(points.empty() || other.cols != descriptors.cols || other.type() != descriptors.type())
+    return;
+
+  const float infinity = std::numeric_limits<float>::max();
+  for(unsigned int i = 0; i < predicted.size(); i++)
+  {
+    float r = radii.empty() ? radius : radii[i];
+    const Point2f& p = predicted[i];
+    // also rejects NaNs
+    if(!(r > 0 && std::fabs(p.x) < 1e6 && std::fabs(p.y) < 1e6))
+      continue;
+    // cells the search circle touches, clamped to the grid before the
+    // conversion so far off predictions can't overflow
+    int cx0 = std::max(0.0f, std::floor((p.x - r - x0)/cell_size));
+    int cx1 = std::min(grid_cols - 1.0f, std::floor((p.x + r - x0)/cell_size));
+    int cy0 = std::max(0.0f, std::floor((p.y - r - y0)/cell_size));
+    int cy1 = std::min(grid_rows - 1.0f, std::floor((p.y + r - y0)/cell_size));
+
+    int best = -1, second = -1;
+    float best_dist = infinity, second_dist = infinity;
+    for(int cy = cy0; cy <= cy1; cy++)
+    {
+      for(int cx = cx0; cx <= cx1; cx++)
+      {
+        int c = cy*grid_cols + cx;
+        for(int k = cell_start[c]; k < cell_start[c + 1]; k++)
+        {
+          int f = cell_features[k];
+          float dx = points[f].x - p.x;
+          float dy = points[f].y - p.y;
+          if(dx*dx + dy*dy > r*r)
+            continue;
+          float dist = Distance(f, other, i);
+          if(dist < best_dist)
+          {
+            second = best;
+            second_dist = best_dist;
+            best = f;
+            best_dist = dist;
+          }
+          else if(dist < second_dist)
+          {
+            second = f;
+            second_dist = dist;
+          }
+        }
+      }
+    }
+    if(best < 0)
+      continue;
+
+    std::vector<DMatch> pmatches(2);
+    pmatches[0] = DMatch(best, i, best_dist);
+    pmatches[1] = DMatch(second < 0 ? best : second, i, second_dist);
+    matches.push_back(pmatches);
+  }
+}
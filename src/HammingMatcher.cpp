@@ -0,0 +1,226 @@
+#include "mesh_localize/HammingMatcher.h"
+#include "mesh_localize/Log.h"
+
+#include <limits>
+#include <cstring>
+#include <algorithm>
+#include <stdint.h>
+#include <boost/bind.hpp>
+
+#if defined(__AVX2__)
+  #include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+  #include <arm_neon.h>
+#endif
+
+using namespace cv;
+
+// Query rows below which a task isn't worth handing to another thread
+static const int MIN_TASK_ROWS = 64;
+
+namespace
+{
+
+// Hamming distance of 32 byte rows against a query row loaded once
+#if defined(__AVX2__)
+struct Row32
+{
+  Row32(const uchar* q) :
+    q(_mm256_loadu_si256((const __m256i*)q)),
+    lut(_mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                         0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4)),
+    low(_mm256_set1_epi8(0x0f))
+  {
+  }
+
+  int Distance(const uchar* t) const
+  {
+    __m256i sum = Partial(t);
+    __m128i s = _mm_add_epi64(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+    return _mm_cvtsi128_si32(_mm_add_epi64(s, _mm_unpackhi_epi64(s, s)));
+  }
+
+  // Four rows at once, sharing the horizontal sums
+  void Distance4(const Mat& train, int j, int* dist) const
+  {
+    __m256i s0 = Partial(train.ptr(j)), s1 = Partial(train.ptr(j + 1));
+    __m256i s2 = Partial(train.ptr(j + 2)), s3 = Partial(train.ptr(j + 3));
+    // sums of 8 bytes fit in 32 bits, so two rows share each 64 bit lane
+    __m256i t01 = _mm256_or_si256(s0, _mm256_slli_epi64(s1, 32));
+    __m256i t23 = _mm256_or_si256(s2, _mm256_slli_epi64(s3, 32));
+    __m256i t = _mm256_add_epi32(_mm256_unpacklo_epi64(t01, t23), _mm256_unpackhi_epi64(t01, t23));
+    _mm_storeu_si128((__m128i*)dist, _mm_add_epi32(_mm256_castsi256_si128(t), _mm256_extracti128_si256(t, 1)));
+  }
+
+  // bits per nibble by table lookup, summed over each 8 bytes
+  __m256i Partial(const uchar* t) const
+  {
+    __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)t), q);
+    __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(x, low));
+    __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), low));
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+  }
+
+  __m256i q, lut, low;
+};
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+struct Row32
+{
+  Row32(const uchar* q) :
+    q0(vld1q_u8(q)),
+    q1(vld1q_u8(q + 16))
+  {
+  }
+
+  int Distance(const uchar* t) const
+  {
+    uint8x16_t c = vaddq_u8(vcntq_u8(veorq_u8(vld1q_u8(t), q0)), vcntq_u8(veorq_u8(vld1q_u8(t + 16), q1)));
+    uint64x2_t s = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(c)));
+    return vgetq_lane_u64(s, 0) + vgetq_lane_u64(s, 1);
+  }
+
+  void Distance4(const Mat& train, int j, int* dist) const
+  {
+    for(int k = 0; k < 4; k++)
+      dist[k] = Distance(train.ptr(j + k));
+  }
+
+  uint8x16_t q0, q1;
+};
+#else
+struct Row32
+{
+  Row32(const uchar* q)
+  {
+    memcpy(w, q, sizeof(w));
+  }
+
+  int Distance(const uchar* t) const
+  {
+    uint64_t v[4];
+    memcpy(v, t, sizeof(v));
+    return __builtin_popcountll(v[0] ^ w[0]) + __builtin_popcountll(v[1] ^ w[1]) +
+           __builtin_popcountll(v[2] ^ w[2]) + __builtin_popcountll(v[3] ^ w[3]);
+  }
+
+  void Distance4(const Mat& train, int j, int* dist) const
+  {
+    for(int k = 0; k < 4; k++)
+      dist[k] = Distance(train.ptr(j + k));
+  }
+
+  uint64_t w[4];
+};
+#endif
+
+struct RowAny
+{
+  RowAny(const uchar* q, int cols) :
+    q(q),
+    cols(cols)
+  {
+  }
+
+  int Distance(const uchar* t) const
+  {
+    return normHamming(q, t, cols);
+  }
+
+  void Distance4(const Mat& train, int j, int* dist) const
+  {
+    for(int k = 0; k < 4; k++)
+      dist[k] = Distance(train.ptr(j + k));
+  }
+
+  const uchar* q;
+  int cols;
+};
+
+inline void Update(int dist, int j, int& best_idx, int& best, int& second)
+{
+  if(dist < best)
+  {
+    second = best;
+    best = dist;
+    best_idx = j;
+  }
+  else if(dist < second)
+  {
+    second = dist;
+  }
+}
+
+template<typename Row>
+inline void BestTwo(const Row& row, const Mat& train, int& best_idx, int& best, int& second)
+{
+  best_idx = -1;
+  best = second = std::numeric_limits<int>::max();
+  int j = 0;
+  for(; j + 4 <= train.rows; j += 4)
+  {
+    int dist[4];
+    row.Distance4(train, j, dist);
+    for(int k = 0; k < 4; k++)
+      Update(dist[k], j + k, best_idx, best, second);
+  }
+  for(; j < train.rows; j++)
+    Update(row.Distance(train.ptr(j)), j, best_idx, best, second);
+}
+
+}
+
+HammingMatcher::HammingMatcher(boost::shared_ptr<WorkerPool> shared_workers) :
+  workers(shared_workers ? shared_workers : boost::make_shared<WorkerPool>(boost::thread::hardware_concurrency()))
+{
+}
+
+void HammingMatcher::MatchRows(const Mat& query, const Mat& train, int begin, int end, float ratio,
+  std::vector<DMatch>* matches) const
+{
+  matches->clear();
+  for(int i = begin; i < end; i++)
+  {
+    int best_idx, best, second;
+    if(train.cols == 32)
+      BestTwo(Row32(query.ptr(i)), train, best_idx, best, second);
+    else
+      BestTwo(RowAny(query.ptr(i), train.cols), train, best_idx, best, second);
+    if(best_idx >= 0 && (second == std::numeric_limits<int>::max() || best < ratio*second))
+      matches->push_back(DMatch(i, best_idx, best));
+  }
+}
+
+void HammingMatcher::Match(const Mat& query, const Mat& train, float ratio, std::vector<DMatch>& matches)
+{
+  matches.clear();
+  if(query.empty() || train.empty())
+    return;
+  if(query.type() != CV_8U || train.type() != CV_8U || query.cols != train.cols)
+  {
+    ML_ERROR("HammingMatcher: descriptors are not binary descriptors of the same length");
+    return;
+  }
+
+  int num_tasks = std::max(1, std::min<int>(workers->NumThreads(), query.rows/MIN_TASK_ROWS));
+  if(num_tasks == 1)
+  {
+    MatchRows(query, train, 0, query.rows, ratio, &matches);
+    return;
+  }
+
+  task_matches.resize(num_tasks);
+  std::vector< boost::function<void()> > tasks;
+  for(int t = 0; t < num_tasks; t++)
+  {
+    tasks.push_back(boost::bind(&HammingMatcher::MatchRows, this, boost::cref(query), boost::cref(train),
+      t*query.rows/num_tasks, (t + 1)*query.rows/num_tasks, ratio, &task_matches[t]));
+  }
+  workers->RunAll(tasks);
+
+  size_t total = 0;
+  for(int t = 0; t < num_tasks; t++)
+    total += task_matches[t].size();
+  matches.reserve(total);
+  for(int t = 0; t < num_tasks; t++)
+    matches.insert(matches.end(), task_matches[t].begin(), task_matches[t].end());
+}
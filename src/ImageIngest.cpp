@@ -0,0 +1,283 @@
+#include "mesh_localize/ImageIngest.h"
+
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "mesh_localize/Log.h"
+
+using namespace cv;
+
+// Fixed-point luma weights (sum to 1 << 14)
+static const int GRAY_R = 4899;
+static const int GRAY_G = 9617;
+static const int GRAY_B = 1868;
+static const int GRAY_SHIFT = 14;
+
+template <int CN, int RI, int BI>
+static inline int GrayAt(const uchar* p)
+{
+  return (GRAY_R*p[RI] + GRAY_G*p[1] + GRAY_B*p[BI] + (1 << (GRAY_SHIFT-1))) >> GRAY_SHIFT;
+}
+
+// Gray value at (x, y), 0 outside of the image (same as BORDER_CONSTANT)
+template <int CN, int RI, int BI>
+static inline int GrayAtChecked(const Mat& src, int x, int y)
+{
+  if(x < 0 || y < 0 || x >= src.cols || y >= src.rows)
+    return 0;
+  return GrayAt<CN, RI, BI>(src.ptr<uchar>(y) + CN*x);
+}
+
+ImageIngest::ImageIngest(unsigned int pool_size) :
+  scale(1.0),
+  undistort(false),
+  identity(true),
+  src_width(0),
+  src_height(0),
+  pool_size(pool_size)
+{
+}
+
+void ImageIngest::Configure(const Mat& K, const Mat& distcoeff, double scale, bool undistort)
+{
+  this->K = K.clone();
+  this->distcoeff = distcoeff.clone();
+  this->scale = scale;
+  this->undistort = undistort;
+  identity = (scale == 1.0 && !undistort);
+
+  // force the maps to be rebuilt on the next image
+  src_width = 0;
+  src_height = 0;
+}
+
+void ImageIngest::BuildMaps(int width, int height)
+{
+  src_width = width;
+  src_height = height;
+  dst_size = Size(saturate_cast<int>(width*scale), saturate_cast<int>(height*scale));
+  if(identity)
+    return;
+
+  Mat K_scaled = scale*K;
+  K_scaled.at<double>(2,2) = 1;
+
+  // map from undistorted pixels to distorted pixels of the scaled image
+  Mat map_x, map_y;
+  if(undistort)
+  {
+    initUndistortRectifyMap(K_scaled, distcoeff, Mat::eye(3, 3, CV_64F), K_scaled, dst_size,
+      CV_32FC1, map_x, map_y);
+  }
+  else
+  {
+    map_x.create(dst_size, CV_32FC1);
+    map_y.create(dst_size, CV_32FC1);
+    for(int y = 0; y < dst_size.height; y++)
+    {
+      float* mx = map_x.ptr<float>(y);
+      float* my = map_y.ptr<float>(y);
+      for(int x = 0; x < dst_size.width; x++)
+      {
+        mx[x] = x;
+        my[x] = y;
+      }
+    }
+  }
+
+  // fold the resize into the map so pixels are read straight from the full
+  // resolution image (same pixel center convention as resize)
+  float inv_scale = 1.0/scale;
+  for(int y = 0; y < dst_size.height; y++)
+  {
+    float* mx = map_x.ptr<float>(y);
+    float* my = map_y.ptr<float>(y);
+    for(int x = 0; x < dst_size.width; x++)
+    {
+      mx[x] = (mx[x] + 0.5f)*inv_scale - 0.5f;
+      my[x] = (my[x] + 0.5f)*inv_scale - 0.5f;
+    }
+  }
+  convertMaps(map_x, map_y, map_xy, map_a, CV_16SC2);
+}
+
+Mat ImageIngest::AcquireBuffer()
+{
+  for(unsigned int i = 0; i < pool.size(); i++)
+  {
+    // If the pool holds the only reference nobody downstream is using it
+    if(pool[i].refcount && *pool[i].refcount == 1)
+    {
+      pool[i].create(dst_size, CV_8UC1);
+      return pool[i];
+    }
+  }
+
+  Mat buffer(dst_size, CV_8UC1);
+  if(pool.size() < pool_size)
+  {
+    pool.push_back(buffer);
+  }
+  return buffer;
+}
+
+// Bilinear remap with the gray conversion done on the fly, using the same
+// fixed-point tables as remap (INTER_BITS fractional bits per axis), for a
+// range of output rows
+template <int CN, int RI, int BI>
+class RemapToGrayBody : public ParallelLoopBody
+{
+public:
+  RemapToGrayBody(const Mat& src, Mat& dst, const Mat& map_xy, const Mat& map_a) :
+    src(src), dst(dst), map_xy(map_xy), map_a(map_a)
+  {
+  }
+
+  virtual void operator()(const Range& rows) const
+  {
+    const int tab_mask = INTER_TAB_SIZE - 1;
+    const int w_shift = 2*INTER_BITS;
+
+    for(int y = rows.start; y < rows.end; y++)
+    {
+      const short* xy = map_xy.ptr<short>(y);
+      const ushort* a = map_a.ptr<ushort>(y);
+      uchar* out = dst.ptr<uchar>(y);
+      for(int x = 0; x < dst.cols; x++)
+      {
+        int sx = xy[2*x];
+        int sy = xy[2*x+1];
+        int fx = a[x] & tab_mask;
+        int fy = a[x] >> INTER_BITS;
+
+        int p00, p01, p10, p11;
+        if(sx >= 0 && sy >= 0 && sx < src.cols-1 && sy < src.rows-1)
+        {
+          const uchar* r0 = src.ptr<uchar>(sy) + CN*sx;
+          const uchar* r1 = r0 + src.step;
+          p00 = GrayAt<CN, RI, BI>(r0);
+          p01 = GrayAt<CN, RI, BI>(r0 + CN);
+          p10 = GrayAt<CN, RI, BI>(r1);
+          p11 = GrayAt<CN, RI, BI>(r1 + CN);
+        }
+        else
+        {
+          p00 = GrayAtChecked<CN, RI, BI>(src, sx, sy);
+          p01 = GrayAtChecked<CN, RI, BI>(src, sx+1, sy);
+          p10 = GrayAtChecked<CN, RI, BI>(src, sx, sy+1);
+          p11 = GrayAtChecked<CN, RI, BI>(src, sx+1, sy+1);
+        }
+
+        int v = (INTER_TAB_SIZE-fx)*(INTER_TAB_SIZE-fy)*p00 + fx*(INTER_TAB_SIZE-fy)*p01
+          + (INTER_TAB_SIZE-fx)*fy*p10 + fx*fy*p11;
+        out[x] = (uchar)((v + (1 << (w_shift-1))) >> w_shift);
+      }
+    }
+  }
+
+private:
+  const Mat& src;
+  Mat& dst;
+  const Mat& map_xy;
+  const Mat& map_a;
+};
+
+template <int CN, int RI, int BI>
+void ImageIngest::RemapToGray(const Mat& src, Mat& dst)
+{
+  // rows on OpenCV's threads, like the remap and cvtColor passes this replaces
+  parallel_for_(Range(0, dst.rows), RemapToGrayBody<CN, RI, BI>(src, dst, map_xy, map_a));
+}
+
+void ImageIngest::Prepare(int width, int height, Mat& dst)
+{
+  if(width != src_width || height != src_height)
+  {
+    BuildMaps(width, height);
+  }
+  dst = AcquireBuffer();
+}
+
+void ImageIngest::ProcessGray(const Mat& src, Mat& dst)
+{
+  if(identity)
+    src.copyTo(dst);
+  else
+    remap(src, dst, map_xy, map_a, INTER_LINEAR);
+}
+
+void ImageIngest::ProcessColor(const Mat& src, Mat& dst, bool rgb)
+{
+  if(src.channels() == 3)
+  {
+    if(identity)
+      cvtColor(src, dst, rgb ? CV_RGB2GRAY : CV_BGR2GRAY);
+    else if(rgb)
+      RemapToGray<3, 0, 2>(src, dst);
+    else
+      RemapToGray<3, 2, 0>(src, dst);
+  }
+  else
+  {
+    if(identity)
+      cvtColor(src, dst, rgb ? CV_RGBA2GRAY : CV_BGRA2GRAY);
+    else if(rgb)
+      RemapToGray<4, 0, 2>(src, dst);
+    else
+      RemapToGray<4, 2, 0>(src, dst);
+  }
+}
+
+bool ImageIngest::Process(const Mat& src, Mat& dst)
+{
+  if(src.depth() != CV_8U || (src.channels() != 1 && src.channels() != 3 && src.channels() != 4))
+  {
+    ML_ERROR("ImageIngest: unsupported image type %d", src.type());
+    dst = Mat();
+    return false;
+  }
+  PixelFormat format = src.channels() == 1 ? MONO8 : (src.channels() == 3 ? BGR8 : BGRA8);
+  return Process(src, format, dst);
+}
+
+bool ImageIngest::Process(const Mat& src, PixelFormat format, Mat& dst)
+{
+  int channels = (format == BGR8 || format == RGB8) ? 3 : ((format == BGRA8 || format == RGBA8) ? 4 : 1);
+  if(src.depth() != CV_8U || src.channels() != channels)
+  {
+    ML_ERROR("ImageIngest: image type %d does not fit pixel format %d", src.type(), format);
+    dst = Mat();
+    return false;
+  }
+  Prepare(src.cols, src.rows, dst);
+
+  int bayer_code = -1;
+  if(format == BAYER_RGGB8)
+    bayer_code = CV_BayerBG2GRAY;
+  else if(format == BAYER_BGGR8)
+    bayer_code = CV_BayerRG2GRAY;
+  else if(format == BAYER_GBRG8)
+    bayer_code = CV_BayerGR2GRAY;
+  else if(format == BAYER_GRBG8)
+    bayer_code = CV_BayerGB2GRAY;
+
+  if(bayer_code >= 0)
+  {
+    // Demosaicing needs its neighbourhood, so it stays a separate pass
+    if(identity)
+    {
+      cvtColor(src, dst, bayer_code);
+      return true;
+    }
+    cvtColor(src, convert_buffer, bayer_code);
+    ProcessGray(convert_buffer, dst);
+  }
+  else if(channels == 1)
+  {
+    ProcessGray(src, dst);
+  }
+  else
+  {
+    ProcessColor(src, dst, format == RGB8 || format == RGBA8);
+  }
+  return true;
+}
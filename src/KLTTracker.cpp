@@ -8,6 +8,7 @@ KLTTracker::KLTTracker()
 {
   m_nextID = 0;
   m_maxNumberOfPoints = 200;
+  m_undistorter = NULL;
   m_fastDetector = cv::FastFeatureDetector::create(std::string("FAST"));
 }
 
@@ -20,6 +21,11 @@ std::vector<unsigned char> KLTTracker::filterMatchesEpipolarContraint(
   return status;
 }
 
+void KLTTracker::setUndistorter(const PointUndistorter* undistorter)
+{
+  m_undistorter = undistorter;
+}
+
 void KLTTracker::init(const cv::Mat& inputFrame, const cv::Mat& depth, const Eigen::Matrix3f& inputK, 
   const Eigen::Matrix3f& depthK, const Eigen::Matrix4f& inputTf, const cv::Mat& mask)
 {
@@ -39,8 +45,13 @@ void KLTTracker::init(const cv::Mat& inputFrame, const cv::Mat& depth, const Eig
 
   for (size_t i=0; i<m_nextKeypoints.size(); i++)
   {
-    Eigen::Vector3f hkp(m_nextKeypoints[i].pt.x, m_nextKeypoints[i].pt.y, 1);
+    cv::Point2f kp = m_nextKeypoints[i].pt;
+    if(m_undistorter)
+      kp = m_undistorter->Undistort(kp);
+    Eigen::Vector3f hkp(kp.x, kp.y, 1);
     Eigen::Vector3f depth_kp = depthK*inputK.inverse()*hkp;
+    if(depth_kp(0) < 0 || depth_kp(1) < 0 || depth_kp(0) >= depth.cols || depth_kp(1) >= depth.rows)
+      continue;
 
     double pt_depth = depth.at<float>(int(depth_kp(1)), int(depth_kp(0)));
     if(pt_depth == 0 || pt_depth == -1)
@@ -59,14 +70,12 @@ void KLTTracker::init(const cv::Mat& inputFrame, const cv::Mat& depth, const Eig
   inputFrame.copyTo(m_prevImg);
 }
 
-//! Processes a frame and returns output image
-bool KLTTracker::processFrame(const cv::Mat& inputFrame, cv::Mat& outputFrame, 
-  std::vector<cv::Point2f>& pts2d, std::vector<cv::Point3f>& pts3d, std::vector<int>& ptIDs)
+//! Processes a frame and returns the tracked points
+bool KLTTracker::processFrame(const cv::Mat& inputFrame, std::vector<cv::Point2f>& pts2d, std::vector<cv::Point3f>& pts3d, std::vector<int>& ptIDs)
 {
   pts2d.clear();
   pts3d.clear();
   inputFrame.copyTo(m_nextImg);
-  cv::cvtColor(inputFrame, outputFrame, CV_GRAY2BGR);
 
   if (m_mask.rows != inputFrame.rows || m_mask.cols != inputFrame.cols)
     m_mask.create(inputFrame.rows, inputFrame.cols, CV_8UC1);
@@ -102,11 +111,7 @@ bool KLTTracker::processFrame(const cv::Mat& inputFrame, cv::Mat& outputFrame,
       trackedPts.push_back(lkNextPts[i]);
       trackedPtIDs.push_back(lkTrackedPtIDs[i]);
       cv::circle(m_mask, lkPrevPts[i], 15, cv::Scalar(0), -1);
-      cv::line(outputFrame, lkPrevPts[i], lkNextPts[i], cv::Scalar(0,250,0));
-      cv::circle(outputFrame, lkNextPts[i], 3, cv::Scalar(0,250,0), -1);
-      cv::putText(outputFrame, std::to_string(lkTrackedPtIDs[i]), lkNextPts[i], 
-        cv::FONT_HERSHEY_PLAIN, 2, cv::Scalar::all(255));
-      pts2d.push_back(lkNextPts[i]);
+      pts2d.push_back(m_undistorter ? m_undistorter->Undistort(lkNextPts[i]) : lkNextPts[i]);
       pts3d.push_back(lk3dPts[i]);
       ptIDs.push_back(lkTrackedPtIDs[i]);
     }
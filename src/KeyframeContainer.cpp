@@ -10,6 +10,8 @@
 KeyframeContainer::KeyframeContainer(Mat img, std::string desc_type, bool extract_now)
  : desc_type(desc_type), has_depth(false), delete_cc(true)
 {
+  undistorter = NULL;
+  max_features = 1000;
   mask = Mat(img.rows, img.cols, CV_8U, Scalar(255));
   cc = new CameraContainer(img);
   if(extract_now)
@@ -20,6 +22,8 @@ KeyframeContainer::KeyframeContainer(Mat img, std::vector<KeyPoint>& keypoints,
   keypoints(keypoints),
   descriptors(descriptors)
 {
+  undistorter = NULL;
+  max_features = 1000;
   cc = new CameraContainer(img);
   mask = Mat(img.rows, img.cols, CV_8U, Scalar(255));
   delete_cc = true;
@@ -31,6 +35,8 @@ KeyframeContainer::KeyframeContainer(Mat img, std::vector<KeyPoint>& keypoints,
   descriptors(descriptors),
   depth(depth)
 {
+  undistorter = NULL;
+  max_features = 1000;
   cc = new CameraContainer(img);
   mask = Mat(img.rows, img.cols, CV_8U, Scalar(255));
   delete_cc = true;
@@ -39,6 +45,8 @@ KeyframeContainer::KeyframeContainer(Mat img, std::vector<KeyPoint>& keypoints,
 KeyframeContainer::KeyframeContainer(CameraContainer* cc, std::string desc_type) :
  cc(cc)
 {
+  undistorter = NULL;
+  max_features = 1000;
   delete_cc = false;
   mask = Mat(cc->GetImage().rows, cc->GetImage().cols, CV_8U, Scalar(255));
   ExtractFeatures(desc_type);
@@ -50,6 +58,8 @@ KeyframeContainer::KeyframeContainer(CameraContainer* cc, std::vector<KeyPoint>&
   keypoints(keypoints),
   descriptors(descriptors)
 {
+  undistorter = NULL;
+  max_features = 1000;
   mask = Mat(cc->GetImage().rows, cc->GetImage().cols, CV_8U, Scalar(255));
   delete_cc = false;
   has_depth = false;
@@ -61,6 +71,8 @@ KeyframeContainer::KeyframeContainer(CameraContainer* cc, std::vector<KeyPoint>&
   descriptors(descriptors),
   depth(depth)
 {
+  undistorter = NULL;
+  max_features = 1000;
   mask = Mat(cc->GetImage().rows, cc->GetImage().cols, CV_8U, Scalar(255));
   delete_cc = false;
   has_depth = true;
@@ -75,6 +87,8 @@ KeyframeContainer::KeyframeContainer(const KeyframeContainer& kfc)
   this->has_depth = kfc.has_depth;
   this->depth = kfc.depth;
   this->mask = kfc.mask;
+  this->undistorter = kfc.undistorter;
+  this->max_features = kfc.max_features;
 }
 
 KeyframeContainer::~KeyframeContainer()
@@ -92,11 +106,32 @@ void KeyframeContainer::SetMask(Mat new_mask)
   mask = new_mask;
 }
 
+void KeyframeContainer::SetUndistorter(const PointUndistorter* new_undistorter)
+{
+  undistorter = new_undistorter;
+}
+
+const PointUndistorter* KeyframeContainer::GetUndistorter()
+{
+  return undistorter;
+}
+
+void KeyframeContainer::SetMaxFeatures(int new_max_features)
+{
+  max_features = new_max_features;
+}
+
 void KeyframeContainer::ExtractFeatures()
 {
   ExtractFeatures(desc_type);
 }
 
+void KeyframeContainer::SetFeatures(const std::vector<KeyPoint>& new_keypoints, const Mat& new_descriptors)
+{
+  keypoints = new_keypoints;
+  descriptors = new_descriptors;
+}
+
 void KeyframeContainer::ExtractFeatures(std::string desc_type)
 {
   Mat img = cc->GetImage();
@@ -112,7 +147,7 @@ void KeyframeContainer::ExtractFeatures(std::string desc_type)
   }  
   else if(desc_type == "orb")
   {
-    ORB orb(1000, 1.2f, 4);
+    ORB orb(max_features, 1.2f, 4);
     orb(img, mask, keypoints, descriptors);
   }
   else if(desc_type == "surf")
@@ -134,6 +169,12 @@ void KeyframeContainer::ExtractFeatures(std::string desc_type)
   }
 #endif
 
+  // Features are detected in the raw image, only their locations are undistorted
+  if(undistorter)
+  {
+    undistorter->Undistort(keypoints);
+  }
+
 }
 
 Mat KeyframeContainer::GetImage()
@@ -162,7 +203,7 @@ Mat KeyframeContainer::GetDescriptors()
   return descriptors;
 }
 
-std::vector<KeyPoint> KeyframeContainer::GetKeypoints()
+const std::vector<KeyPoint>& KeyframeContainer::GetKeypoints()
 {
   return keypoints;
 }
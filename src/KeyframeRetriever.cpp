@@ -0,0 +1,137 @@
+#include "mesh_localize/KeyframeRetriever.h"
+#include "mesh_localize/Log.h"
+
+#include <algorithm>
+#include <boost/bind.hpp>
+
+using namespace cv;
+
+KeyframeRetriever::KeyframeRetriever(const std::vector<KeyframeContainer*>& keyframes, std::string index_filename,
+  std::string vocabulary_filename, int shortlist_size, boost::shared_ptr<WorkerPool> shared_workers)
+  : keyframes(keyframes), bow(&vocabulary), use_vocabulary(false), shortlist_size(shortlist_size),
+    workers(shared_workers ? shared_workers : boost::make_shared<WorkerPool>(boost::thread::hardware_concurrency()))
+{
+  if(vocabulary_filename != "" && InitVocabulary(vocabulary_filename))
+  {
+    use_vocabulary = true;
+  }
+  else if(index_filename == "" || !index.Load(index_filename, keyframes))
+  {
+    ML_INFO("Indexing descriptors of %lu keyframes", keyframes.size());
+    index.Build(keyframes);
+    if(index_filename != "")
+      index.Save(index_filename);
+  }
+}
+
+bool KeyframeRetriever::InitVocabulary(const std::string& vocabulary_filename)
+{
+  if(!vocabulary.Load(vocabulary_filename))
+    return false;
+  for(unsigned int i = 0; i < keyframes.size(); i++)
+  {
+    Mat desc = keyframes[i]->GetDescriptors();
+    if(desc.rows > 0 && (desc.type() != vocabulary.DescriptorType() || desc.cols != vocabulary.DescriptorCols()))
+    {
+      ML_WARN("Vocabulary %s is for other descriptors than the keyframes", vocabulary_filename.c_str());
+      return false;
+    }
+    bow.Add(desc);
+  }
+  bow.Finish();
+  ML_INFO("Shortlisting %d of %lu keyframes with a vocabulary of %lu words", shortlist_size, keyframes.size(),
+    vocabulary.NumWords());
+  return true;
+}
+
+void KeyframeRetriever::MatchKeyframe(KeyframeContainer* img, int kf, double ratio, std::vector<DMatch>& good,
+  std::vector<DMatch>& all)
+{
+  Mat kf_desc = keyframes[kf]->GetDescriptors();
+  if(kf_desc.rows < 2 || img->GetDescriptors().rows == 0)
+    return;
+  BFMatcher matcher(kf_desc.type() == CV_8U ? NORM_HAMMING : NORM_L2);
+  std::vector < std::vector< DMatch > > matches;
+  matcher.knnMatch( img->GetDescriptors(), kf_desc, matches, 2 );
+  for(unsigned int j = 0; j < matches.size(); j++)
+  {
+    if(matches[j].size() < 2)
+      continue;
+    matches[j][0].imgIdx = kf;
+    all.push_back(matches[j][0]);
+    if(matches[j][0].distance < ratio*matches[j][1].distance)
+      good.push_back(matches[j][0]);
+  }
+}
+
+std::vector< KeyframeMatch > KeyframeRetriever::FindImageMatches(KeyframeContainer* img, int k, double ratio,
+  Eigen::Matrix4f* pose_guess, unsigned int search_bound)
+{
+  std::vector< KeyframeMatch > kfMatches;
+
+  // Keyframes to choose from, with a pose guess the search_bound nearest
+  std::vector<int> candidates(keyframes.size());
+  for(unsigned int i = 0; i < keyframes.size(); i++)
+    candidates[i] = i;
+  if(pose_guess && search_bound < keyframes.size())
+  {
+    KeyframePositionSorter kps(*pose_guess, keyframes);
+    std::nth_element(candidates.begin(), candidates.begin() + search_bound, candidates.end(), kps);
+    candidates.resize(search_bound);
+  }
+
+  // Shortlist the candidates whose words are most like the query's, or the
+  // k with the most votes in the index
+  std::vector<float> scores;
+  unsigned int shortlist;
+  if(use_vocabulary)
+  {
+    bow.Score(img->GetDescriptors(), scores);
+    shortlist = std::max(shortlist_size, 1);
+  }
+  else
+  {
+    std::vector<int> votes;
+    index.Vote(img->GetDescriptors(), ratio, votes);
+    scores.assign(votes.begin(), votes.end());
+    shortlist = std::max(k, 1);
+  }
+  shortlist = std::min<size_t>(shortlist, candidates.size());
+  std::partial_sort(candidates.begin(), candidates.begin() + shortlist, candidates.end(), KeyframeScoreSorter(scores));
+  candidates.resize(shortlist);
+
+  // Match the shortlist keyframe by keyframe, so every keyframe gets all of
+  // its matches whatever the other keyframes hold
+  std::vector< std::vector< DMatch > > goodMatches(keyframes.size());
+  std::vector< std::vector< DMatch > > allMatches(keyframes.size());
+  std::vector< boost::function<void()> > tasks;
+  for(unsigned int c = 0; c < candidates.size(); c++)
+  {
+    tasks.push_back(boost::bind(&KeyframeRetriever::MatchKeyframe, this, img, candidates[c], ratio,
+      boost::ref(goodMatches[candidates[c]]), boost::ref(allMatches[candidates[c]])));
+  }
+  workers->RunAll(tasks);
+
+  k = (candidates.size() < k) ? candidates.size() : k;
+  std::partial_sort(candidates.begin(), candidates.begin() + k, candidates.end(), KeyframeMatchSorter(goodMatches));
+  const std::vector<KeyPoint>& img_kps = img->GetKeypoints();
+  for(int c = 0; c < k; c++)
+  {
+    int i = candidates[c];
+    const std::vector<KeyPoint>& kf_kps = keyframes[i]->GetKeypoints();
+    std::vector<Point2f> matchPts1;
+    std::vector<Point2f> matchPts2;
+    std::vector<KeyPoint> matchKps1;
+    std::vector<KeyPoint> matchKps2;
+    for(unsigned int j = 0; j < goodMatches[i].size(); j++)
+    {
+      matchPts1.push_back(img_kps[goodMatches[i][j].queryIdx].pt);
+      matchPts2.push_back(kf_kps[goodMatches[i][j].trainIdx].pt);
+      matchKps1.push_back(img_kps[goodMatches[i][j].queryIdx]);
+      matchKps2.push_back(kf_kps[goodMatches[i][j].trainIdx]);
+    }
+    kfMatches.push_back(KeyframeMatch(keyframes[i], goodMatches[i], allMatches[i], matchPts1, matchPts2, matchKps1, matchKps2));
+  }
+
+  return kfMatches;
+}
@@ -0,0 +1,336 @@
+#include "mesh_localize/LandmarkDatabase.h"
+#include "mesh_localize/Log.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+
+using namespace cv;
+
+static const char LANDMARK_MAGIC[8] = {'M', 'L', 'L', 'M', 'A', 'R', 'K', '\0'};
+static const uint32_t LANDMARK_VERSION = 1;
+// Observations the medoid descriptor of a landmark is chosen from
+static const size_t MAX_MEDOID_OBSERVATIONS = 32;
+
+LandmarkDatabaseBuilder::LandmarkDatabaseBuilder(float merge_radius, double max_desc_dist) :
+  merge_radius(merge_radius),
+  max_desc_dist(max_desc_dist),
+  norm_type(NORM_L2)
+{
+}
+
+uint64_t LandmarkDatabaseBuilder::VoxelKey(const Eigen::Vector3f& p, int dx, int dy, int dz) const
+{
+  // 21 bits per axis
+  const int offset = 1 << 20;
+  int x = std::floor(p(0)/merge_radius) + dx;
+  int y = std::floor(p(1)/merge_radius) + dy;
+  int z = std::floor(p(2)/merge_radius) + dz;
+  return ((uint64_t)((x + offset) & 0x1fffff) << 42) |
+         ((uint64_t)((y + offset) & 0x1fffff) << 21) |
+          (uint64_t)((z + offset) & 0x1fffff);
+}
+
+double LandmarkDatabaseBuilder::Distance(int row_a, int row_b) const
+{
+  return norm(all_descriptors.row(row_a), all_descriptors.row(row_b), norm_type);
+}
+
+bool LandmarkDatabaseBuilder::Add(const Eigen::Matrix4f& pose, const Mat& descriptors,
+  const std::vector<Point3f>& points)
+{
+  if(descriptors.rows != (int)points.size())
+  {
+    ML_ERROR("LandmarkDatabaseBuilder: %lu points for %d descriptors", points.size(), descriptors.rows);
+    return false;
+  }
+  if(points.empty())
+    return true;
+  if(all_descriptors.empty())
+  {
+    norm_type = descriptors.type() == CV_8U ? NORM_HAMMING : NORM_L2;
+  }
+  else if(descriptors.type() != all_descriptors.type() || descriptors.cols != all_descriptors.cols)
+  {
+    ML_ERROR("LandmarkDatabaseBuilder: descriptor layout changed");
+    return false;
+  }
+
+  Eigen::Vector3f camera = pose.block<3,1>(0,3);
+  for(unsigned int i = 0; i < points.size(); i++)
+  {
+    Eigen::Vector3f p(points[i].x, points[i].y, points[i].z);
+    if(!std::isfinite(p.sum()))
+      continue;
+    int row = all_descriptors.rows;
+    all_descriptors.push_back(descriptors.row(i));
+
+    // the landmark nearby with the most similar descriptor
+    int best = -1;
+    double best_dist = max_desc_dist;
+    for(int dx = -1; dx <= 1; dx++)
+    {
+      for(int dy = -1; dy <= 1; dy++)
+      {
+        for(int dz = -1; dz <= 1; dz++)
+        {
+          std::map<uint64_t, std::vector<int> >::const_iterator cell = grid.find(VoxelKey(p, dx, dy, dz));
+          if(cell == grid.end())
+            continue;
+          for(unsigned int c = 0; c < cell->second.size(); c++)
+          {
+            const Track& track = tracks[cell->second[c]];
+            if((track.point_sum/track.rows.size() - p).norm() > merge_radius)
+              continue;
+            double dist = Distance(track.representative, row);
+            if(dist <= best_dist)
+            {
+              best = cell->second[c];
+              best_dist = dist;
+            }
+          }
+        }
+      }
+    }
+
+    if(best < 0)
+    {
+      best = tracks.size();
+      tracks.push_back(Track());
+      tracks.back().point_sum = Eigen::Vector3f::Zero();
+      tracks.back().representative = row;
+      grid[VoxelKey(p, 0, 0, 0)].push_back(best);
+    }
+    Track& track = tracks[best];
+    track.point_sum += p;
+    track.rows.push_back(row);
+    track.cameras.push_back(camera);
+  }
+  return true;
+}
+
+int LandmarkDatabaseBuilder::MedoidRow(const Track& track) const
+{
+  size_t n = std::min(track.rows.size(), MAX_MEDOID_OBSERVATIONS);
+  int best = track.rows[0];
+  double best_sum = std::numeric_limits<double>::max();
+  for(size_t i = 0; i < n; i++)
+  {
+    double sum = 0;
+    for(size_t j = 0; j < n; j++)
+    {
+      sum += Distance(track.rows[i], track.rows[j]);
+    }
+    if(sum < best_sum)
+    {
+      best = track.rows[i];
+      best_sum = sum;
+    }
+  }
+  return best;
+}
+
+size_t LandmarkDatabaseBuilder::NumLandmarks() const
+{
+  return tracks.size();
+}
+
+bool LandmarkDatabaseBuilder::Write(const std::string& filename, const std::string& desc_type,
+  unsigned int min_observations, float view_margin, float distance_margin, size_t* num_written)
+{
+  LandmarkFileHeader header;
+  memset(&header, 0, sizeof(header));
+  if(desc_type.size() >= sizeof(header.desc_type))
+  {
+    ML_ERROR("LandmarkDatabaseBuilder: descriptor type name %s is too long", desc_type.c_str());
+    return false;
+  }
+
+  std::vector<LandmarkRecord> records;
+  Mat descriptors;
+  for(unsigned int t = 0; t < tracks.size(); t++)
+  {
+    const Track& track = tracks[t];
+    if(track.rows.size() < min_observations)
+      continue;
+
+    LandmarkRecord record;
+    memset(&record, 0, sizeof(record));
+    Eigen::Vector3f point = track.point_sum/track.rows.size();
+    Eigen::Vector3f axis = Eigen::Vector3f::Zero();
+    float min_distance = std::numeric_limits<float>::max();
+    float max_distance = 0;
+    for(unsigned int i = 0; i < track.cameras.size(); i++)
+    {
+      Eigen::Vector3f dir = track.cameras[i] - point;
+      float dist = dir.norm();
+      min_distance = std::min(min_distance, dist);
+      max_distance = std::max(max_distance, dist);
+      if(dist > 0)
+        axis += dir/dist;
+    }
+    // views from all around say nothing about the direction
+    float max_angle = M_PI;
+    if(axis.norm() > 1e-6)
+    {
+      axis.normalize();
+      max_angle = 0;
+      for(unsigned int i = 0; i < track.cameras.size(); i++)
+      {
+        Eigen::Vector3f dir = (track.cameras[i] - point).normalized();
+        max_angle = std::max(max_angle, (float)std::acos(std::max(-1.0f, std::min(1.0f, dir.dot(axis)))));
+      }
+    }
+    for(int k = 0; k < 3; k++)
+    {
+      record.point[k] = point(k);
+      record.view_axis[k] = axis(k);
+    }
+    record.cos_view_angle = std::cos(std::min((float)M_PI, max_angle + view_margin));
+    record.min_distance = min_distance/distance_margin;
+    record.max_distance = max_distance*distance_margin;
+    record.num_observations = track.rows.size();
+    records.push_back(record);
+    descriptors.push_back(all_descriptors.row(MedoidRow(track)));
+  }
+
+  memcpy(header.magic, LANDMARK_MAGIC, sizeof(header.magic));
+  header.version = LANDMARK_VERSION;
+  header.num_landmarks = records.size();
+  header.desc_mat_type = all_descriptors.type();
+  header.desc_cols = all_descriptors.cols;
+  strncpy(header.desc_type, desc_type.c_str(), sizeof(header.desc_type) - 1);
+
+  FILE* file = fopen(filename.c_str(), "wb");
+  if(!file)
+  {
+    ML_ERROR("LandmarkDatabaseBuilder: could not open %s", filename.c_str());
+    return false;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+    (records.empty() || fwrite(&records[0], sizeof(LandmarkRecord), records.size(), file) == records.size()) &&
+    (descriptors.empty() || fwrite(descriptors.data, descriptors.elemSize(), descriptors.total(), file) ==
+      descriptors.total());
+  ok = fclose(file) == 0 && ok;
+  if(!ok)
+  {
+    ML_ERROR("LandmarkDatabaseBuilder: write failed");
+    return false;
+  }
+  if(num_written)
+    *num_written = records.size();
+  return true;
+}
+
+LandmarkDatabase::LandmarkDatabase()
+{
+}
+
+bool LandmarkDatabase::Load(const std::string& filename)
+{
+  FILE* file = fopen(filename.c_str(), "rb");
+  if(!file)
+  {
+    ML_ERROR("LandmarkDatabase: could not open %s", filename.c_str());
+    return false;
+  }
+
+  LandmarkFileHeader header;
+  if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, LANDMARK_MAGIC, sizeof(LANDMARK_MAGIC)) != 0 ||
+    header.version != LANDMARK_VERSION)
+  {
+    ML_ERROR("LandmarkDatabase: %s is not a landmark database", filename.c_str());
+    fclose(file);
+    return false;
+  }
+
+  std::vector<LandmarkRecord> records(header.num_landmarks);
+  Mat desc;
+  bool ok = records.empty() || fread(&records[0], sizeof(LandmarkRecord), records.size(), file) == records.size();
+  if(ok && !records.empty())
+  {
+    desc.create(records.size(), header.desc_cols, header.desc_mat_type);
+    ok = fread(desc.data, desc.elemSize(), desc.total(), file) == desc.total();
+  }
+  fclose(file);
+  if(!ok)
+  {
+    ML_ERROR("LandmarkDatabase: %s is truncated", filename.c_str());
+    return false;
+  }
+
+  size_t n = records.size();
+  x.resize(n);
+  y.resize(n);
+  z.resize(n);
+  ax.resize(n);
+  ay.resize(n);
+  az.resize(n);
+  cos_view_angle.resize(n);
+  min_distance.resize(n);
+  max_distance.resize(n);
+  for(size_t i = 0; i < n; i++)
+  {
+    x[i] = records[i].point[0];
+    y[i] = records[i].point[1];
+    z[i] = records[i].point[2];
+    ax[i] = records[i].view_axis[0];
+    ay[i] = records[i].view_axis[1];
+    az[i] = records[i].view_axis[2];
+    cos_view_angle[i] = records[i].cos_view_angle;
+    min_distance[i] = records[i].min_distance;
+    max_distance[i] = records[i].max_distance;
+  }
+  descriptors = desc;
+  header.desc_type[sizeof(header.desc_type) - 1] = '\0';
+  desc_type = header.desc_type;
+  return true;
+}
+
+size_t LandmarkDatabase::NumLandmarks() const
+{
+  return x.size();
+}
+
+const std::string& LandmarkDatabase::GetDescriptorType() const
+{
+  return desc_type;
+}
+
+const Mat& LandmarkDatabase::GetDescriptors() const
+{
+  return descriptors;
+}
+
+Point3f LandmarkDatabase::GetPoint(int landmark) const
+{
+  return Point3f(x[landmark], y[landmark], z[landmark]);
+}
+
+void LandmarkDatabase::SelectVisible(const Eigen::Matrix4f& pose, const Eigen::Matrix3f& K, int rows, int cols,
+  std::vector<int>& landmarks, std::vector<Point2f>& projections) const
+{
+  Eigen::Matrix4f pose_inv = pose.inverse();
+  Eigen::Matrix<float, 3, 4> P = K*pose_inv.block<3,4>(0,0);
+  const float cx = pose(0,3), cy = pose(1,3), cz = pose(2,3);
+
+  landmarks.clear();
+  projections.clear();
+  for(size_t i = 0; i < x.size(); i++)
+  {
+    float w = P(2,0)*x[i] + P(2,1)*y[i] + P(2,2)*z[i] + P(2,3);
+    float u = (P(0,0)*x[i] + P(0,1)*y[i] + P(0,2)*z[i] + P(0,3))/w;
+    float v = (P(1,0)*x[i] + P(1,1)*y[i] + P(1,2)*z[i] + P(1,3))/w;
+    float dx = cx - x[i], dy = cy - y[i], dz = cz - z[i];
+    float dist = std::sqrt(dx*dx + dy*dy + dz*dz);
+    float cos_angle = (dx*ax[i] + dy*ay[i] + dz*az[i])/dist;
+    // also rejects NaNs
+    if(!(w > 0 && u >= 0 && u < cols && v >= 0 && v < rows && dist >= min_distance[i] &&
+      dist <= max_distance[i] && cos_angle >= cos_view_angle[i]))
+      continue;
+    landmarks.push_back(i);
+    projections.push_back(Point2f(u, v));
+  }
+}
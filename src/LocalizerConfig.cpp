@@ -0,0 +1,113 @@
+#include "mesh_localize/LocalizerConfig.h"
+#include "mesh_localize/Log.h"
+
+#include <opencv2/core/core.hpp>
+
+namespace
+{
+  // Reads config values from a FileStorage, leaving missing keys untouched
+  struct FileStorageReader
+  {
+    FileStorageReader(const cv::FileStorage& fs) : fs(fs) {}
+
+    template <typename T>
+    void operator()(const char* name, T& value)
+    {
+      cv::FileNode node = fs[name];
+      if(!node.empty())
+        node >> value;
+    }
+
+    void operator()(const char* name, bool& value)
+    {
+      cv::FileNode node = fs[name];
+      if(!node.empty())
+      {
+        int i;
+        node >> i;
+        value = (i != 0);
+      }
+    }
+
+    const cv::FileStorage& fs;
+  };
+}
+
+LocalizerConfig::LocalizerConfig() :
+  pc_filename("bin/map_points.pcd"),
+  mesh_filename("bin/map.stl"),
+  photoscan_filename("/home/matt/Documents/campus_doc.xml"),
+  load_descriptors(false),
+  descriptor_filename(""),
+  descriptor_index_filename(""),
+  vocabulary_filename(""),
+  vocabulary_shortlist(20),
+  show_pnp_matches(false),
+  show_debug(false),
+  show_global_matches(false),
+  ogre_data_dir(""),
+  ogre_cfg_dir(""),
+  ogre_model(""),
+  virtual_image_source("point_cloud"),
+  pnp_descriptor_type("orb"),
+  img_match_descriptor_type("asurf"),
+  global_localization_alg("feature_match"),
+  image_scale(1.0),
+  min_pnp_inliers(10),
+  max_pnp_reproj_error(3),
+  ratio_test_thresh(0.7),
+  canny_sigma(0.33),
+  canny_high_thresh(200),
+  canny_low_thresh(80),
+  edge_tracking_dmax(15),
+  autotune_canny(false),
+  tracking_mode("PNP"),
+  edge_tracking_iterations(1),
+  pnp_match_radius(-1),
+  motion_model("CONSTANT"),
+  do_undistort(true),
+  undistort_mode("image"),
+  pixel_noise(3),
+  virtual_fx(400),
+  virtual_fy(400),
+  use_depth_shader(true),
+  pipeline_queue_size(1),
+  enable_profiling(true),
+  profile_trace_file(""),
+  diagnostics_period(1.0),
+  speculative_render(false),
+  speculative_trans_tol(0.02),
+  speculative_rot_tol(0.02),
+  frame_budget(0),
+  orb_features(1000),
+  degraded_orb_features(300),
+  tracking_threads(0),
+  worker_threads(0),
+  pc_chunk_size(1.0),
+  pc_backface_culling(true),
+  pc_lod_pixel_spacing(1.0),
+  mesh_backface_culling(false),
+  render_cache_size(0),
+  render_cache_trans_tol(0.005),
+  render_cache_rot_tol(0.005),
+  render_cache_warp_trans_tol(0.02),
+  render_cache_warp_rot_tol(0.02),
+  atlas_filename(""),
+  atlas_rot_weight(1.0),
+  render_crop_margin(-1),
+  landmark_filename("")
+{
+}
+
+bool LocalizerConfig::Load(const std::string& filename)
+{
+  cv::FileStorage fs(filename, cv::FileStorage::READ);
+  if(!fs.isOpened())
+  {
+    ML_ERROR("LocalizerConfig: could not open %s", filename.c_str());
+    return false;
+  }
+  FileStorageReader reader(fs);
+  Visit(reader);
+  return true;
+}
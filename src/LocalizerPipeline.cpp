@@ -0,0 +1,1634 @@
+#include "mesh_localize/LocalizerPipeline.h"
+#include <algorithm>
+#include <sstream>
+#include <cstdlib>     
+#include <time.h> 
+#include <fstream>
+#include <Eigen/Dense>
+#include <Eigen/Geometry>
+#include <unsupported/Eigen/MatrixFunctions>
+#include <boost/bind.hpp>
+
+#ifdef MESH_LOCALIZER_ENABLE_GPU
+  #include <opencv2/gpu/gpu.hpp>
+  #include <opencv2/nonfree/gpu.hpp>
+#endif
+#include <opencv2/imgproc/imgproc.hpp>
+
+#include "mesh_localize/OgreImageGenerator.h"
+#include "mesh_localize/FindCameraMatrices.h"
+#include "mesh_localize/Triangulation.h"
+#include "mesh_localize/ASiftDetector.h"
+#include "mesh_localize/ImageDbUtil.h"
+#include "mesh_localize/PnPUtil.h"
+#include "mesh_localize/EdgeTrackingUtil.h"
+#include "mesh_localize/PointCloudImageGenerator.h"
+#include "mesh_localize/MeshImageGenerator.h"
+#include "mesh_localize/AtlasImageGenerator.h"
+#include "mesh_localize/LandmarkDatabase.h"
+#include "mesh_localize/GuidedMatcher.h"
+#include "mesh_localize/HammingMatcher.h"
+#include "mesh_localize/FeatureMatchLocalizer.h"
+#include "mesh_localize/FABMAPLocalizer.h"
+#include "mesh_localize/DepthFeatureMatchLocalizer.h"
+#include "mesh_localize/RenderStage.h"
+#include "mesh_localize/RenderCache.h"
+#include "mesh_localize/RenderService.h"
+#include "mesh_localize/ImageIngest.h"
+#include "mesh_localize/QueryFeatureCache.h"
+#include "mesh_localize/Profiler.h"
+#include "mesh_localize/Log.h"
+
+#include <pcl/sample_consensus/ransac.h>
+#include <pcl/sample_consensus/sac_model_plane.h>
+#include <pcl/filters/extract_indices.h>
+#include <pcl/io/pcd_io.h>
+#include <pcl/io/vtk_lib_io.h>
+
+//#include <gcop/so3.h>
+
+// Largest guided matching radius as a multiple of pnp_match_radius
+static const float MAX_MATCH_RADIUS_SCALE = 4;
+
+PoseResult::PoseResult() :
+  localized(false),
+  dropped(false),
+  pose(Eigen::Matrix4f::Identity()),
+  stamp(0),
+  state(""),
+  virtual_pose(Eigen::Matrix4f::Identity()),
+  virtual_K(Eigen::Matrix3f::Identity())
+{
+}
+
+LocalizerPipeline::LocalizerPipeline(const LocalizerConfig& config, const Mat& camK, const Mat& camD,
+  int width, int height, RenderService* render_service, boost::shared_ptr<WorkerPool> shared_workers):
+    localize_state(INIT),
+    config(config),
+    initialized(false),
+    numPnpRetrys(0),
+    numLocalizeRetrys(0),
+    localization_init(NULL),
+    render_stage(NULL),
+    render_cache(NULL),
+    atlas(NULL),
+    landmarks(NULL),
+    render_service(NULL),
+    pending_render(0),
+    pnp_cov_valid(false),
+    point_undistorter(NULL),
+    image_ingest(new ImageIngest),
+    query_features(NULL),
+    workers(shared_workers ? shared_workers : boost::make_shared<WorkerPool>(config.worker_threads > 0 ?
+      config.worker_threads : boost::thread::hardware_concurrency())),
+    hamming_matcher(new HammingMatcher(workers)),
+    last_stamp(-1),
+    frame_interval(0),
+    scheduler(config.frame_budget),
+    level(FrameScheduler::FULL)
+{
+  std::srand(time(NULL));
+
+  if(!Init())
+    return;
+
+  InitCamera(camK, camD, width, height);
+
+  if(render_service)
+  {
+    ML_INFO("Using a render service for virtual image generation");
+    this->render_service = render_service;
+  }
+  else if(config.virtual_image_source == "gazebo")
+  {
+    ML_ERROR("Gazebo virtual images need a render service");
+    return;
+  }
+  else if(config.virtual_image_source == "atlas")
+  {
+    // views are served straight from the mapped file, no render thread needed
+    atlas = new AtlasImageGenerator(config.atlas_filename, config.atlas_rot_weight);
+    if(!atlas->IsOpen())
+    {
+      ML_ERROR("Could not load view atlas %s", config.atlas_filename.c_str());
+      return;
+    }
+  }
+  else if(!InitRenderStage())
+  {
+    return;
+  }
+
+  if(!config.landmark_filename.empty())
+  {
+    landmarks = new LandmarkDatabase;
+    if(!landmarks->Load(config.landmark_filename))
+    {
+      ML_ERROR("Could not load landmark database %s", config.landmark_filename.c_str());
+      return;
+    }
+    ML_INFO("Loaded %lu %s landmarks", landmarks->NumLandmarks(), landmarks->GetDescriptorType().c_str());
+    if(landmarks->GetDescriptorType() != config.pnp_descriptor_type)
+      ML_WARN("Landmarks have %s descriptors, PnP tracking with %s descriptors still renders",
+        landmarks->GetDescriptorType().c_str(), config.pnp_descriptor_type.c_str());
+  }
+
+  ResetMotionModel();
+  localize_state = INIT;
+  initialized = true;
+  ML_INFO("Initialized");
+}
+
+LocalizerPipeline::~LocalizerPipeline()
+{
+  if(render_service && pending_render)
+    render_service->Cancel(pending_render);
+  if(render_stage)
+    delete render_stage;
+  if(render_cache)
+    delete render_cache;
+  if(atlas)
+    delete atlas;
+  if(landmarks)
+    delete landmarks;
+
+  if(!config.profile_trace_file.empty())
+  {
+    if(Profiler::Instance().WriteChromeTrace(config.profile_trace_file))
+      ML_INFO("Wrote profiling trace to %s", config.profile_trace_file.c_str());
+    else
+      ML_ERROR("Could not write profiling trace to %s", config.profile_trace_file.c_str());
+  }
+  if(point_undistorter)
+    delete point_undistorter;
+  delete image_ingest;
+  delete hamming_matcher;
+  //if(imu_mm)
+  //  delete imu_mm;
+}
+
+bool LocalizerPipeline::IsInitialized() const
+{
+  return initialized;
+}
+
+PoseResult LocalizerPipeline::ProcessFrame(const Mat& image, double stamp)
+{
+  int64_t start = Profiler::Now();
+  Mat frame;
+  if(!Preprocess(image, frame))
+  {
+    PoseResult failed;
+    failed.stamp = stamp;
+    failed.state = StateName(localize_state);
+    return failed;
+  }
+  return ProcessPreprocessedFrame(frame, stamp, 1e-9*(Profiler::Now() - start));
+}
+
+bool LocalizerPipeline::Preprocess(const Mat& image, Mat& frame)
+{
+  PROFILE_SCOPE("ingest");
+  // gray conversion, scaling and undistortion in a single pass
+  return image_ingest->Process(image, frame);
+}
+
+void LocalizerPipeline::SetQueryFeatures(QueryFeatureCache* cache)
+{
+  query_features = cache;
+}
+
+void LocalizerPipeline::ConfigureIngest(ImageIngest& ingest) const
+{
+  if(point_undistorter)
+    ingest.Configure(Kcv_undistort, distcoeffcv, config.image_scale, false);
+  else
+    ingest.Configure(Kcv_undistort, distcoeffcv, config.image_scale, config.do_undistort);
+}
+
+void LocalizerPipeline::UndistortFrame(const Mat& frame, Mat& dst) const
+{
+  if(point_undistorter)
+    point_undistorter->UndistortImage(frame, dst);
+  else
+    dst = frame;
+}
+
+LocalizerPipeline::State LocalizerPipeline::GetState() const
+{
+  return localize_state;
+}
+
+const char* LocalizerPipeline::GetStateName() const
+{
+  return StateName(localize_state);
+}
+
+const LocalizerConfig& LocalizerPipeline::GetConfig() const
+{
+  return config;
+}
+
+const Eigen::Matrix3f& LocalizerPipeline::GetK() const
+{
+  return K_scaled;
+}
+
+void LocalizerPipeline::SetPose(const Eigen::Matrix4f& tf)
+{
+  currentPose = tf;
+  if(render_service)
+  {
+    // start rendering the view the next frame will most likely ask for
+    if(pending_render)
+      render_service->Cancel(pending_render);
+    pending_render = render_service->Request(currentPose);
+    pending_render_pose = currentPose;
+  }
+  result.localized = true;
+  result.pose = currentPose;
+}
+
+bool LocalizerPipeline::Init()
+{
+  Profiler::Instance().SetEnabled(config.enable_profiling);
+
+  //TODO: read from param file.  Hard-coded, based on DSLR
+  map_K << 1799.352269, 0, 1799.029749, 0, 1261.4382272, 957.3402899, 0, 0, 1;
+  map_distcoeff = Eigen::VectorXf(5);
+  map_distcoeff << 0, 0, 0, 0, 0;
+  //map_distcoeff << -.0066106, .04618129, -.00042169, -.004390247, -.048470351;
+  map_Kcv = (Mat_<double>(3,3) << map_K(0,0), map_K(0,1), map_K(0,2),
+              map_K(1,0), map_K(1,1), map_K(1,2),
+              map_K(2,0), map_K(2,1), map_K(2,2)); 
+  map_distcoeffcv = (Mat_<double>(5,1) << map_distcoeff(0), map_distcoeff(1), map_distcoeff(2), map_distcoeff(3), map_distcoeff(4)); 
+
+  if(config.image_scale != 1.0)
+  {
+    ML_INFO("Scaling images by %f", config.image_scale);
+  }
+
+  ML_INFO("Using %s for pnp descriptors and %s for image matching descriptors", config.pnp_descriptor_type.c_str(), config.img_match_descriptor_type.c_str());
+
+  if(config.global_localization_alg == "feature_match")
+  {
+    vector<CameraContainer*> image_db;
+    if(!ImageDbUtil::LoadPhotoscanFile(config.photoscan_filename, image_db, map_Kcv, map_distcoeffcv))
+    {
+      return false;
+    }
+    ML_INFO("Using Photoscan object feature matching for initialization");
+    localization_init = new FeatureMatchLocalizer(image_db, config.img_match_descriptor_type, config.show_global_matches, config.load_descriptors, config.descriptor_filename, config.descriptor_index_filename,
+      config.vocabulary_filename, config.vocabulary_shortlist, workers);
+  }
+  else if(config.global_localization_alg == "depth_feature_match")
+  {
+    vector<KeyframeContainer*> image_db;
+    if(!ImageDbUtil::LoadOgreDataDir(config.ogre_data_dir, image_db))
+    {
+      ML_ERROR("Could not load OGRE object pose database"); 
+      return false;
+    }
+    ML_INFO("Using Ogre object feature matching for initialization");
+    if(config.img_match_descriptor_type != "surf")
+    {
+      ML_ERROR("img_match_descriptor_type must be 'surf' when using OGRE ImageDb");
+      return false;
+    }
+    localization_init = new DepthFeatureMatchLocalizer(image_db, config.img_match_descriptor_type,
+      config.show_global_matches, config.min_pnp_inliers, config.max_pnp_reproj_error, 0.8,
+      config.descriptor_index_filename, config.vocabulary_filename, config.vocabulary_shortlist, workers);
+  }
+  else if(config.global_localization_alg == "fabmap")
+  {
+    vector<CameraContainer*> image_db;
+    if(!ImageDbUtil::LoadPhotoscanFile(config.photoscan_filename, image_db, map_Kcv, map_distcoeffcv))
+    {
+      return false;
+    }
+    ML_INFO("Using OpenFABMAP for initialization");
+    if(config.img_match_descriptor_type != "surf")
+    {
+      ML_ERROR("img_match_descriptor_type must be 'surf' when using OpenFABMAP");
+      return false;
+    }
+    localization_init = new FABMAPLocalizer(image_db, config.img_match_descriptor_type, config.show_global_matches, config.load_descriptors, config.descriptor_filename);
+  }
+  else
+  {
+    ML_ERROR("%s is not a valid initialization option", config.global_localization_alg.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+void LocalizerPipeline::InitCamera(const Mat& camK, const Mat& camD, int width, int height)
+{
+  camK.convertTo(Kcv_undistort, CV_64F);
+  K << Kcv_undistort.at<double>(0,0), Kcv_undistort.at<double>(0,1), Kcv_undistort.at<double>(0,2),
+       Kcv_undistort.at<double>(1,0), Kcv_undistort.at<double>(1,1), Kcv_undistort.at<double>(1,2),
+       Kcv_undistort.at<double>(2,0), Kcv_undistort.at<double>(2,1), Kcv_undistort.at<double>(2,2);
+  K_scaled = config.image_scale * K;
+  K_scaled(2,2) = 1;
+  camera_height = height;
+  camera_width = width;
+  Mat D;
+  camD.convertTo(D, CV_64F);
+  distcoeff = Eigen::VectorXf::Zero(5);
+  for(unsigned int i = 0; i < D.total() && i < 5; i++)
+  {
+    distcoeff(i) = D.at<double>(i);
+  }
+  distcoeffcv = (Mat_<double>(5,1) << distcoeff(0), distcoeff(1), distcoeff(2), distcoeff(3), distcoeff(4)); 
+  Kcv = config.image_scale*Kcv_undistort;
+  Kcv.at<double>(2,2) = 1;
+  if(config.do_undistort && config.undistort_mode == "points")
+  {
+    // Frames are kept distorted, only detected/tracked points get undistorted
+    ML_INFO("Undistorting points instead of full images");
+    point_undistorter = new PointUndistorter(Kcv, distcoeffcv, 
+      Size(saturate_cast<int>(camera_width*config.image_scale), saturate_cast<int>(camera_height*config.image_scale)));
+    klt_tracker.setUndistorter(point_undistorter);
+  }
+  ConfigureIngest(*image_ingest);
+}
+
+bool LocalizerPipeline::InitRenderStage()
+{
+  if(config.virtual_image_source != "point_cloud" && config.virtual_image_source != "ogre" &&
+    config.virtual_image_source != "mesh")
+  {
+    ML_ERROR("%s is not a valid virtual image source", config.virtual_image_source.c_str());
+    return false;
+  }
+
+  // The generator is created on the render stage's own thread
+  render_stage = new RenderStage(boost::bind(&LocalizerPipeline::CreateVirtualImageGenerator,
+    boost::cref(config), K, camera_height, camera_width, workers));
+  if(!render_stage->Start())
+  {
+    ML_ERROR("Could not create virtual image generator");
+    return false;
+  }
+  render_stage->SetSpeculativeTolerance(config.speculative_trans_tol, config.speculative_rot_tol);
+  render_stage->SetCropMargin(config.render_crop_margin);
+  if(config.render_cache_size > 0)
+  {
+    render_cache = new RenderCache(config.render_cache_size,
+      config.render_cache_trans_tol, config.render_cache_rot_tol, config.render_cache_warp_trans_tol,
+      config.render_cache_warp_rot_tol);
+  }
+  return true;
+}
+
+VirtualImageGenerator* LocalizerPipeline::CreateVirtualImageGenerator(const LocalizerConfig& config,
+  const Eigen::Matrix3f& K, int rows, int cols, boost::shared_ptr<WorkerPool> workers)
+{
+  if(config.virtual_image_source == "point_cloud")
+  {
+    ML_INFO("Using PCL point cloud for virtual image generation");
+    pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr map_cloud = 
+      pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr(new pcl::PointCloud<pcl::PointXYZRGBNormal>);
+    ML_INFO("Loading point cloud %s", config.pc_filename.c_str());
+    if(pcl::io::loadPCDFile<pcl::PointXYZRGBNormal> (config.pc_filename, *map_cloud) == -1)
+    {
+      ML_ERROR("Could not open point cloud %s", config.pc_filename.c_str());
+      return NULL;
+    }
+    ML_INFO("Successfully loaded point cloud");
+    return new PointCloudImageGenerator(map_cloud, K, rows, cols, 
+      workers, config.pc_chunk_size, config.pc_backface_culling,
+      config.pc_lod_pixel_spacing); 
+  }
+  else if(config.virtual_image_source == "mesh")
+  {
+    ML_INFO("Using CPU mesh rasterizer for virtual image generation");
+    pcl::PolygonMesh mesh;
+    ML_INFO("Loading mesh %s", config.mesh_filename.c_str());
+    if(pcl::io::loadPolygonFile(config.mesh_filename, mesh) == 0 || mesh.polygons.empty())
+    {
+      ML_ERROR("Could not open mesh %s", config.mesh_filename.c_str());
+      return NULL;
+    }
+    return new MeshImageGenerator(mesh, K, rows, cols, workers,
+      config.mesh_backface_culling);
+  }
+  else if(config.virtual_image_source == "ogre")
+  {
+    ML_INFO("Using Ogre for virtual image generation");
+    return new OgreImageGenerator(config.ogre_cfg_dir, config.ogre_model, config.virtual_fx, config.virtual_fy, config.use_depth_shader);
+  }
+  return NULL;
+}
+
+const char* LocalizerPipeline::StateName(State state)
+{
+  switch(state)
+  {
+    case INIT: return "INIT";
+    case INIT_PNP: return "INIT_PNP";
+    case LOCAL_INIT: return "LOCAL_INIT";
+    case PNP: return "PNP";
+    case EDGES: return "EDGES";
+    case KLT_INIT: return "KLT_INIT";
+    case KLT: return "KLT";
+  }
+  return "UNKNOWN";
+}
+
+// decaying velocity model
+void LocalizerPipeline::UpdateMotionModel(const Eigen::Matrix4f& oldTf, const Eigen::Matrix4f& newTf,
+  const Eigen::Matrix<float, 6, 6>& cov, double dt)
+{
+  if(config.motion_model == "CONSTANT")
+  {
+    // frames with the same stamp carry no velocity information
+    if(dt <= 0)
+      return;
+    Eigen::Matrix4f new_from_old = newTf*oldTf.inverse();
+    Eigen::Matrix4f cam_motion = new_from_old.log()/dt;
+    Eigen::Matrix4f old_cam_vel = camera_velocity;
+    camera_velocity = 0.9 * (0.5 * cam_motion + 0.5 * old_cam_vel);
+  }
+  else if(config.motion_model == "IMU")
+  {
+    // Apply correction measurement.  
+    //imu_mm->correct(newTf, cov);
+  }
+  else
+  {
+    camera_velocity = Eigen::MatrixXf::Zero(4,4);
+  }
+}
+
+Eigen::Matrix4f LocalizerPipeline::ApplyMotionModel(double dt)
+{
+  if(config.motion_model == "IMU")
+  {
+    // Apply all IMU measurements since last ApplyMotionModel call
+    //return imu_mm->predict();
+  }
+  else if(config.motion_model == "CONSTANT")
+  {
+    return (dt*camera_velocity).exp()*currentPose;
+  }
+  else
+  {
+    return currentPose;
+  }
+}
+
+void LocalizerPipeline::ResetMotionModel()
+{
+  pnp_cov_valid = false;
+  if(config.motion_model == "CONSTANT")
+  {
+    camera_velocity = Eigen::MatrixXf::Zero(4,4);
+  }
+  else if(config.motion_model == "IMU")
+  {
+    //imu_mm->reset();
+  }
+}
+
+PoseResult LocalizerPipeline::ProcessPreprocessedFrame(const Mat& frame, double stamp, double age)
+{
+  result = PoseResult();
+  result.stamp = stamp;
+  result.state = StateName(localize_state);
+  if(!initialized)
+    return result;
+
+  // Global localization has no cheaper alternative, so those frames are only
+  // dropped once they are already late
+  bool tracking = (localize_state == PNP || localize_state == EDGES || 
+    localize_state == KLT_INIT || localize_state == KLT);
+  level = scheduler.Schedule(result.state, age, NumLevels(localize_state), tracking);
+  if(level == FrameScheduler::DROP)
+  {
+    ML_DEBUG("Dropped %s frame, %f s old", result.state, age);
+    result.dropped = true;
+    return result;
+  }
+  int64_t start = Profiler::Now();
+
+  current_image = frame;
+  if(point_undistorter && 
+    (localize_state == INIT || localize_state == LOCAL_INIT || localize_state == INIT_PNP))
+  {
+    // Global localization works on whole images, undistort the full frame
+    point_undistorter->UndistortImage(frame, current_image);
+  }
+
+  // whole frame latency is recorded under the name of the state it started in
+  Profiler::Instance().CountFrame(StateName(localize_state));
+  PROFILE_SCOPE(StateName(localize_state));
+
+  // the motion model runs on frame stamps so replay can go faster than real time
+  if(last_stamp < 0)
+    last_stamp = stamp;
+  double dt = stamp - last_stamp;
+  last_stamp = stamp;
+  if(dt > 0)
+    frame_interval = frame_interval > 0 ? 0.8*frame_interval + 0.2*dt : dt;
+
+  RunStateMachine(dt);
+  scheduler.Report(result.state, level, 1e-9*(Profiler::Now() - start));
+
+  // don't hold on to the frame buffers between frames, ImageIngest reuses them
+  PoseResult out = result;
+  result = PoseResult();
+  return out;
+}
+
+// Number of FrameScheduler levels each state can run at
+int LocalizerPipeline::NumLevels(State state) const
+{
+  if(state == PNP && config.pnp_descriptor_type == "orb" && 
+    config.degraded_orb_features < config.orb_features)
+    return 2;
+  if(state == EDGES && config.edge_tracking_iterations > 1)
+    return 2;
+  return 1;
+}
+
+int LocalizerPipeline::OrbFeatures() const
+{
+  return level == FrameScheduler::REDUCED ? config.degraded_orb_features : config.orb_features;
+}
+
+void LocalizerPipeline::RunStateMachine(double dt)
+{
+  if(localize_state == KLT_INIT)
+  {
+    // if init, 
+    //   give last image (presumably from pnp) to video tracker
+    //   give depth map for this image (from the render engine)
+    //   backproject initial key points to 3D
+    ML_DEBUG("Initializing KLT tracking...");
+    Mat vimg, depth, mask, reproj_mask;
+    Eigen::Matrix3f vimgK;
+    // the render may come from the cache at a slightly different pose
+    Eigen::Matrix4f vimgTf = currentPose;
+    if(!GetVirtualImage(vimgTf, vimg, depth, mask, vimgK))
+    {
+      return;
+    }
+    std::vector<cv::Point2f> pts2d;
+    std::vector<cv::Point3f> pts3d;
+    std::vector<int> ptIDs;
+    ReprojectMask(reproj_mask, mask, K_scaled, vimgK);
+    klt_tracker.init(klt_init_img, depth, K_scaled, vimgK, vimgTf, reproj_mask); 
+    klt_tracker.processFrame(current_image, pts2d, pts3d, ptIDs);
+
+    double pnpReprojError;
+    std::vector<int> inlierIdx;
+    Eigen::Matrix4f tfran;
+    Eigen::Matrix<float, 6, 6> cov;
+    if(!PnPUtil::RansacPnP(pts3d, pts2d, Kcv, currentPose.inverse(), tfran, inlierIdx, &pnpReprojError, &cov) || inlierIdx.size() < config.min_pnp_inliers)
+    {
+      ResetMotionModel();
+      localize_state = PNP;
+    }
+    else
+    {
+      SetPose(tfran.inverse());
+      result.tracked_points = pts2d;
+      result.tracked_ids = ptIDs;
+      ML_DEBUG("Found image tf");
+      localize_state = KLT;
+    }
+  }
+  else if(localize_state == KLT)
+  {
+    // otherwise,
+    //   give current image to video tracker
+    //   get matched keypts  
+    //   do that PnP to get pose, bro
+    ML_DEBUG("Performing KLT tracking...");
+    std::vector<cv::Point2f> pts2d;
+    std::vector<cv::Point3f> pts3d;
+    std::vector<int> ptIDs;
+    ScopedTimer klt_timer("klt");
+    klt_tracker.processFrame(current_image, pts2d, pts3d, ptIDs);
+    klt_timer.Stop();
+
+    double pnpReprojError;
+    std::vector<int> inlierIdx;
+    Eigen::Matrix4f tfran;
+    Eigen::Matrix<float, 6, 6> cov;
+    ScopedTimer pnp_timer("klt_pnp");
+    bool pnp_ok = PnPUtil::RansacPnP(pts3d, pts2d, Kcv, currentPose.inverse(), tfran, inlierIdx, &pnpReprojError, &cov);
+    pnp_timer.Stop();
+    if(!pnp_ok || inlierIdx.size() < config.min_pnp_inliers)
+    {
+      ML_INFO("KLT failed, reverting back to feature matching");
+      ResetMotionModel();
+      localize_state = PNP;
+    }
+    else
+    {
+      if(pnpReprojError < config.max_pnp_reproj_error && inlierIdx.size() >= config.min_pnp_inliers)
+      {
+        SetPose(tfran.inverse());
+        result.tracked_points = pts2d;
+        result.tracked_ids = ptIDs;
+        ML_DEBUG("Found image tf");
+        localize_state = KLT;
+      }
+      else if(!scheduler.Fits(StateName(PNP), (FrameScheduler::Level)(NumLevels(PNP)-1)))
+      {
+        // Feature matching would blow the frame budget, keep the degraded KLT pose
+        ML_INFO("KLT tracking is poor, but PnP does not fit in the frame budget");
+        SetPose(tfran.inverse());
+        result.tracked_points = pts2d;
+        result.tracked_ids = ptIDs;
+      }
+      else
+      {
+        ML_INFO("KLT failed (bad tracking), reverting back to feature matching");
+        ResetMotionModel();
+        localize_state = PNP;
+      }
+    }
+    ML_DEBUG("KLT PnP: # Inliers = %lu,\t Avg Reproj Error = %f", inlierIdx.size(), pnpReprojError);
+  }
+  else if(localize_state == EDGES)
+  {
+    KeyframeContainer* kf = new KeyframeContainer(current_image, config.pnp_descriptor_type, false);
+    kf->SetUndistorter(point_undistorter);
+    ML_DEBUG("Performing local Edge search...");
+    Eigen::Matrix4f imgTf;
+    if(FindImageTfVirtualEdges(kf, ApplyMotionModel(dt), imgTf, true))
+    //if(FindImageTfVirtualEdges(kf, currentPose, imgTf, true))
+    {
+      // refinement iterations are skipped when the frame is short on time
+      int iterations = level == FrameScheduler::REDUCED ? 1 : config.edge_tracking_iterations;
+      for(int i = 0; i < iterations-1; i++)
+      {
+        Eigen::Matrix4f prevTf = imgTf;
+        FindImageTfVirtualEdges(kf, prevTf, imgTf, true);
+      }
+    
+      Eigen::Matrix<float, 6, 6> cov;
+      UpdateMotionModel(currentPose, imgTf, cov, dt);
+
+      SetPose(imgTf);
+      
+      ML_DEBUG("Found image tf");
+    }
+    else
+    {
+      ResetMotionModel();
+      localize_state = PNP;
+    }
+    delete kf;
+  }
+  else if(localize_state == PNP)
+  {
+    //start = ros::Time::now();
+    KeyframeContainer* kf = new KeyframeContainer(current_image, config.pnp_descriptor_type, false);
+    kf->SetUndistorter(point_undistorter);
+    kf->SetMaxFeatures(OrbFeatures());
+    //ROS_INFO("Descriptor extraction time: %f", (ros::Time::now()-start).toSec());  
+    
+    ML_DEBUG("Performing local PnP search...");
+    Eigen::Matrix4f imgTf;
+
+    Eigen::Matrix<float, 6 ,6> cov;
+    Eigen::Matrix4f currentPoseMM = ApplyMotionModel(dt);
+    //std::cout << "currentPoseMM = " << std::endl << currentPoseMM << std::endl;
+    //std::cout << "currentPose = " << std::endl << currentPose << std::endl;
+    if(FindImageTfVirtualPnp(kf, currentPoseMM, imgTf, config.pnp_descriptor_type, true, cov))
+    {
+
+      UpdateMotionModel(currentPose, imgTf, cov, dt);
+      numPnpRetrys = 0;
+      if(pnpReprojError < config.max_pnp_reproj_error)
+      {
+        if(config.tracking_mode == "EDGE")
+          localize_state = EDGES;
+        else if(config.tracking_mode == "KLT")
+        {
+          klt_init_img = current_image;
+          localize_state = KLT_INIT;
+        }
+      }
+      SetPose(imgTf);
+      // the caller can reproject the depth into the camera frame with TransformDepthFrame
+      result.image = current_image;
+      result.virtual_depth = virtual_depth;
+      result.virtual_pose = virtual_depth_tf;
+      result.virtual_K = virtual_depth_K;
+
+      ML_DEBUG("Found image tf");
+    }
+    else
+    {
+      ResetMotionModel();
+      numPnpRetrys++;
+      if(numPnpRetrys > 1)
+      {
+        ML_INFO("PnP failed, reinitializing using last known pose");
+        numPnpRetrys = 0;
+        localize_state = LOCAL_INIT;
+      }
+    }
+    delete kf;
+  }
+  else if (localize_state == INIT_PNP)
+  {
+    ML_DEBUG("Refining matched pose with PnP...");
+    Eigen::Matrix4f imgTf;
+    
+    ScopedTimer extract_timer("extract");
+    KeyframeContainer* kf = new KeyframeContainer(current_image, config.img_match_descriptor_type);
+    kf->SetMaxFeatures(OrbFeatures());
+    extract_timer.Stop();
+
+    Eigen::Matrix<float, 6 ,6> cov;
+    if(FindImageTfVirtualPnp(kf, currentPose, imgTf, config.img_match_descriptor_type, true, cov))
+    {
+     
+      ResetMotionModel();
+      if(config.motion_model == "IMU")
+      { 
+        //imu_mm->init(imgTf, cov);
+      }
+
+      numPnpRetrys = 0;
+      localize_state = PNP;
+      SetPose(imgTf);
+      ML_DEBUG("Found image tf");
+    }
+    else
+    {
+      ML_INFO("PnP init failed, reinitializing using last known pose");
+      localize_state = LOCAL_INIT;
+    }
+
+    delete kf;
+  }
+  else
+  {
+    PROFILE_SCOPE("global_localize");
+    Eigen::Matrix4f pose;
+    bool localize_success;
+
+    if(localize_state == LOCAL_INIT) 
+    {
+      localize_success = localization_init->localize(current_image, Kcv, &pose, &currentPose);
+    }
+    else if(localize_state == INIT) 
+    {
+      localize_success = localization_init->localize(current_image, Kcv, &pose);
+    }
+
+    if(localize_success)
+    {
+      ML_DEBUG("Found image tf");
+     
+      localize_state = INIT_PNP;
+      numLocalizeRetrys = 0;
+      SetPose(pose);
+    }
+    else
+    {
+      numLocalizeRetrys++;
+      if(numLocalizeRetrys > 3)
+      {
+        ML_INFO("Fully reinitializing");
+        localize_state = INIT;
+      }
+    }
+  }
+
+  // PNP on landmarks renders nothing to speculate on
+  bool pnp_renders = localize_state == PNP && !(landmarks && landmarks->GetDescriptorType() == config.pnp_descriptor_type);
+  if(config.speculative_render && render_stage && (pnp_renders || localize_state == EDGES))
+  {
+    // Start rendering where we expect the camera to be for the next frame
+    render_stage->Prefetch(ApplyMotionModel(frame_interval));
+  }
+
+}
+
+bool LocalizerPipeline::GetVirtualImage(Eigen::Matrix4f& pose, Mat& vimg, Mat& depth, Mat& mask,
+  Eigen::Matrix3f& vimgK, bool predicted)
+{
+  if(render_service)
+  {
+    vimgK = render_service->GetK();
+    unsigned long seq = pending_render;
+    pending_render = 0;
+    // the render requested at the last pose update is used if it was for
+    // this pose, or close enough to it for a predicted render
+    if(!seq || (!(pose == pending_render_pose) &&
+      !(predicted && WithinSpeculativeTolerance(pose, pending_render_pose))))
+    {
+      if(seq)
+        render_service->Cancel(seq);
+      seq = render_service->Request(pose);
+    }
+    RenderResponse response;
+    if(!render_service->Wait(seq, response))
+      return false;
+    pose = response.pose;
+    vimg = response.image;
+    depth = response.depth;
+    mask = response.mask;
+    render_owner = response.owner;
+  }
+  else if(atlas)
+  {
+    vimgK = atlas->GetK();
+    vimg = atlas->GenerateNearestView(pose, depth, mask);
+  }
+  else if(render_stage)
+  {
+    if(render_cache && render_cache->Lookup(pose, vimg, depth, mask, vimgK) != RenderCache::MISS)
+      return true;
+    if(predicted && config.speculative_render)
+      vimg = render_stage->RenderPredicted(pose, depth, mask, vimgK);
+    else
+      vimg = render_stage->Render(pose, depth, mask, vimgK);
+    if(render_cache && !vimg.empty())
+      render_cache->Insert(pose, vimg, depth, mask, vimgK);
+  }
+  else
+  {
+    ML_ERROR("Invalid virtual_image_source");
+    return false;
+  }
+  return !vimg.empty();
+}
+
+bool LocalizerPipeline::WithinSpeculativeTolerance(const Eigen::Matrix4f& a, const Eigen::Matrix4f& b) const
+{
+  double dt = (a.block<3,1>(0,3) - b.block<3,1>(0,3)).norm();
+  Eigen::Matrix3f dR = a.block<3,3>(0,0).transpose()*b.block<3,3>(0,0);
+  double c = std::max(-1.0, std::min(1.0, 0.5*(dR.trace() - 1.0)));
+  return dt <= config.speculative_trans_tol && acos(c) <= config.speculative_rot_tol;
+}
+
+std::vector<int> LocalizerPipeline::FindPlaneInPointCloud(const std::vector<pcl::PointXYZ>& pts)
+{
+  std::vector<int> inliers;
+  pcl::PointCloud<pcl::PointXYZ>::Ptr cloud(new pcl::PointCloud<pcl::PointXYZ>);//, plane;
+
+  cloud->points.resize(pts.size());
+  for(unsigned int i = 0; i < pts.size(); i++)
+  {
+    cloud->points[i] = pts[i];
+  }
+
+  pcl::SampleConsensusModelPlane<pcl::PointXYZ>::Ptr model_p (new pcl::SampleConsensusModelPlane<pcl::PointXYZ> (cloud));
+  pcl::RandomSampleConsensus<pcl::PointXYZ> ransac (model_p);
+  ransac.setDistanceThreshold (.01);
+  ransac.computeModel();
+  ransac.getInliers(inliers);
+
+  //pcl::copyPointCloud<pcl::PointXYZ>(*cloud, inliers, *plane);
+  return inliers;
+}
+
+std::vector<pcl::PointXYZ> LocalizerPipeline::GetPointCloudFromFrames(KeyframeContainer* kfc1, KeyframeContainer* kfc2)
+{
+  std::vector<CloudPoint> pcCv;	
+  std::vector<pcl::PointXYZ> pc;	
+  std::vector<KeyPoint> correspImg1Pt;
+  const double matchRatio = config.ratio_test_thresh;
+	
+  Eigen::Matrix4f tf1 = kfc1->GetTf().inverse();
+  Eigen::Matrix4f tf2 = kfc2->GetTf().inverse();
+
+  Matx34d P(tf1(0,0), tf1(0,1), tf1(0,2), tf1(0,3),
+            tf1(1,0), tf1(1,1), tf1(1,2), tf1(1,3), 
+            tf1(2,0), tf1(2,1), tf1(2,2), tf1(2,3));
+  Matx34d P1(tf2(0,0), tf2(0,1), tf2(0,2), tf2(0,3),
+             tf2(1,0), tf2(1,1), tf2(1,2), tf2(1,3), 
+             tf2(2,0), tf2(2,1), tf2(2,2), tf2(2,3));
+  Matx33d Kcv33(Kcv.at<double>(0,0), Kcv.at<double>(0,1), Kcv.at<double>(0,2),
+                Kcv.at<double>(1,0), Kcv.at<double>(1,1), Kcv.at<double>(1,2),
+                Kcv.at<double>(2,0), Kcv.at<double>(2,1), Kcv.at<double>(2,2));  
+
+  //Find matches between kfc1 and kfc2
+  FlannBasedMatcher matcher;
+  std::vector < std::vector< DMatch > > matches;
+  matcher.knnMatch( kfc1->GetDescriptors(), kfc2->GetDescriptors(), matches, 2 );
+
+  std::vector< DMatch > goodMatches;
+  std::vector< DMatch > allMatches;
+  std::vector<Point3d> triangulatedPts1;
+  std::vector<Point3d> triangulatedPts2;
+  std::vector<KeyPoint> matchKps1;
+  std::vector<KeyPoint> matchKps2;
+
+
+  double reprojError;
+  // Use ratio test to find good keypoint matches
+  for(unsigned int j = 0; j < matches.size(); j++)
+  {
+    allMatches.push_back(matches[j][0]);
+    if(matches[j][0].distance < matchRatio*matches[j][1].distance)
+    {
+      Point2f pt1 = kfc1->GetKeypoints()[matches[j][0].queryIdx].pt;
+      Point2f pt2 = kfc2->GetKeypoints()[matches[j][0].trainIdx].pt;
+      Mat_<double> triPt = LinearLSTriangulation(Point3d(pt1.x, pt1.y, 1), Kcv33*P, Point3d(pt2.x, pt2.y, 1), Kcv33*P1, &reprojError);
+      //std::cout << "Reproj Error: " << *reprojError << std::endl;
+
+      if(reprojError < 1.)
+      {
+        pc.push_back(pcl::PointXYZ(triPt(0), triPt(1), triPt(2)));
+      
+        goodMatches.push_back(matches[j][0]);
+        matchKps1.push_back(kfc1->GetKeypoints()[matches[j][0].queryIdx]);
+        matchKps2.push_back(kfc2->GetKeypoints()[matches[j][0].trainIdx]);
+      }
+    }
+  }
+  
+ 
+#if 0
+  namedWindow("matches", 1);
+  Mat img_matches;
+  drawMatches(kfc1->GetImage(), kfc1->GetKeypoints(), kfc2->GetImage(), kfc2->GetKeypoints(), goodMatches, img_matches);
+  imshow("matches", img_matches);
+  waitKey(0); 
+#endif
+  
+  return pc;
+}
+
+std::vector<Point3d> LocalizerPipeline::PCLToPoint3d(const std::vector<pcl::PointXYZ>& cpvec)
+{
+  std::vector<Point3d> points;
+  for(unsigned int i = 0; i < cpvec.size(); i++)
+  {
+    Point3d pt(cpvec[i].x, cpvec[i].y, cpvec[i].z);
+    points.push_back(pt);  
+  }
+  return points;
+}
+
+void LocalizerPipeline::ReprojectMask(Mat& dst, const Mat& src, const Eigen::Matrix3f& dstK, 
+  const Eigen::Matrix3f& srcK, bool median_blur)
+{
+  double fxs = srcK(0,0);
+  double fys = srcK(1,1);
+  double cxs = srcK(0,2);
+  double cys = srcK(1,2);
+  double fxd = dstK(0,0);
+  double fyd = dstK(1,1);
+  double cxd = dstK(0,2);
+  double cyd = dstK(1,2);
+  for(int i = 0; i < src.rows; i++)
+  {
+    for(int j = 0; j < src.cols; j++)
+    {
+      if(src.at<uchar>(i,j) != 255)
+        continue;
+      double px_un = (j - cxs)/fxs;
+      double py_un = (i - cys)/fys;
+
+      int dst_x = floor(px_un*fxd + cxd);
+      int dst_y = floor(py_un*fyd + cyd);
+      if(dst_x < 0 || dst_x >= dst.cols || dst_y < 0 || dst_y >= dst.rows)
+        continue;
+      
+      dst.at<uchar>(dst_y, dst_x) = src.at<uchar>(i,j);
+    }
+  }
+  
+  // Fill in any holes
+  if(median_blur)
+  {
+    medianBlur(dst, dst, 3);
+  }
+}  
+
+
+
+bool LocalizerPipeline::FindImageTfVirtualEdges(KeyframeContainer* kfc, Eigen::Matrix4f vimgTf, Eigen::Matrix4f& tf, bool mask_kf)
+{
+  tf = Eigen::MatrixXf::Identity(4,4);
+
+  // Get virtual image and depth map
+  Mat depth, mask;
+  Mat vimg, vimg_masked;
+  Eigen::Matrix3f vimgK;
+  ScopedTimer vimg_timer("virtual_image");
+  if(!GetVirtualImage(vimgTf, vimg, depth, mask, vimgK, true))
+  {
+    return false;
+  }
+  vimg.copyTo(vimg_masked, mask);
+  vimg_timer.Stop();
+  
+  Mat kf_mask;
+  if(mask_kf)
+  {
+    ScopedTimer mask_timer("reproject_mask");
+    Mat reproj_mask = Mat(kfc->GetImage().rows, kfc->GetImage().cols, CV_8U, Scalar(0));
+    ReprojectMask(reproj_mask, mask, K_scaled, vimgK);
+
+    //dilate mask so as not to mask good features that may have moved
+    int dilate_size = 15;
+    Mat element = getStructuringElement(MORPH_RECT, Size(2*dilate_size+1,2*dilate_size+1), Point(dilate_size,dilate_size));
+    dilate(reproj_mask, kf_mask, element);
+    if(kfc->GetUndistorter())
+    {
+      // the mask is in undistorted pixels, features are detected on the distorted frame
+      kfc->GetUndistorter()->DistortImage(kf_mask.clone(), kf_mask, INTER_NEAREST);
+    }
+    kfc->SetMask(kf_mask);
+    mask_timer.Stop();
+    //namedWindow( "Reproj Mask", WINDOW_NORMAL );// Create a window for display.
+    //imshow( "Reproj Mask", reproj_mask ); 
+    if(config.show_debug)
+    {
+      Mat query_masked;
+      kfc->GetImage().copyTo(query_masked, kf_mask);
+      namedWindow( "Query Masked", WINDOW_NORMAL );// Create a window for display.
+      imshow( "Query Masked", query_masked ); 
+    }
+  }
+  
+
+  // this pipeline's settings, other objects' pipelines may have their own
+  EdgeTrackingUtil::EdgeParams edge_params;
+  edge_params.show_debug = config.show_debug;
+  edge_params.autotune_canny = config.autotune_canny;
+  edge_params.canny_high_thresh = config.canny_high_thresh;
+  edge_params.canny_low_thresh = config.canny_low_thresh;
+  edge_params.canny_sigma = config.canny_sigma;
+  edge_params.dmax = config.edge_tracking_dmax;
+  edge_params.undistorter = point_undistorter;
+  std::vector<EdgeTrackingUtil::SamplePoint> sps = 
+    EdgeTrackingUtil::getEdgeMatches(vimg_masked, kfc->GetImage(), vimgK, K_scaled, depth, 
+      kf_mask, vimgTf, edge_params);
+
+  double avgError = 0;
+  for(int i = 0; i < sps.size(); i++)
+  {
+    avgError += sps[i].dist;
+  }
+  avgError /= sps.size();
+
+  // hacky way to detect failure 
+  if(avgError > 15 || sps.size() < 15)
+    return false;
+  
+  ML_DEBUG("VirtualEdges: avg matching error: %f", avgError);
+  ScopedTimer irls_timer("irls");
+  //EdgeTrackingUtil::getEstimatedPosePnP(tf, vimgTf.inverse(), sps, Kcv);
+  EdgeTrackingUtil::getEstimatedPoseIRLS(tf, vimgTf.inverse(), sps, K_scaled, edge_params);
+  tf = tf.inverse();
+  irls_timer.Stop();
+
+  return true;
+}
+
+bool LocalizerPipeline::FindImageTfVirtualPnp(KeyframeContainer* kfc, Eigen::Matrix4f vimgTf, Eigen::Matrix4f& tf, std::string vdesc_type, bool mask_kf, Eigen::Matrix<float, 6, 6>& cov)
+{
+  tf = Eigen::MatrixXf::Identity(4,4);
+  // where the query is predicted to be, the virtual image may be taken
+  // elsewhere (the nearest atlas view, a render close enough to it)
+  const Eigen::Matrix4f queryTf = vimgTf;
+  const Eigen::Matrix4f queryTf_inv = queryTf.inverse();
+
+  // Get virtual image and depth map
+  Mat depth, mask;
+  Mat vimg;
+  Eigen::Matrix3f vimgK, vimgK_inv;
+  // With landmarks their projections into the query take the place of the
+  // virtual image features.  surf_gpu matches on the GPU, landmarks aren't uploaded.
+  bool use_landmarks = landmarks && landmarks->GetDescriptorType() == vdesc_type && vdesc_type != "surf_gpu";
+  std::vector<int> landmark_ids;
+  std::vector<Point2f> landmark_pts;
+  if(use_landmarks)
+  {
+    ScopedTimer select_timer("select_landmarks");
+    landmarks->SelectVisible(vimgTf, K_scaled, kfc->GetImage().rows, kfc->GetImage().cols, landmark_ids,
+      landmark_pts);
+    if(landmark_ids.size() < 4)
+    {
+      ML_WARN("Only %lu landmarks visible", landmark_ids.size());
+      return false;
+    }
+    vimgK = K_scaled;
+  }
+  else
+  {
+    ScopedTimer vimg_timer("virtual_image");
+    if(!GetVirtualImage(vimgTf, vimg, depth, mask, vimgK, true))
+    {
+      return false;
+    }
+  }
+  virtual_depth = depth;  
+  virtual_depth_tf = vimgTf;
+  virtual_depth_K = vimgK;
+
+  vimgK_inv = vimgK.inverse();
+  
+  if(mask_kf)
+  {
+    Mat reproj_mask = Mat(kfc->GetImage().rows, kfc->GetImage().cols, CV_8U, Scalar(0));
+    ScopedTimer mask_timer("reproject_mask");
+    if(use_landmarks)
+    {
+      // the area the visible landmarks span
+      std::vector<Point2f> hull;
+      convexHull(landmark_pts, hull);
+      std::vector<Point> hull_px(hull.begin(), hull.end());
+      fillConvexPoly(reproj_mask, hull_px, Scalar(255));
+    }
+    else
+    {
+      ReprojectMask(reproj_mask, mask, K_scaled, vimgK, false);
+    }
+    int dilate_size = 15;
+    Mat element = getStructuringElement(MORPH_RECT, Size(2*dilate_size+1,2*dilate_size+1), Point(dilate_size,dilate_size));
+    dilate(reproj_mask, reproj_mask, element);
+    if(kfc->GetUndistorter())
+    {
+      // same as for edges, the frame itself is still distorted
+      kfc->GetUndistorter()->DistortImage(reproj_mask.clone(), reproj_mask, INTER_NEAREST);
+    }
+    mask_timer.Stop();
+    kfc->SetMask(reproj_mask);
+    
+    ScopedTimer extract_timer("extract");
+    std::vector<KeyPoint> shared_kps;
+    Mat shared_desc;
+    if(query_features && query_features->Get(kfc->GetImage(), vdesc_type, OrbFeatures(), reproj_mask,
+      point_undistorter, shared_kps, shared_desc))
+    {
+      kfc->SetFeatures(shared_kps, shared_desc);
+    }
+    else
+    {
+      kfc->ExtractFeatures();
+    }
+    extract_timer.Stop();
+    //namedWindow( "Reproj Mask", WINDOW_NORMAL );// Create a window for display.
+    //imshow( "Reproj Mask", reproj_mask ); 
+    if(config.show_debug)
+    {
+      Mat query_masked;
+      kfc->GetImage().copyTo(query_masked, reproj_mask);
+      namedWindow( "Query Masked", WINDOW_NORMAL );// Create a window for display.
+      imshow( "Query Masked", query_masked ); 
+    }
+    if(kfc->GetKeypoints().size() == 0)
+    {
+      ML_WARN("Keyframe has no keypoints");
+      return false;
+    }
+  }
+  if(config.show_debug && !use_landmarks)
+  {
+    Mat depth_im;
+    double min_depth, max_depth;
+    minMaxLoc(depth, &min_depth, &max_depth);    
+    //std::cout << "min_depth=" << min_depth << " max_depth=" << max_depth << std::endl;
+    depth.convertTo(depth_im, CV_8U, 255.0/(max_depth-min_depth), 0);// -min_depth*255.0/(max_depth-min_depth));
+
+    namedWindow( "Query", WINDOW_NORMAL );// Create a window for display.
+    imshow( "Query", kfc->GetImage() ); 
+    namedWindow( "Virtual", WINDOW_NORMAL );// Create a window for display.
+    imshow( "Virtual", vimg ); 
+    namedWindow( "Depth", WINDOW_NORMAL );// Create a window for display.
+    imshow( "Depth", depth_im ); 
+    //namedWindow( "Mask", WINDOW_NORMAL );// Create a window for display.
+    //imshow( "Mask", mask ); 
+    waitKey(1);
+  }
+
+  // Find features in virtual image
+  std::vector<KeyPoint> vkps;
+  Mat vdesc;
+#ifdef MESH_LOCALIZER_ENABLE_GPU
+  gpu::GpuMat vdesc_gpu;
+#endif
+  std::vector < std::vector< DMatch > > matches;
+  // best matches that pass the ratio test
+  std::vector< DMatch > ratioMatches;
+  
+  // Find image features matches between kfc and vimg
+  double matchRatio = config.ratio_test_thresh;
+
+  ScopedTimer match_timer("match");
+  // atlas views come with their features and 3D points, and a cached
+  // render may still hold the features extracted from it
+  std::vector<Point3f> vpts3d;
+  std::ostringstream feature_key;
+  feature_key << vdesc_type << "/" << OrbFeatures();
+  bool cached_features = use_landmarks;
+  if(use_landmarks)
+  {
+    const Mat& landmark_desc = landmarks->GetDescriptors();
+    vdesc.create(landmark_ids.size(), landmark_desc.cols, landmark_desc.type());
+    for(unsigned int i = 0; i < landmark_ids.size(); i++)
+    {
+      vkps.push_back(KeyPoint(landmark_pts[i], 1));
+      landmark_desc.row(landmark_ids[i]).copyTo(vdesc.row(i));
+      vpts3d.push_back(landmarks->GetPoint(landmark_ids[i]));
+    }
+  }
+  cached_features = cached_features || (atlas && atlas->GetFeatures(vimg, vdesc_type, vkps, vdesc, vpts3d));
+  cached_features = cached_features || (render_cache && vdesc_type != "surf_gpu" &&
+    render_cache->GetFeatures(vimg, feature_key.str(), vkps, vdesc));
+  if(use_landmarks)
+  {
+    ML_DEBUG("Matching against %lu visible landmarks", vkps.size());
+  }
+  else if(cached_features)
+  {
+    ML_DEBUG("Reusing %lu cached virtual image features", vkps.size());
+  }
+  else if(vdesc_type == "asift")
+  {
+    ASiftDetector detector;
+    detector.detectAndCompute(vimg, vkps, vdesc, mask, ASiftDetector::SIFT);
+
+    //matchRatio = 0.7;
+  }
+  else if(vdesc_type == "asurf")
+  {
+    ASiftDetector detector;
+    detector.detectAndCompute(vimg, vkps, vdesc, mask, ASiftDetector::SURF);
+
+    //matchRatio = 0.7;
+  }
+  else if(vdesc_type == "orb")
+  {
+    ORB orb(OrbFeatures(), 1.2f, 4);
+    orb(vimg, mask, vkps, vdesc);
+
+    ML_DEBUG("vkps: %lu", vkps.size());
+
+    //matchRatio = 0.8;
+  }
+  else if(vdesc_type == "surf")
+  {
+    SurfFeatureDetector detector;
+    detector.detect(vimg, vkps, mask);
+
+    SurfDescriptorExtractor extractor;
+    extractor.compute(vimg, vkps, vdesc);
+
+    //matchRatio = 0.7;
+  }
+#ifdef MESH_LOCALIZER_ENABLE_GPU
+  else if(vdesc_type == "surf_gpu")
+  {
+    gpu::SURF_GPU surf_gpu;
+   
+    if(config.virtual_image_source == "gazebo")
+      cvtColor(vimg, vimg, CV_BGR2GRAY);
+    gpu::GpuMat vkps_gpu, mask_gpu(mask), vimg_gpu(vimg);
+    
+    surf_gpu(vimg_gpu, mask_gpu, vkps_gpu, vdesc_gpu);
+    surf_gpu.downloadKeypoints(vkps_gpu, vkps);   
+
+    ML_DEBUG("vkps: %lu", vkps.size());
+ 
+    //matchRatio = 0.8;
+  }
+#endif
+  if(!cached_features && render_cache && vdesc_type != "surf_gpu")
+    render_cache->SetFeatures(vimg, feature_key.str(), vkps, vdesc);
+  if(vkps.size() <= 0)
+  {
+    ML_WARN("No keypoints found in virtual image");
+    return false;
+  }
+
+  if(config.pnp_match_radius > 0 && vdesc_type != "surf_gpu")
+  {
+    // the virtual features where they should show up in the query, their 3D
+    // points projected at the predicted pose, with the search radius grown
+    // by the pose uncertainty
+    std::vector<Point2f> predicted(vkps.size());
+    std::vector<Point3f> predicted3d(vkps.size(), Point3f(NAN, NAN, NAN));
+    for(unsigned int i = 0; i < vkps.size(); i++)
+    {
+      if(!vpts3d.empty())
+      {
+        predicted3d[i] = vpts3d[i];
+      }
+      else
+      {
+        float d = depth.at<float>(vkps[i].pt.y, vkps[i].pt.x);
+        if(d > 0)
+        {
+          Eigen::Vector3f ray = vimgK_inv*Eigen::Vector3f(vkps[i].pt.x, vkps[i].pt.y, 1);
+          Eigen::Vector4f pt = vimgTf*Eigen::Vector4f(d*ray(0)/ray(2), d*ray(1)/ray(2), d, 1);
+          predicted3d[i] = Point3f(pt(0), pt(1), pt(2));
+        }
+      }
+      Eigen::Vector3f vkp_in_kf;
+      if(std::isfinite(predicted3d[i].x))
+      {
+        Eigen::Vector4f pt = queryTf_inv*Eigen::Vector4f(predicted3d[i].x, predicted3d[i].y, predicted3d[i].z, 1);
+        vkp_in_kf = K_scaled*pt.head<3>();
+        // behind the camera, left unmatched
+        if(pt(2) <= 0)
+          vkp_in_kf = Eigen::Vector3f(NAN, NAN, 1);
+      }
+      else
+      {
+        // no depth, assume the virtual image was taken at the predicted pose
+        vkp_in_kf = K_scaled*vimgK_inv*Eigen::Vector3f(vkps[i].pt.x, vkps[i].pt.y, 1);
+      }
+      predicted[i] = Point2f(vkp_in_kf(0)/vkp_in_kf(2), vkp_in_kf(1)/vkp_in_kf(2));
+    }
+    std::vector<float> radii;
+    PredictionRadii(predicted3d, queryTf, radii);
+
+    GuidedMatcher matcher(kfc->GetKeypoints(), kfc->GetDescriptors(), config.pnp_match_radius);
+    matcher.Match(predicted, vdesc, config.pnp_match_radius, radii, matches);
+  }
+  else
+  {
+    // TODO: Add option to match all descriptors on GPU
+#ifdef MESH_LOCALIZER_ENABLE_GPU
+    if(vdesc_type == "surf_gpu")
+    {
+      gpu::BFMatcher_GPU matcher;
+      matcher.knnMatch(kfc->GetGPUDescriptors(), vdesc_gpu, matches, 2);  
+    }
+    else 
+#endif     
+    if(vdesc_type == "orb")
+    {
+      // ratio test already applied
+      hamming_matcher->Match(kfc->GetDescriptors(), vdesc, matchRatio, ratioMatches);
+    }
+    else
+    {
+      FlannBasedMatcher matcher;
+      matcher.knnMatch( kfc->GetDescriptors(), vdesc, matches, 2 );
+    }
+  }
+  for(unsigned int j = 0; j < matches.size(); j++)
+  {
+    if(matches[j][0].distance < matchRatio*matches[j][1].distance)
+      ratioMatches.push_back(matches[j][0]);
+  }
+
+  match_timer.Stop();
+
+  std::vector< DMatch > goodMatches;
+  std::vector<Point2f> matchPts;
+  std::vector<Point2f> matchPts3dProj;
+  std::vector<Point3f> matchPts3d;
+  std::vector<pcl::PointXYZ> matchPts3d_pcl;
+  
+  ScopedTimer filter_timer("match_filter");
+  const std::vector<KeyPoint>& kf_kps = kfc->GetKeypoints();
+  for(unsigned int j = 0; j < ratioMatches.size(); j++)
+  {
+    const DMatch& match = ratioMatches[j];
+    // Back-project point to 3d
+    if(match.trainIdx >= vkps.size() || match.queryIdx >= kf_kps.size())
+    {
+      ML_ERROR("Index mismatch? AHH: %d %d %lu %lu", match.trainIdx, match.queryIdx, vkps.size(), kf_kps.size());
+    }
+
+    Point2f kp = vkps[match.trainIdx].pt;
+    Eigen::Vector4f backproj_h;
+    if(!vpts3d.empty())
+    {
+      const Point3f& pt3d = vpts3d[match.trainIdx];
+      backproj_h = Eigen::Vector4f(pt3d.x, pt3d.y, pt3d.z, 1);
+    }
+    else
+    {
+      Eigen::Vector3f hkp(kp.x, kp.y, 1);
+      Eigen::Vector3f backproj = vimgK_inv*hkp;
+      backproj /= backproj(2);    
+      backproj *= depth.at<float>(kp.y, kp.x);
+      backproj_h = Eigen::Vector4f(backproj(0), backproj(1), backproj(2), 1);
+      backproj_h = vimgTf*backproj_h;
+    }
+
+    goodMatches.push_back(match);
+    matchPts3dProj.push_back(kp);
+    matchPts.push_back(kf_kps[match.queryIdx].pt);
+    matchPts3d.push_back(Point3f(backproj_h(0), backproj_h(1), backproj_h(2)));
+    matchPts3d_pcl.push_back(pcl::PointXYZ(backproj_h(0), backproj_h(1), backproj_h(2)));
+  } 
+  filter_timer.Stop();
+
+  if(config.show_pnp_matches && !use_landmarks)
+  { 
+    //PublishPointCloud(matchPts3d_pcl);
+    Mat img_matches;
+    drawMatches(kfc->GetImage(), kfc->GetKeypoints(), vimg, vkps, goodMatches, img_matches);
+    imshow("PnP Matches", img_matches);
+    waitKey(1);
+  }
+
+  if(goodMatches.size() < 4)
+  {
+    ML_WARN("Not enough matches found in virtual image");
+    return false;
+  }
+
+  /**** Pnp on known correspondences from virtual image ****  
+  Mat Rvec_true, t_true;
+  solvePnP(matchPts3d, matchPts3dProj, Kcv, distcoeffcv, Rvec_true, t_true);
+
+  Mat Rtrue;
+  Rodrigues(Rvec_true, Rtrue);
+  Eigen::Matrix4f true_tf;
+  true_tf << Rtrue.at<double>(0,0), Rtrue.at<double>(0,1), Rtrue.at<double>(0,2), t_true.at<double>(0),
+        Rtrue.at<double>(1,0), Rtrue.at<double>(1,1), Rtrue.at<double>(1,2), t_true.at<double>(1),
+        Rtrue.at<double>(2,0), Rtrue.at<double>(2,1), Rtrue.at<double>(2,2), t_true.at<double>(2),
+             0,      0,      0,    1;
+  std::cout << "Known: " << std::endl << vimgTf << std::endl << std::endl << true_tf.inverse() << std::endl; 
+  *****/
+
+
+  Eigen::Matrix4f tfran;
+  //solvePnPRansac(matchPts3d, matchPts, Kcv, 
+  std::vector<int> inlierIdx;
+  ScopedTimer pnp_timer("ransac_pnp");
+  cov.setZero();
+  bool pnp_ok = PnPUtil::RansacPnP(matchPts3d, matchPts, Kcv, vimgTf.inverse(), tfran, inlierIdx, &pnpReprojError, &cov);
+  pnp_timer.Stop();
+  if(!pnp_ok || inlierIdx.size() < config.min_pnp_inliers)
+  {
+    ML_DEBUG("VirtualPnP: #inliers=%lu pnp_reproj_error=%f", inlierIdx.size(), pnpReprojError);
+    return false;
+  }
+  // guides the matching of the next frame
+  pnp_cov = config.pixel_noise*cov;
+  pnp_cov_valid = true;
+ 
+  // compute covariance of inverse transform from transform;
+  Eigen::Matrix<float, 6, 6> J;
+  J.setZero();
+  J.block<3,3>(0,0) = -Eigen::MatrixXf::Identity(3,3);
+  J.block<3,3>(3,3) = -tfran.block<3,3>(0,0).transpose();
+  Eigen::Vector3d Avec = (-tfran.block<3,3>(0,0).transpose()*tfran.block<3,1>(0,3)).cast<double>();
+  Eigen::Matrix3d A ;
+  A << 0, -Avec(2), Avec(1),
+       Avec(2), 0, -Avec(0),
+       -Avec(1), Avec(0), 0;
+  //gcop::SO3::Instance().hat(A, (-tfran.block<3,3>(0,0).transpose()*tfran.block<3,1>(0,3)).cast<double>()); // hat(-R^Tt)
+  J.block<3,3>(3,0) = A.cast<float>();
+
+  cov = J*config.pixel_noise*cov*J.transpose();
+  //std::cout << "R, t inv covariance:" << std::endl << cov << std::endl;
+
+  if(config.show_pnp_matches && !use_landmarks)
+  { 
+    std::vector< DMatch > inlierMatches;
+    for(int j = 0; j < inlierIdx.size(); j++)
+    {
+      inlierMatches.push_back(goodMatches[inlierIdx[j]]);
+    }
+    Mat img_matches;
+    drawMatches(kfc->GetImage(), kfc->GetKeypoints(), vimg, vkps, inlierMatches, img_matches);
+    imshow("PnP Match Inliers", img_matches);
+    waitKey(1);
+  }
+
+  ML_DEBUG("VirtualPnP: found match. Average reproj error = %f", pnpReprojError);
+  tf = tfran.inverse();
+  return true;
+}
+
+void LocalizerPipeline::PredictionRadii(const std::vector<Point3f>& pts3d, const Eigen::Matrix4f& pose,
+  std::vector<float>& radii)
+{
+  radii.assign(pts3d.size(), config.pnp_match_radius);
+  if(!pnp_cov_valid || pts3d.empty())
+    return;
+
+  // Jacobian of every projection by the rotation vector and translation of
+  // the inverse pose, the parameters the PnP covariance is over
+  Eigen::Matrix4f pose_inv = pose.inverse();
+  Mat R = (Mat_<double>(3,3) << pose_inv(0,0), pose_inv(0,1), pose_inv(0,2),
+                                pose_inv(1,0), pose_inv(1,1), pose_inv(1,2),
+                                pose_inv(2,0), pose_inv(2,1), pose_inv(2,2));
+  Mat rvec, t = (Mat_<double>(3,1) << pose_inv(0,3), pose_inv(1,3), pose_inv(2,3));
+  Rodrigues(R, rvec);
+  std::vector<Point3f> pts(pts3d);
+  for(unsigned int i = 0; i < pts.size(); i++)
+  {
+    if(!std::isfinite(pts[i].x))
+      pts[i] = Point3f(0, 0, 0);
+  }
+  std::vector<Point2f> proj;
+  Mat J;
+  projectPoints(pts, rvec, t, Kcv, Mat(), proj, J);
+
+  Mat sigma(6, 6, CV_64F);
+  for(int i = 0; i < 6; i++)
+    for(int j = 0; j < 6; j++)
+      sigma.at<double>(i,j) = pnp_cov(i,j);
+  for(unsigned int i = 0; i < pts3d.size(); i++)
+  {
+    if(!std::isfinite(pts3d[i].x))
+      continue;
+    Mat Ji = J(Rect(0, 2*i, 6, 2));
+    Mat C = Ji*sigma*Ji.t();
+    double sigma_px = std::sqrt(std::max(0.0, C.at<double>(0,0) + C.at<double>(1,1)));
+    // 3 sigma of the projection, within reason
+    radii[i] = std::min(MAX_MATCH_RADIUS_SCALE*config.pnp_match_radius, config.pnp_match_radius + 3*sigma_px);
+  }
+}
+
+void LocalizerPipeline::TransformDepthFrame(const Mat& d1, const Eigen::Matrix4f& tf1, 
+  const Eigen::Matrix3f K1, Mat& d2, 
+  const Eigen::Matrix4f& tf2, const Eigen::Matrix3f& K2, const Size& d2_size)
+{
+  d2 = Mat(d2_size, CV_32F, Scalar(0));
+  double fx1 = K1(0,0);
+  double fy1 = K1(1,1);
+  double cx1 = K1(0,2);
+  double cy1 = K1(1,2);
+  double fx2 = K2(0,0);
+  double fy2 = K2(1,1);
+  double cx2 = K2(0,2);
+  double cy2 = K2(1,2);
+
+  Eigen::Matrix4f tf2_inv = tf2.inverse();
+
+  for(int i = 0; i < d1.rows; i++)
+  {
+    for(int j = 0; j < d1.cols; j++)
+    {
+      if(d1.at<float>(i,j) == 0 || d1.at<float>(i,j) == -1)
+        continue;
+
+      Eigen::Vector3f pt2d((j-cx1)/fx1, (i-cy1)/fy1, 1);
+      Eigen::Vector3f pt3d = d1.at<float>(i,j)*pt2d;
+      Eigen::Vector3f pt3d_tf2 = (tf2_inv*tf1*Eigen::Vector4f(pt3d(0), pt3d(1), pt3d(2),1)).head<3>();
+      float depth = pt3d_tf2(2);
+      int d2x = round(fx2*pt3d_tf2(0)/depth + cx2);
+      int d2y = round(fy2*pt3d_tf2(1)/depth + cy2);
+
+      if(d2x < 0 || d2x >= d2.cols || d2y < 0 || d2y >= d2.rows)
+        continue;
+
+      d2.at<float>(d2y, d2x) = depth;
+    }
+  }
+  medianBlur(d2, d2, 5);
+}
+
+Eigen::Matrix4f LocalizerPipeline::FindImageTfPnp(KeyframeContainer* kfc, const MapFeatures& mf)
+{
+  Eigen::Matrix4f tf;
+  
+  // Find image features matches in map
+  const double matchRatio = config.ratio_test_thresh;
+
+  FlannBasedMatcher matcher;
+  std::vector < std::vector< DMatch > > matches;
+  matcher.knnMatch( kfc->GetDescriptors(), mf.GetDescriptors(), matches, 2 );
+
+  std::vector< DMatch > goodMatches;
+  std::vector< DMatch > allMatches;
+  std::vector<Point2f> matchPts;
+  std::vector<Point3f> matchPts3d;
+
+  for(unsigned int j = 0; j < matches.size(); j++)
+  {
+    allMatches.push_back(matches[j][0]);
+    if(matches[j][0].distance < matchRatio*matches[j][1].distance)
+    {
+      pcl::PointXYZ pt3d = mf.GetKeypoints()[matches[j][0].trainIdx];
+
+      goodMatches.push_back(matches[j][0]);
+      matchPts.push_back(kfc->GetKeypoints()[matches[j][0].queryIdx].pt);
+      matchPts3d.push_back(Point3f(pt3d.x, pt3d.y, pt3d.z));
+    }
+  }
+ 
+  if(goodMatches.size() <= 0)
+  {
+    ML_WARN("No matches found in map");
+    return tf;
+  }
+  // Solve for camera transform
+  Mat Rvec, t;
+  //solvePnP(matchPts3d, matchPts, Kcv, distcoeffcv, Rvec, t);
+  solvePnPRansac(matchPts3d, matchPts, Kcv, distcoeffcv, Rvec, t);
+
+  Mat R;
+  Rodrigues(Rvec, R);
+
+  tf << R.at<double>(0,0), R.at<double>(0,1), R.at<double>(0,2), t.at<double>(0),
+        R.at<double>(1,0), R.at<double>(1,1), R.at<double>(1,2), t.at<double>(1),
+        R.at<double>(2,0), R.at<double>(2,1), R.at<double>(2,2), t.at<double>(2),
+             0,      0,      0,    1;
+  return tf.inverse();
+}
@@ -0,0 +1,58 @@
+#include "mesh_localize/Log.h"
+
+#include <cstdio>
+#include <cstdarg>
+#include <vector>
+#include <boost/thread/mutex.hpp>
+
+static boost::mutex handler_mutex;
+static Log::Handler handler;
+static volatile int min_level = Log::LEVEL_INFO;
+
+static const char* LEVEL_NAMES[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+void Log::SetHandler(Handler new_handler)
+{
+  boost::mutex::scoped_lock lock(handler_mutex);
+  handler = new_handler;
+}
+
+void Log::SetLevel(Level level)
+{
+  min_level = level;
+}
+
+bool Log::Enabled(Level level)
+{
+  return level >= min_level;
+}
+
+void Log::Write(Level level, const char* format, ...)
+{
+  char buffer[512];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+
+  std::string msg;
+  if(len >= (int)sizeof(buffer))
+  {
+    // too long for the stack buffer, format again into one that fits
+    std::vector<char> long_buffer(len + 1);
+    va_start(args, format);
+    vsnprintf(&long_buffer[0], long_buffer.size(), format, args);
+    va_end(args);
+    msg.assign(&long_buffer[0], len);
+  }
+  else if(len > 0)
+  {
+    msg.assign(buffer, len);
+  }
+
+  boost::mutex::scoped_lock lock(handler_mutex);
+  if(handler)
+    handler(level, msg);
+  else
+    fprintf(stderr, "[%s] %s\n", LEVEL_NAMES[level], msg.c_str());
+}
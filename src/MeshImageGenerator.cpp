@@ -0,0 +1,134 @@
+#include "mesh_localize/MeshImageGenerator.h"
+
+#include <limits>
+#include <algorithm>
+#include <boost/bind.hpp>
+#include <pcl/point_types.h>
+#include <pcl/conversions.h>
+#include "mesh_localize/Log.h"
+
+using namespace cv;
+
+MeshImageGenerator::MeshImageGenerator(const pcl::PolygonMesh& mesh, const Eigen::Matrix3f& K, int rows,
+  int cols, boost::shared_ptr<WorkerPool> shared_workers, bool backface_culling) :
+  workers(shared_workers ? shared_workers : boost::make_shared<WorkerPool>(boost::thread::hardware_concurrency())),
+  rasterizer(K, rows, cols, workers),
+  backface_culling(backface_culling),
+  K(K),
+  rows(rows),
+  cols(cols)
+{
+  bool has_color = pcl::getFieldIndex(mesh.cloud, "rgb") >= 0 || pcl::getFieldIndex(mesh.cloud, "rgba") >= 0;
+  pcl::PointCloud<pcl::PointXYZRGB> vertices;
+  pcl::fromPCLPointCloud2(mesh.cloud, vertices);
+  min_pt = Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+  max_pt = -min_pt;
+  for(unsigned int i = 0; i < vertices.points.size(); i++)
+  {
+    const pcl::PointXYZRGB& pt = vertices.points[i];
+    triangles.AddVertex(pt.x, pt.y, pt.z, (pt.r*77 + pt.g*150 + pt.b*29) >> 8);
+    min_pt = min_pt.cwiseMin(pt.getVector3fMap());
+    max_pt = max_pt.cwiseMax(pt.getVector3fMap());
+  }
+  triangles.shade = !has_color;
+
+  size_t n = vertices.points.size();
+  for(unsigned int i = 0; i < mesh.polygons.size(); i++)
+  {
+    const std::vector<uint32_t>& v = mesh.polygons[i].vertices;
+    for(unsigned int j = 2; j < v.size(); j++)
+    {
+      if(v[0] >= n || v[j-1] >= n || v[j] >= n)
+        continue;
+      triangles.AddTriangle(v[0], v[j-1], v[j]);
+    }
+  }
+  rasterizer.SetBackfaceCulling(backface_culling);
+  ML_INFO("Loaded mesh with %lu vertices and %lu triangles", triangles.NumVertices(),
+    triangles.NumTriangles());
+}
+
+MeshImageGenerator::~MeshImageGenerator()
+{
+  for(unsigned int i = 0; i < lanes.size(); i++)
+  {
+    delete lanes[i];
+  }
+}
+
+Eigen::Matrix3f MeshImageGenerator::GetK()
+{
+  return K;
+}
+
+Mat MeshImageGenerator::GenerateVirtualImage(const Eigen::Matrix4f& pose, Mat& depth, Mat& mask)
+{
+  Mat img;
+  rasterizer.SetCamera(K, rows, cols);
+  rasterizer.Render(pose, triangles, img, depth, mask);
+  return img;
+}
+
+Mat MeshImageGenerator::GenerateCroppedVirtualImage(const Eigen::Matrix4f& pose, int margin, Mat& depth,
+  Mat& mask, Rect& roi)
+{
+  roi = ProjectBounds(min_pt, max_pt, pose, K, rows, cols, margin);
+  Mat img;
+  rasterizer.SetCamera(CropK(K, roi), roi.height, roi.width);
+  rasterizer.Render(pose, triangles, img, depth, mask);
+  return img;
+}
+
+void MeshImageGenerator::GenerateVirtualImages(const PoseList& poses, std::vector<Mat>& images,
+  std::vector<Mat>& depths, std::vector<Mat>& masks, int outputs)
+{
+  images.resize(poses.size());
+  depths.resize(poses.size());
+  masks.resize(poses.size());
+  if(poses.empty())
+    return;
+  if(poses.size() == 1)
+  {
+    rasterizer.SetCamera(K, rows, cols);
+    rasterizer.Render(poses[0], triangles, images[0], depths[0], masks[0], outputs);
+    return;
+  }
+
+  unsigned int num_lanes = std::min<size_t>(poses.size(), std::max(1u, workers->NumThreads()));
+  SetupLanes(num_lanes);
+  std::vector< boost::function<void()> > tasks;
+  for(unsigned int lane = 0; lane < num_lanes; lane++)
+  {
+    tasks.push_back(boost::bind(&MeshImageGenerator::RenderLane, this, lane, boost::cref(poses),
+      boost::ref(images), boost::ref(depths), boost::ref(masks), outputs));
+  }
+  workers->RunAll(tasks);
+}
+
+void MeshImageGenerator::SetupLanes(unsigned int num_lanes)
+{
+  if(lanes.size() == num_lanes)
+    return;
+
+  for(unsigned int i = 0; i < lanes.size(); i++)
+  {
+    delete lanes[i];
+  }
+  lanes.clear();
+  for(unsigned int i = 0; i < num_lanes; i++)
+  {
+    lanes.push_back(new MeshRasterizer(K, rows, cols, workers));
+    lanes.back()->SetBackfaceCulling(backface_culling);
+  }
+}
+
+void MeshImageGenerator::RenderLane(unsigned int lane, const PoseList& poses, std::vector<Mat>& images,
+  std::vector<Mat>& depths, std::vector<Mat>& masks, int outputs)
+{
+  // the mesh is shared, each lane only has its own transformed vertices and
+  // z-buffer
+  for(unsigned int i = lane; i < poses.size(); i += lanes.size())
+  {
+    lanes[lane]->Render(poses[i], triangles, images[i], depths[i], masks[i], outputs);
+  }
+}
@@ -0,0 +1,397 @@
+#include "mesh_localize/MeshRasterizer.h"
+
+#include <cmath>
+#include <algorithm>
+#include <boost/bind.hpp>
+
+using namespace cv;
+
+// Edge length of the square screen tiles triangles are binned into
+static const int TILE_SIZE = 64;
+// Vertices transformed per worker task
+static const size_t TASK_SIZE = 1 << 16;
+// Triangles are clipped to z >= NEAR_PLANE in the camera frame
+static const float NEAR_PLANE = 0.01;
+// Smallest screen space area of a triangle that is drawn, in pixels
+static const double MIN_AREA = 1e-8;
+// Intensity of shaded faces seen edge on, as a fraction of white
+static const float AMBIENT = 0.2;
+
+TriangleMesh::TriangleMesh() :
+  shade(true)
+{
+}
+
+void TriangleMesh::AddVertex(float px, float py, float pz, uchar value)
+{
+  x.push_back(px);
+  y.push_back(py);
+  z.push_back(pz);
+  intensity.push_back(value);
+}
+
+void TriangleMesh::AddTriangle(uint32_t a, uint32_t b, uint32_t c)
+{
+  indices.push_back(a);
+  indices.push_back(b);
+  indices.push_back(c);
+}
+
+size_t TriangleMesh::NumVertices() const
+{
+  return x.size();
+}
+
+size_t TriangleMesh::NumTriangles() const
+{
+  return indices.size()/3;
+}
+
+MeshRasterizer::MeshRasterizer(const Eigen::Matrix3f& K, int rows, int cols,
+  boost::shared_ptr<WorkerPool> shared_workers) :
+  workers(shared_workers ? shared_workers : boost::make_shared<WorkerPool>(boost::thread::hardware_concurrency())),
+  backface_culling(false),
+  mesh(NULL)
+{
+  unsigned int num_tasks = std::max(1u, workers->NumThreads());
+  triangles.resize(num_tasks);
+  bins.resize(num_tasks);
+  SetCamera(K, rows, cols);
+}
+
+void MeshRasterizer::SetBackfaceCulling(bool enable)
+{
+  backface_culling = enable;
+}
+
+void MeshRasterizer::SetCamera(const Eigen::Matrix3f& K, int rows, int cols)
+{
+  this->K = K;
+  this->rows = rows;
+  this->cols = cols;
+  tiles_x = (cols + TILE_SIZE - 1)/TILE_SIZE;
+  tiles_y = (rows + TILE_SIZE - 1)/TILE_SIZE;
+  zbuffer.resize(rows*cols);
+  vbuffer.resize(rows*cols);
+  for(unsigned int t = 0; t < bins.size(); t++)
+  {
+    bins[t].resize(tiles_x*tiles_y);
+  }
+}
+
+void MeshRasterizer::Render(const Eigen::Matrix4f& pose, const TriangleMesh& new_mesh, Mat& img, Mat& depth,
+  Mat& mask, int outputs)
+{
+  pose_inv = pose.inverse();
+  mesh = &new_mesh;
+
+  std::vector< boost::function<void()> > tasks;
+  size_t num_vertices = mesh->NumVertices();
+  cam_x.resize(num_vertices);
+  cam_y.resize(num_vertices);
+  cam_z.resize(num_vertices);
+  for(size_t begin = 0; begin < num_vertices; begin += TASK_SIZE)
+  {
+    tasks.push_back(boost::bind(&MeshRasterizer::Transform, this, begin,
+      std::min(num_vertices, begin + TASK_SIZE)));
+  }
+  workers->RunAll(tasks);
+
+  // one setup task per list, so each task bins into its own lists
+  tasks.clear();
+  size_t num_triangles = mesh->NumTriangles();
+  size_t per_task = (num_triangles + triangles.size() - 1)/triangles.size();
+  for(unsigned int t = 0; t < triangles.size(); t++)
+  {
+    triangles[t].clear();
+    for(unsigned int b = 0; b < bins[t].size(); b++)
+    {
+      bins[t][b].clear();
+    }
+    size_t begin = std::min(num_triangles, t*per_task);
+    tasks.push_back(boost::bind(&MeshRasterizer::Setup, this, t, begin,
+      std::min(num_triangles, begin + per_task)));
+  }
+  workers->RunAll(tasks);
+
+  // outputs that aren't wanted are skipped by Rasterize
+  Mat* img_out = NULL;
+  Mat* depth_out = NULL;
+  Mat* mask_out = NULL;
+  if(outputs & RENDER_IMAGE)
+  {
+    img.create(rows, cols, CV_8U);
+    img_out = &img;
+  }
+  else
+    img.release();
+  if(outputs & RENDER_DEPTH)
+  {
+    depth.create(rows, cols, CV_32F);
+    depth_out = &depth;
+  }
+  else
+    depth.release();
+  if(outputs & RENDER_MASK)
+  {
+    mask.create(rows, cols, CV_8U);
+    mask_out = &mask;
+  }
+  else
+    mask.release();
+  tasks.clear();
+  for(int tile = 0; tile < tiles_x*tiles_y; tile++)
+  {
+    tasks.push_back(boost::bind(&MeshRasterizer::Rasterize, this, tile, img_out, depth_out, mask_out));
+  }
+  workers->RunAll(tasks);
+}
+
+void MeshRasterizer::Transform(size_t begin, size_t end)
+{
+  const float r00 = pose_inv(0,0), r01 = pose_inv(0,1), r02 = pose_inv(0,2), t0 = pose_inv(0,3);
+  const float r10 = pose_inv(1,0), r11 = pose_inv(1,1), r12 = pose_inv(1,2), t1 = pose_inv(1,3);
+  const float r20 = pose_inv(2,0), r21 = pose_inv(2,1), r22 = pose_inv(2,2), t2 = pose_inv(2,3);
+  const float* x = &mesh->x[0];
+  const float* y = &mesh->y[0];
+  const float* z = &mesh->z[0];
+  for(size_t i = begin; i < end; i++)
+  {
+    cam_x[i] = r00*x[i] + r01*y[i] + r02*z[i] + t0;
+    cam_y[i] = r10*x[i] + r11*y[i] + r12*z[i] + t1;
+    cam_z[i] = r20*x[i] + r21*y[i] + r22*z[i] + t2;
+  }
+}
+
+void MeshRasterizer::Setup(unsigned int task, size_t begin, size_t end)
+{
+  for(size_t t = begin; t < end; t++)
+  {
+    Eigen::Vector3f p[3];
+    float value[3];
+    int in_front = 0;
+    for(int k = 0; k < 3; k++)
+    {
+      uint32_t idx = mesh->indices[3*t + k];
+      p[k] = Eigen::Vector3f(cam_x[idx], cam_y[idx], cam_z[idx]);
+      value[k] = mesh->intensity[idx];
+      in_front += p[k](2) >= NEAR_PLANE;
+    }
+    if(in_front == 0)
+      continue;
+
+    // The camera is at the origin, so the face points away from it if its
+    // normal does not point back to the origin
+    Eigen::Vector3f normal = (p[1] - p[0]).cross(p[2] - p[0]);
+    float facing = -normal.dot(p[0]);
+    if(backface_culling && facing <= 0)
+      continue;
+    if(mesh->shade)
+    {
+      Eigen::Vector3f center = (p[0] + p[1] + p[2])/3;
+      float norm = normal.norm()*center.norm();
+      float shade = norm > 0 ? std::fabs(normal.dot(center))/norm : 0;
+      value[0] = value[1] = value[2] = 255*(AMBIENT + (1 - AMBIENT)*shade);
+    }
+
+    if(in_front == 3)
+    {
+      AddTriangle(task, p, value);
+      continue;
+    }
+
+    // Clip to the near plane, which leaves a triangle or a quad
+    Eigen::Vector3f clipped[4];
+    float clipped_value[4];
+    int n = 0;
+    for(int k = 0; k < 3; k++)
+    {
+      int next = (k + 1) % 3;
+      bool k_in = p[k](2) >= NEAR_PLANE;
+      bool next_in = p[next](2) >= NEAR_PLANE;
+      if(k_in)
+      {
+        clipped[n] = p[k];
+        clipped_value[n++] = value[k];
+      }
+      if(k_in != next_in)
+      {
+        float s = (NEAR_PLANE - p[k](2))/(p[next](2) - p[k](2));
+        clipped[n] = p[k] + s*(p[next] - p[k]);
+        clipped[n](2) = NEAR_PLANE;
+        clipped_value[n++] = value[k] + s*(value[next] - value[k]);
+      }
+    }
+    AddTriangle(task, clipped, clipped_value);
+    if(n == 4)
+    {
+      Eigen::Vector3f fan[3] = {clipped[0], clipped[2], clipped[3]};
+      float fan_value[3] = {clipped_value[0], clipped_value[2], clipped_value[3]};
+      AddTriangle(task, fan, fan_value);
+    }
+  }
+}
+
+void MeshRasterizer::AddTriangle(unsigned int task, const Eigen::Vector3f* p, const float* value)
+{
+  // Pixel (j, i) samples the screen at (j + 0.5, i + 0.5)
+  double sx[3], sy[3];
+  for(int k = 0; k < 3; k++)
+  {
+    sx[k] = (K(0,0)*p[k](0) + K(0,1)*p[k](1))/p[k](2) + K(0,2) - 0.5;
+    sy[k] = K(1,1)*p[k](1)/p[k](2) + K(1,2) - 0.5;
+  }
+
+  ScreenTriangle tri;
+  tri.xmin = std::max(0.0, std::ceil(std::min(sx[0], std::min(sx[1], sx[2]))));
+  tri.xmax = std::min(cols - 1.0, std::floor(std::max(sx[0], std::max(sx[1], sx[2]))));
+  tri.ymin = std::max(0.0, std::ceil(std::min(sy[0], std::min(sy[1], sy[2]))));
+  tri.ymax = std::min(rows - 1.0, std::floor(std::max(sy[0], std::max(sy[1], sy[2]))));
+  if(tri.xmin > tri.xmax || tri.ymin > tri.ymax)
+    return;
+
+  double area = (sx[1] - sx[0])*(sy[2] - sy[0]) - (sy[1] - sy[0])*(sx[2] - sx[0]);
+  if(std::fabs(area) < MIN_AREA)
+    return;
+  // Wind counter clockwise so inside is where all edge functions are positive
+  int order[3] = {0, 1, 2};
+  if(area < 0)
+  {
+    std::swap(order[1], order[2]);
+    area = -area;
+  }
+
+  // Edge k is opposite vertex k, set up relative to the bounding box corner
+  // so huge coordinates of clipped vertices don't eat the precision.  The
+  // edge functions divided by area are the barycentric coordinates.
+  double ex[3], ey[3], ec[3];
+  for(int k = 0; k < 3; k++)
+  {
+    int a = order[(k + 1) % 3];
+    int b = order[(k + 2) % 3];
+    ex[k] = sy[a] - sy[b];
+    ey[k] = sx[b] - sx[a];
+    ec[k] = ex[k]*(tri.xmin - sx[a]) + ey[k]*(tri.ymin - sy[a]);
+    tri.edge[k][0] = ec[k];
+    tri.edge[k][1] = ex[k];
+    tri.edge[k][2] = ey[k];
+  }
+
+  // 1/z and intensity/z interpolate linearly in screen space
+  for(int c = 0; c < 3; c++)
+  {
+    tri.inv_z[c] = 0;
+    tri.value_z[c] = 0;
+  }
+  for(int k = 0; k < 3; k++)
+  {
+    double inv_z = 1.0/p[order[k]](2);
+    double value_z = value[order[k]]*inv_z;
+    tri.inv_z[0] += ec[k]*inv_z/area;
+    tri.inv_z[1] += ex[k]*inv_z/area;
+    tri.inv_z[2] += ey[k]*inv_z/area;
+    tri.value_z[0] += ec[k]*value_z/area;
+    tri.value_z[1] += ex[k]*value_z/area;
+    tri.value_z[2] += ey[k]*value_z/area;
+  }
+
+  uint32_t index = triangles[task].size();
+  triangles[task].push_back(tri);
+  for(int ty = tri.ymin/TILE_SIZE; ty <= tri.ymax/TILE_SIZE; ty++)
+  {
+    for(int tx = tri.xmin/TILE_SIZE; tx <= tri.xmax/TILE_SIZE; tx++)
+    {
+      bins[task][ty*tiles_x + tx].push_back(index);
+    }
+  }
+}
+
+void MeshRasterizer::Rasterize(int tile, Mat* img, Mat* depth, Mat* mask)
+{
+  int col_begin = (tile % tiles_x)*TILE_SIZE;
+  int col_end = std::min(cols, col_begin + TILE_SIZE);
+  int row_begin = (tile / tiles_x)*TILE_SIZE;
+  int row_end = std::min(rows, row_begin + TILE_SIZE);
+
+  // 1/z = 0 is infinitely far
+  for(int i = row_begin; i < row_end; i++)
+  {
+    std::fill(&zbuffer[i*cols + col_begin], &zbuffer[i*cols + col_end], 0.0f);
+  }
+
+  for(unsigned int task = 0; task < bins.size(); task++)
+  {
+    const std::vector<uint32_t>& bin = bins[task][tile];
+    for(unsigned int b = 0; b < bin.size(); b++)
+    {
+      const ScreenTriangle& tri = triangles[task][bin[b]];
+      int x0 = std::max(col_begin, tri.xmin);
+      int x1 = std::min(col_end - 1, tri.xmax);
+      int y0 = std::max(row_begin, tri.ymin);
+      int y1 = std::min(row_end - 1, tri.ymax);
+      for(int i = y0; i <= y1; i++)
+      {
+        float dy = i - tri.ymin;
+        float e0 = tri.edge[0][0] + tri.edge[0][2]*dy, a0 = tri.edge[0][1];
+        float e1 = tri.edge[1][0] + tri.edge[1][2]*dy, a1 = tri.edge[1][1];
+        float e2 = tri.edge[2][0] + tri.edge[2][2]*dy, a2 = tri.edge[2][1];
+        float iz = tri.inv_z[0] + tri.inv_z[2]*dy, az = tri.inv_z[1];
+        float vz = tri.value_z[0] + tri.value_z[2]*dy, av = tri.value_z[1];
+        float* z_row = &zbuffer[i*cols];
+        float* v_row = &vbuffer[i*cols];
+        // Branch free so the loop vectorizes
+        if(img)
+        {
+          for(int j = x0; j <= x1; j++)
+          {
+            float dx = j - tri.xmin;
+            float z = iz + az*dx;
+            bool hit = (e0 + a0*dx >= 0) & (e1 + a1*dx >= 0) & (e2 + a2*dx >= 0) & (z > z_row[j]);
+            z_row[j] = hit ? z : z_row[j];
+            v_row[j] = hit ? vz + av*dx : v_row[j];
+          }
+        }
+        else
+        {
+          for(int j = x0; j <= x1; j++)
+          {
+            float dx = j - tri.xmin;
+            float z = iz + az*dx;
+            bool hit = (e0 + a0*dx >= 0) & (e1 + a1*dx >= 0) & (e2 + a2*dx >= 0) & (z > z_row[j]);
+            z_row[j] = hit ? z : z_row[j];
+          }
+        }
+      }
+    }
+  }
+
+  for(int i = row_begin; i < row_end; i++)
+  {
+    const float* z_row = &zbuffer[i*cols];
+    const float* v_row = &vbuffer[i*cols];
+    if(img)
+    {
+      uchar* img_row = img->ptr<uchar>(i);
+      for(int j = col_begin; j < col_end; j++)
+      {
+        img_row[j] = z_row[j] > 0 ? saturate_cast<uchar>(v_row[j]/z_row[j]) : 0;
+      }
+    }
+    if(depth)
+    {
+      float* depth_row = depth->ptr<float>(i);
+      for(int j = col_begin; j < col_end; j++)
+      {
+        depth_row[j] = z_row[j] > 0 ? 1.0f/z_row[j] : -1.0f;
+      }
+    }
+    if(mask)
+    {
+      uchar* mask_row = mask->ptr<uchar>(i);
+      for(int j = col_begin; j < col_end; j++)
+      {
+        mask_row[j] = z_row[j] > 0 ? 255 : 0;
+      }
+    }
+  }
+}
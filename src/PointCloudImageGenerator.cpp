@@ -1,15 +1,42 @@
 #include "mesh_localize/PointCloudImageGenerator.h"
 
+#include <limits>
+#include <algorithm>
+#include <boost/bind.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
+#include "mesh_localize/Log.h"
 
 using namespace cv;
 
-PointCloudImageGenerator::PointCloudImageGenerator(pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr pc, const Eigen::Matrix3f& K, int rows, int cols) :
-  map_cloud(pc),
+PointCloudImageGenerator::PointCloudImageGenerator(pcl::PointCloud<pcl::PointXYZRGBNormal>::Ptr pc, const Eigen::Matrix3f& K, int rows, int cols,
+  boost::shared_ptr<WorkerPool> shared_workers, float chunk_size, bool backface_culling, float lod_pixel_spacing) :
+  map_chunks(*pc, chunk_size, lod_pixel_spacing > 0),
+  workers(shared_workers ? shared_workers : boost::make_shared<WorkerPool>(boost::thread::hardware_concurrency())),
+  renderer(K, rows, cols, workers),
   K(K),
   rows(rows),
-  cols(cols)
+  cols(cols),
+  backface_culling(backface_culling),
+  lod_pixel_spacing(lod_pixel_spacing)
 {
+  renderer.SetBackfaceCulling(backface_culling);
+  min_pt = Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+  max_pt = -min_pt;
+  for(unsigned int i = 0; i < pc->points.size(); i++)
+  {
+    Eigen::Vector3f p = pc->points[i].getVector3fMap();
+    min_pt = min_pt.cwiseMin(p);
+    max_pt = max_pt.cwiseMax(p);
+  }
+  ML_INFO("Split %lu map points into %lu chunks", map_chunks.NumPoints(), map_chunks.NumChunks());
+}
+
+PointCloudImageGenerator::~PointCloudImageGenerator()
+{
+  for(unsigned int i = 0; i < lanes.size(); i++)
+  {
+    delete lanes[i];
+  }
 }
 
 Eigen::Matrix3f PointCloudImageGenerator::GetK()
@@ -19,44 +46,93 @@ Eigen::Matrix3f PointCloudImageGenerator::GetK()
 
 cv::Mat PointCloudImageGenerator::GenerateVirtualImage(const Eigen::Matrix4f& tf, cv::Mat& depths, cv::Mat& mask)
 {
-  double scale = 1.0;
-  int height = rows * scale;
-  int width = cols * scale;
-
-  Mat img(height, width, CV_8U, Scalar(0));
-  depths = Mat(height, width, CV_32F, Scalar(-1));
-  mask = Mat(height, width, CV_8U, Scalar(0));
-
-  Eigen::MatrixXf P(3,4);
-  P = K*tf.inverse().block<3,4>(0,0);
-  for(unsigned int j = 0; j < map_cloud->points.size(); j++)
-  {
-    Eigen::Matrix3f Rinv = tf.inverse().block<3,3>(0,0);
-    Eigen::Vector3f normal(map_cloud->points[j].normal_x, map_cloud->points[j].normal_y, map_cloud->points[j].normal_z);
-    normal = Rinv*normal;
-
-    Eigen::Vector4f hpt(map_cloud->points[j].x, map_cloud->points[j].y, map_cloud->points[j].z, 1);
-    Eigen::Vector3f impt = P*hpt;
-    impt /= impt(2);
-    int dx_idx = floor(impt(0)*scale);
-    int dy_idx = floor(impt(1)*scale);
-    if(dx_idx < 0  || dx_idx >= width || dy_idx < 0 || dy_idx >= height)
-    {
-      continue;
-    }
-    double depth = (tf.inverse()*hpt)(2);
-    
-    if(depth > 0 /*&& normal(2) < 0*/ && (depths.at<float>(dy_idx, dx_idx) == -1 || depth < depths.at<float>(dy_idx, dx_idx)))
-    {
-      depths.at<float>(dy_idx, dx_idx) = depth;
-      mask.at<uchar>(dy_idx, dx_idx) = 255;
-      img.at<uchar>(dy_idx, dx_idx) = (*reinterpret_cast<int*>(&(map_cloud->points[j].rgb)) & 0x0000ff);
-    }
+  return Render(renderer, tf, K, rows, cols, depths, mask);
+}
+
+cv::Mat PointCloudImageGenerator::GenerateCroppedVirtualImage(const Eigen::Matrix4f& tf, int margin, cv::Mat& depths,
+  cv::Mat& mask, cv::Rect& roi)
+{
+  roi = ProjectBounds(min_pt, max_pt, tf, K, rows, cols, margin);
+  return Render(renderer, tf, CropK(K, roi), roi.height, roi.width, depths, mask);
+}
+
+void PointCloudImageGenerator::GenerateVirtualImages(const PoseList& poses, std::vector<cv::Mat>& images,
+  std::vector<cv::Mat>& depths, std::vector<cv::Mat>& masks, int outputs)
+{
+  images.resize(poses.size());
+  depths.resize(poses.size());
+  masks.resize(poses.size());
+  if(poses.empty())
+    return;
+  if(poses.size() == 1)
+  {
+    images[0] = Render(renderer, poses[0], K, rows, cols, depths[0], masks[0], outputs);
+    return;
+  }
+
+  unsigned int num_lanes = std::min<size_t>(poses.size(), std::max(1u, workers->NumThreads()));
+  SetupLanes(num_lanes);
+  std::vector< boost::function<void()> > tasks;
+  for(unsigned int lane = 0; lane < num_lanes; lane++)
+  {
+    tasks.push_back(boost::bind(&PointCloudImageGenerator::RenderLane, this, lane, boost::cref(poses),
+      boost::ref(images), boost::ref(depths), boost::ref(masks), outputs));
+  }
+  workers->RunAll(tasks);
+}
+
+void PointCloudImageGenerator::SetupLanes(unsigned int num_lanes)
+{
+  if(lanes.size() == num_lanes)
+    return;
+
+  for(unsigned int i = 0; i < lanes.size(); i++)
+  {
+    delete lanes[i];
+  }
+  lanes.clear();
+  for(unsigned int i = 0; i < num_lanes; i++)
+  {
+    // the lanes' renders share the workers the lanes run on
+    lanes.push_back(new SplatRenderer(K, rows, cols, workers));
+    lanes.back()->SetBackfaceCulling(backface_culling);
+  }
+}
+
+void PointCloudImageGenerator::RenderLane(unsigned int lane, const PoseList& poses, std::vector<cv::Mat>& images,
+  std::vector<cv::Mat>& depths, std::vector<cv::Mat>& masks, int outputs)
+{
+  for(unsigned int i = lane; i < poses.size(); i += lanes.size())
+  {
+    images[i] = Render(*lanes[lane], poses[i], K, rows, cols, depths[i], masks[i], outputs);
   }
+}
+
+cv::Mat PointCloudImageGenerator::Render(SplatRenderer& renderer, const Eigen::Matrix4f& tf, const Eigen::Matrix3f& K,
+  int rows, int cols, cv::Mat& depths, cv::Mat& mask, int outputs)
+{
+  // only chunks in view are projected, far ones at a coarser level
+  std::vector<VisibleChunk> visible;
+  map_chunks.GetVisibleChunks(tf, K, rows, cols, backface_culling, visible);
+  float focal = std::max(K(0,0), K(1,1));
+  std::vector<const PointBlock*> blocks(visible.size());
+  for(unsigned int i = 0; i < visible.size(); i++)
+  {
+    if(lod_pixel_spacing > 0)
+      blocks[i] = &ChunkedPointCloud::SelectLevel(*visible[i].chunk, visible[i].near_depth, focal, lod_pixel_spacing);
+    else
+      blocks[i] = &visible[i].chunk->levels[0];
+  }
+
+  Mat img;
+  renderer.SetCamera(K, rows, cols);
+  renderer.Render(tf, blocks, img, depths, mask, outputs);
 
   //pyrUp(img, img);//, Size(oldheight, oldwidth));
-  medianBlur(img, img, 3);
-  medianBlur(depths, depths, 5);
+  if(!img.empty())
+    medianBlur(img, img, 3);
+  if(!depths.empty())
+    medianBlur(depths, depths, 5);
   //medianBlur(mask, mask, 3);
   return img;
 }
@@ -0,0 +1,114 @@
+#include "mesh_localize/PointUndistorter.h"
+
+#include <cmath>
+#include <opencv2/imgproc/imgproc.hpp>
+
+using namespace cv;
+
+PointUndistorter::PointUndistorter(const Mat& K, const Mat& distcoeff, const Size& size,
+  int lut_step) :
+  size(size),
+  lut_step(lut_step > 0 ? lut_step : 1)
+{
+  K.convertTo(this->K, CV_64F);
+  distcoeff.convertTo(this->distcoeff, CV_64F);
+  fx = this->K.at<double>(0,0);
+  fy = this->K.at<double>(1,1);
+  cx = this->K.at<double>(0,2);
+  cy = this->K.at<double>(1,2);
+  k1 = this->distcoeff.at<double>(0);
+  k2 = this->distcoeff.at<double>(1);
+  p1 = this->distcoeff.at<double>(2);
+  p2 = this->distcoeff.at<double>(3);
+  k3 = this->distcoeff.total() > 4 ? this->distcoeff.at<double>(4) : 0;
+
+  // Undistorted coordinates for a grid over the distorted image
+  int lut_cols = size.width/this->lut_step + 2;
+  int lut_rows = size.height/this->lut_step + 2;
+  Mat grid(lut_rows*lut_cols, 1, CV_32FC2);
+  for(int y = 0; y < lut_rows; y++)
+  {
+    for(int x = 0; x < lut_cols; x++)
+    {
+      grid.at<Point2f>(y*lut_cols + x) = Point2f(x*this->lut_step, y*this->lut_step);
+    }
+  }
+  Mat undistorted;
+  undistortPoints(grid, undistorted, this->K, this->distcoeff, noArray(), this->K);
+  lut = undistorted.reshape(2, lut_rows);
+
+  initUndistortRectifyMap(this->K, this->distcoeff, Mat::eye(3, 3, CV_64F), this->K, size,
+    CV_16SC2, map1, map2);
+
+  // Undistorted position of every distorted pixel, to warp images the other way
+  Mat distort_map(size, CV_32FC2);
+  for(int y = 0; y < size.height; y++)
+  {
+    Point2f* row = distort_map.ptr<Point2f>(y);
+    for(int x = 0; x < size.width; x++)
+    {
+      row[x] = Undistort(Point2f(x, y));
+    }
+  }
+  convertMaps(distort_map, Mat(), distort_map1, distort_map2, CV_16SC2);
+}
+
+Point2f PointUndistorter::UndistortExact(const Point2f& pt) const
+{
+  std::vector<Point2f> src(1, pt), dst;
+  undistortPoints(src, dst, K, distcoeff, noArray(), K);
+  return dst[0];
+}
+
+Point2f PointUndistorter::Undistort(const Point2f& pt) const
+{
+  float gx = pt.x/lut_step;
+  float gy = pt.y/lut_step;
+  int x0 = floor(gx);
+  int y0 = floor(gy);
+  if(x0 < 0 || y0 < 0 || x0 >= lut.cols-1 || y0 >= lut.rows-1)
+    return UndistortExact(pt);
+
+  float ax = gx - x0;
+  float ay = gy - y0;
+  const Point2f* r0 = lut.ptr<Point2f>(y0) + x0;
+  const Point2f* r1 = lut.ptr<Point2f>(y0+1) + x0;
+  return (1-ay)*((1-ax)*r0[0] + ax*r0[1]) + ay*((1-ax)*r1[0] + ax*r1[1]);
+}
+
+void PointUndistorter::Undistort(std::vector<Point2f>& pts) const
+{
+  for(unsigned int i = 0; i < pts.size(); i++)
+  {
+    pts[i] = Undistort(pts[i]);
+  }
+}
+
+void PointUndistorter::Undistort(std::vector<KeyPoint>& kps) const
+{
+  for(unsigned int i = 0; i < kps.size(); i++)
+  {
+    kps[i].pt = Undistort(kps[i].pt);
+  }
+}
+
+Point2f PointUndistorter::Distort(const Point2f& pt) const
+{
+  double x = (pt.x - cx)/fx;
+  double y = (pt.y - cy)/fy;
+  double r2 = x*x + y*y;
+  double radial = 1 + k1*r2 + k2*r2*r2 + k3*r2*r2*r2;
+  double xd = x*radial + 2*p1*x*y + p2*(r2 + 2*x*x);
+  double yd = y*radial + p1*(r2 + 2*y*y) + 2*p2*x*y;
+  return Point2f(fx*xd + cx, fy*yd + cy);
+}
+
+void PointUndistorter::UndistortImage(const Mat& src, Mat& dst) const
+{
+  remap(src, dst, map1, map2, INTER_LINEAR);
+}
+
+void PointUndistorter::DistortImage(const Mat& src, Mat& dst, int interpolation) const
+{
+  remap(src, dst, distort_map1, distort_map2, interpolation);
+}
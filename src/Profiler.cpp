@@ -0,0 +1,272 @@
+#include "mesh_localize/Profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+
+// Events are handed to the shared histograms in batches of this size
+static const unsigned int FLUSH_SIZE = 256;
+static const int SUB_BITS = 3;
+static const int NUM_BUCKETS = 64 << SUB_BITS;
+
+thread_local Profiler::ThreadBuffer* Profiler::thread_buffer = NULL;
+
+Profiler::Histogram::Histogram() :
+  count(0),
+  sum(0),
+  max(0),
+  buckets(NUM_BUCKETS, 0)
+{
+}
+
+int Profiler::Histogram::Bucket(uint64_t value)
+{
+  if(value < (1u << SUB_BITS))
+    return value;
+  int e = 63 - __builtin_clzll(value);
+  return ((e - SUB_BITS + 1) << SUB_BITS) + ((value >> (e - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+}
+
+uint64_t Profiler::Histogram::BucketStart(int bucket)
+{
+  if(bucket < (1 << SUB_BITS))
+    return bucket;
+  int e = (bucket >> SUB_BITS) + SUB_BITS - 1;
+  uint64_t sub = bucket & ((1 << SUB_BITS) - 1);
+  return ((1ull << SUB_BITS) + sub) << (e - SUB_BITS);
+}
+
+void Profiler::Histogram::Add(uint64_t value)
+{
+  buckets[Bucket(value)]++;
+  count++;
+  sum += value;
+  max = std::max(max, value);
+}
+
+double Profiler::Histogram::Percentile(double p) const
+{
+  if(count == 0)
+    return 0;
+  unsigned long target = std::max(1ul, (unsigned long)(p*count + 0.5));
+  unsigned long seen = 0;
+  for(int i = 0; i < NUM_BUCKETS; i++)
+  {
+    seen += buckets[i];
+    if(seen >= target)
+    {
+      // report the middle of the bucket, never more than the largest sample
+      double lo = BucketStart(i);
+      double hi = i+1 < NUM_BUCKETS ? BucketStart(i+1) : lo;
+      return std::min(0.5*(lo + hi), (double)max);
+    }
+  }
+  return max;
+}
+
+Profiler& Profiler::Instance()
+{
+  static Profiler profiler;
+  return profiler;
+}
+
+int64_t Profiler::Now()
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Profiler::Profiler() :
+  enabled(true),
+  trace_capacity(100000),
+  trace_next(0)
+{
+}
+
+Profiler::ThreadBuffer* Profiler::GetThreadBuffer()
+{
+  if(!thread_buffer)
+  {
+    boost::shared_ptr<ThreadBuffer> buffer(new ThreadBuffer);
+    buffer->events.reserve(FLUSH_SIZE);
+    boost::mutex::scoped_lock lock(buffers_mutex);
+    buffer->tid = buffers.size();
+    buffers.push_back(buffer);
+    thread_buffer = buffer.get();
+  }
+  return thread_buffer;
+}
+
+void Profiler::Record(const char* stage, int64_t start_ns, int64_t end_ns)
+{
+  if(!enabled)
+    return;
+
+  ThreadBuffer* buffer = GetThreadBuffer();
+  std::vector<Event> full;
+  {
+    // only contended while statistics are being collected
+    boost::mutex::scoped_lock lock(buffer->mutex);
+    Event e = {stage, start_ns, end_ns, buffer->tid};
+    buffer->events.push_back(e);
+    if(buffer->events.size() < FLUSH_SIZE)
+      return;
+    full.reserve(FLUSH_SIZE);
+    full.swap(buffer->events);
+  }
+  Merge(full);
+}
+
+void Profiler::CountFrame(const char* state)
+{
+  if(!enabled)
+    return;
+  boost::mutex::scoped_lock lock(stats_mutex);
+  frame_counts[state]++;
+}
+
+void Profiler::Merge(const std::vector<Event>& events)
+{
+  boost::mutex::scoped_lock lock(stats_mutex);
+  for(unsigned int i = 0; i < events.size(); i++)
+  {
+    const Event& e = events[i];
+    histograms[e.stage].Add(e.end > e.start ? e.end - e.start : 0);
+
+    if(trace_capacity == 0)
+      continue;
+    if(trace.size() < trace_capacity)
+    {
+      trace.push_back(e);
+    }
+    else
+    {
+      trace[trace_next] = e;
+      trace_next = (trace_next + 1) % trace_capacity;
+    }
+  }
+}
+
+void Profiler::FlushAll()
+{
+  std::vector< boost::shared_ptr<ThreadBuffer> > current;
+  {
+    boost::mutex::scoped_lock lock(buffers_mutex);
+    current = buffers;
+  }
+  for(unsigned int i = 0; i < current.size(); i++)
+  {
+    std::vector<Event> events;
+    {
+      boost::mutex::scoped_lock lock(current[i]->mutex);
+      events.swap(current[i]->events);
+    }
+    Merge(events);
+  }
+}
+
+void Profiler::GetStageStats(std::vector<StageStats>& stats)
+{
+  FlushAll();
+  stats.clear();
+  boost::mutex::scoped_lock lock(stats_mutex);
+  for(std::map<std::string, Histogram>::const_iterator it = histograms.begin();
+    it != histograms.end(); it++)
+  {
+    const Histogram& h = it->second;
+    StageStats s;
+    s.name = it->first;
+    s.count = h.count;
+    s.mean_ms = h.count > 0 ? 1e-6*h.sum/h.count : 0;
+    s.p50_ms = 1e-6*h.Percentile(0.50);
+    s.p95_ms = 1e-6*h.Percentile(0.95);
+    s.p99_ms = 1e-6*h.Percentile(0.99);
+    s.max_ms = 1e-6*h.max;
+    stats.push_back(s);
+  }
+}
+
+void Profiler::GetFrameCounts(std::map<std::string, unsigned long>& counts)
+{
+  boost::mutex::scoped_lock lock(stats_mutex);
+  counts = frame_counts;
+}
+
+bool Profiler::WriteChromeTrace(const std::string& filename)
+{
+  FlushAll();
+  std::ofstream out(filename.c_str());
+  if(!out.is_open())
+    return false;
+
+  boost::mutex::scoped_lock lock(stats_mutex);
+  int64_t origin = 0;
+  for(unsigned int i = 0; i < trace.size(); i++)
+  {
+    if(i == 0 || trace[i].start < origin)
+      origin = trace[i].start;
+  }
+
+  out << "{\"traceEvents\":[";
+  for(unsigned int n = 0; n < trace.size(); n++)
+  {
+    // oldest first once the ring buffer has wrapped
+    const Event& e = trace[(trace_next + n) % trace.size()];
+    out << (n > 0 ? ",\n" : "\n") << "{\"name\":\"" << e.stage << "\",\"cat\":\"mesh_localize\","
+        << "\"ph\":\"X\",\"pid\":1,\"tid\":" << e.tid << ","
+        << "\"ts\":" << 1e-3*(e.start - origin) << ",\"dur\":" << 1e-3*(e.end - e.start) << "}";
+  }
+  out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+  return out.good();
+}
+
+void Profiler::Reset()
+{
+  FlushAll();
+  boost::mutex::scoped_lock lock(stats_mutex);
+  histograms.clear();
+  frame_counts.clear();
+  trace.clear();
+  trace_next = 0;
+}
+
+void Profiler::SetEnabled(bool enabled)
+{
+  this->enabled = enabled;
+}
+
+bool Profiler::IsEnabled() const
+{
+  return enabled;
+}
+
+void Profiler::SetTraceCapacity(unsigned int capacity)
+{
+  boost::mutex::scoped_lock lock(stats_mutex);
+  trace_capacity = capacity;
+  trace.clear();
+  trace_next = 0;
+}
+
+ScopedTimer::ScopedTimer(const char* stage) :
+  stage(stage),
+  start(Profiler::Now()),
+  stopped(false)
+{
+}
+
+ScopedTimer::~ScopedTimer()
+{
+  Stop();
+}
+
+double ScopedTimer::Stop()
+{
+  int64_t end = Profiler::Now();
+  if(!stopped)
+  {
+    Profiler::Instance().Record(stage, start, end);
+    stopped = true;
+  }
+  return 1e-9*(end - start);
+}
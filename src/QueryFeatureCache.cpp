@@ -0,0 +1,86 @@
+#include "mesh_localize/QueryFeatureCache.h"
+
+#include <sstream>
+#include "mesh_localize/KeyframeContainer.h"
+#include "mesh_localize/Profiler.h"
+
+QueryFeatureCache::QueryFeatureCache() :
+  num_trackers(1)
+{
+}
+
+void QueryFeatureCache::Reset(const Mat& image, unsigned int num_trackers)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  this->image = image;
+  this->num_trackers = num_trackers > 0 ? num_trackers : 1;
+  entries.clear();
+}
+
+bool QueryFeatureCache::CanShare(const std::string& desc_type)
+{
+  return desc_type != "surf_gpu";
+}
+
+bool QueryFeatureCache::Get(const Mat& image, const std::string& desc_type, int max_features, const Mat& mask,
+  const PointUndistorter* undistorter, std::vector<KeyPoint>& keypoints, Mat& descriptors)
+{
+  if(!CanShare(desc_type))
+    return false;
+
+  std::stringstream key;
+  key << desc_type << "/" << max_features;
+  boost::shared_ptr<Entry> entry;
+  Mat frame;
+  unsigned int budget_scale;
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    // only frames that are the shared frame, not e.g. an undistorted copy
+    if(this->image.empty() || image.data != this->image.data || image.size() != this->image.size())
+      return false;
+    boost::shared_ptr<Entry>& e = entries[key.str()];
+    if(!e)
+      e.reset(new Entry);
+    entry = e;
+    frame = this->image;
+    budget_scale = num_trackers;
+  }
+
+  {
+    // Other trackers wanting the same features wait here for the first one
+    boost::mutex::scoped_lock lock(entry->mutex);
+    if(!entry->extracted)
+    {
+      PROFILE_SCOPE("shared_extract");
+      KeyframeContainer kf(frame, desc_type, false);
+      kf.SetMaxFeatures(max_features*budget_scale);
+      kf.ExtractFeatures();
+      entry->keypoints = kf.GetKeypoints();
+      entry->descriptors = kf.GetDescriptors();
+      entry->extracted = true;
+    }
+  }
+
+  keypoints.clear();
+  std::vector<int> rows;
+  for(unsigned int i = 0; i < entry->keypoints.size(); i++)
+  {
+    int x = cvRound(entry->keypoints[i].pt.x);
+    int y = cvRound(entry->keypoints[i].pt.y);
+    if(x < 0 || y < 0 || x >= mask.cols || y >= mask.rows || mask.at<uchar>(y, x) == 0)
+      continue;
+    keypoints.push_back(entry->keypoints[i]);
+    rows.push_back(i);
+  }
+  descriptors.create(rows.size(), entry->descriptors.cols, entry->descriptors.type());
+  for(unsigned int i = 0; i < rows.size(); i++)
+  {
+    entry->descriptors.row(rows[i]).copyTo(descriptors.row(i));
+  }
+
+  if(undistorter)
+  {
+    undistorter->Undistort(keypoints);
+  }
+  return true;
+}
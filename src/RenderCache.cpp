@@ -0,0 +1,227 @@
+#include "mesh_localize/RenderCache.h"
+#include "mesh_localize/Profiler.h"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <Eigen/Geometry>
+#include "mesh_localize/Log.h"
+
+using namespace cv;
+
+// Rotation angle between the rotations of two poses
+static double RotationDistance(const Eigen::Matrix4f& a, const Eigen::Matrix4f& b)
+{
+  Eigen::Matrix3f dR = a.block<3,3>(0,0).transpose()*b.block<3,3>(0,0);
+  double c = std::max(-1.0, std::min(1.0, 0.5*(dR.trace() - 1.0)));
+  return acos(c);
+}
+
+static bool ValidDepth(float d)
+{
+  return d != 0 && d != -1;
+}
+
+RenderCache::RenderCache(unsigned int capacity, double trans_tol, double rot_tol, double warp_trans_tol,
+  double warp_rot_tol) :
+  capacity(std::max(1u, capacity)),
+  trans_tol(trans_tol),
+  rot_tol(rot_tol),
+  warp_trans_tol(warp_trans_tol),
+  warp_rot_tol(warp_rot_tol),
+  clock(0),
+  num_hits(0),
+  num_warps(0),
+  num_misses(0)
+{
+}
+
+RenderCache::~RenderCache()
+{
+  for(EntryMap::iterator it = entries.begin(); it != entries.end(); it++)
+  {
+    delete it->second;
+  }
+}
+
+RenderCache::PoseKey RenderCache::Quantize(const Eigen::Matrix4f& pose) const
+{
+  Eigen::AngleAxisf aa(Eigen::Matrix3f(pose.block<3,3>(0,0)));
+  Eigen::Vector3f rot = aa.angle()*aa.axis();
+  PoseKey key(6);
+  for(int i = 0; i < 3; i++)
+  {
+    key[i] = trans_tol > 0 ? std::floor(pose(i,3)/trans_tol) : 0;
+    key[i+3] = rot_tol > 0 ? std::floor(rot(i)/rot_tol) : 0;
+  }
+  return key;
+}
+
+RenderCache::Result RenderCache::Lookup(Eigen::Matrix4f& pose, Mat& image, Mat& depth, Mat& mask,
+  Eigen::Matrix3f& K)
+{
+  EntryMap::iterator it = entries.find(Quantize(pose));
+  if(it != entries.end())
+  {
+    Entry* entry = it->second;
+    entry->last_used = ++clock;
+    pose = entry->pose;
+    image = entry->image;
+    depth = entry->depth;
+    mask = entry->mask;
+    K = entry->K;
+    num_hits++;
+    return HIT;
+  }
+
+  // nearest render, translation and rotation relative to their tolerances
+  const Entry* nearest = NULL;
+  double nearest_dist = std::numeric_limits<double>::max();
+  for(it = entries.begin(); it != entries.end(); it++)
+  {
+    double dt = (it->second->pose.block<3,1>(0,3) - pose.block<3,1>(0,3)).norm();
+    double dr = RotationDistance(it->second->pose, pose);
+    if(dt > warp_trans_tol || dr > warp_rot_tol)
+      continue;
+    double dist = std::max(dt/std::max(warp_trans_tol, 1e-9), dr/std::max(warp_rot_tol, 1e-9));
+    if(dist < nearest_dist)
+    {
+      nearest = it->second;
+      nearest_dist = dist;
+    }
+  }
+  if(nearest)
+  {
+    Warp(*nearest, pose, image, depth, mask);
+    K = nearest->K;
+    num_warps++;
+    return WARPED;
+  }
+
+  num_misses++;
+  ML_DEBUG("RenderCache: miss (%lu hits, %lu warps, %lu misses)", num_hits, num_warps, num_misses);
+  return MISS;
+}
+
+void RenderCache::Insert(const Eigen::Matrix4f& pose, const Mat& image, const Mat& depth, const Mat& mask,
+  const Eigen::Matrix3f& K)
+{
+  PoseKey key = Quantize(pose);
+  Entry*& entry = entries[key];
+  if(!entry)
+  {
+    if(entries.size() > capacity)
+    {
+      EntryMap::iterator oldest = entries.end();
+      for(EntryMap::iterator it = entries.begin(); it != entries.end(); it++)
+      {
+        if(it->second && (oldest == entries.end() || it->second->last_used < oldest->second->last_used))
+          oldest = it;
+      }
+      delete oldest->second;
+      entries.erase(oldest);
+    }
+    entry = new Entry;
+  }
+  entry->pose = pose;
+  entry->K = K;
+  entry->image = image;
+  entry->depth = depth;
+  entry->mask = mask;
+  entry->features.clear();
+  entry->last_used = ++clock;
+}
+
+RenderCache::Entry* RenderCache::FindEntry(const Mat& image)
+{
+  for(EntryMap::iterator it = entries.begin(); it != entries.end(); it++)
+  {
+    if(it->second->image.data == image.data)
+      return it->second;
+  }
+  return NULL;
+}
+
+bool RenderCache::GetFeatures(const Mat& image, const std::string& key, std::vector<KeyPoint>& keypoints,
+  Mat& descriptors)
+{
+  Entry* entry = FindEntry(image);
+  if(!entry)
+    return false;
+  std::map<std::string, Features>::const_iterator it = entry->features.find(key);
+  if(it == entry->features.end())
+    return false;
+  keypoints = it->second.keypoints;
+  descriptors = it->second.descriptors;
+  return true;
+}
+
+void RenderCache::SetFeatures(const Mat& image, const std::string& key, const std::vector<KeyPoint>& keypoints,
+  const Mat& descriptors)
+{
+  Entry* entry = FindEntry(image);
+  if(!entry)
+    return;
+  Features& features = entry->features[key];
+  features.keypoints = keypoints;
+  features.descriptors = descriptors;
+}
+
+void RenderCache::Warp(const Entry& entry, const Eigen::Matrix4f& pose, Mat& image, Mat& depth, Mat& mask)
+{
+  PROFILE_SCOPE("render_cache_warp");
+  const Mat& src_image = entry.image;
+  const Mat& src_depth = entry.depth;
+  const Mat& src_mask = entry.mask;
+  image = Mat::zeros(src_image.rows, src_image.cols, src_image.type());
+  depth = Mat(src_depth.rows, src_depth.cols, CV_32F, Scalar(-1));
+  mask = Mat::zeros(src_mask.rows, src_mask.cols, CV_8U);
+
+  // cached camera to requested camera
+  Eigen::Matrix4f rel = pose.inverse()*entry.pose;
+  Eigen::Matrix3f R = rel.block<3,3>(0,0);
+  Eigen::Vector3f t = rel.block<3,1>(0,3);
+  const Eigen::Matrix3f& K = entry.K;
+  Eigen::Matrix3f K_inv = K.inverse();
+  size_t elem_size = src_image.elemSize();
+
+  for(int i = 0; i < src_depth.rows; i++)
+  {
+    const float* depth_row = src_depth.ptr<float>(i);
+    const uchar* mask_row = src_mask.ptr<uchar>(i);
+    for(int j = 0; j < src_depth.cols; j++)
+    {
+      float d = depth_row[j];
+      if(!ValidDepth(d) || !mask_row[j])
+        continue;
+
+      Eigen::Vector3f p = R*(d*(K_inv*Eigen::Vector3f(j, i, 1))) + t;
+      if(p(2) <= 0)
+        continue;
+      Eigen::Vector3f uv = K*p;
+      float u = uv(0)/uv(2);
+      float v = uv(1)/uv(2);
+      // Splat onto the 4 pixels around the warped point, so magnified
+      // surfaces don't crack
+      int u0 = std::floor(u);
+      int v0 = std::floor(v);
+      for(int y = v0; y <= v0 + 1; y++)
+      {
+        if(y < 0 || y >= depth.rows)
+          continue;
+        float* dst_depth = depth.ptr<float>(y);
+        for(int x = u0; x <= u0 + 1; x++)
+        {
+          if(x < 0 || x >= depth.cols)
+            continue;
+          if(dst_depth[x] > 0 && dst_depth[x] <= p(2))
+            continue;
+          dst_depth[x] = p(2);
+          memcpy(image.ptr(y) + x*elem_size, src_image.ptr(i) + j*elem_size, elem_size);
+          mask.at<uchar>(y, x) = 255;
+        }
+      }
+    }
+  }
+}
@@ -0,0 +1,201 @@
+#include "mesh_localize/RenderService.h"
+#include "mesh_localize/Profiler.h"
+#include "mesh_localize/Log.h"
+
+RenderResponse::RenderResponse() :
+  seq(0)
+{
+  pose = Eigen::Matrix4f::Identity();
+}
+
+RenderService::RenderService() :
+  running(false),
+  ready(false),
+  setup_ok(false),
+  next_seq(1),
+  current_seq(0),
+  current_cancelled(false)
+{
+}
+
+RenderService::~RenderService()
+{
+  Stop();
+}
+
+bool RenderService::Start()
+{
+  boost::mutex::scoped_lock lock(mutex);
+  running = true;
+  worker = boost::thread(&RenderService::Run, this);
+  while(!ready)
+  {
+    cond.wait(lock);
+  }
+  return setup_ok;
+}
+
+void RenderService::Stop()
+{
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    running = false;
+    requests.clear();
+    cond.notify_all();
+  }
+  if(worker.joinable())
+  {
+    worker.join();
+  }
+}
+
+void RenderService::Run()
+{
+  bool ok = Setup();
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    setup_ok = ok;
+    ready = true;
+    if(!ok)
+      running = false;
+    cond.notify_all();
+  }
+  if(!ok)
+  {
+    return;
+  }
+
+  while(true)
+  {
+    PendingRender request;
+    {
+      boost::mutex::scoped_lock lock(mutex);
+      while(running && requests.empty())
+      {
+        cond.wait(lock);
+      }
+      if(!running)
+        break;
+      request = requests.front();
+      requests.pop_front();
+      current_seq = request.seq;
+      current_cancelled = false;
+    }
+
+    RenderResponse response;
+    bool rendered;
+    {
+      PROFILE_SCOPE("render_service");
+      rendered = Render(request.pose, response);
+    }
+    response.seq = request.seq;
+
+    boost::mutex::scoped_lock lock(mutex);
+    if(rendered && !current_cancelled)
+      responses[request.seq] = response;
+    current_seq = 0;
+    cond.notify_all();
+  }
+  Teardown();
+}
+
+unsigned long RenderService::Request(const Eigen::Matrix4f& pose)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  PendingRender request;
+  request.seq = next_seq++;
+  request.pose = pose;
+  if(running)
+  {
+    requests.push_back(request);
+    cond.notify_all();
+  }
+  return request.seq;
+}
+
+bool RenderService::Wait(unsigned long seq, RenderResponse& response)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  while(true)
+  {
+    ResponseMap::iterator it = responses.find(seq);
+    if(it != responses.end())
+    {
+      response = it->second;
+      responses.erase(it);
+      return true;
+    }
+
+    bool pending = current_seq == seq;
+    for(unsigned int i = 0; i < requests.size() && !pending; i++)
+    {
+      pending = requests[i].seq == seq;
+    }
+    if(!running || !pending)
+      return false;
+    cond.wait(lock);
+  }
+}
+
+void RenderService::Cancel(unsigned long seq)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  for(unsigned int i = 0; i < requests.size(); i++)
+  {
+    if(requests[i].seq == seq)
+    {
+      requests.erase(requests.begin() + i);
+      cond.notify_all();
+      return;
+    }
+  }
+  if(current_seq == seq)
+  {
+    current_cancelled = true;
+    cond.notify_all();
+  }
+  responses.erase(seq);
+}
+
+GeneratorRenderService::GeneratorRenderService(GeneratorFactory factory) :
+  factory(factory),
+  generator(NULL)
+{
+  K = Eigen::Matrix3f::Identity();
+}
+
+GeneratorRenderService::~GeneratorRenderService()
+{
+  // Render and Teardown must not run once this part is gone
+  Stop();
+}
+
+Eigen::Matrix3f GeneratorRenderService::GetK()
+{
+  return K;
+}
+
+bool GeneratorRenderService::Setup()
+{
+  generator = factory();
+  if(!generator)
+  {
+    ML_ERROR("GeneratorRenderService: could not create the virtual image generator");
+    return false;
+  }
+  K = generator->GetK();
+  return true;
+}
+
+void GeneratorRenderService::Teardown()
+{
+  delete generator;
+  generator = NULL;
+}
+
+bool GeneratorRenderService::Render(const Eigen::Matrix4f& pose, RenderResponse& response)
+{
+  response.pose = pose;
+  response.image = generator->GenerateVirtualImage(pose, response.depth, response.mask);
+  return !response.image.empty();
+}
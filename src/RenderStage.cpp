@@ -0,0 +1,233 @@
+#include "mesh_localize/RenderStage.h"
+#include "mesh_localize/Profiler.h"
+#include "mesh_localize/Log.h"
+#include <algorithm>
+#include <cmath>
+
+RenderJob::RenderJob(const Eigen::Matrix4f& pose, int crop_margin) :
+  pose(pose),
+  crop_margin(crop_margin),
+  done(false),
+  cancelled(false)
+{
+  K = Eigen::Matrix3f::Identity();
+}
+
+void RenderJob::Finish(const cv::Mat& image, const cv::Mat& depth, const cv::Mat& mask, const Eigen::Matrix3f& K)
+{
+  boost::mutex::scoped_lock lock(mutex);
+  this->image = image;
+  this->depth = depth;
+  this->mask = mask;
+  this->K = K;
+  done = true;
+  cond.notify_all();
+}
+
+void RenderJob::Wait()
+{
+  boost::mutex::scoped_lock lock(mutex);
+  while(!done)
+  {
+    cond.wait(lock);
+  }
+}
+
+bool RenderJob::IsDone()
+{
+  boost::mutex::scoped_lock lock(mutex);
+  return done;
+}
+
+void RenderJob::Cancel()
+{
+  boost::mutex::scoped_lock lock(mutex);
+  cancelled = true;
+}
+
+bool RenderJob::IsCancelled()
+{
+  boost::mutex::scoped_lock lock(mutex);
+  return cancelled;
+}
+
+RenderStage::RenderStage(GeneratorFactory factory, unsigned int queue_size) :
+  factory(factory),
+  generator(NULL),
+  jobs(queue_size),
+  ready(false),
+  trans_tol(0),
+  rot_tol(0),
+  num_prefetch_hits(0),
+  num_prefetch_misses(0),
+  crop_margin(-1)
+{
+  K = Eigen::Matrix3f::Identity();
+}
+
+RenderStage::~RenderStage()
+{
+  Stop();
+}
+
+bool RenderStage::Start()
+{
+  worker = boost::thread(&RenderStage::Run, this);
+
+  boost::mutex::scoped_lock lock(ready_mutex);
+  while(!ready)
+  {
+    ready_cond.wait(lock);
+  }
+  return generator != NULL;
+}
+
+void RenderStage::Stop()
+{
+  jobs.Close();
+  if(worker.joinable())
+  {
+    worker.join();
+  }
+}
+
+void RenderStage::Run()
+{
+  VirtualImageGenerator* vig = factory();
+  {
+    boost::mutex::scoped_lock lock(ready_mutex);
+    generator = vig;
+    if(generator)
+    {
+      K = generator->GetK();
+    }
+    ready = true;
+    ready_cond.notify_all();
+  }
+  if(!vig)
+  {
+    return;
+  }
+
+  boost::shared_ptr<RenderJob> job;
+  while(jobs.Pop(job))
+  {
+    if(job->IsCancelled())
+    {
+      job->Finish(cv::Mat(), cv::Mat(), cv::Mat(), K);
+      continue;
+    }
+    PROFILE_SCOPE("render");
+    cv::Mat depth, mask, image;
+    if(job->crop_margin >= 0)
+    {
+      cv::Rect roi;
+      image = vig->GenerateCroppedVirtualImage(job->pose, job->crop_margin, depth, mask, roi);
+      job->Finish(image, depth, mask, VirtualImageGenerator::CropK(K, roi));
+    }
+    else
+    {
+      image = vig->GenerateVirtualImage(job->pose, depth, mask);
+      job->Finish(image, depth, mask, K);
+    }
+  }
+  delete vig;
+}
+
+boost::shared_ptr<RenderJob> RenderStage::Submit(const Eigen::Matrix4f& pose)
+{
+  boost::shared_ptr<RenderJob> job(new RenderJob(pose, crop_margin));
+  if(!jobs.Push(job))
+  {
+    job->Finish(cv::Mat(), cv::Mat(), cv::Mat(), K);
+  }
+  return job;
+}
+
+cv::Mat RenderStage::Render(const Eigen::Matrix4f& pose, cv::Mat& depth, cv::Mat& mask, Eigen::Matrix3f& image_K)
+{
+  {
+    // an explicit render supersedes any outstanding prediction
+    boost::mutex::scoped_lock lock(prefetch_mutex);
+    if(prefetch_job)
+    {
+      prefetch_job->Cancel();
+      prefetch_job.reset();
+    }
+  }
+  boost::shared_ptr<RenderJob> job = Submit(pose);
+  job->Wait();
+  depth = job->depth;
+  mask = job->mask;
+  image_K = job->K;
+  return job->image;
+}
+
+Eigen::Matrix3f RenderStage::GetK()
+{
+  return K;
+}
+
+void RenderStage::SetCropMargin(int margin)
+{
+  crop_margin = margin;
+}
+
+void RenderStage::SetSpeculativeTolerance(double trans_tol, double rot_tol)
+{
+  boost::mutex::scoped_lock lock(prefetch_mutex);
+  this->trans_tol = trans_tol;
+  this->rot_tol = rot_tol;
+}
+
+void RenderStage::Prefetch(const Eigen::Matrix4f& pose)
+{
+  boost::shared_ptr<RenderJob> job = Submit(pose);
+  boost::mutex::scoped_lock lock(prefetch_mutex);
+  if(prefetch_job)
+    prefetch_job->Cancel();
+  prefetch_job = job;
+}
+
+cv::Mat RenderStage::RenderPredicted(Eigen::Matrix4f& pose, cv::Mat& depth, cv::Mat& mask, Eigen::Matrix3f& image_K)
+{
+  boost::shared_ptr<RenderJob> job;
+  {
+    boost::mutex::scoped_lock lock(prefetch_mutex);
+    job.swap(prefetch_job);
+    if(job)
+    {
+      if(WithinTolerance(job->pose, pose))
+      {
+        num_prefetch_hits++;
+      }
+      else
+      {
+        num_prefetch_misses++;
+        ML_DEBUG("RenderStage: prediction missed (%lu hits, %lu misses)", num_prefetch_hits,
+          num_prefetch_misses);
+        job->Cancel();
+        job.reset();
+      }
+    }
+  }
+
+  if(!job)
+  {
+    job = Submit(pose);
+  }
+  job->Wait();
+  pose = job->pose;
+  depth = job->depth;
+  mask = job->mask;
+  image_K = job->K;
+  return job->image;
+}
+
+bool RenderStage::WithinTolerance(const Eigen::Matrix4f& a, const Eigen::Matrix4f& b)
+{
+  double dt = (a.block<3,1>(0,3) - b.block<3,1>(0,3)).norm();
+  Eigen::Matrix3f dR = a.block<3,3>(0,0).transpose()*b.block<3,3>(0,0);
+  double c = std::max(-1.0, std::min(1.0, 0.5*(dR.trace() - 1.0)));
+  return dt <= trans_tol && acos(c) <= rot_tol;
+}
@@ -0,0 +1,54 @@
+#include "mesh_localize/RosImageUtil.h"
+
+#include <cv_bridge/cv_bridge.h>
+#include <sensor_msgs/image_encodings.h>
+#include <ros/ros.h>
+
+using namespace cv;
+namespace enc = sensor_msgs::image_encodings;
+
+bool RosImageUtil::Ingest(ImageIngest& ingest, const sensor_msgs::ImageConstPtr& msg, Mat& dst)
+{
+  const std::string& encoding = msg->encoding;
+  int type = CV_8UC1;
+  ImageIngest::PixelFormat format;
+  if(encoding == enc::MONO8)
+    format = ImageIngest::MONO8;
+  else if(encoding == enc::BAYER_RGGB8)
+    format = ImageIngest::BAYER_RGGB8;
+  else if(encoding == enc::BAYER_BGGR8)
+    format = ImageIngest::BAYER_BGGR8;
+  else if(encoding == enc::BAYER_GBRG8)
+    format = ImageIngest::BAYER_GBRG8;
+  else if(encoding == enc::BAYER_GRBG8)
+    format = ImageIngest::BAYER_GRBG8;
+  else if(encoding == enc::RGB8 || encoding == enc::BGR8)
+  {
+    format = encoding == enc::RGB8 ? ImageIngest::RGB8 : ImageIngest::BGR8;
+    type = CV_8UC3;
+  }
+  else if(encoding == enc::RGBA8 || encoding == enc::BGRA8)
+  {
+    format = encoding == enc::RGBA8 ? ImageIngest::RGBA8 : ImageIngest::BGRA8;
+    type = CV_8UC4;
+  }
+  else
+  {
+    // Uncommon encodings go through cv_bridge first
+    cv_bridge::CvImageConstPtr cvImg;
+    try
+    {
+      cvImg = cv_bridge::toCvShare(msg, enc::MONO8);
+    }
+    catch(cv_bridge::Exception& e)
+    {
+      ROS_ERROR("RosImageUtil: cannot convert %s image: %s", encoding.c_str(), e.what());
+      dst = Mat();
+      return false;
+    }
+    return ingest.Process(cvImg->image, ImageIngest::MONO8, dst);
+  }
+
+  Mat src(msg->height, msg->width, type, const_cast<uchar*>(&msg->data[0]), msg->step);
+  return ingest.Process(src, format, dst);
+}
@@ -0,0 +1,249 @@
+#include "mesh_localize/SplatRenderer.h"
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+#include <boost/bind.hpp>
+
+using namespace cv;
+
+// Empty z-buffer word, farther than any packed depth
+static const uint64_t ZBUFFER_EMPTY = ~(uint64_t)0;
+// Points projected per batch, small enough to stay in L1
+static const int BATCH_SIZE = 256;
+// Points splatted per worker task
+static const size_t TASK_SIZE = 1 << 16;
+
+// Positive floats order like their bit patterns, so depth goes in the high
+// word and the smallest word is the nearest point
+static inline uint64_t PackDepth(float depth, uint32_t index)
+{
+  uint32_t bits;
+  memcpy(&bits, &depth, sizeof(bits));
+  return ((uint64_t)bits << 32) | index;
+}
+
+static inline float UnpackDepth(uint64_t word)
+{
+  uint32_t bits = word >> 32;
+  float depth;
+  memcpy(&depth, &bits, sizeof(depth));
+  return depth;
+}
+
+static inline void AtomicMin(std::atomic<uint64_t>& target, uint64_t value)
+{
+  uint64_t current = target.load(std::memory_order_relaxed);
+  while(value < current &&
+    !target.compare_exchange_weak(current, value, std::memory_order_relaxed))
+  {
+  }
+}
+
+void PointBlock::Reserve(size_t n)
+{
+  x.reserve(n);
+  y.reserve(n);
+  z.reserve(n);
+  nx.reserve(n);
+  ny.reserve(n);
+  nz.reserve(n);
+  intensity.reserve(n);
+}
+
+void PointBlock::Push(float px, float py, float pz, float pnx, float pny, float pnz, uchar value)
+{
+  x.push_back(px);
+  y.push_back(py);
+  z.push_back(pz);
+  nx.push_back(pnx);
+  ny.push_back(pny);
+  nz.push_back(pnz);
+  intensity.push_back(value);
+}
+
+size_t PointBlock::Size() const
+{
+  return x.size();
+}
+
+SplatRenderer::SplatRenderer(const Eigen::Matrix3f& K, int rows, int cols,
+  boost::shared_ptr<WorkerPool> shared_workers) :
+  K(K),
+  rows(rows),
+  cols(cols),
+  workers(shared_workers ? shared_workers : boost::make_shared<WorkerPool>(boost::thread::hardware_concurrency())),
+  backface_culling(false),
+  zbuffer(NULL),
+  zbuffer_size(0)
+{
+  SetCamera(K, rows, cols);
+}
+
+SplatRenderer::~SplatRenderer()
+{
+  delete [] zbuffer;
+}
+
+void SplatRenderer::SetBackfaceCulling(bool enable)
+{
+  backface_culling = enable;
+}
+
+void SplatRenderer::SetCamera(const Eigen::Matrix3f& K, int rows, int cols)
+{
+  this->K = K;
+  this->rows = rows;
+  this->cols = cols;
+  // Resolve leaves the z-buffer empty, so a smaller view can reuse it
+  if((size_t)rows*cols > zbuffer_size)
+  {
+    delete [] zbuffer;
+    zbuffer_size = rows*cols;
+    zbuffer = new std::atomic<uint64_t>[zbuffer_size];
+    for(size_t i = 0; i < zbuffer_size; i++)
+    {
+      zbuffer[i].store(ZBUFFER_EMPTY, std::memory_order_relaxed);
+    }
+  }
+}
+
+void SplatRenderer::Render(const Eigen::Matrix4f& pose, const std::vector<const PointBlock*>& new_blocks,
+  Mat& img, Mat& depth, Mat& mask, int outputs)
+{
+  Eigen::Matrix4f pose_inv = pose.inverse();
+  P = K*pose_inv.block<3,4>(0,0);
+  camera = pose.block<3,1>(0,3);
+  blocks = new_blocks;
+
+  std::vector< boost::function<void()> > tasks;
+  block_base.resize(blocks.size());
+  uint32_t base = 0;
+  for(unsigned int b = 0; b < blocks.size(); b++)
+  {
+    block_base[b] = base;
+    size_t size = blocks[b]->Size();
+    for(size_t begin = 0; begin < size; begin += TASK_SIZE)
+    {
+      tasks.push_back(boost::bind(&SplatRenderer::Splat, this, blocks[b], begin,
+        std::min(size, begin + TASK_SIZE), base));
+    }
+    base += size;
+  }
+  workers->RunAll(tasks);
+
+  // outputs that aren't wanted are skipped by Resolve
+  Mat* img_out = NULL;
+  Mat* depth_out = NULL;
+  Mat* mask_out = NULL;
+  if(outputs & RENDER_IMAGE)
+  {
+    img.create(rows, cols, CV_8U);
+    img_out = &img;
+  }
+  else
+    img.release();
+  if(outputs & RENDER_DEPTH)
+  {
+    depth.create(rows, cols, CV_32F);
+    depth_out = &depth;
+  }
+  else
+    depth.release();
+  if(outputs & RENDER_MASK)
+  {
+    mask.create(rows, cols, CV_8U);
+    mask_out = &mask;
+  }
+  else
+    mask.release();
+  tasks.clear();
+  int num_tiles = std::max(1u, workers->NumThreads());
+  int tile_rows = (rows + num_tiles - 1)/num_tiles;
+  for(int r = 0; r < rows; r += tile_rows)
+  {
+    tasks.push_back(boost::bind(&SplatRenderer::Resolve, this, r, std::min(rows, r + tile_rows),
+      img_out, depth_out, mask_out));
+  }
+  workers->RunAll(tasks);
+}
+
+void SplatRenderer::Splat(const PointBlock* block, size_t begin, size_t end, uint32_t base)
+{
+  const float p00 = P(0,0), p01 = P(0,1), p02 = P(0,2), p03 = P(0,3);
+  const float p10 = P(1,0), p11 = P(1,1), p12 = P(1,2), p13 = P(1,3);
+  const float p20 = P(2,0), p21 = P(2,1), p22 = P(2,2), p23 = P(2,3);
+  const float* x = &block->x[0];
+  const float* y = &block->y[0];
+  const float* z = &block->z[0];
+  const float* nx = &block->nx[0];
+  const float* ny = &block->ny[0];
+  const float* nz = &block->nz[0];
+  const float cx = camera(0), cy = camera(1), cz = camera(2);
+  const float cull = backface_culling ? 1 : 0;
+
+  float u[BATCH_SIZE], v[BATCH_SIZE], d[BATCH_SIZE];
+  for(size_t start = begin; start < end; start += BATCH_SIZE)
+  {
+    int n = std::min((size_t)BATCH_SIZE, end - start);
+    // Branch free projection so the loop vectorizes
+    for(int i = 0; i < n; i++)
+    {
+      float px = x[start+i], py = y[start+i], pz = z[start+i];
+      float w = p20*px + p21*py + p22*pz + p23;
+      float inv_w = 1.0f/w;
+      u[i] = std::floor((p00*px + p01*py + p02*pz + p03)*inv_w);
+      v[i] = std::floor((p10*px + p11*py + p12*pz + p13)*inv_w);
+      float away = cull*(nx[start+i]*(px - cx) + ny[start+i]*(py - cy) + nz[start+i]*(pz - cz));
+      d[i] = away > 0 ? -1.0f : w;
+    }
+
+    for(int i = 0; i < n; i++)
+    {
+      // also rejects NaNs
+      if(!(d[i] > 0 && u[i] >= 0 && u[i] < cols && v[i] >= 0 && v[i] < rows))
+        continue;
+      int idx = (int)v[i]*cols + (int)u[i];
+      AtomicMin(zbuffer[idx], PackDepth(d[i], base + start + i));
+    }
+  }
+}
+
+void SplatRenderer::Resolve(int row_begin, int row_end, Mat* img, Mat* depth, Mat* mask)
+{
+  for(int i = row_begin; i < row_end; i++)
+  {
+    uchar* img_row = img ? img->ptr<uchar>(i) : NULL;
+    float* depth_row = depth ? depth->ptr<float>(i) : NULL;
+    uchar* mask_row = mask ? mask->ptr<uchar>(i) : NULL;
+    std::atomic<uint64_t>* z_row = zbuffer + i*cols;
+    for(int j = 0; j < cols; j++)
+    {
+      uint64_t word = z_row[j].load(std::memory_order_relaxed);
+      if(word == ZBUFFER_EMPTY)
+      {
+        if(img_row)
+          img_row[j] = 0;
+        if(depth_row)
+          depth_row[j] = -1;
+        if(mask_row)
+          mask_row[j] = 0;
+        continue;
+      }
+      // clear for the next render while the word is at hand
+      z_row[j].store(ZBUFFER_EMPTY, std::memory_order_relaxed);
+
+      // the winning point's block is only looked up for its intensity
+      if(img_row)
+      {
+        uint32_t index = word & 0xffffffff;
+        unsigned int b = std::upper_bound(block_base.begin(), block_base.end(), index) - block_base.begin() - 1;
+        img_row[j] = blocks[b]->intensity[index - block_base[b]];
+      }
+      if(depth_row)
+        depth_row[j] = UnpackDepth(word);
+      if(mask_row)
+        mask_row[j] = 255;
+    }
+  }
+}
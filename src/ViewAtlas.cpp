@@ -0,0 +1,315 @@
+#include "mesh_localize/ViewAtlas.h"
+#include "mesh_localize/Log.h"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+using namespace cv;
+
+static const char ATLAS_MAGIC[8] = {'M', 'L', 'A', 'T', 'L', 'A', 'S', '\0'};
+static const uint32_t ATLAS_VERSION = 1;
+static const size_t ATLAS_ALIGNMENT = 16;
+
+ViewAtlasWriter::ViewAtlasWriter() :
+  file(NULL),
+  rows(0),
+  cols(0),
+  image_type(-1),
+  desc_mat_type(-1),
+  desc_cols(0)
+{
+}
+
+ViewAtlasWriter::~ViewAtlasWriter()
+{
+  if(file)
+    fclose(file);
+}
+
+bool ViewAtlasWriter::Open(const std::string& filename, const Eigen::Matrix3f& K, const std::string& desc_type)
+{
+  if(desc_type.size() >= sizeof(((AtlasFileHeader*)0)->desc_type))
+  {
+    ML_ERROR("ViewAtlasWriter: descriptor type name %s is too long", desc_type.c_str());
+    return false;
+  }
+  file = fopen(filename.c_str(), "wb");
+  if(!file)
+  {
+    ML_ERROR("ViewAtlasWriter: could not open %s", filename.c_str());
+    return false;
+  }
+  this->K = K;
+  this->desc_type = desc_type;
+  records.clear();
+
+  // the header is written for real by Close, once the sizes are known
+  AtlasFileHeader header;
+  memset(&header, 0, sizeof(header));
+  return fwrite(&header, sizeof(header), 1, file) == 1;
+}
+
+bool ViewAtlasWriter::WriteAligned(const void* data, size_t size, uint64_t& offset)
+{
+  long pos = ftell(file);
+  size_t padding = (ATLAS_ALIGNMENT - pos % ATLAS_ALIGNMENT) % ATLAS_ALIGNMENT;
+  static const char zeros[ATLAS_ALIGNMENT] = {0};
+  if(padding > 0 && fwrite(zeros, 1, padding, file) != padding)
+    return false;
+  offset = pos + padding;
+  return size == 0 || fwrite(data, 1, size, file) == size;
+}
+
+bool ViewAtlasWriter::Add(const AtlasView& view)
+{
+  if(!file)
+    return false;
+  if(records.empty())
+  {
+    rows = view.image.rows;
+    cols = view.image.cols;
+    image_type = view.image.type();
+  }
+  // views without features say nothing about the descriptor layout
+  if(desc_cols == 0 && !view.descriptors.empty())
+  {
+    desc_mat_type = view.descriptors.type();
+    desc_cols = view.descriptors.cols;
+  }
+  if(view.image.rows != rows || view.image.cols != cols || view.image.type() != image_type ||
+    view.depth.type() != CV_32F || view.mask.type() != CV_8U ||
+    view.keypoints.size() != view.points.size() || view.descriptors.rows != (int)view.keypoints.size() ||
+    (!view.descriptors.empty() && (view.descriptors.type() != desc_mat_type || view.descriptors.cols != desc_cols)))
+  {
+    ML_ERROR("ViewAtlasWriter: view %lu does not match the atlas layout", records.size());
+    return false;
+  }
+
+  AtlasViewRecord record;
+  memset(&record, 0, sizeof(record));
+  for(int i = 0; i < 16; i++)
+  {
+    record.pose[i] = view.pose(i/4, i%4);
+  }
+  record.num_features = view.keypoints.size();
+
+  std::vector<AtlasKeypoint> keypoints(view.keypoints.size());
+  for(unsigned int i = 0; i < view.keypoints.size(); i++)
+  {
+    const KeyPoint& kp = view.keypoints[i];
+    AtlasKeypoint& akp = keypoints[i];
+    akp.x = kp.pt.x;
+    akp.y = kp.pt.y;
+    akp.size = kp.size;
+    akp.angle = kp.angle;
+    akp.response = kp.response;
+    akp.octave = kp.octave;
+    akp.px = view.points[i].x;
+    akp.py = view.points[i].y;
+    akp.pz = view.points[i].z;
+  }
+
+  // sections are written as contiguous blocks
+  Mat image = view.image.isContinuous() ? view.image : view.image.clone();
+  Mat depth = view.depth.isContinuous() ? view.depth : view.depth.clone();
+  Mat mask = view.mask.isContinuous() ? view.mask : view.mask.clone();
+  Mat desc = view.descriptors.isContinuous() ? view.descriptors : view.descriptors.clone();
+  bool ok = WriteAligned(image.data, image.total()*image.elemSize(), record.image_offset) &&
+    WriteAligned(depth.data, depth.total()*depth.elemSize(), record.depth_offset) &&
+    WriteAligned(mask.data, mask.total()*mask.elemSize(), record.mask_offset) &&
+    WriteAligned(keypoints.empty() ? NULL : &keypoints[0], keypoints.size()*sizeof(AtlasKeypoint),
+      record.keypoints_offset) &&
+    WriteAligned(desc.data, desc.total()*desc.elemSize(), record.descriptors_offset);
+  if(!ok)
+  {
+    ML_ERROR("ViewAtlasWriter: write failed");
+    return false;
+  }
+  records.push_back(record);
+  return true;
+}
+
+bool ViewAtlasWriter::Close()
+{
+  if(!file)
+    return false;
+
+  AtlasFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, ATLAS_MAGIC, sizeof(header.magic));
+  header.version = ATLAS_VERSION;
+  header.num_views = records.size();
+  header.rows = rows;
+  header.cols = cols;
+  header.image_type = image_type;
+  header.desc_mat_type = desc_mat_type >= 0 ? desc_mat_type : CV_8U;
+  header.desc_cols = desc_cols;
+  for(int i = 0; i < 9; i++)
+  {
+    header.K[i] = K(i/3, i%3);
+  }
+  strncpy(header.desc_type, desc_type.c_str(), sizeof(header.desc_type) - 1);
+
+  bool ok = WriteAligned(records.empty() ? NULL : &records[0], records.size()*sizeof(AtlasViewRecord),
+    header.table_offset);
+  ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, file) == 1;
+  ok = (fclose(file) == 0) && ok;
+  file = NULL;
+  return ok;
+}
+
+ViewAtlas::ViewAtlas() :
+  data(NULL),
+  size(0),
+  header(NULL)
+{
+}
+
+ViewAtlas::~ViewAtlas()
+{
+  if(data)
+    munmap(data, size);
+}
+
+bool ViewAtlas::Open(const std::string& filename)
+{
+  int fd = open(filename.c_str(), O_RDONLY);
+  if(fd < 0)
+  {
+    ML_ERROR("ViewAtlas: could not open %s", filename.c_str());
+    return false;
+  }
+  struct stat st;
+  if(fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(AtlasFileHeader))
+  {
+    ML_ERROR("ViewAtlas: %s is not an atlas", filename.c_str());
+    close(fd);
+    return false;
+  }
+  size = st.st_size;
+  // private so views can be handed out as writable Mats
+  void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(mapping == MAP_FAILED)
+  {
+    ML_ERROR("ViewAtlas: could not map %s", filename.c_str());
+    return false;
+  }
+  data = (uchar*)mapping;
+  header = (const AtlasFileHeader*)data;
+
+  if(memcmp(header->magic, ATLAS_MAGIC, sizeof(ATLAS_MAGIC)) != 0 || header->version != ATLAS_VERSION ||
+    header->table_offset + (uint64_t)header->num_views*sizeof(AtlasViewRecord) > size)
+  {
+    ML_ERROR("ViewAtlas: %s is not a complete atlas", filename.c_str());
+    munmap(data, size);
+    data = NULL;
+    header = NULL;
+    return false;
+  }
+  desc_type = std::string(header->desc_type, strnlen(header->desc_type, sizeof(header->desc_type)));
+  return true;
+}
+
+bool ViewAtlas::IsOpen() const
+{
+  return header != NULL;
+}
+
+size_t ViewAtlas::NumViews() const
+{
+  return header ? header->num_views : 0;
+}
+
+Eigen::Matrix3f ViewAtlas::GetK() const
+{
+  Eigen::Matrix3f K = Eigen::Matrix3f::Identity();
+  if(!header)
+    return K;
+  for(int i = 0; i < 9; i++)
+  {
+    K(i/3, i%3) = header->K[i];
+  }
+  return K;
+}
+
+const std::string& ViewAtlas::GetDescriptorType() const
+{
+  return desc_type;
+}
+
+const AtlasViewRecord* ViewAtlas::GetRecord(int view) const
+{
+  return (const AtlasViewRecord*)(data + header->table_offset) + view;
+}
+
+int ViewAtlas::FindNearest(const Eigen::Matrix4f& pose, float rot_weight) const
+{
+  int nearest = -1;
+  float nearest_dist = std::numeric_limits<float>::max();
+  for(unsigned int v = 0; v < NumViews(); v++)
+  {
+    // row major pose of the view
+    const float* p = GetRecord(v)->pose;
+    float dx = p[3] - pose(0,3), dy = p[7] - pose(1,3), dz = p[11] - pose(2,3);
+    float trace = 0;
+    for(int i = 0; i < 3; i++)
+    {
+      for(int j = 0; j < 3; j++)
+      {
+        trace += p[4*j + i]*pose(j,i);
+      }
+    }
+    float angle = std::acos(std::max(-1.0f, std::min(1.0f, 0.5f*(trace - 1))));
+    float dist = std::sqrt(dx*dx + dy*dy + dz*dz) + rot_weight*angle;
+    if(dist < nearest_dist)
+    {
+      nearest = v;
+      nearest_dist = dist;
+    }
+  }
+  return nearest;
+}
+
+Eigen::Matrix4f ViewAtlas::GetPose(int view) const
+{
+  Eigen::Matrix4f pose;
+  const float* p = GetRecord(view)->pose;
+  for(int i = 0; i < 16; i++)
+  {
+    pose(i/4, i%4) = p[i];
+  }
+  return pose;
+}
+
+void ViewAtlas::GetImages(int view, Mat& image, Mat& depth, Mat& mask) const
+{
+  const AtlasViewRecord* record = GetRecord(view);
+  image = Mat(header->rows, header->cols, header->image_type, data + record->image_offset);
+  depth = Mat(header->rows, header->cols, CV_32F, data + record->depth_offset);
+  mask = Mat(header->rows, header->cols, CV_8U, data + record->mask_offset);
+}
+
+void ViewAtlas::GetFeatures(int view, std::vector<KeyPoint>& keypoints, Mat& descriptors,
+  std::vector<Point3f>& points) const
+{
+  const AtlasViewRecord* record = GetRecord(view);
+  const AtlasKeypoint* akps = (const AtlasKeypoint*)(data + record->keypoints_offset);
+  keypoints.resize(record->num_features);
+  points.resize(record->num_features);
+  for(unsigned int i = 0; i < record->num_features; i++)
+  {
+    keypoints[i] = KeyPoint(akps[i].x, akps[i].y, akps[i].size, akps[i].angle, akps[i].response, akps[i].octave);
+    points[i] = Point3f(akps[i].px, akps[i].py, akps[i].pz);
+  }
+  if(record->num_features > 0)
+    descriptors = Mat(record->num_features, header->desc_cols, header->desc_mat_type, data + record->descriptors_offset);
+  else
+    descriptors = Mat();
+}
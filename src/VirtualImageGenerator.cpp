@@ -0,0 +1,105 @@
+#include "mesh_localize/VirtualImageGenerator.h"
+
+#include <cmath>
+#include <limits>
+#include <algorithm>
+
+using namespace cv;
+
+Mat VirtualImageGenerator::GenerateCroppedVirtualImage(const Eigen::Matrix4f& pose, int margin, Mat& depth,
+  Mat& mask, Rect& roi)
+{
+  Mat img = GenerateVirtualImage(pose, depth, mask);
+  roi = Rect(0, 0, img.cols, img.rows);
+  if(img.empty())
+    return img;
+
+  // bounding box of the mask
+  int xmin = mask.cols, xmax = -1, ymin = mask.rows, ymax = -1;
+  for(int i = 0; i < mask.rows; i++)
+  {
+    const uchar* row = mask.ptr<uchar>(i);
+    for(int j = 0; j < mask.cols; j++)
+    {
+      if(row[j])
+      {
+        xmin = std::min(xmin, j);
+        xmax = std::max(xmax, j);
+        ymin = std::min(ymin, i);
+        ymax = std::max(ymax, i);
+      }
+    }
+  }
+  if(xmax < 0)
+    return img;
+
+  roi = Rect(xmin - margin, ymin - margin, xmax - xmin + 2*margin + 1, ymax - ymin + 2*margin + 1) &
+    Rect(0, 0, img.cols, img.rows);
+  depth = depth(roi);
+  mask = mask(roi);
+  return img(roi);
+}
+
+void VirtualImageGenerator::GenerateVirtualImages(const PoseList& poses, std::vector<Mat>& images,
+  std::vector<Mat>& depths, std::vector<Mat>& masks, int outputs)
+{
+  images.resize(poses.size());
+  depths.resize(poses.size());
+  masks.resize(poses.size());
+  for(unsigned int i = 0; i < poses.size(); i++)
+  {
+    images[i] = GenerateVirtualImage(poses[i], depths[i], masks[i]);
+    if(!(outputs & RENDER_IMAGE))
+      images[i].release();
+    if(!(outputs & RENDER_DEPTH))
+      depths[i].release();
+    if(!(outputs & RENDER_MASK))
+      masks[i].release();
+  }
+}
+
+Eigen::Matrix3f VirtualImageGenerator::CropK(const Eigen::Matrix3f& K, const Rect& roi)
+{
+  Eigen::Matrix3f crop_K = K;
+  crop_K(0,2) -= roi.x;
+  crop_K(1,2) -= roi.y;
+  return crop_K;
+}
+
+Rect VirtualImageGenerator::ProjectBounds(const Eigen::Vector3f& min_pt, const Eigen::Vector3f& max_pt,
+  const Eigen::Matrix4f& pose, const Eigen::Matrix3f& K, int rows, int cols, int margin)
+{
+  Rect view(0, 0, cols, rows);
+  // empty model
+  if(!(min_pt.array() <= max_pt.array()).all())
+    return view;
+  Eigen::Matrix4f pose_inv = pose.inverse();
+  float xmin = std::numeric_limits<float>::max(), xmax = -xmin;
+  float ymin = xmin, ymax = -xmin;
+  for(int c = 0; c < 8; c++)
+  {
+    Eigen::Vector3f corner((c & 1) ? max_pt(0) : min_pt(0), (c & 2) ? max_pt(1) : min_pt(1),
+      (c & 4) ? max_pt(2) : min_pt(2));
+    Eigen::Vector3f p = pose_inv.block<3,3>(0,0)*corner + pose_inv.block<3,1>(0,3);
+    // the projection of a box around the camera isn't bounded by its corners
+    if(p(2) <= 0.01)
+      return view;
+    Eigen::Vector3f uv = K*p;
+    float u = uv(0)/uv(2);
+    float v = uv(1)/uv(2);
+    xmin = std::min(xmin, u);
+    xmax = std::max(xmax, u);
+    ymin = std::min(ymin, v);
+    ymax = std::max(ymax, v);
+  }
+
+  int x0 = std::floor(xmin) - margin;
+  int y0 = std::floor(ymin) - margin;
+  int x1 = std::ceil(xmax) + margin;
+  int y1 = std::ceil(ymax) + margin;
+  Rect roi = Rect(x0, y0, std::max(0, x1 - x0), std::max(0, y1 - y0)) & view;
+  // nothing of the model is in view, render as usual
+  if(roi.area() == 0)
+    return view;
+  return roi;
+}
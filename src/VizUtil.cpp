@@ -0,0 +1,50 @@
+#include "mesh_localize/VizUtil.h"
+
+#include <sstream>
+#include <opencv2/imgproc/imgproc.hpp>
+
+using namespace cv;
+
+void VizUtil::DrawPose(const Mat& src, Mat& dst, const Eigen::Matrix4f& tf,
+  const Eigen::Matrix3f& K)
+{
+  if(src.channels() == 1)
+    cvtColor(src, dst, CV_GRAY2RGB);
+  else
+    src.copyTo(dst);
+  Eigen::Vector3f t = tf.block<3,1>(0,3);
+  Eigen::Vector3f xr = tf.block<3,1>(0,0);
+  Eigen::Vector3f yr = tf.block<3,1>(0,1);
+  Eigen::Vector3f zr = tf.block<3,1>(0,2);
+  
+  Eigen::Vector3f x = t + xr/6*xr.norm();
+  Eigen::Vector3f y = t + yr/6*yr.norm();
+  Eigen::Vector3f z = t + zr/6*zr.norm();
+
+  Eigen::Vector3f origin = K*t;
+  Eigen::Vector3f xp = K*x;
+  Eigen::Vector3f yp = K*y;
+  Eigen::Vector3f zp = K*z;
+  Point o2d(origin(0)/origin(2), origin(1)/origin(2));
+  Point x2d(xp(0)/xp(2), xp(1)/xp(2));
+  Point y2d(yp(0)/yp(2), yp(1)/yp(2));
+  Point z2d(zp(0)/zp(2), zp(1)/zp(2));
+
+  line(dst, o2d, x2d, CV_RGB(255, 0, 0), 3, CV_AA);
+  line(dst, o2d, y2d, CV_RGB(0, 255, 0), 3, CV_AA);
+  line(dst, o2d, z2d, CV_RGB(0, 0, 255), 3, CV_AA);
+}
+
+void VizUtil::DrawTracks(Mat& dst, const std::vector<Point2f>& pts, const std::vector<int>& ids)
+{
+  for(unsigned int i = 0; i < pts.size(); i++)
+  {
+    circle(dst, pts[i], 3, Scalar(0,250,0), -1);
+    if(i < ids.size())
+    {
+      std::stringstream id;
+      id << ids[i];
+      putText(dst, id.str(), pts[i], FONT_HERSHEY_PLAIN, 1, Scalar::all(255));
+    }
+  }
+}
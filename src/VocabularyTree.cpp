@@ -0,0 +1,413 @@
+#include "mesh_localize/VocabularyTree.h"
+#include "mesh_localize/Log.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+
+using namespace cv;
+
+static const char VOCABULARY_MAGIC[8] = {'M', 'L', 'V', 'O', 'C', 'A', 'B', '\0'};
+static const uint32_t VOCABULARY_VERSION = 1;
+// Clustering iterations per node
+static const int CLUSTER_ITERATIONS = 10;
+
+VocabularyTree::VocabularyTree() :
+  branching(0),
+  depth(0),
+  num_words(0)
+{
+}
+
+float VocabularyTree::Distance(const Mat& descriptors, int row, int node) const
+{
+  if(centers.type() == CV_8U)
+    return normHamming(descriptors.ptr<uchar>(row), centers.ptr<uchar>(node), centers.cols);
+  return normL2Sqr_(descriptors.ptr<float>(row), centers.ptr<float>(node), centers.cols);
+}
+
+void VocabularyTree::Cluster(const Mat& descriptors, const std::vector<int>& rows, int k, Mat& node_centers,
+  std::vector<int>& labels) const
+{
+  labels.assign(rows.size(), 0);
+  if(descriptors.type() == CV_32F)
+  {
+    Mat data(rows.size(), descriptors.cols, CV_32F);
+    for(unsigned int i = 0; i < rows.size(); i++)
+      descriptors.row(rows[i]).copyTo(data.row(i));
+    Mat mat_labels;
+    kmeans(data, k, mat_labels, TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, CLUSTER_ITERATIONS, 1e-4),
+      1, KMEANS_PP_CENTERS, node_centers);
+    for(unsigned int i = 0; i < rows.size(); i++)
+      labels[i] = mat_labels.at<int>(i);
+    return;
+  }
+
+  // k-majority: k-means++ seeds, then every centre bit is the majority of
+  // its cluster's bits
+  int cols = descriptors.cols;
+  node_centers.create(k, cols, CV_8U);
+  std::vector<float> nearest(rows.size(), std::numeric_limits<float>::max());
+  int seed = rows[std::rand() % rows.size()];
+  for(int c = 0; c < k; c++)
+  {
+    descriptors.row(seed).copyTo(node_centers.row(c));
+    double total = 0;
+    for(unsigned int i = 0; i < rows.size(); i++)
+    {
+      float d = normHamming(descriptors.ptr<uchar>(rows[i]), node_centers.ptr<uchar>(c), cols);
+      nearest[i] = std::min(nearest[i], d*d);
+      total += nearest[i];
+    }
+    double pick = total*(std::rand()/(RAND_MAX + 1.0));
+    for(unsigned int i = 0; i < rows.size(); i++)
+    {
+      seed = rows[i];
+      pick -= nearest[i];
+      if(pick < 0)
+        break;
+    }
+  }
+
+  std::vector<int> counts(k*cols*8);
+  std::vector<int> sizes(k);
+  for(int it = 0; it < CLUSTER_ITERATIONS; it++)
+  {
+    bool changed = it == 0;
+    for(unsigned int i = 0; i < rows.size(); i++)
+    {
+      int best = 0, best_dist = std::numeric_limits<int>::max();
+      for(int c = 0; c < k; c++)
+      {
+        int d = normHamming(descriptors.ptr<uchar>(rows[i]), node_centers.ptr<uchar>(c), cols);
+        if(d < best_dist)
+        {
+          best = c;
+          best_dist = d;
+        }
+      }
+      changed = changed || labels[i] != best;
+      labels[i] = best;
+    }
+    if(!changed)
+      break;
+
+    std::fill(counts.begin(), counts.end(), 0);
+    std::fill(sizes.begin(), sizes.end(), 0);
+    for(unsigned int i = 0; i < rows.size(); i++)
+    {
+      const uchar* d = descriptors.ptr<uchar>(rows[i]);
+      int* count = &counts[labels[i]*cols*8];
+      for(int b = 0; b < cols*8; b++)
+        count[b] += (d[b >> 3] >> (b & 7)) & 1;
+      sizes[labels[i]]++;
+    }
+    for(int c = 0; c < k; c++)
+    {
+      // empty clusters keep their centre
+      if(sizes[c] == 0)
+        continue;
+      uchar* center = node_centers.ptr<uchar>(c);
+      const int* count = &counts[c*cols*8];
+      memset(center, 0, cols);
+      for(int b = 0; b < cols*8; b++)
+      {
+        if(2*count[b] > sizes[c])
+          center[b >> 3] |= 1 << (b & 7);
+      }
+    }
+  }
+}
+
+void VocabularyTree::Split(const Mat& descriptors, const std::vector<int>& rows, int node, int level)
+{
+  if(level == depth || (int)rows.size() <= branching)
+  {
+    nodes[node].word = num_words++;
+    return;
+  }
+
+  Mat node_centers;
+  std::vector<int> labels;
+  Cluster(descriptors, rows, branching, node_centers, labels);
+  int first = nodes.size();
+  nodes[node].first_child = first;
+  nodes[node].num_children = branching;
+  for(int c = 0; c < branching; c++)
+  {
+    VocabularyNode child = {-1, 0, -1};
+    nodes.push_back(child);
+    centers.push_back(node_centers.row(c));
+  }
+  for(int c = 0; c < branching; c++)
+  {
+    std::vector<int> child_rows;
+    for(unsigned int i = 0; i < rows.size(); i++)
+    {
+      if(labels[i] == c)
+        child_rows.push_back(rows[i]);
+    }
+    Split(descriptors, child_rows, first + c, level + 1);
+  }
+}
+
+bool VocabularyTree::Train(const Mat& descriptors, int branching, int depth)
+{
+  if(descriptors.rows == 0 || (descriptors.type() != CV_8U && descriptors.type() != CV_32F))
+  {
+    ML_ERROR("VocabularyTree: needs CV_8U or CV_32F descriptors");
+    return false;
+  }
+  if(branching < 2 || depth < 1)
+  {
+    ML_ERROR("VocabularyTree: invalid branching %d or depth %d", branching, depth);
+    return false;
+  }
+
+  this->branching = branching;
+  this->depth = depth;
+  num_words = 0;
+  nodes.clear();
+  VocabularyNode root = {-1, 0, -1};
+  nodes.push_back(root);
+  centers = Mat::zeros(1, descriptors.cols, descriptors.type());
+  std::vector<int> rows(descriptors.rows);
+  for(int i = 0; i < descriptors.rows; i++)
+    rows[i] = i;
+  Split(descriptors, rows, 0, 0);
+  return true;
+}
+
+bool VocabularyTree::Save(const std::string& filename) const
+{
+  VocabularyFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, VOCABULARY_MAGIC, sizeof(header.magic));
+  header.version = VOCABULARY_VERSION;
+  header.branching = branching;
+  header.depth = depth;
+  header.num_nodes = nodes.size();
+  header.num_words = num_words;
+  header.desc_mat_type = centers.type();
+  header.desc_cols = centers.cols;
+
+  FILE* file = fopen(filename.c_str(), "wb");
+  if(!file)
+  {
+    ML_ERROR("VocabularyTree: could not open %s", filename.c_str());
+    return false;
+  }
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+    (nodes.empty() || fwrite(&nodes[0], sizeof(VocabularyNode), nodes.size(), file) == nodes.size());
+  for(int i = 0; ok && i < centers.rows; i++)
+    ok = fwrite(centers.ptr(i), centers.elemSize(), centers.cols, file) == (size_t)centers.cols;
+  ok = fclose(file) == 0 && ok;
+  if(!ok)
+    ML_ERROR("VocabularyTree: write failed");
+  return ok;
+}
+
+bool VocabularyTree::Load(const std::string& filename)
+{
+  FILE* file = fopen(filename.c_str(), "rb");
+  if(!file)
+  {
+    ML_WARN("VocabularyTree: could not open %s", filename.c_str());
+    return false;
+  }
+
+  VocabularyFileHeader header;
+  if(fread(&header, sizeof(header), 1, file) != 1 || memcmp(header.magic, VOCABULARY_MAGIC, sizeof(VOCABULARY_MAGIC)) != 0 ||
+    header.version != VOCABULARY_VERSION || header.num_nodes == 0 || header.num_words == 0 || header.desc_cols <= 0 ||
+    (header.desc_mat_type != CV_8U && header.desc_mat_type != CV_32F))
+  {
+    ML_WARN("VocabularyTree: %s is not a vocabulary", filename.c_str());
+    fclose(file);
+    return false;
+  }
+
+  // Check the size before allocating for the nodes the header claims
+  long start = ftell(file);
+  bool ok = start >= 0 && fseek(file, 0, SEEK_END) == 0;
+  uint64_t available = ok ? ftell(file) - start : 0;
+  uint64_t center_size = (uint64_t)header.desc_cols*(header.desc_mat_type == CV_8U ? 1 : sizeof(float));
+  if(!ok || fseek(file, start, SEEK_SET) != 0 ||
+    available < (uint64_t)header.num_nodes*(sizeof(VocabularyNode) + center_size))
+  {
+    ML_WARN("VocabularyTree: %s is truncated", filename.c_str());
+    fclose(file);
+    return false;
+  }
+
+  std::vector<VocabularyNode> file_nodes(header.num_nodes);
+  Mat file_centers(header.num_nodes, header.desc_cols, header.desc_mat_type);
+  ok = fread(&file_nodes[0], sizeof(VocabularyNode), file_nodes.size(), file) == file_nodes.size() &&
+    fread(file_centers.data, file_centers.elemSize(), file_centers.total(), file) == file_centers.total();
+  fclose(file);
+  if(!ok)
+  {
+    ML_WARN("VocabularyTree: %s is truncated", filename.c_str());
+    return false;
+  }
+
+  // Quantize descends from the root by these records and BowDatabase counts
+  // into num_words words, so inner nodes must point forward to children
+  // that exist and leaves must be words
+  for(unsigned int i = 0; ok && i < file_nodes.size(); i++)
+  {
+    const VocabularyNode& node = file_nodes[i];
+    if(node.num_children > 0)
+      ok = node.first_child > (int64_t)i && (int64_t)node.first_child + node.num_children <= header.num_nodes;
+    else
+      ok = node.num_children == 0 && node.word >= 0 && (uint32_t)node.word < header.num_words;
+  }
+  if(!ok)
+  {
+    ML_WARN("VocabularyTree: %s has broken nodes", filename.c_str());
+    return false;
+  }
+
+  branching = header.branching;
+  depth = header.depth;
+  num_words = header.num_words;
+  nodes.swap(file_nodes);
+  centers = file_centers;
+  return true;
+}
+
+size_t VocabularyTree::NumWords() const
+{
+  return num_words;
+}
+
+int VocabularyTree::DescriptorType() const
+{
+  return centers.type();
+}
+
+int VocabularyTree::DescriptorCols() const
+{
+  return centers.cols;
+}
+
+int VocabularyTree::Quantize(const Mat& descriptors, int row) const
+{
+  int node = 0;
+  while(nodes[node].num_children > 0)
+  {
+    int best = nodes[node].first_child;
+    float best_dist = Distance(descriptors, row, best);
+    for(int c = 1; c < nodes[node].num_children; c++)
+    {
+      float dist = Distance(descriptors, row, nodes[node].first_child + c);
+      if(dist < best_dist)
+      {
+        best = nodes[node].first_child + c;
+        best_dist = dist;
+      }
+    }
+    node = best;
+  }
+  return nodes[node].word;
+}
+
+BowDatabase::BowDatabase(const VocabularyTree* vocabulary) :
+  vocabulary(vocabulary)
+{
+}
+
+void BowDatabase::Histogram(const Mat& descriptors, std::vector< std::pair<int, float> >& histogram) const
+{
+  histogram.clear();
+  if(descriptors.rows == 0 || descriptors.type() != vocabulary->DescriptorType() ||
+    descriptors.cols != vocabulary->DescriptorCols())
+    return;
+
+  std::vector<int> words(descriptors.rows);
+  for(int i = 0; i < descriptors.rows; i++)
+    words[i] = vocabulary->Quantize(descriptors, i);
+  std::sort(words.begin(), words.end());
+  for(unsigned int i = 0; i < words.size(); i++)
+  {
+    if(histogram.empty() || histogram.back().first != words[i])
+      histogram.push_back(std::make_pair(words[i], 0.0f));
+    histogram.back().second += 1;
+  }
+}
+
+void BowDatabase::Normalize(std::vector< std::pair<int, float> >& histogram) const
+{
+  float sum = 0;
+  unsigned int n = 0;
+  for(unsigned int i = 0; i < histogram.size(); i++)
+  {
+    // words in every image say nothing
+    float weight = histogram[i].second*idf[histogram[i].first];
+    if(weight <= 0)
+      continue;
+    histogram[n++] = std::make_pair(histogram[i].first, weight);
+    sum += weight;
+  }
+  histogram.resize(n);
+  for(unsigned int i = 0; i < histogram.size(); i++)
+    histogram[i].second /= sum;
+}
+
+void BowDatabase::Add(const Mat& descriptors)
+{
+  histograms.push_back(std::vector< std::pair<int, float> >());
+  Histogram(descriptors, histograms.back());
+}
+
+void BowDatabase::Finish()
+{
+  std::vector<int> image_counts(vocabulary->NumWords(), 0);
+  for(unsigned int i = 0; i < histograms.size(); i++)
+  {
+    for(unsigned int j = 0; j < histograms[i].size(); j++)
+      image_counts[histograms[i][j].first]++;
+  }
+  idf.assign(vocabulary->NumWords(), 0);
+  for(unsigned int w = 0; w < idf.size(); w++)
+  {
+    if(image_counts[w] > 0)
+      idf[w] = std::log(histograms.size()/(double)image_counts[w]);
+  }
+
+  inverted.assign(vocabulary->NumWords(), std::vector<Posting>());
+  for(unsigned int i = 0; i < histograms.size(); i++)
+  {
+    Normalize(histograms[i]);
+    for(unsigned int j = 0; j < histograms[i].size(); j++)
+    {
+      Posting posting = {(int)i, histograms[i][j].second};
+      inverted[histograms[i][j].first].push_back(posting);
+    }
+  }
+  // only the number of images is needed from here on
+  std::vector< std::vector< std::pair<int, float> > >(histograms.size()).swap(histograms);
+}
+
+size_t BowDatabase::NumImages() const
+{
+  return histograms.size();
+}
+
+void BowDatabase::Score(const Mat& descriptors, std::vector<float>& scores) const
+{
+  scores.assign(histograms.size(), 0);
+  if(inverted.empty())
+    return;
+  std::vector< std::pair<int, float> > histogram;
+  Histogram(descriptors, histogram);
+  Normalize(histogram);
+  for(unsigned int i = 0; i < histogram.size(); i++)
+  {
+    const std::vector<Posting>& postings = inverted[histogram[i].first];
+    for(unsigned int p = 0; p < postings.size(); p++)
+      scores[postings[p].image] += std::min(histogram[i].second, postings[p].weight);
+  }
+}
@@ -0,0 +1,100 @@
+#include "mesh_localize/WorkerPool.h"
+
+WorkerPool::WorkerPool(unsigned int num_threads) :
+  num_threads(num_threads > 1 ? num_threads : 0),
+  running(true)
+{
+  for(unsigned int i = 0; i < this->num_threads; i++)
+  {
+    threads.push_back(new boost::thread(&WorkerPool::WorkerLoop, this));
+  }
+}
+
+WorkerPool::~WorkerPool()
+{
+  {
+    boost::mutex::scoped_lock lock(mutex);
+    running = false;
+    work_cond.notify_all();
+  }
+  for(unsigned int i = 0; i < threads.size(); i++)
+  {
+    threads[i]->join();
+    delete threads[i];
+  }
+}
+
+unsigned int WorkerPool::NumThreads() const
+{
+  return num_threads;
+}
+
+void WorkerPool::RunAll(const std::vector< boost::function<void()> >& new_tasks)
+{
+  if(threads.empty() || new_tasks.size() == 1)
+  {
+    for(unsigned int i = 0; i < new_tasks.size(); i++)
+    {
+      new_tasks[i]();
+    }
+    return;
+  }
+
+  unsigned int pending = new_tasks.size();
+  boost::mutex::scoped_lock lock(mutex);
+  for(unsigned int i = 0; i < new_tasks.size(); i++)
+  {
+    Task task;
+    task.run = new_tasks[i];
+    task.pending = &pending;
+    tasks.push_back(task);
+  }
+  work_cond.notify_all();
+
+  while(pending > 0)
+  {
+    // run the batch's own tasks that no worker has taken yet
+    std::deque<Task>::iterator it = tasks.begin();
+    while(it != tasks.end() && it->pending != &pending)
+      ++it;
+    if(it == tasks.end())
+    {
+      done_cond.wait(lock);
+      continue;
+    }
+    Task task = *it;
+    tasks.erase(it);
+    lock.unlock();
+    task.run();
+    lock.lock();
+    Finish(task);
+  }
+}
+
+void WorkerPool::Finish(const Task& task)
+{
+  (*task.pending)--;
+  if(*task.pending == 0)
+    done_cond.notify_all();
+}
+
+void WorkerPool::WorkerLoop()
+{
+  boost::mutex::scoped_lock lock(mutex);
+  while(true)
+  {
+    while(running && tasks.empty())
+    {
+      work_cond.wait(lock);
+    }
+    if(!running)
+      return;
+
+    Task task = tasks.front();
+    tasks.pop_front();
+    lock.unlock();
+    task.run();
+    lock.lock();
+    Finish(task);
+  }
+}
@@ -0,0 +1,187 @@
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+#include <Eigen/Geometry>
+#include "mesh_localize/LocalizerPipeline.h"
+#include "mesh_localize/KeyframeContainer.h"
+#include "mesh_localize/ViewAtlas.h"
+
+using namespace cv;
+
+// Views rendered at once, bounds the memory held by a batch
+static const int RENDER_BATCH_SIZE = 16;
+
+/**
+ *  Renders the model from poses on a viewing shell around the model origin
+ *  and writes every view with its features and their 3D points into an atlas
+ *  file for virtual_image_source "atlas".  Any virtual image source that
+ *  renders (ogre, point_cloud, mesh) can be used.
+ *
+ *  camera.yml holds K (3x3), width and height of the rendered views.  Views
+ *  are spread evenly over num_shells spheres with radii from min_radius to
+ *  max_radius, each view looking at the origin, and are repeated for
+ *  num_rolls rotations about the optical axis.
+ */
+
+// Camera pose at position looking at the origin, rolled about its optical axis
+static Eigen::Matrix4f LookAtOrigin(const Eigen::Vector3f& position, float roll)
+{
+  Eigen::Vector3f z = -position.normalized();
+  Eigen::Vector3f up = std::fabs(z(2)) < 0.99 ? Eigen::Vector3f::UnitZ() : Eigen::Vector3f::UnitY();
+  // with x = z cross up, y = z cross x points against up, down in the image
+  Eigen::Vector3f x = z.cross(up).normalized();
+  Eigen::Vector3f y = z.cross(x);
+  Eigen::Matrix3f R;
+  R.col(0) = x;
+  R.col(1) = y;
+  R.col(2) = z;
+  R = R*Eigen::AngleAxisf(roll, Eigen::Vector3f::UnitZ()).toRotationMatrix();
+
+  Eigen::Matrix4f pose = Eigen::Matrix4f::Identity();
+  pose.block<3,3>(0,0) = R;
+  pose.block<3,1>(0,3) = position;
+  return pose;
+}
+
+int main(int argc, char **argv)
+{
+  if(argc < 7)
+  {
+    std::cout << "Usage: " << argv[0] << " <config.yml> <camera.yml> <output.atlas> <views_per_shell> "
+      << "<min_radius> <max_radius> [num_shells] [num_rolls]" << std::endl;
+    return 1;
+  }
+  std::string config_file = argv[1];
+  std::string camera_file = argv[2];
+  std::string output_file = argv[3];
+  int views_per_shell = atoi(argv[4]);
+  double min_radius = atof(argv[5]);
+  double max_radius = atof(argv[6]);
+  int num_shells = argc > 7 ? atoi(argv[7]) : 1;
+  int num_rolls = argc > 8 ? atoi(argv[8]) : 1;
+  if(views_per_shell < 1 || num_shells < 1 || num_rolls < 1 || min_radius <= 0 || max_radius < min_radius)
+  {
+    std::cout << "Invalid sampling parameters" << std::endl;
+    return 1;
+  }
+
+  LocalizerConfig config;
+  if(!config.Load(config_file))
+    return 1;
+
+  FileStorage fs(camera_file, FileStorage::READ);
+  if(!fs.isOpened())
+  {
+    std::cout << "Could not open " << camera_file << std::endl;
+    return 1;
+  }
+  Mat camK;
+  int width = 0, height = 0;
+  fs["K"] >> camK;
+  fs["width"] >> width;
+  fs["height"] >> height;
+  if(camK.rows != 3 || camK.cols != 3 || width <= 0 || height <= 0)
+  {
+    std::cout << "camera.yml must contain a 3x3 K, width and height" << std::endl;
+    return 1;
+  }
+  camK.convertTo(camK, CV_64F);
+  Eigen::Matrix3f K;
+  for(int i = 0; i < 3; i++)
+    for(int j = 0; j < 3; j++)
+      K(i,j) = camK.at<double>(i,j);
+
+  VirtualImageGenerator* generator = LocalizerPipeline::CreateVirtualImageGenerator(config, K, height, width);
+  if(!generator)
+  {
+    std::cout << "Could not create virtual image generator for " << config.virtual_image_source << std::endl;
+    return 1;
+  }
+  K = generator->GetK();
+  Eigen::Matrix3f K_inv = K.inverse();
+
+  ViewAtlasWriter writer;
+  if(!writer.Open(output_file, K, config.pnp_descriptor_type))
+    return 1;
+
+  VirtualImageGenerator::PoseList poses;
+  for(int s = 0; s < num_shells; s++)
+  {
+    double radius = num_shells > 1 ? min_radius + s*(max_radius - min_radius)/(num_shells - 1) : min_radius;
+    for(int v = 0; v < views_per_shell; v++)
+    {
+      // Fibonacci sphere, evenly spread directions
+      double z = 1 - (2.0*v + 1)/views_per_shell;
+      double r = std::sqrt(std::max(0.0, 1 - z*z));
+      double phi = v*M_PI*(3 - std::sqrt(5.0));
+      Eigen::Vector3f position(radius*r*std::cos(phi), radius*r*std::sin(phi), radius*z);
+
+      for(int k = 0; k < num_rolls; k++)
+      {
+        poses.push_back(LookAtOrigin(position, 2*M_PI*k/num_rolls));
+      }
+    }
+  }
+
+  int num_views = poses.size();
+  for(int begin = 0; begin < num_views; begin += RENDER_BATCH_SIZE)
+  {
+    // a batch of views is rendered at once, the generator spreads them over
+    // the cores
+    VirtualImageGenerator::PoseList batch(poses.begin() + begin,
+      poses.begin() + std::min(num_views, begin + RENDER_BATCH_SIZE));
+    std::vector<Mat> images, depths, masks;
+    generator->GenerateVirtualImages(batch, images, depths, masks);
+
+    for(unsigned int b = 0; b < batch.size(); b++)
+    {
+      AtlasView view;
+      view.pose = batch[b];
+      view.image = images[b];
+      view.depth = depths[b];
+      view.mask = masks[b];
+      if(view.image.empty())
+      {
+        std::cout << "Render failed" << std::endl;
+        return 1;
+      }
+      KeyframeContainer kfc(view.image, config.pnp_descriptor_type, false);
+      kfc.SetMask(view.mask);
+      kfc.SetMaxFeatures(config.orb_features);
+      kfc.ExtractFeatures();
+      std::vector<KeyPoint> kps = kfc.GetKeypoints();
+      Mat desc = kfc.GetDescriptors();
+
+      // keep the features that back project onto the model
+      for(unsigned int i = 0; i < kps.size(); i++)
+      {
+        int x = kps[i].pt.x, y = kps[i].pt.y;
+        if(x < 0 || y < 0 || x >= view.depth.cols || y >= view.depth.rows)
+          continue;
+        float d = view.depth.at<float>(y, x);
+        if(d == 0 || d == -1)
+          continue;
+        Eigen::Vector3f ray = K_inv*Eigen::Vector3f(kps[i].pt.x, kps[i].pt.y, 1);
+        Eigen::Vector4f pt = view.pose*Eigen::Vector4f(d*ray(0)/ray(2), d*ray(1)/ray(2), d, 1);
+        view.keypoints.push_back(kps[i]);
+        view.points.push_back(Point3f(pt(0), pt(1), pt(2)));
+        view.descriptors.push_back(desc.row(i));
+      }
+
+      if(!writer.Add(view))
+        return 1;
+      std::cout << "View " << begin + b + 1 << "/" << num_views << ": " << view.keypoints.size()
+        << " features" << std::endl;
+    }
+  }
+
+  delete generator;
+  if(!writer.Close())
+  {
+    std::cout << "Could not write " << output_file << std::endl;
+    return 1;
+  }
+  std::cout << "Wrote " << num_views << " views to " << output_file << std::endl;
+  return 0;
+}
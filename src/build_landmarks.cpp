@@ -0,0 +1,77 @@
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+
+#include "mesh_localize/ViewAtlas.h"
+#include "mesh_localize/LandmarkDatabase.h"
+
+using namespace cv;
+
+/**
+ *  Turns the per view features of an atlas (see build_atlas) into a 3D
+ *  landmark database for ~landmark_filename.  Features of different views
+ *  whose points are within merge_radius of each other and whose descriptors
+ *  are within max_desc_dist are merged into one landmark.  Landmarks seen in
+ *  fewer than min_observations views are dropped, they are unlikely to be
+ *  found again.  The default max_desc_dist suits the atlas' descriptor type
+ *  (hamming for binary descriptors, L2 otherwise).
+ */
+int main(int argc, char **argv)
+{
+  if(argc < 4)
+  {
+    std::cout << "Usage: " << argv[0] << " <input.atlas> <output.landmarks> <merge_radius> "
+      << "[min_observations] [max_desc_dist] [view_margin_deg]" << std::endl;
+    return 1;
+  }
+  std::string atlas_file = argv[1];
+  std::string output_file = argv[2];
+  float merge_radius = atof(argv[3]);
+  int min_observations = argc > 4 ? atoi(argv[4]) : 2;
+  double max_desc_dist = argc > 5 ? atof(argv[5]) : -1;
+  float view_margin = (argc > 6 ? atof(argv[6]) : 15)*M_PI/180;
+  if(merge_radius <= 0 || min_observations < 1)
+  {
+    std::cout << "Invalid merge parameters" << std::endl;
+    return 1;
+  }
+
+  ViewAtlas atlas;
+  if(!atlas.Open(atlas_file))
+    return 1;
+
+  LandmarkDatabaseBuilder* builder = NULL;
+  for(size_t v = 0; v < atlas.NumViews(); v++)
+  {
+    std::vector<KeyPoint> keypoints;
+    Mat descriptors;
+    std::vector<Point3f> points;
+    atlas.GetFeatures(v, keypoints, descriptors, points);
+    if(descriptors.empty())
+      continue;
+    if(!builder)
+    {
+      if(max_desc_dist < 0)
+        max_desc_dist = descriptors.type() == CV_8U ? 8*descriptors.cols/5 : 0.3;
+      builder = new LandmarkDatabaseBuilder(merge_radius, max_desc_dist);
+    }
+    if(!builder->Add(atlas.GetPose(v), descriptors, points))
+      return 1;
+    std::cout << "View " << v + 1 << "/" << atlas.NumViews() << ": " << builder->NumLandmarks()
+      << " landmarks" << std::endl;
+  }
+  if(!builder)
+  {
+    std::cout << atlas_file << " has no features" << std::endl;
+    return 1;
+  }
+
+  // scale changes of a third are still matched
+  size_t num_written;
+  if(!builder->Write(output_file, atlas.GetDescriptorType(), min_observations, view_margin, 1.3, &num_written))
+    return 1;
+  std::cout << "Wrote " << num_written << " of " << builder->NumLandmarks() << " landmarks to "
+    << output_file << std::endl;
+  delete builder;
+  return 0;
+}
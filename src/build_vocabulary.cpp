@@ -0,0 +1,78 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#include "mesh_localize/ImageDbUtil.h"
+#include "mesh_localize/KeyframeContainer.h"
+#include "mesh_localize/VocabularyTree.h"
+
+using namespace cv;
+
+/**
+ *  Trains the vocabulary tree for ~vocabulary_filename, with branching
+ *  clusters per node and depth levels (branching^depth words at most).  The
+ *  descriptors come either from an OGRE image database (--ogre <data_dir>,
+ *  as for depth_feature_match) or are extracted from the given images with
+ *  descriptor_type (e.g. the images of a photoscan database, for
+ *  feature_match).  The vocabulary only needs images like the ones it will
+ *  index, not the same ones.
+ */
+int main(int argc, char **argv)
+{
+  if(argc < 6)
+  {
+    std::cout << "Usage: " << argv[0] << " <output.voc> <branching> <depth> --ogre <data_dir>" << std::endl
+      << "       " << argv[0] << " <output.voc> <branching> <depth> <descriptor_type> <image> [image...]"
+      << std::endl;
+    return 1;
+  }
+  std::string output_file = argv[1];
+  int branching = atoi(argv[2]);
+  int depth = atoi(argv[3]);
+
+  Mat descriptors;
+  if(strcmp(argv[4], "--ogre") == 0)
+  {
+    std::vector<KeyframeContainer*> keyframes;
+    if(!ImageDbUtil::LoadOgreDataDir(argv[5], keyframes))
+    {
+      std::cout << "Could not load OGRE image database " << argv[5] << std::endl;
+      return 1;
+    }
+    for(unsigned int i = 0; i < keyframes.size(); i++)
+    {
+      if(keyframes[i]->GetDescriptors().rows > 0)
+        descriptors.push_back(keyframes[i]->GetDescriptors());
+      delete keyframes[i];
+    }
+  }
+  else
+  {
+    std::string desc_type = argv[4];
+    for(int i = 5; i < argc; i++)
+    {
+      Mat img = imread(argv[i], CV_LOAD_IMAGE_GRAYSCALE);
+      if(!img.data)
+      {
+        std::cout << "Could not open " << argv[i] << std::endl;
+        return 1;
+      }
+      KeyframeContainer kfc(img, desc_type);
+      if(kfc.GetDescriptors().rows > 0)
+        descriptors.push_back(kfc.GetDescriptors());
+      std::cout << "Image " << i - 4 << "/" << argc - 5 << ": " << descriptors.rows << " descriptors" << std::endl;
+    }
+  }
+  if(descriptors.empty())
+  {
+    std::cout << "No descriptors to train on" << std::endl;
+    return 1;
+  }
+
+  std::cout << "Training on " << descriptors.rows << " descriptors" << std::endl;
+  VocabularyTree vocabulary;
+  if(!vocabulary.Train(descriptors, branching, depth) || !vocabulary.Save(output_file))
+    return 1;
+  std::cout << "Wrote " << vocabulary.NumWords() << " words to " << output_file << std::endl;
+  return 0;
+}
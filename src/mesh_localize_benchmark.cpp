@@ -0,0 +1,334 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <dirent.h>
+
+#include <opencv2/highgui/highgui.hpp>
+#include <Eigen/Geometry>
+#include "mesh_localize/LocalizerPipeline.h"
+#include "mesh_localize/Profiler.h"
+#include "mesh_localize/Log.h"
+
+using namespace cv;
+
+/**
+ *  Replays a recorded image sequence through the localizer as fast as possible
+ *  and reports latency, throughput and pose error.  No ROS master is needed.
+ *
+ *  Sequence directory layout:
+ *    images/          frames, processed in file name order
+ *    camera.yml       K (3x3), optional D, frame_rate (used without times.txt),
+ *                     map_scale and H_map_gt (ground truth frame to map frame)
+ *    times.txt        optional, one stamp per frame
+ *    groundtruth.txt  optional, "stamp tx ty tz qx qy qz qw" camera poses
+ */
+
+struct GroundTruthPose
+{
+  double stamp;
+  Eigen::Vector3d t;
+  Eigen::Quaterniond q;
+
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+struct ErrorStats
+{
+  ErrorStats() : n(0), mean(0), m2(0) {}
+
+  // Welford's running mean/variance
+  void Add(double x)
+  {
+    n++;
+    double delta = x - mean;
+    mean += delta/n;
+    m2 += delta*(x - mean);
+  }
+  double Variance() const { return n > 1 ? m2/(n-1) : 0; }
+
+  unsigned long n;
+  double mean;
+  double m2;
+};
+
+static bool HasImageExtension(const std::string& name)
+{
+  std::string::size_type dot = name.rfind('.');
+  if(dot == std::string::npos)
+    return false;
+  std::string ext = name.substr(dot + 1);
+  std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return ext == "png" || ext == "jpg" || ext == "jpeg" || ext == "pgm" ||
+    ext == "ppm" || ext == "bmp" || ext == "tif" || ext == "tiff";
+}
+
+static bool ListImages(const std::string& dir, std::vector<std::string>& files)
+{
+  DIR* d = opendir(dir.c_str());
+  if(!d)
+    return false;
+  struct dirent* entry;
+  while((entry = readdir(d)) != NULL)
+  {
+    std::string name = entry->d_name;
+    if(HasImageExtension(name))
+      files.push_back(dir + "/" + name);
+  }
+  closedir(d);
+  std::sort(files.begin(), files.end());
+  return true;
+}
+
+static bool LoadTimes(const std::string& filename, std::vector<double>& times)
+{
+  std::ifstream in(filename.c_str());
+  if(!in.is_open())
+    return false;
+  double t;
+  while(in >> t)
+  {
+    times.push_back(t);
+  }
+  return true;
+}
+
+static bool LoadGroundTruth(const std::string& filename, std::vector<GroundTruthPose>& poses)
+{
+  std::ifstream in(filename.c_str());
+  if(!in.is_open())
+    return false;
+  std::string line;
+  while(std::getline(in, line))
+  {
+    if(line.empty() || line[0] == '#')
+      continue;
+    std::replace(line.begin(), line.end(), ',', ' ');
+    std::stringstream ss(line);
+    GroundTruthPose p;
+    double qx, qy, qz, qw;
+    if(!(ss >> p.stamp >> p.t(0) >> p.t(1) >> p.t(2) >> qx >> qy >> qz >> qw))
+      continue;
+    p.q = Eigen::Quaterniond(qw, qx, qy, qz).normalized();
+    poses.push_back(p);
+  }
+  std::sort(poses.begin(), poses.end(),
+    [](const GroundTruthPose& a, const GroundTruthPose& b) { return a.stamp < b.stamp; });
+  return true;
+}
+
+// Index of the ground truth pose closest in time, -1 if none is within max_dt
+static int MatchNearest(const std::vector<GroundTruthPose>& poses, double stamp, double max_dt)
+{
+  std::vector<GroundTruthPose>::const_iterator it = std::lower_bound(poses.begin(), poses.end(), stamp,
+    [](const GroundTruthPose& p, double t) { return p.stamp < t; });
+  int best = -1;
+  double best_dt = max_dt;
+  if(it != poses.end() && std::fabs(it->stamp - stamp) <= best_dt)
+  {
+    best = it - poses.begin();
+    best_dt = std::fabs(it->stamp - stamp);
+  }
+  if(it != poses.begin() && std::fabs((it-1)->stamp - stamp) <= best_dt)
+  {
+    best = (it-1) - poses.begin();
+  }
+  return best;
+}
+
+static double Percentile(std::vector<double> values, double p)
+{
+  if(values.empty())
+    return 0;
+  std::sort(values.begin(), values.end());
+  unsigned int idx = std::min<unsigned int>(values.size()-1, p*values.size());
+  return values[idx];
+}
+
+int main(int argc, char **argv)
+{
+  if(argc < 3)
+  {
+    std::cout << "Usage: " << argv[0] << " <sequence_dir> <config.yml> [results.csv]" << std::endl;
+    return 1;
+  }
+  std::string seq_dir = argv[1];
+  std::string config_file = argv[2];
+  std::string results_file = argc > 3 ? argv[3] : "";
+
+  // Only the per-frame logging is silenced
+  Log::SetLevel(Log::LEVEL_WARN);
+
+  LocalizerConfig config;
+  if(!config.Load(config_file))
+    return 1;
+
+  FileStorage fs(seq_dir + "/camera.yml", FileStorage::READ);
+  if(!fs.isOpened())
+  {
+    std::cout << "Could not open " << seq_dir << "/camera.yml" << std::endl;
+    return 1;
+  }
+  Mat camK, camD, H_map_gt;
+  double frame_rate = 30;
+  double map_scale = 1;
+  fs["K"] >> camK;
+  fs["D"] >> camD;
+  fs["H_map_gt"] >> H_map_gt;
+  if(!fs["frame_rate"].empty())
+    fs["frame_rate"] >> frame_rate;
+  if(!fs["map_scale"].empty())
+    fs["map_scale"] >> map_scale;
+  if(camK.rows != 3 || camK.cols != 3)
+  {
+    std::cout << "camera.yml must contain a 3x3 K" << std::endl;
+    return 1;
+  }
+  if(camD.empty())
+    camD = Mat::zeros(5, 1, CV_64F);
+
+  Eigen::Matrix4d map_from_gt = Eigen::Matrix4d::Identity();
+  if(!H_map_gt.empty())
+  {
+    H_map_gt.convertTo(H_map_gt, CV_64F);
+    for(int i = 0; i < 4; i++)
+      for(int j = 0; j < 4; j++)
+        map_from_gt(i,j) = H_map_gt.at<double>(i,j);
+  }
+  Eigen::Matrix4d gt_from_map = map_from_gt.inverse();
+
+  std::vector<std::string> images;
+  if(!ListImages(seq_dir + "/images", images) || images.empty())
+  {
+    std::cout << "No images found in " << seq_dir << "/images" << std::endl;
+    return 1;
+  }
+
+  std::vector<double> times;
+  if(LoadTimes(seq_dir + "/times.txt", times) && times.size() < images.size())
+  {
+    std::cout << "times.txt has " << times.size() << " stamps for " << images.size() << " images" << std::endl;
+    return 1;
+  }
+  if(times.empty())
+  {
+    for(unsigned int i = 0; i < images.size(); i++)
+      times.push_back((i+1)/frame_rate);
+  }
+
+  std::vector<GroundTruthPose> ground_truth;
+  LoadGroundTruth(seq_dir + "/groundtruth.txt", ground_truth);
+
+  Mat first = imread(images[0], CV_LOAD_IMAGE_UNCHANGED);
+  if(first.empty())
+  {
+    std::cout << "Could not read " << images[0] << std::endl;
+    return 1;
+  }
+
+  std::cout << "Replaying " << images.size() << " frames from " << seq_dir << std::endl;
+  LocalizerPipeline localizer(config, camK, camD, first.cols, first.rows);
+  if(!localizer.IsInitialized())
+  {
+    std::cout << "Could not initialize localizer" << std::endl;
+    return 1;
+  }
+  Profiler::Instance().Reset();
+
+  std::ofstream csv;
+  if(!results_file.empty())
+  {
+    csv.open(results_file.c_str());
+    csv << "frame,stamp,state,latency_ms,localized,tx,ty,tz,qx,qy,qz,qw,trans_error,rot_error_deg" << std::endl;
+  }
+
+  std::vector<double> latencies;
+  ErrorStats trans_error, rot_error;
+  unsigned int num_localized = 0;
+  unsigned int num_dropped = 0;
+  double total_time = 0;
+  double max_gt_dt = 0.5/frame_rate;
+  for(unsigned int i = 0; i < images.size(); i++)
+  {
+    Mat img = imread(images[i], CV_LOAD_IMAGE_UNCHANGED);
+    if(img.empty())
+    {
+      std::cout << "Could not read " << images[i] << ", skipping" << std::endl;
+      continue;
+    }
+    int64_t start = Profiler::Now();
+    PoseResult result = localizer.ProcessFrame(img, times[i]);
+    double latency = 1e-9*(Profiler::Now() - start);
+    latencies.push_back(1e3*latency);
+    total_time += latency;
+
+    Eigen::Vector3d t(0, 0, 0);
+    Eigen::Quaterniond q(1, 0, 0, 0);
+    double terr = -1, rerr = -1;
+    if(result.dropped)
+      num_dropped++;
+    if(result.localized)
+    {
+      num_localized++;
+      // published pose is the camera in the map frame
+      Eigen::Matrix4d cam = result.pose.cast<double>().inverse();
+      cam.block<3,1>(0,3) *= map_scale;
+      cam = gt_from_map*cam;
+      t = cam.block<3,1>(0,3);
+      q = Eigen::Quaterniond(Eigen::Matrix3d(cam.block<3,3>(0,0))).normalized();
+
+      int gt_idx = MatchNearest(ground_truth, times[i], max_gt_dt);
+      if(gt_idx >= 0)
+      {
+        const GroundTruthPose& gt = ground_truth[gt_idx];
+        terr = (t - gt.t).norm();
+        rerr = 180/M_PI*gt.q.angularDistance(q);
+        trans_error.Add(terr);
+        rot_error.Add(rerr);
+      }
+    }
+
+    if(csv.is_open())
+    {
+      char line[512];
+      snprintf(line, sizeof(line), "%u,%.6f,%s,%.3f,%d,%f,%f,%f,%f,%f,%f,%f,%f,%f", i, times[i],
+        result.state, 1e3*latency, result.localized ? 1 : 0, t(0), t(1), t(2), q.x(), q.y(), q.z(), q.w(),
+        terr, rerr);
+      csv << line << std::endl;
+    }
+  }
+
+  printf("\nframes: %lu, localized: %u (%.1f%%)\n", latencies.size(), num_localized,
+    latencies.empty() ? 0 : 100.0*num_localized/latencies.size());
+  if(config.frame_budget > 0)
+    printf("dropped to meet the %.1f ms frame budget: %u\n", 1e3*config.frame_budget, num_dropped);
+  printf("sustained fps: %.2f\n", total_time > 0 ? latencies.size()/total_time : 0);
+  printf("frame latency (ms): mean %.2f p50 %.2f p95 %.2f p99 %.2f max %.2f\n",
+    latencies.empty() ? 0 : 1e3*total_time/latencies.size(), Percentile(latencies, 0.5),
+    Percentile(latencies, 0.95), Percentile(latencies, 0.99), Percentile(latencies, 1.0));
+  if(trans_error.n > 0)
+  {
+    printf("translation error: mean %f variance %f (%lu frames)\n", trans_error.mean,
+      trans_error.Variance(), trans_error.n);
+    printf("rotation error (deg): mean %f variance %f\n", rot_error.mean, rot_error.Variance());
+  }
+  else if(!ground_truth.empty())
+  {
+    printf("no localized frames matched the ground truth\n");
+  }
+
+  std::vector<Profiler::StageStats> stats;
+  Profiler::Instance().GetStageStats(stats);
+  if(!stats.empty())
+  {
+    printf("\n%-24s %8s %8s %8s %8s %8s %8s\n", "stage", "count", "mean", "p50", "p95", "p99", "max");
+    for(unsigned int i = 0; i < stats.size(); i++)
+    {
+      printf("%-24s %8lu %8.2f %8.2f %8.2f %8.2f %8.2f\n", stats[i].name.c_str(), stats[i].count,
+        stats[i].mean_ms, stats[i].p50_ms, stats[i].p95_ms, stats[i].p99_ms, stats[i].max_ms);
+    }
+  }
+  return 0;
+}